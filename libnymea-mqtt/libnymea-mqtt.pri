@@ -11,12 +11,33 @@ SOURCES += \
     mqttserver.cpp \
     mqttpacket.cpp \
     mqttsubscription.cpp \
-    mqttclient.cpp
+    mqttclient.cpp \
+    mqttinprocesschannel.cpp \
+    mqttiouring.cpp \
+    mqtthandover.cpp \
+    mqttsessionstore.cpp \
+    mqttretainedmessages.cpp \
+    mqttinflightpackets.cpp \
+    mqttbridge.cpp \
+    mqttcluster.cpp \
+    mqttbroker.cpp \
+    mqttaccesscontrol.cpp
 
 PRIVATE_HEADERS = \
     mqttpacket_p.h \
     mqttclient_p.h \
-    mqttserver_p.h
+    mqttserver_p.h \
+    mqtttimerwheel_p.h \
+    mqttinprocesschannel_p.h \
+    mqttiouring_p.h \
+    mqtthandover_p.h \
+    mqttsessionstore_p.h \
+    mqttretainedmessages_p.h \
+    mqttinflightpackets_p.h \
+    mqttbridge_p.h \
+    mqttcluster_p.h \
+    mqttbroker_p.h \
+    mqttaccesscontrol_p.h
 
 PUBLIC_HEADERS = \
     mqttserver.h \
@@ -24,5 +45,9 @@ PUBLIC_HEADERS = \
     mqtt.h \
     mqttsubscription.h \
     mqttclient.h \
+    mqttsessionstore.h \
+    mqttbridge.h \
+    mqttbroker.h \
+    mqttaccesscontrol.h \
 
 HEADERS += $$PRIVATE_HEADERS $$PUBLIC_HEADERS
@@ -0,0 +1,286 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+*
+* Copyright 2013 - 2020, nymea GmbH
+* Contact: contact@nymea.io
+*
+* This file is part of nymea.
+* This project including source code and documentation is protected by copyright law, and
+* remains the property of nymea GmbH. All rights, including reproduction, publication,
+* editing and translation, are reserved. The use of this project is subject to the terms of a
+* license agreement to be concluded with nymea GmbH in accordance with the terms
+* of use of nymea GmbH, available under https://nymea.io/license
+*
+* GNU Lesser General Public License Usage
+* Alternatively, this project may be redistributed and/or modified under the terms of the GNU
+* Lesser General Public License as published by the Free Software Foundation; version 3.
+* this project is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+* without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License along with this project.
+* If not, see <https://www.gnu.org/licenses/>.
+*
+* For any further details and any questions please contact us under contact@nymea.io
+* or see our FAQ/Licensing Information on https://nymea.io/license/faq
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*!
+    \class MqttAccessControl
+    \brief Access control lists evaluated by MqttServer.
+    \inmodule nymea-mqtt
+    \ingroup mqtt
+
+    Most deployments restrict clients to their own part of the topic tree, e.g. a device may only publish
+    below devices/<client ID>/ and read commands/<username>/. Instead of implementing this in a
+    MqttAuthorizer, such rules can be given to the server with MqttServer::setAccessControl().
+
+    When a client connects, the rules applying to it are compiled into a tree of topic levels with the client
+    ID and username already filled in. Publish and subscribe requests are then checked against that tree by
+    walking the levels of the topic once, without calling out to the authorizer.
+
+    Access is denied unless granted by a rule. A subscription requires read access to all topics matching its
+    topic filter, e.g. a rule for "sensors/+/temperature" allows subscribing to "sensors/kitchen/temperature"
+    and "sensors/+/temperature", but not to "sensors/#". A MqttAuthorizer set in addition is asked only for
+    requests allowed by the rules.
+*/
+
+#include "mqttaccesscontrol.h"
+#include "mqttaccesscontrol_p.h"
+#include "mqttserver_p.h"
+
+#include <QFile>
+#include <QRegExp>
+
+// Substituted values must stay within their level
+static bool isUsableLevel(const QString &value)
+{
+    return !value.isEmpty() && !value.contains('/') && !value.contains('+') && !value.contains('#');
+}
+
+bool MqttAccessControl::isEmpty() const
+{
+    return m_rules.isEmpty();
+}
+
+void MqttAccessControl::clear()
+{
+    m_rules.clear();
+}
+
+/*!
+ * \brief Grants \a access to the topics matching \a topicFilter to the clients connected with \a username, or
+ * to all clients if \a username is empty.
+ */
+void MqttAccessControl::addRule(const QString &topicFilter, Access access, const QString &username)
+{
+    Rule rule;
+    rule.topicFilter = topicFilter;
+    rule.username = username;
+    rule.access = access;
+    m_rules.append(rule);
+}
+
+/*!
+ * \brief Grants \a access to the topics matching \a pattern to all clients. Occurrences of %c are replaced
+ * with the client ID and %u with the username. A pattern containing %u doesn't apply to clients without a
+ * username. Neither does it apply if the client ID or username contain a /, + or # which would let the client
+ * reach beyond its level.
+ */
+void MqttAccessControl::addPattern(const QString &pattern, Access access)
+{
+    Rule rule;
+    rule.topicFilter = pattern;
+    rule.access = access;
+    rule.pattern = true;
+    m_rules.append(rule);
+}
+
+/*!
+ * \brief Adds the rules in the file \a fileName, see loadRules() for the format. Returns false if the file
+ * can't be read or contains errors, no rules are added then.
+ */
+bool MqttAccessControl::load(const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QFile::ReadOnly)) {
+        qCWarning(dbgServer) << "Error opening access control file" << fileName << file.errorString();
+        return false;
+    }
+    return loadRules(file.readAll());
+}
+
+/*!
+ * \brief Adds the \a rules given in a format similar to the acl_file of mosquitto, one per line:
+ *
+ * \code
+ * # Comments start with a #
+ * topic [read|write|readwrite] <topic filter>
+ * user <username>
+ * pattern [read|write|readwrite] <pattern>
+ * \endcode
+ *
+ * topic lines apply to all clients until the first user line, and to that user after it. Unlike in mosquitto,
+ * topic lines before any user line apply to clients with a username too. pattern lines always apply to all
+ * clients, see addPattern(). The access defaults to readwrite.
+ *
+ * Returns false if the rules contain errors, no rules are added then.
+ */
+bool MqttAccessControl::loadRules(const QByteArray &rules)
+{
+    QList<Rule> parsed;
+    QString username;
+    QList<QByteArray> lines = rules.split('\n');
+    for (int i = 0; i < lines.count(); i++) {
+        QString line = QString::fromUtf8(lines.at(i)).trimmed();
+        if (line.isEmpty() || line.startsWith('#')) {
+            continue;
+        }
+
+        int separator = line.indexOf(QRegExp("\\s"));
+        QString keyword = line.left(separator);
+        QString argument = separator < 0 ? QString() : line.mid(separator).trimmed();
+        if (keyword == QLatin1String("user") && !argument.isEmpty()) {
+            username = argument;
+            continue;
+        }
+        if (keyword != QLatin1String("topic") && keyword != QLatin1String("pattern")) {
+            qCWarning(dbgServer) << "Access control rules: Invalid line" << i + 1 << line;
+            return false;
+        }
+
+        Rule rule;
+        rule.access = AccessReadWrite;
+        separator = argument.indexOf(QRegExp("\\s"));
+        QString access = argument.left(separator);
+        if (separator >= 0 && (access == QLatin1String("read") || access == QLatin1String("write") || access == QLatin1String("readwrite"))) {
+            rule.access = access == QLatin1String("read") ? AccessRead : access == QLatin1String("write") ? AccessWrite : AccessReadWrite;
+            argument = argument.mid(separator).trimmed();
+        }
+        if (argument.isEmpty()) {
+            qCWarning(dbgServer) << "Access control rules: Missing topic in line" << i + 1 << line;
+            return false;
+        }
+        rule.topicFilter = argument;
+        rule.pattern = keyword == QLatin1String("pattern");
+        if (!rule.pattern) {
+            rule.username = username;
+        }
+        parsed.append(rule);
+    }
+
+    m_rules.append(parsed);
+    return true;
+}
+
+MqttAccessTrie MqttAccessControl::compile(const QString &clientId, const QString &username) const
+{
+    bool clientIdUsable = isUsableLevel(clientId);
+    bool usernameUsable = isUsableLevel(username);
+
+    MqttAccessTrie trie;
+    foreach (const Rule &rule, m_rules) {
+        if (!rule.pattern) {
+            if (rule.username.isEmpty() || rule.username == username) {
+                trie.insert(rule.topicFilter.toUtf8(), rule.access);
+            }
+            continue;
+        }
+
+        // In one pass over the pattern, a client ID or username containing placeholders is not expanded again
+        QString topicFilter;
+        bool usable = true;
+        for (int i = 0; i < rule.topicFilter.length() && usable; i++) {
+            QChar c = rule.topicFilter.at(i);
+            QChar next = i + 1 < rule.topicFilter.length() ? rule.topicFilter.at(i + 1) : QChar();
+            if (c == '%' && next == 'c') {
+                usable = clientIdUsable;
+                topicFilter.append(clientId);
+                i++;
+            } else if (c == '%' && next == 'u') {
+                usable = usernameUsable;
+                topicFilter.append(username);
+                i++;
+            } else {
+                topicFilter.append(c);
+            }
+        }
+        if (usable) {
+            trie.insert(topicFilter.toUtf8(), rule.access);
+        }
+    }
+    return trie;
+}
+
+bool MqttAccessTrie::isEmpty() const
+{
+    return m_nodes.isEmpty();
+}
+
+void MqttAccessTrie::insert(const QByteArray &topicFilter, quint8 access)
+{
+    if (m_nodes.isEmpty()) {
+        m_nodes.append(Node());
+    }
+    int node = 0;
+    foreach (const QByteArray &level, topicFilter.split('/')) {
+        if (level == "#") {
+            m_nodes[node].wildcardAccess |= access;
+            return;
+        }
+        node = child(node, level);
+    }
+    m_nodes[node].access |= access;
+}
+
+quint8 MqttAccessTrie::access(const QByteArray &topic) const
+{
+    if (m_nodes.isEmpty()) {
+        return 0;
+    }
+    return access(0, topic, 0);
+}
+
+int MqttAccessTrie::child(int node, const QByteArray &level)
+{
+    foreach (int child, m_nodes.at(node).children) {
+        if (m_nodes.at(child).level == level) {
+            return child;
+        }
+    }
+    Node child;
+    child.level = level;
+    m_nodes.append(child);
+    m_nodes[node].children.append(m_nodes.count() - 1);
+    return m_nodes.count() - 1;
+}
+
+quint8 MqttAccessTrie::access(int node, const QByteArray &topic, int from) const
+{
+    // Wildcards at the first level don't match topics starting with $
+    bool wildcards = from > 0 || !topic.startsWith('$');
+    const Node &current = m_nodes.at(node);
+    quint8 granted = wildcards ? current.wildcardAccess : 0;
+    if (from > topic.size()) {
+        return granted | current.access;
+    }
+
+    int end = topic.indexOf('/', from);
+    if (end < 0) {
+        end = topic.size();
+    }
+    const QByteArray level = QByteArray::fromRawData(topic.constData() + from, end - from);
+    bool wildcardLevel = level == "+" || level == "#";
+    foreach (int child, current.children) {
+        const QByteArray &childLevel = m_nodes.at(child).level;
+        if (childLevel == "+") {
+            // + covers any single level, including a + in a topic filter, but not a #
+            if (wildcards && level != "#") {
+                granted |= access(child, topic, end + 1);
+            }
+        } else if (!wildcardLevel && childLevel == level) {
+            granted |= access(child, topic, end + 1);
+        }
+    }
+    return granted;
+}
@@ -0,0 +1,76 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+*
+* Copyright 2013 - 2020, nymea GmbH
+* Contact: contact@nymea.io
+*
+* This file is part of nymea.
+* This project including source code and documentation is protected by copyright law, and
+* remains the property of nymea GmbH. All rights, including reproduction, publication,
+* editing and translation, are reserved. The use of this project is subject to the terms of a
+* license agreement to be concluded with nymea GmbH in accordance with the terms
+* of use of nymea GmbH, available under https://nymea.io/license
+*
+* GNU Lesser General Public License Usage
+* Alternatively, this project may be redistributed and/or modified under the terms of the GNU
+* Lesser General Public License as published by the Free Software Foundation; version 3.
+* this project is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+* without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License along with this project.
+* If not, see <https://www.gnu.org/licenses/>.
+*
+* For any further details and any questions please contact us under contact@nymea.io
+* or see our FAQ/Licensing Information on https://nymea.io/license/faq
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef MQTTACCESSCONTROL_H
+#define MQTTACCESSCONTROL_H
+
+#include <QString>
+#include <QList>
+
+class MqttAccessTrie;
+
+// Access control lists evaluated by the server itself, see MqttServer::setAccessControl(). Rules grant read
+// (subscribe) and/or write (publish) access to the topics matching a topic filter. Without any rules, access
+// control is disabled.
+class MqttAccessControl
+{
+public:
+    enum Access {
+        AccessNone = 0x0,
+        AccessRead = 0x1,
+        AccessWrite = 0x2,
+        AccessReadWrite = AccessRead | AccessWrite
+    };
+
+    bool isEmpty() const;
+    void clear();
+
+    // A rule for the client with the given username, or for all clients if it's empty
+    void addRule(const QString &topicFilter, Access access, const QString &username = QString());
+    // A rule for all clients, %c and %u in the pattern are replaced by the client ID and the username
+    void addPattern(const QString &pattern, Access access);
+
+    // Adds rules in a format similar to the acl_file of mosquitto, see the documentation of loadRules()
+    bool load(const QString &fileName);
+    bool loadRules(const QByteArray &rules);
+
+private:
+    friend class MqttServerPrivate;
+
+    // The effective permissions of a session
+    MqttAccessTrie compile(const QString &clientId, const QString &username) const;
+
+    struct Rule {
+        QString topicFilter;
+        QString username;
+        Access access = AccessNone;
+        bool pattern = false;
+    };
+    QList<Rule> m_rules;
+};
+
+#endif // MQTTACCESSCONTROL_H
@@ -0,0 +1,61 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+*
+* Copyright 2013 - 2020, nymea GmbH
+* Contact: contact@nymea.io
+*
+* This file is part of nymea.
+* This project including source code and documentation is protected by copyright law, and
+* remains the property of nymea GmbH. All rights, including reproduction, publication,
+* editing and translation, are reserved. The use of this project is subject to the terms of a
+* license agreement to be concluded with nymea GmbH in accordance with the terms
+* of use of nymea GmbH, available under https://nymea.io/license
+*
+* GNU Lesser General Public License Usage
+* Alternatively, this project may be redistributed and/or modified under the terms of the GNU
+* Lesser General Public License as published by the Free Software Foundation; version 3.
+* this project is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+* without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License along with this project.
+* If not, see <https://www.gnu.org/licenses/>.
+*
+* For any further details and any questions please contact us under contact@nymea.io
+* or see our FAQ/Licensing Information on https://nymea.io/license/faq
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef MQTTACCESSCONTROL_P_H
+#define MQTTACCESSCONTROL_P_H
+
+#include <QByteArray>
+#include <QVector>
+
+// The permissions of one session as a tree of topic levels. Checks walk the levels of a topic or topic filter
+// once, following the matching children and the + and # wildcards, and collect the access granted on the way.
+// Nodes are stored in one vector, the root is the first one. An empty trie grants nothing.
+class MqttAccessTrie
+{
+public:
+    bool isEmpty() const;
+    void insert(const QByteArray &topicFilter, quint8 access);
+
+    // The access granted for a topic, or for all topics matching a topic filter
+    quint8 access(const QByteArray &topic) const;
+
+private:
+    struct Node {
+        QByteArray level;
+        QVector<int> children;
+        // Granted for topics ending at this node, and by a # child for everything below it
+        quint8 access = 0;
+        quint8 wildcardAccess = 0;
+    };
+
+    int child(int node, const QByteArray &level);
+    quint8 access(int node, const QByteArray &topic, int from) const;
+
+    QVector<Node> m_nodes;
+};
+
+#endif // MQTTACCESSCONTROL_P_H
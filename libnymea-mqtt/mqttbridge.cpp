@@ -0,0 +1,397 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+*
+* Copyright 2013 - 2020, nymea GmbH
+* Contact: contact@nymea.io
+*
+* This file is part of nymea.
+* This project including source code and documentation is protected by copyright law, and
+* remains the property of nymea GmbH. All rights, including reproduction, publication,
+* editing and translation, are reserved. The use of this project is subject to the terms of a
+* license agreement to be concluded with nymea GmbH in accordance with the terms
+* of use of nymea GmbH, available under https://nymea.io/license
+*
+* GNU Lesser General Public License Usage
+* Alternatively, this project may be redistributed and/or modified under the terms of the GNU
+* Lesser General Public License as published by the Free Software Foundation; version 3.
+* this project is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+* without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License along with this project.
+* If not, see <https://www.gnu.org/licenses/>.
+*
+* For any further details and any questions please contact us under contact@nymea.io
+* or see our FAQ/Licensing Information on https://nymea.io/license/faq
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*!
+    \class MqttBridge
+    \brief Forwards selected topics between a MqttServer and a remote MQTT broker.
+    \inmodule nymea-mqtt
+    \ingroup mqtt
+
+    The bridge is made of two MqttClient objects: one connected in-process to the local server and one
+    connected to the remote broker. Messages on the local server matching an outgoing topic are published on
+    the remote broker, messages on the remote broker matching an incoming topic are published on the local
+    server. Topic prefixes can be replaced on the way, e.g. to move the topics of a gateway below its own
+    prefix on the central broker.
+
+    Outgoing messages are queued while the uplink is down and sent in batches. The uplink uses a persistent
+    session, so messages sent but not acknowledged when the connection dropped are resent on reconnect.
+
+    Messages published by the bridge on one side are not forwarded back when they come back from there,
+    topics mapped in both directions don't loop between the two brokers.
+*/
+
+#include "mqttbridge.h"
+#include "mqttbridge_p.h"
+#include "mqttserver.h"
+#include "mqttserver_p.h"
+
+Q_LOGGING_CATEGORY(dbgBridge, "nymea.mqtt.bridge")
+
+// Messages published by the bridge are expected back within this time, if at all
+static const qint64 echoTimeout = 30000;
+
+MqttBridge::MqttBridge(MqttServer *server, const QString &clientId, QObject *parent):
+    QObject(parent),
+    d_ptr(new MqttBridgePrivate(server, clientId, this))
+{
+}
+
+MqttBridge::~MqttBridge()
+{
+    d_ptr->remoteClient->disconnectFromHost();
+    d_ptr->localClient->disconnectFromHost();
+}
+
+/*!
+ * \brief Forwards messages on topics matching \a pattern in the given \a direction with the given \a qos.
+ *
+ * Outgoing messages on the local topic \a localPrefix + topic are published as \a remotePrefix + topic on the
+ * remote broker, incoming ones the other way round. The \a pattern is a topic filter matched against the
+ * topic without the prefix. The first matching topic is used if several match.
+ */
+void MqttBridge::addTopic(const QString &pattern, Direction direction, Mqtt::QoS qos, const QString &localPrefix, const QString &remotePrefix)
+{
+    MqttBridgePrivate::Topic topic;
+    topic.pattern = pattern;
+    topic.direction = direction;
+    topic.qos = qos;
+    topic.localPrefix = localPrefix;
+    topic.remotePrefix = remotePrefix;
+    d_ptr->topics.append(topic);
+
+    if (MqttBridgePrivate::isOutgoing(topic) && d_ptr->localClient->isConnected()) {
+        d_ptr->localClient->subscribe(localPrefix + pattern, qos);
+    }
+    if (MqttBridgePrivate::isIncoming(topic) && d_ptr->remoteClient->isConnected()) {
+        d_ptr->remoteClient->subscribe(remotePrefix + pattern, qos);
+    }
+}
+
+void MqttBridge::removeTopic(const QString &pattern)
+{
+    for (int i = d_ptr->topics.count() - 1; i >= 0; i--) {
+        const MqttBridgePrivate::Topic &topic = d_ptr->topics.at(i);
+        if (topic.pattern != pattern) {
+            continue;
+        }
+        if (MqttBridgePrivate::isOutgoing(topic) && d_ptr->localClient->isConnected()) {
+            d_ptr->localClient->unsubscribe(topic.localPrefix + pattern);
+        }
+        if (MqttBridgePrivate::isIncoming(topic) && d_ptr->remoteClient->isConnected()) {
+            d_ptr->remoteClient->unsubscribe(topic.remotePrefix + pattern);
+        }
+        d_ptr->topics.removeAt(i);
+    }
+}
+
+QString MqttBridge::username() const
+{
+    return d_ptr->remoteClient->username();
+}
+
+void MqttBridge::setUsername(const QString &username)
+{
+    d_ptr->remoteClient->setUsername(username);
+}
+
+QString MqttBridge::password() const
+{
+    return d_ptr->remoteClient->password();
+}
+
+void MqttBridge::setPassword(const QString &password)
+{
+    d_ptr->remoteClient->setPassword(password);
+}
+
+/*!
+ * \brief Connects the uplink to the broker at \a hostName and \a port. The connection is reestablished
+ * automatically when it drops.
+ */
+void MqttBridge::connectToHost(const QString &hostName, quint16 port, bool useSsl, const QSslConfiguration &sslConfiguration)
+{
+    d_ptr->remoteClient->connectToHost(hostName, port, false, useSsl, sslConfiguration);
+}
+
+/*!
+ * \brief Connects the uplink in-process to \a remoteServer, which needs to be listening for in-process clients.
+ */
+void MqttBridge::connectToServer(MqttServer *remoteServer)
+{
+    d_ptr->remoteClient->connectToServer(remoteServer, false);
+}
+
+void MqttBridge::disconnectFromHost()
+{
+    d_ptr->batchTimer.stop();
+    d_ptr->remoteClient->disconnectFromHost();
+}
+
+bool MqttBridge::isConnected() const
+{
+    return d_ptr->remoteClient->isConnected();
+}
+
+int MqttBridge::batchInterval() const
+{
+    return d_ptr->batchInterval;
+}
+
+void MqttBridge::setBatchInterval(int batchInterval)
+{
+    d_ptr->batchInterval = qMax(0, batchInterval);
+}
+
+int MqttBridge::batchSize() const
+{
+    return d_ptr->batchSize;
+}
+
+void MqttBridge::setBatchSize(int batchSize)
+{
+    d_ptr->batchSize = qMax(1, batchSize);
+}
+
+int MqttBridge::maximumQueuedMessages() const
+{
+    return d_ptr->maximumQueuedMessages;
+}
+
+void MqttBridge::setMaximumQueuedMessages(int maximumQueuedMessages)
+{
+    d_ptr->maximumQueuedMessages = qMax(1, maximumQueuedMessages);
+    while (d_ptr->queue.count() > d_ptr->maximumQueuedMessages) {
+        d_ptr->queue.dequeue();
+    }
+}
+
+int MqttBridge::queuedMessages() const
+{
+    return d_ptr->queue.count();
+}
+
+MqttBridgePrivate::MqttBridgePrivate(MqttServer *server, const QString &clientId, MqttBridge *q):
+    QObject(q),
+    q_ptr(q)
+{
+    clock.start();
+    batchTimer.setSingleShot(true);
+    connect(&batchTimer, &QTimer::timeout, this, &MqttBridgePrivate::flush);
+
+    localClient = new MqttClient(clientId, this);
+    connect(localClient, &MqttClient::connected, this, [this](Mqtt::ConnectReturnCode connectReturnCode) {
+        if (connectReturnCode != Mqtt::ConnectReturnCodeAccepted) {
+            return;
+        }
+        foreach (const Topic &topic, topics) {
+            if (isOutgoing(topic)) {
+                localClient->subscribe(topic.localPrefix + topic.pattern, topic.qos);
+            }
+        }
+    });
+    connect(localClient, &MqttClient::publishReceived, this, &MqttBridgePrivate::onLocalMessage);
+    server->listenInProcess();
+    localClient->connectToServer(server);
+
+    remoteClient = new MqttClient(clientId, this);
+    connect(remoteClient, &MqttClient::connected, this, &MqttBridgePrivate::onRemoteConnected);
+    connect(remoteClient, &MqttClient::disconnected, q, &MqttBridge::disconnected);
+    connect(remoteClient, &MqttClient::publishReceived, this, &MqttBridgePrivate::onRemoteMessage);
+    connect(remoteClient, &MqttClient::published, this, &MqttBridgePrivate::onRemotePublished);
+}
+
+bool MqttBridgePrivate::isOutgoing(const Topic &topic)
+{
+    return topic.direction == MqttBridge::DirectionOut || topic.direction == MqttBridge::DirectionBoth;
+}
+
+bool MqttBridgePrivate::isIncoming(const Topic &topic)
+{
+    return topic.direction == MqttBridge::DirectionIn || topic.direction == MqttBridge::DirectionBoth;
+}
+
+const MqttBridgePrivate::Topic *MqttBridgePrivate::outgoingTopic(const QString &localTopic) const
+{
+    for (int i = 0; i < topics.count(); i++) {
+        const Topic &topic = topics.at(i);
+        if (isOutgoing(topic) && localTopic.startsWith(topic.localPrefix)
+                && MqttServerPrivate::matchTopic(topic.pattern, localTopic.mid(topic.localPrefix.length()))) {
+            return &topic;
+        }
+    }
+    return nullptr;
+}
+
+const MqttBridgePrivate::Topic *MqttBridgePrivate::incomingTopic(const QString &remoteTopic) const
+{
+    for (int i = 0; i < topics.count(); i++) {
+        const Topic &topic = topics.at(i);
+        if (isIncoming(topic) && remoteTopic.startsWith(topic.remotePrefix)
+                && MqttServerPrivate::matchTopic(topic.pattern, remoteTopic.mid(topic.remotePrefix.length()))) {
+            return &topic;
+        }
+    }
+    return nullptr;
+}
+
+void MqttBridgePrivate::onLocalMessage(const QString &topic, const QByteArray &payload, bool retained)
+{
+    if (localEchoes.take(topic, payload, clock.elapsed())) {
+        return;
+    }
+    const Topic *mapping = outgoingTopic(topic);
+    if (!mapping) {
+        return;
+    }
+    Message message;
+    message.topic = mapping->remotePrefix + topic.mid(mapping->localPrefix.length());
+    message.payload = payload;
+    message.qos = mapping->qos;
+    message.retain = retained;
+    queue.enqueue(message);
+    if (queue.count() > maximumQueuedMessages) {
+        Message dropped = queue.dequeue();
+        qCDebug(dbgBridge) << "Bridge queue is full. Dropping message on" << dropped.topic;
+    }
+    scheduleFlush();
+}
+
+void MqttBridgePrivate::onRemoteMessage(const QString &topic, const QByteArray &payload, bool retained)
+{
+    qint64 now = clock.elapsed();
+    if (remoteEchoes.take(topic, payload, now)) {
+        return;
+    }
+    const Topic *mapping = incomingTopic(topic);
+    if (!mapping) {
+        return;
+    }
+    if (!localClient->isConnected()) {
+        qCWarning(dbgBridge) << "Bridge not connected to the local server. Dropping message on" << topic;
+        return;
+    }
+    QString localTopic = mapping->localPrefix + topic.mid(mapping->remotePrefix.length());
+    if (outgoingTopic(localTopic)) {
+        localEchoes.add(localTopic, payload, now);
+    }
+    localClient->publish(localTopic, payload, mapping->qos, retained);
+}
+
+void MqttBridgePrivate::onRemoteConnected(Mqtt::ConnectReturnCode connectReturnCode)
+{
+    if (connectReturnCode != Mqtt::ConnectReturnCodeAccepted) {
+        qCWarning(dbgBridge) << "Bridge connection refused:" << connectReturnCode;
+        return;
+    }
+    foreach (const Topic &topic, topics) {
+        if (isIncoming(topic)) {
+            remoteClient->subscribe(topic.remotePrefix + topic.pattern, topic.qos);
+        }
+    }
+    qCDebug(dbgBridge) << "Bridge connected," << queue.count() << "messages queued";
+    emit q_ptr->connected();
+    scheduleFlush();
+}
+
+void MqttBridgePrivate::onRemotePublished(quint16 packetId)
+{
+    inflight.remove(packetId);
+    // Refill the window in batches rather than one message per acknowledgement
+    if (inflight.count() <= batchSize / 2) {
+        scheduleFlush();
+    }
+}
+
+void MqttBridgePrivate::scheduleFlush()
+{
+    if (queue.isEmpty() || !remoteClient->isConnected()) {
+        return;
+    }
+    if (queue.count() >= batchSize) {
+        flush();
+    } else if (!batchTimer.isActive()) {
+        batchTimer.start(batchInterval);
+    }
+}
+
+void MqttBridgePrivate::flush()
+{
+    batchTimer.stop();
+    if (!remoteClient->isConnected()) {
+        return;
+    }
+    qint64 now = clock.elapsed();
+    int sent = 0;
+    while (!queue.isEmpty() && inflight.count() < batchSize) {
+        Message message = queue.dequeue();
+        if (incomingTopic(message.topic)) {
+            remoteEchoes.add(message.topic, message.payload, now);
+        }
+        quint16 packetId = remoteClient->publish(message.topic, message.payload, message.qos, message.retain);
+        if (message.qos != Mqtt::QoS0) {
+            inflight.insert(packetId);
+        }
+        sent++;
+    }
+    if (sent > 0) {
+        qCDebug(dbgBridge) << "Bridge forwarded" << sent << "messages," << queue.count() << "still queued";
+    }
+}
+
+void MqttBridgePrivate::EchoFilter::add(const QString &topic, const QByteArray &payload, qint64 now)
+{
+    expire(now);
+    Key key(topic, qHash(payload));
+    m_pending[key]++;
+    m_order.enqueue(qMakePair(now, key));
+}
+
+bool MqttBridgePrivate::EchoFilter::take(const QString &topic, const QByteArray &payload, qint64 now)
+{
+    expire(now);
+    if (m_pending.isEmpty()) {
+        return false;
+    }
+    QHash<Key, int>::iterator it = m_pending.find(Key(topic, qHash(payload)));
+    if (it == m_pending.end()) {
+        return false;
+    }
+    if (--it.value() <= 0) {
+        m_pending.erase(it);
+    }
+    return true;
+}
+
+void MqttBridgePrivate::EchoFilter::expire(qint64 now)
+{
+    while (!m_order.isEmpty() && now - m_order.head().first > echoTimeout) {
+        QHash<Key, int>::iterator it = m_pending.find(m_order.dequeue().second);
+        if (it != m_pending.end() && --it.value() <= 0) {
+            m_pending.erase(it);
+        }
+    }
+}
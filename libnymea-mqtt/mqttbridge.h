@@ -0,0 +1,89 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+*
+* Copyright 2013 - 2020, nymea GmbH
+* Contact: contact@nymea.io
+*
+* This file is part of nymea.
+* This project including source code and documentation is protected by copyright law, and
+* remains the property of nymea GmbH. All rights, including reproduction, publication,
+* editing and translation, are reserved. The use of this project is subject to the terms of a
+* license agreement to be concluded with nymea GmbH in accordance with the terms
+* of use of nymea GmbH, available under https://nymea.io/license
+*
+* GNU Lesser General Public License Usage
+* Alternatively, this project may be redistributed and/or modified under the terms of the GNU
+* Lesser General Public License as published by the Free Software Foundation; version 3.
+* this project is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+* without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License along with this project.
+* If not, see <https://www.gnu.org/licenses/>.
+*
+* For any further details and any questions please contact us under contact@nymea.io
+* or see our FAQ/Licensing Information on https://nymea.io/license/faq
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef MQTTBRIDGE_H
+#define MQTTBRIDGE_H
+
+#include <QObject>
+#include <QSslConfiguration>
+
+#include "mqtt.h"
+
+class MqttServer;
+class MqttBridgePrivate;
+
+class MqttBridge : public QObject
+{
+    Q_OBJECT
+public:
+    enum Direction {
+        DirectionOut,
+        DirectionIn,
+        DirectionBoth
+    };
+    Q_ENUM(Direction)
+
+    // The bridge connects to the local server in-process and to the remote broker with the given client ID.
+    explicit MqttBridge(MqttServer *server, const QString &clientId, QObject *parent = nullptr);
+    ~MqttBridge() override;
+
+    // Forwards messages on topics matching the pattern. Outgoing messages have the local prefix replaced by the
+    // remote prefix, incoming ones the other way round. The pattern is matched without the prefixes.
+    void addTopic(const QString &pattern, Direction direction, Mqtt::QoS qos = Mqtt::QoS1, const QString &localPrefix = QString(), const QString &remotePrefix = QString());
+    void removeTopic(const QString &pattern);
+
+    QString username() const;
+    void setUsername(const QString &username);
+    QString password() const;
+    void setPassword(const QString &password);
+
+    void connectToHost(const QString &hostName, quint16 port, bool useSsl = false, const QSslConfiguration &sslConfiguration = QSslConfiguration());
+    void connectToServer(MqttServer *remoteServer);
+    void disconnectFromHost();
+    bool isConnected() const;
+
+    // Outgoing messages are collected and sent in batches, after the given number of milliseconds or once the
+    // given number of messages is waiting. The batch size also limits the unacknowledged messages on the uplink.
+    int batchInterval() const;
+    void setBatchInterval(int batchInterval);
+    int batchSize() const;
+    void setBatchSize(int batchSize);
+
+    // Outgoing messages are queued while the uplink is down. When the queue is full, the oldest are dropped.
+    int maximumQueuedMessages() const;
+    void setMaximumQueuedMessages(int maximumQueuedMessages);
+    int queuedMessages() const;
+
+signals:
+    void connected();
+    void disconnected();
+
+private:
+    MqttBridgePrivate *d_ptr;
+};
+
+#endif // MQTTBRIDGE_H
@@ -0,0 +1,108 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+*
+* Copyright 2013 - 2020, nymea GmbH
+* Contact: contact@nymea.io
+*
+* This file is part of nymea.
+* This project including source code and documentation is protected by copyright law, and
+* remains the property of nymea GmbH. All rights, including reproduction, publication,
+* editing and translation, are reserved. The use of this project is subject to the terms of a
+* license agreement to be concluded with nymea GmbH in accordance with the terms
+* of use of nymea GmbH, available under https://nymea.io/license
+*
+* GNU Lesser General Public License Usage
+* Alternatively, this project may be redistributed and/or modified under the terms of the GNU
+* Lesser General Public License as published by the Free Software Foundation; version 3.
+* this project is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+* without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License along with this project.
+* If not, see <https://www.gnu.org/licenses/>.
+*
+* For any further details and any questions please contact us under contact@nymea.io
+* or see our FAQ/Licensing Information on https://nymea.io/license/faq
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef MQTTBRIDGE_P_H
+#define MQTTBRIDGE_P_H
+
+#include <QObject>
+#include <QTimer>
+#include <QQueue>
+#include <QHash>
+#include <QSet>
+#include <QPair>
+#include <QElapsedTimer>
+#include <QLoggingCategory>
+
+#include "mqttbridge.h"
+#include "mqttclient.h"
+
+Q_DECLARE_LOGGING_CATEGORY(dbgBridge)
+
+class MqttBridgePrivate: public QObject
+{
+    Q_OBJECT
+public:
+    struct Topic {
+        QString pattern;
+        MqttBridge::Direction direction;
+        Mqtt::QoS qos;
+        QString localPrefix;
+        QString remotePrefix;
+    };
+
+    struct Message {
+        QString topic;
+        QByteArray payload;
+        Mqtt::QoS qos;
+        bool retain;
+    };
+
+    // Messages the bridge published itself, keyed by topic and payload hash. They come back if the bridge is
+    // subscribed to their topic on that side and must not be forwarded again.
+    class EchoFilter {
+    public:
+        void add(const QString &topic, const QByteArray &payload, qint64 now);
+        bool take(const QString &topic, const QByteArray &payload, qint64 now);
+    private:
+        typedef QPair<QString, uint> Key;
+        void expire(qint64 now);
+        QHash<Key, int> m_pending;
+        QQueue<QPair<qint64, Key> > m_order;
+    };
+
+    MqttBridgePrivate(MqttServer *server, const QString &clientId, MqttBridge *q);
+    MqttBridge *q_ptr;
+
+    MqttClient *localClient = nullptr;
+    MqttClient *remoteClient = nullptr;
+    QList<Topic> topics;
+
+    int batchInterval = 50;
+    int batchSize = 100;
+    int maximumQueuedMessages = 1000;
+    QQueue<Message> queue;
+    QSet<quint16> inflight;
+    QTimer batchTimer;
+
+    QElapsedTimer clock;
+    EchoFilter localEchoes;
+    EchoFilter remoteEchoes;
+
+    static bool isOutgoing(const Topic &topic);
+    static bool isIncoming(const Topic &topic);
+    const Topic *outgoingTopic(const QString &localTopic) const;
+    const Topic *incomingTopic(const QString &remoteTopic) const;
+
+    void onLocalMessage(const QString &topic, const QByteArray &payload, bool retained);
+    void onRemoteMessage(const QString &topic, const QByteArray &payload, bool retained);
+    void onRemoteConnected(Mqtt::ConnectReturnCode connectReturnCode);
+    void onRemotePublished(quint16 packetId);
+    void scheduleFlush();
+    void flush();
+};
+
+#endif // MQTTBRIDGE_P_H
@@ -0,0 +1,180 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+*
+* Copyright 2013 - 2020, nymea GmbH
+* Contact: contact@nymea.io
+*
+* This file is part of nymea.
+* This project including source code and documentation is protected by copyright law, and
+* remains the property of nymea GmbH. All rights, including reproduction, publication,
+* editing and translation, are reserved. The use of this project is subject to the terms of a
+* license agreement to be concluded with nymea GmbH in accordance with the terms
+* of use of nymea GmbH, available under https://nymea.io/license
+*
+* GNU Lesser General Public License Usage
+* Alternatively, this project may be redistributed and/or modified under the terms of the GNU
+* Lesser General Public License as published by the Free Software Foundation; version 3.
+* this project is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+* without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License along with this project.
+* If not, see <https://www.gnu.org/licenses/>.
+*
+* For any further details and any questions please contact us under contact@nymea.io
+* or see our FAQ/Licensing Information on https://nymea.io/license/faq
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*!
+    \class MqttBroker
+    \brief A routing domain shared by several MqttServer instances in one process.
+    \inmodule nymea-mqtt
+    \ingroup mqtt
+
+    Each MqttServer routes messages among its own clients only and keeps its own retained messages. Servers
+    attached to the same MqttBroker act as one broker instead, e.g. when listening on several interfaces
+    with different configurations: a message published on one of them is delivered to the subscribers on
+    all of them, retained messages are shared and client IDs are unique across the servers. A client
+    connecting to one server takes over its session from another one it was connected to before.
+
+    Settings for retained messages, like setRetainedMessagesFile() or setMaximumRetainedBytes(), apply to the
+    shared retained messages when made on any of the attached servers.
+*/
+
+#include "mqttbroker.h"
+#include "mqttbroker_p.h"
+#include "mqttserver.h"
+#include "mqttserver_p.h"
+
+MqttBroker::MqttBroker(QObject *parent):
+    QObject(parent),
+    d_ptr(new MqttBrokerPrivate())
+{
+}
+
+MqttBroker::~MqttBroker()
+{
+    while (!d_ptr->servers.isEmpty()) {
+        d_ptr->detach(d_ptr->servers.first());
+    }
+    delete d_ptr;
+}
+
+/*!
+ * \brief Attaches \a server to this broker. Retained messages the server had so far are added to the shared
+ * ones unless there is one for the topic already. A server attached to another broker is moved over.
+ */
+void MqttBroker::addServer(MqttServer *server)
+{
+    MqttServerPrivate *serverPrivate = server->d_ptr;
+    if (serverPrivate->broker == d_ptr) {
+        return;
+    }
+    if (serverPrivate->broker) {
+        serverPrivate->broker->detach(serverPrivate);
+    }
+    d_ptr->attach(serverPrivate);
+}
+
+/*!
+ * \brief Detaches \a server from this broker. It continues on its own with a copy of the shared retained
+ * messages. Sessions stay with the server they are on.
+ */
+void MqttBroker::removeServer(MqttServer *server)
+{
+    if (server->d_ptr->broker == d_ptr) {
+        d_ptr->detach(server->d_ptr);
+    }
+}
+
+QList<MqttServer*> MqttBroker::servers() const
+{
+    QList<MqttServer*> servers;
+    foreach (MqttServerPrivate *server, d_ptr->servers) {
+        servers.append(server->q_ptr);
+    }
+    return servers;
+}
+
+QStringList MqttBroker::clients() const
+{
+    QStringList clients;
+    foreach (MqttServerPrivate *server, d_ptr->servers) {
+        clients.append(server->q_ptr->clients());
+    }
+    return clients;
+}
+
+void MqttBrokerPrivate::attach(MqttServerPrivate *server)
+{
+    MqttRetainedMessages *own = server->retainedMessages;
+    foreach (const QString &topic, own->topics()) {
+        MqttPackets packets = own->value(topic);
+        if (!packets.isEmpty() && !retainedMessages.contains(topic)) {
+            retainedMessages.insert(topic, packets.last());
+        }
+    }
+    server->retainedMessages = &retainedMessages;
+    server->broker = this;
+    servers.append(server);
+    qCDebug(dbgServer) << "Server attached to broker," << servers.count() << "servers," << retainedMessages.count() << "retained messages";
+}
+
+void MqttBrokerPrivate::detach(MqttServerPrivate *server)
+{
+    servers.removeAll(server);
+    server->broker = nullptr;
+    server->retainedMessages = &server->ownRetainedMessages;
+
+    // Continue with the current state of the shared retained messages
+    MqttRetainedMessages *own = server->retainedMessages;
+    foreach (const QString &topic, own->topics()) {
+        if (!retainedMessages.contains(topic)) {
+            own->remove(topic);
+        }
+    }
+    foreach (const QString &topic, retainedMessages.topics()) {
+        MqttPackets packets = retainedMessages.value(topic);
+        if (!packets.isEmpty()) {
+            own->insert(topic, packets.last());
+        }
+    }
+    qCDebug(dbgServer) << "Server detached from broker," << servers.count() << "servers left";
+}
+
+void MqttBrokerPrivate::releaseClientId(MqttServerPrivate *server, const QString &clientId)
+{
+    foreach (MqttServerPrivate *other, servers) {
+        if (other == server) {
+            continue;
+        }
+        foreach (QIODevice *client, other->clientList.keys()) {
+            if (other->clientList.value(client)->clientId == clientId) {
+                qCDebug(dbgServer).nospace() << clientId << ": Connected to another server of the broker. Disconnecting it there.";
+                other->cleanupClient(client);
+                break;
+            }
+        }
+
+        ClientContext *ctx = other->offlineSessions.take(clientId);
+        if (!ctx) {
+            continue;
+        }
+        qCDebug(dbgServer).nospace() << clientId << ": Moving session over from another server of the broker.";
+        other->sessionExpiries.remove(clientId);
+        foreach (const MqttSubscription &subscription, ctx->subscriptions) {
+            emit other->q_ptr->clientUnsubscribed(clientId, subscription.topicFilter());
+        }
+        if (other->isPersisted(ctx)) {
+            other->sessionStore->removeSession(clientId);
+        }
+
+        server->offlineSessions.insert(clientId, ctx);
+        foreach (const MqttSubscription &subscription, ctx->subscriptions) {
+            emit server->q_ptr->clientSubscribed(clientId, subscription.topicFilter(), subscription.qoS());
+        }
+        if (server->isPersisted(ctx)) {
+            server->persistSession(ctx);
+        }
+    }
+}
@@ -0,0 +1,57 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+*
+* Copyright 2013 - 2020, nymea GmbH
+* Contact: contact@nymea.io
+*
+* This file is part of nymea.
+* This project including source code and documentation is protected by copyright law, and
+* remains the property of nymea GmbH. All rights, including reproduction, publication,
+* editing and translation, are reserved. The use of this project is subject to the terms of a
+* license agreement to be concluded with nymea GmbH in accordance with the terms
+* of use of nymea GmbH, available under https://nymea.io/license
+*
+* GNU Lesser General Public License Usage
+* Alternatively, this project may be redistributed and/or modified under the terms of the GNU
+* Lesser General Public License as published by the Free Software Foundation; version 3.
+* this project is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+* without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License along with this project.
+* If not, see <https://www.gnu.org/licenses/>.
+*
+* For any further details and any questions please contact us under contact@nymea.io
+* or see our FAQ/Licensing Information on https://nymea.io/license/faq
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef MQTTBROKER_H
+#define MQTTBROKER_H
+
+#include <QObject>
+#include <QList>
+#include <QStringList>
+
+class MqttServer;
+class MqttBrokerPrivate;
+
+class MqttBroker : public QObject
+{
+    Q_OBJECT
+public:
+    explicit MqttBroker(QObject *parent = nullptr);
+    ~MqttBroker() override;
+
+    // Servers attached to the broker share message routing, retained messages and client sessions.
+    // A server can be attached to one broker at a time, it is detached automatically when destroyed.
+    void addServer(MqttServer *server);
+    void removeServer(MqttServer *server);
+    QList<MqttServer*> servers() const;
+
+    QStringList clients() const;
+
+private:
+    MqttBrokerPrivate *d_ptr;
+};
+
+#endif // MQTTBROKER_H
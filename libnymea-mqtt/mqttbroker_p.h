@@ -0,0 +1,52 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+*
+* Copyright 2013 - 2020, nymea GmbH
+* Contact: contact@nymea.io
+*
+* This file is part of nymea.
+* This project including source code and documentation is protected by copyright law, and
+* remains the property of nymea GmbH. All rights, including reproduction, publication,
+* editing and translation, are reserved. The use of this project is subject to the terms of a
+* license agreement to be concluded with nymea GmbH in accordance with the terms
+* of use of nymea GmbH, available under https://nymea.io/license
+*
+* GNU Lesser General Public License Usage
+* Alternatively, this project may be redistributed and/or modified under the terms of the GNU
+* Lesser General Public License as published by the Free Software Foundation; version 3.
+* this project is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+* without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License along with this project.
+* If not, see <https://www.gnu.org/licenses/>.
+*
+* For any further details and any questions please contact us under contact@nymea.io
+* or see our FAQ/Licensing Information on https://nymea.io/license/faq
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef MQTTBROKER_P_H
+#define MQTTBROKER_P_H
+
+#include <QList>
+#include <QString>
+
+#include "mqttretainedmessages_p.h"
+
+class MqttServerPrivate;
+
+// The servers attached keep their own clients, each one delivers a message to the subscribers among its
+// clients. They point to the retained messages of the broker instead of their own, and a client connecting
+// to one of them takes its session along from whichever server had it so far.
+class MqttBrokerPrivate
+{
+public:
+    void attach(MqttServerPrivate *server);
+    void detach(MqttServerPrivate *server);
+    void releaseClientId(MqttServerPrivate *server, const QString &clientId);
+
+    QList<MqttServerPrivate*> servers;
+    MqttRetainedMessages retainedMessages;
+};
+
+#endif // MQTTBROKER_P_H
@@ -37,6 +37,9 @@
 #include "mqttclient.h"
 #include "mqttclient_p.h"
 #include "mqttpacket.h"
+#include "mqttserver.h"
+#include "mqttserver_p.h"
+#include "mqttinprocesschannel_p.h"
 
 Q_LOGGING_CATEGORY(dbgClient, "nymea.mqtt.client")
 
@@ -53,7 +56,9 @@ MqttClientPrivate::MqttClientPrivate(MqttClient *q):
 
 void MqttClientPrivate::connectToHost(const QString &hostName, quint16 port, bool cleanSession, bool useSsl, const QSslConfiguration &sslConfiguration)
 {
-    if (serverHostname != hostName || serverPort != port || this->useSsl != useSsl || sslConfiguration != this->sslConfiguration) {
+    if (inProcessServer || !localServerName.isEmpty() || serverHostname != hostName || serverPort != port || this->useSsl != useSsl || sslConfiguration != this->sslConfiguration) {
+        inProcessServer = nullptr;
+        localServerName.clear();
         serverHostname = hostName;
         serverPort = port;
         this->useSsl = useSsl;
@@ -65,10 +70,7 @@ void MqttClientPrivate::connectToHost(const QString &hostName, quint16 port, boo
 
     sessionActive = true;
 
-    if (socket) {
-        socket->abort();
-        socket->deleteLater();
-    }
+    resetTransport();
     socket = new QSslSocket(this);
     socket->setSslConfiguration(sslConfiguration);
     connect(socket, &QTcpSocket::connected, this, &MqttClientPrivate::onConnected);
@@ -86,16 +88,147 @@ void MqttClientPrivate::connectToHost(const QString &hostName, quint16 port, boo
     }
 }
 
+void MqttClientPrivate::connectToLocalServer(const QString &serverName, bool cleanSession)
+{
+    if (inProcessServer || localServerName != serverName) {
+        inProcessServer = nullptr;
+        localServerName = serverName;
+        serverHostname.clear();
+        serverPort = 0;
+        reconnectAttempt = 1;
+        reconnectTimer.stop();
+    }
+    this->cleanSession = cleanSession;
+
+    sessionActive = true;
+
+    resetTransport();
+    localSocket = new QLocalSocket(this);
+    connect(localSocket, &QLocalSocket::connected, this, &MqttClientPrivate::onConnected);
+    connect(localSocket, &QLocalSocket::disconnected, this, &MqttClientPrivate::onDisconnected);
+    connect(localSocket, &QLocalSocket::readyRead, this, &MqttClientPrivate::onReadyRead);
+    // QLocalSocket states and errors are defined to match their QAbstractSocket counterparts
+    connect(localSocket, &QLocalSocket::stateChanged, this, [this](QLocalSocket::LocalSocketState state) {
+        onSocketStateChanged(static_cast<QAbstractSocket::SocketState>(state));
+    });
+    typedef void (QLocalSocket:: *errorSignal)(QLocalSocket::LocalSocketError);
+    connect(localSocket, static_cast<errorSignal>(&QLocalSocket::error), this, [this](QLocalSocket::LocalSocketError error) {
+        onSocketError(static_cast<QAbstractSocket::SocketError>(error));
+    });
+    localSocket->connectToServer(serverName);
+}
+
+void MqttClientPrivate::connectToServer(MqttServer *server, bool cleanSession)
+{
+    if (inProcessServer != server) {
+        inProcessServer = server;
+        localServerName.clear();
+        serverHostname.clear();
+        serverPort = 0;
+        reconnectAttempt = 1;
+        reconnectTimer.stop();
+    }
+    this->cleanSession = cleanSession;
+
+    sessionActive = true;
+
+    resetTransport();
+    inProcessChannel = server ? server->d_ptr->connectInProcess(this) : nullptr;
+    if (!inProcessChannel) {
+        QTimer::singleShot(0, this, [this]() {
+            onSocketError(QAbstractSocket::ConnectionRefusedError);
+        });
+        return;
+    }
+    connect(inProcessChannel, &MqttInProcessChannel::packetsAvailable, this, &MqttClientPrivate::onPacketsAvailable);
+    connect(inProcessChannel, &MqttInProcessChannel::disconnected, this, [this]() {
+        onSocketStateChanged(QAbstractSocket::UnconnectedState);
+        onDisconnected();
+    });
+    // Behave like a socket and report the connection from the event loop
+    QTimer::singleShot(0, inProcessChannel, [this]() {
+        onSocketStateChanged(QAbstractSocket::ConnectedState);
+        onConnected();
+    });
+}
+
 void MqttClientPrivate::disconnectFromHost()
 {
     sessionActive = false;
-    if (!socket || !socket->isOpen()) {
+    QIODevice *device = transport();
+    if (!device || !device->isOpen()) {
         return;
     }
     MqttPacket packet(MqttPacket::TypeDisconnect);
-    socket->write(packet.serialize());
-    socket->flush();
-    socket->disconnectFromHost();
+    sendPacket(packet);
+    if (socket) {
+        socket->flush();
+        socket->disconnectFromHost();
+    } else if (localSocket) {
+        localSocket->flush();
+        localSocket->disconnectFromServer();
+    } else {
+        inProcessChannel->close();
+    }
+}
+
+QIODevice *MqttClientPrivate::transport() const
+{
+    if (inProcessChannel) {
+        return inProcessChannel;
+    }
+    if (localSocket) {
+        return localSocket;
+    }
+    return socket;
+}
+
+void MqttClientPrivate::sendPacket(const MqttPacket &packet)
+{
+    if (inProcessChannel) {
+        inProcessChannel->sendPacket(packet);
+        return;
+    }
+    QIODevice *device = transport();
+    if (!device) {
+        qCWarning(dbgClient) << "Not connected. Cannot send packet.";
+        return;
+    }
+    device->write(packet.serialize());
+}
+
+void MqttClientPrivate::abortTransport()
+{
+    inputBuffer.clear();
+    if (socket) {
+        socket->abort();
+    }
+    if (localSocket) {
+        localSocket->abort();
+    }
+    if (inProcessChannel) {
+        inProcessChannel->close();
+    }
+}
+
+void MqttClientPrivate::resetTransport()
+{
+    inputBuffer.clear();
+    if (inProcessChannel) {
+        inProcessChannel->close();
+        inProcessChannel->deleteLater();
+        inProcessChannel = nullptr;
+    }
+    if (socket) {
+        socket->abort();
+        socket->deleteLater();
+        socket = nullptr;
+    }
+    if (localSocket) {
+        localSocket->abort();
+        localSocket->deleteLater();
+        localSocket = nullptr;
+    }
 }
 
 /*!
@@ -229,6 +362,24 @@ void MqttClient::connectToHost(const QString &hostName, quint16 port, bool clean
     d_ptr->connectToHost(hostName, port, cleanSession, useSsl, sslConfiguration);
 }
 
+/*!
+ * \brief Connects to a MqttServer listening on the local socket \a serverName, see MqttServer::listenLocal().
+ */
+void MqttClient::connectToLocalServer(const QString &serverName, bool cleanSession)
+{
+    d_ptr->connectToLocalServer(serverName, cleanSession);
+}
+
+/*!
+ * \brief Connects to a MqttServer living in the same process, see MqttServer::listenInProcess().
+ *
+ * Packets are exchanged with the \a server as MqttPacket objects, no encoding or socket I/O takes place.
+ */
+void MqttClient::connectToServer(MqttServer *server, bool cleanSession)
+{
+    d_ptr->connectToServer(server, cleanSession);
+}
+
 void MqttClient::disconnectFromHost()
 {
     d_ptr->disconnectFromHost();
@@ -236,7 +387,10 @@ void MqttClient::disconnectFromHost()
 
 bool MqttClient::isConnected() const
 {
-    return d_ptr->socket && d_ptr->socket->state() == QAbstractSocket::ConnectedState && d_ptr->keepAliveTimer.isActive();
+    bool transportConnected = (d_ptr->socket && d_ptr->socket->state() == QAbstractSocket::ConnectedState)
+            || (d_ptr->localSocket && d_ptr->localSocket->state() == QLocalSocket::ConnectedState)
+            || (d_ptr->inProcessChannel && d_ptr->inProcessChannel->isOpen());
+    return transportConnected && d_ptr->keepAliveTimer.isActive();
 }
 
 quint16 MqttClient::subscribe(const MqttSubscription &subscription)
@@ -255,9 +409,8 @@ quint16 MqttClient::subscribe(const MqttSubscriptions &subscriptions)
 {
     MqttPacket packet(MqttPacket::TypeSubscribe, d_ptr->newPacketId());
     packet.setSubscriptions(subscriptions);
-    d_ptr->unackedPackets.insert(packet.packetId(), packet);
-    d_ptr->unackedPacketList.append(packet.packetId());
-    d_ptr->socket->write(packet.serialize());
+    d_ptr->unackedPackets.insert(packet);
+    d_ptr->sendPacket(packet);
     return packet.packetId();
 }
 
@@ -276,9 +429,8 @@ quint16 MqttClient::unsubscribe(const MqttSubscriptions &subscriptions)
 {
     MqttPacket packet(MqttPacket::TypeUnsubscribe, d_ptr->newPacketId());
     packet.setSubscriptions(subscriptions);
-    d_ptr->unackedPackets.insert(packet.packetId(), packet);
-    d_ptr->unackedPacketList.append(packet.packetId());
-    d_ptr->socket->write(packet.serialize());
+    d_ptr->unackedPackets.insert(packet);
+    d_ptr->sendPacket(packet);
     return packet.packetId();
 }
 
@@ -288,14 +440,13 @@ quint16 MqttClient::publish(const QString &topic, const QByteArray &payload, Mqt
     MqttPacket packet(MqttPacket::TypePublish, packetId, qos, retain, false);
     packet.setTopic(topic.toUtf8());
     packet.setPayload(payload);
-    d_ptr->socket->write(packet.serialize());
+    d_ptr->sendPacket(packet);
     if (qos == Mqtt::QoS0) {
         QTimer::singleShot(0, this, [this, packet](){
             emit published(packet.packetId(), packet.topic());
         });
     } else {
-        d_ptr->unackedPackets.insert(packet.packetId(), packet);
-        d_ptr->unackedPacketList.append(packetId);
+        d_ptr->unackedPackets.insert(packet);
     }
     return packetId;
 }
@@ -313,7 +464,7 @@ void MqttClientPrivate::onConnected()
     packet.setWillRetain(willRetain);
     packet.setUsername(username.toUtf8());
     packet.setPassword(password.toUtf8());
-    socket->write(packet.serialize());
+    sendPacket(packet);
 }
 
 void MqttClientPrivate::onDisconnected()
@@ -330,39 +481,50 @@ void MqttClientPrivate::onDisconnected()
 
 void MqttClientPrivate::onReadyRead()
 {
-    static QByteArray data;
-    data.append(socket->readAll());
-//    qCDebug(dbgClient) << "Received data from server:" << data.toHex() << "\n" << data;
-    MqttPacket packet;
-    int ret = packet.parse(data);
-    if (ret == -1) {
-        qCDebug(dbgClient) << "Bad data from server. Dropping connection.";
-        data.clear();
-        socket->abort();
-        return;
+    inputBuffer.append(transport()->readAll());
+//    qCDebug(dbgClient) << "Received data from server:" << inputBuffer.toHex() << "\n" << inputBuffer;
+    while (!inputBuffer.isEmpty()) {
+        MqttPacket packet;
+        int ret = packet.parse(inputBuffer);
+        if (ret == -1) {
+            qCDebug(dbgClient) << "Bad data from server. Dropping connection.";
+            abortTransport();
+            return;
+        }
+        if (ret == 0) {
+            qCDebug(dbgClient) << "Not enough data from server...";
+            return;
+        }
+        inputBuffer.remove(0, ret);
+
+        processPacket(packet);
     }
-    if (ret == 0) {
-        qCDebug(dbgClient) << "Not enough data from server...";
-        return;
+}
+
+void MqttClientPrivate::onPacketsAvailable()
+{
+    while (inProcessChannel && inProcessChannel->hasPendingPackets()) {
+        processPacket(inProcessChannel->takePacket());
     }
-    data.remove(0, ret);
+}
 
+void MqttClientPrivate::processPacket(const MqttPacket &packet)
+{
     switch (packet.type()) {
     case MqttPacket::TypeConnack:
         if (packet.connectReturnCode() != Mqtt::ConnectReturnCodeAccepted) {
             qCWarning(dbgClient) << "MQTT connection refused:" << packet.connectReturnCode();
             // Always emit connected, even if just to indicate a "ClientRefusedError"
             emit q_ptr->connected(packet.connectReturnCode(), packet.connackFlags());
-            socket->abort();
+            abortTransport();
             emit q_ptr->error(QAbstractSocket::ConnectionRefusedError);
             return;
         }
-        foreach (quint16 retryPacketId, unackedPacketList) {
-            MqttPacket retryPacket = unackedPackets.value(retryPacketId);
+        foreach (MqttPacket retryPacket, unackedPackets.packets()) {
             if (retryPacket.type() == MqttPacket::TypePublish) {
                 retryPacket.setDup(true);
             }
-            socket->write(retryPacket.serialize());
+            sendPacket(retryPacket);
         }
         restartKeepAliveTimer();
         // Make sure we emit connected after having handled all the retransmission queue
@@ -377,31 +539,36 @@ void MqttClientPrivate::onReadyRead()
         case Mqtt::QoS1: {
             emit q_ptr->publishReceived(packet.topic(), packet.payload(), packet.retain());
             MqttPacket response(MqttPacket::TypePuback, packet.packetId());
-            socket->write(response.serialize());
+            sendPacket(response);
             break;
         }
         case Mqtt::QoS2: {
-            if (!packet.dup() && unackedPacketList.contains(packet.packetId())) {
+            if (!packet.dup() && unackedPackets.contains(packet.packetId())) {
                 // Hmm... Server says it's not a duplicate, but packet id is not released yet... Drop connection.
-                socket->disconnectFromHost();
+                inputBuffer.clear();
+                if (socket) {
+                    socket->disconnectFromHost();
+                } else if (localSocket) {
+                    localSocket->disconnectFromServer();
+                } else {
+                    inProcessChannel->close();
+                }
                 return;
             }
 
             MqttPacket response(MqttPacket::TypePubrec, packet.packetId());
 
-            if (!unackedPacketList.contains(packet.packetId())) {
-                unackedPackets.insert(packet.packetId(), response);
-                unackedPacketList.append(packet.packetId());
+            if (!unackedPackets.contains(packet.packetId())) {
+                unackedPackets.insert(response);
                 emit q_ptr->publishReceived(packet.topic(), packet.payload(), packet.retain());
             }
-            socket->write(response.serialize());
+            sendPacket(response);
             break;
         }
         }
         break;
     case MqttPacket::TypePuback: {
         MqttPacket publishPacket = unackedPackets.take(packet.packetId());
-        unackedPacketList.removeAll(packet.packetId());
         emit q_ptr->published(packet.packetId(), publishPacket.topic());
         restartKeepAliveTimer();
         break;
@@ -409,31 +576,30 @@ void MqttClientPrivate::onReadyRead()
     case MqttPacket::TypePubrec: {
         MqttPacket publishPacket = unackedPackets.value(packet.packetId());
         MqttPacket response(MqttPacket::TypePubrel, packet.packetId());
-        unackedPackets[packet.packetId()] = response;
-        socket->write(response.serialize());
+        unackedPackets.insert(response);
+        sendPacket(response);
         emit q_ptr->published(packet.packetId(), publishPacket.topic());
         restartKeepAliveTimer();
         break;
     }
     case MqttPacket::TypePubrel: {
+        // The exchange is complete with the PUBCOMP, a repeated PUBREL is answered regardless
         MqttPacket response(MqttPacket::TypePubcomp, packet.packetId());
-        unackedPackets[packet.packetId()] = response;
-        socket->write(response.serialize());
+        unackedPackets.remove(packet.packetId());
+        sendPacket(response);
         restartKeepAliveTimer();
         break;
     }
     case MqttPacket::TypePubcomp:
         unackedPackets.remove(packet.packetId());
-        unackedPacketList.removeAll(packet.packetId());
         restartKeepAliveTimer();
         break;
     case MqttPacket::TypeSuback: {
         MqttPacket subscribePacket = unackedPackets.take(packet.packetId());
-        unackedPacketList.removeAll(packet.packetId());
 
         if (subscribePacket.subscriptions().count() != packet.subscribeReturnCodes().count()) {
             qCWarning(dbgClient) << "Subscription return code count not matching subscribe packet!";
-            socket->abort();
+            abortTransport();
             return;
         }
 
@@ -450,11 +616,10 @@ void MqttClientPrivate::onReadyRead()
     case MqttPacket::TypeUnsuback:
         if (!unackedPackets.contains(packet.packetId())) {
             qCWarning(dbgClient) << "UNSUBACK received but not waiting for it. Dropping connection. Packet ID:" << packet.packetId();
-            socket->abort();
+            abortTransport();
             return;
         }
         unackedPackets.remove(packet.packetId());
-        unackedPacketList.removeAll(packet.packetId());
         emit q_ptr->unsubscribed(packet.packetId());
         restartKeepAliveTimer();
         break;
@@ -464,10 +629,6 @@ void MqttClientPrivate::onReadyRead()
         qCDebug(dbgClient).noquote().nospace() << "Unhandled packet type: 0x" << QString::number(packet.type(), 16);
         Q_ASSERT(false);
     }
-
-    if (!data.isEmpty()) {
-        onReadyRead();
-    }
 }
 
 void MqttClientPrivate::onSocketStateChanged(QAbstractSocket::SocketState socketState)
@@ -488,17 +649,13 @@ void MqttClientPrivate::onSslErrors(const QList<QSslError> &errors)
 
 quint16 MqttClientPrivate::newPacketId()
 {
-    static quint16 packetId = 1;
-    do {
-        packetId++;
-    } while (unackedPacketList.contains(packetId));
-    return packetId;
+    return unackedPackets.newPacketId();
 }
 
 void MqttClientPrivate::sendPingreq()
 {
     MqttPacket packet(MqttPacket::TypePingreq);
-    socket->write(packet.serialize());
+    sendPacket(packet);
 }
 
 void MqttClientPrivate::restartKeepAliveTimer()
@@ -513,5 +670,13 @@ void MqttClientPrivate::reconnectTimerTimeout()
     if (!autoReconnect) {
         return;
     }
+    if (inProcessServer) {
+        connectToServer(inProcessServer, false);
+        return;
+    }
+    if (!localServerName.isEmpty()) {
+        connectToLocalServer(localServerName, false);
+        return;
+    }
     connectToHost(serverHostname, serverPort, false, useSsl, sslConfiguration);
 }
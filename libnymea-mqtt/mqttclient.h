@@ -36,6 +36,7 @@
 #include "mqttsubscription.h"
 
 class MqttClientPrivate;
+class MqttServer;
 
 class MqttClient : public QObject
 {
@@ -72,6 +73,8 @@ public:
     void setPassword(const QString &password);
 
     void connectToHost(const QString &hostName, quint16 port, bool cleanSession = true, bool useSsl = false, const QSslConfiguration &sslConfiguration = QSslConfiguration());
+    void connectToLocalServer(const QString &serverName, bool cleanSession = true);
+    void connectToServer(MqttServer *server, bool cleanSession = true);
     void disconnectFromHost();
 
     bool isConnected() const;
@@ -30,15 +30,21 @@
 
 #include <QObject>
 #include <QTcpSocket>
+#include <QLocalSocket>
+#include <QPointer>
 #include <QTimer>
 #include <QLoggingCategory>
 
 #include "mqttpacket.h"
 #include "mqttclient.h"
 #include "mqttsubscription.h"
+#include "mqttinflightpackets_p.h"
 
 Q_DECLARE_LOGGING_CATEGORY(dbgClient)
 
+class MqttServer;
+class MqttInProcessChannel;
+
 class MqttClientPrivate: public QObject
 {
     Q_OBJECT
@@ -47,12 +53,21 @@ public:
     MqttClient *q_ptr;
 
     void connectToHost(const QString &hostName, quint16 port, bool cleanSession, bool useSsl, const QSslConfiguration &sslConfiguration);
+    void connectToLocalServer(const QString &serverName, bool cleanSession);
+    void connectToServer(MqttServer *server, bool cleanSession);
     void disconnectFromHost();
 
+    QIODevice *transport() const;
+    void sendPacket(const MqttPacket &packet);
+    void abortTransport();
+    void resetTransport();
+
 public slots:
     void onConnected();
     void onDisconnected();
     void onReadyRead();
+    void onPacketsAvailable();
+    void processPacket(const MqttPacket &packet);
     void onSocketStateChanged(QAbstractSocket::SocketState socketState);
     void onSocketError(QAbstractSocket::SocketError error);
     void onSslErrors(const QList<QSslError> &errors);
@@ -72,6 +87,11 @@ public:
     bool sessionActive = false;
     bool cleanSession = true;
     QSslSocket *socket = nullptr;
+    QString localServerName;
+    QLocalSocket *localSocket = nullptr;
+    QPointer<MqttServer> inProcessServer;
+    MqttInProcessChannel *inProcessChannel = nullptr;
+    QByteArray inputBuffer;
     QTimer reconnectTimer;
     int reconnectAttempt = 0;
     quint16 maxReconnectTimeout = 36000;
@@ -86,8 +106,7 @@ public:
     QString username;
     QString password;
 
-    QVector<quint16> unackedPacketList;
-    QHash<quint16, MqttPacket> unackedPackets;
+    MqttInflightPackets unackedPackets;
 };
 
 #endif // MQTTCLIENT_P_H
@@ -0,0 +1,438 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+*
+* Copyright 2013 - 2020, nymea GmbH
+* Contact: contact@nymea.io
+*
+* This file is part of nymea.
+* This project including source code and documentation is protected by copyright law, and
+* remains the property of nymea GmbH. All rights, including reproduction, publication,
+* editing and translation, are reserved. The use of this project is subject to the terms of a
+* license agreement to be concluded with nymea GmbH in accordance with the terms
+* of use of nymea GmbH, available under https://nymea.io/license
+*
+* GNU Lesser General Public License Usage
+* Alternatively, this project may be redistributed and/or modified under the terms of the GNU
+* Lesser General Public License as published by the Free Software Foundation; version 3.
+* this project is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+* without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License along with this project.
+* If not, see <https://www.gnu.org/licenses/>.
+*
+* For any further details and any questions please contact us under contact@nymea.io
+* or see our FAQ/Licensing Information on https://nymea.io/license/faq
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "mqttcluster_p.h"
+#include "mqttserver.h"
+#include "mqttserver_p.h"
+
+#include <QDataStream>
+#include <QDateTime>
+#include <QtEndian>
+
+Q_DECLARE_LOGGING_CATEGORY(dbgServer)
+
+static const int frameHeaderSize = 4;
+
+MqttClusterNode::MqttClusterNode(MqttServerPrivate *server, const QString &nodeName, const QStringList &peerNames):
+    QObject(server),
+    m_server(server),
+    m_nodeName(nodeName),
+    m_peerNames(peerNames)
+{
+    m_peerNames.removeAll(nodeName);
+
+    connect(&m_localServer, &QLocalServer::newConnection, this, [this]() {
+        while (m_localServer.hasPendingConnections()) {
+            // The name is known once the peer said hello
+            addPeer(m_localServer.nextPendingConnection(), QString());
+        }
+    });
+
+    m_reconnectTimer.setInterval(1000);
+    connect(&m_reconnectTimer, &QTimer::timeout, this, &MqttClusterNode::connectToPeers);
+
+    m_filterTimer.setSingleShot(true);
+    m_filterTimer.setInterval(0);
+    connect(&m_filterTimer, &QTimer::timeout, this, &MqttClusterNode::updateFilters);
+    connect(server->q_ptr, &MqttServer::clientSubscribed, this, &MqttClusterNode::scheduleFilterUpdate);
+    connect(server->q_ptr, &MqttServer::clientUnsubscribed, this, &MqttClusterNode::scheduleFilterUpdate);
+}
+
+MqttClusterNode::~MqttClusterNode()
+{
+    QList<QLocalSocket*> sockets = m_peers.keys() + m_connecting.values();
+    foreach (QLocalSocket *socket, sockets) {
+        socket->disconnect(this);
+        socket->abort();
+        delete socket;
+    }
+    m_localServer.close();
+}
+
+bool MqttClusterNode::listen()
+{
+    if (!m_localServer.listen(m_nodeName)) {
+        if (m_localServer.serverError() != QAbstractSocket::AddressInUseError) {
+            qCWarning(dbgServer) << "Cluster: Error listening on local socket" << m_nodeName << m_localServer.errorString();
+            return false;
+        }
+        // Most likely a leftover from a previous instance of this node
+        QLocalServer::removeServer(m_nodeName);
+        if (!m_localServer.listen(m_nodeName)) {
+            qCWarning(dbgServer) << "Cluster: Error listening on local socket" << m_nodeName << m_localServer.errorString();
+            return false;
+        }
+    }
+    updateFilters();
+    connectToPeers();
+    m_reconnectTimer.start();
+    qCDebug(dbgServer) << "Cluster: Node" << m_nodeName << "joined, peers:" << m_peerNames;
+    return true;
+}
+
+QString MqttClusterNode::nodeName() const
+{
+    return m_nodeName;
+}
+
+QStringList MqttClusterNode::connectedPeers() const
+{
+    QStringList peers;
+    foreach (const Peer &peer, m_peers) {
+        if (!peer.name.isEmpty()) {
+            peers.append(peer.name);
+        }
+    }
+    peers.sort();
+    return peers;
+}
+
+void MqttClusterNode::forwardPublish(const QString &topic, const QByteArray &payload, qint64 expiry)
+{
+    QByteArray record;
+    for (QHash<QLocalSocket*, Peer>::const_iterator it = m_peers.constBegin(); it != m_peers.constEnd(); ++it) {
+        bool matching = false;
+        foreach (const QString &filter, it->filters) {
+            if (MqttServerPrivate::matchTopic(filter, topic)) {
+                matching = true;
+                break;
+            }
+        }
+        if (!matching) {
+            continue;
+        }
+        if (record.isNull()) {
+            QDataStream stream(&record, QIODevice::WriteOnly);
+            stream << static_cast<quint8>(MessagePublish) << topic << payload << expiry;
+        }
+        send(it.key(), record);
+    }
+}
+
+void MqttClusterNode::replicateRetained(const QString &topic, const MqttPacket &packet)
+{
+    // Strictly increasing per topic, even if the clock doesn't move in between
+    qint64 stamp = qMax(QDateTime::currentMSecsSinceEpoch(), m_retainedStamps.value(topic).first + 1);
+    m_retainedStamps.insert(topic, qMakePair(stamp, m_nodeName));
+    broadcast(retainRecord(topic, packet, stamp, m_nodeName));
+}
+
+void MqttClusterNode::removeRetained(const QString &topic)
+{
+    qint64 stamp = qMax(QDateTime::currentMSecsSinceEpoch(), m_retainedStamps.value(topic).first + 1);
+    m_retainedStamps.insert(topic, qMakePair(stamp, m_nodeName));
+    broadcast(removeRetainedRecord(topic, stamp, m_nodeName));
+}
+
+void MqttClusterNode::scheduleFilterUpdate()
+{
+    if (!m_filterTimer.isActive()) {
+        m_filterTimer.start();
+    }
+}
+
+void MqttClusterNode::connectToPeers()
+{
+    QSet<QString> connected;
+    foreach (const Peer &peer, m_peers) {
+        connected.insert(peer.name);
+    }
+    foreach (const QString &peerName, m_peerNames) {
+        if (peerName >= m_nodeName || connected.contains(peerName) || m_connecting.contains(peerName)) {
+            continue;
+        }
+        QLocalSocket *socket = new QLocalSocket(this);
+        m_connecting.insert(peerName, socket);
+        connect(socket, &QLocalSocket::connected, this, [this, socket, peerName]() {
+            m_connecting.remove(peerName);
+            addPeer(socket, peerName);
+        });
+        typedef void (QLocalSocket:: *errorSignal)(QLocalSocket::LocalSocketError);
+        connect(socket, static_cast<errorSignal>(&QLocalSocket::error), this, [this, socket, peerName](QLocalSocket::LocalSocketError) {
+            if (m_connecting.value(peerName) == socket) {
+                // Not up (yet), retried by the reconnect timer
+                m_connecting.remove(peerName);
+                socket->deleteLater();
+            }
+        });
+        socket->connectToServer(peerName);
+    }
+}
+
+void MqttClusterNode::addPeer(QLocalSocket *socket, const QString &name)
+{
+    Peer peer;
+    peer.name = name;
+    m_peers.insert(socket, peer);
+    connect(socket, &QLocalSocket::readyRead, this, [this, socket]() {
+        onReadyRead(socket);
+    });
+    connect(socket, &QLocalSocket::disconnected, this, [this, socket]() {
+        onDisconnected(socket);
+    });
+    if (!name.isEmpty()) {
+        qCDebug(dbgServer) << "Cluster: Connected to node" << name;
+    }
+    sendState(socket);
+    if (socket->bytesAvailable() > 0) {
+        onReadyRead(socket);
+    }
+}
+
+void MqttClusterNode::onReadyRead(QLocalSocket *socket)
+{
+    QHash<QLocalSocket*, Peer>::iterator it = m_peers.find(socket);
+    if (it == m_peers.end()) {
+        return;
+    }
+    it->buffer.append(socket->readAll());
+    int offset = 0;
+    QList<QByteArray> records;
+    while (it->buffer.size() - offset >= frameHeaderSize) {
+        quint32 length = qFromBigEndian<quint32>(reinterpret_cast<const uchar*>(it->buffer.constData() + offset));
+        if (it->buffer.size() - offset - frameHeaderSize < static_cast<qint64>(length)) {
+            break;
+        }
+        records.append(it->buffer.mid(offset + frameHeaderSize, static_cast<int>(length)));
+        offset += frameHeaderSize + static_cast<int>(length);
+    }
+    it->buffer.remove(0, offset);
+
+    foreach (const QByteArray &record, records) {
+        // Processing may drop the peer
+        if (!m_peers.contains(socket)) {
+            return;
+        }
+        processMessage(socket, record);
+    }
+}
+
+void MqttClusterNode::onDisconnected(QLocalSocket *socket)
+{
+    Peer peer = m_peers.take(socket);
+    qCDebug(dbgServer) << "Cluster: Node" << (peer.name.isEmpty() ? QStringLiteral("(unknown)") : peer.name) << "disconnected";
+    socket->deleteLater();
+}
+
+void MqttClusterNode::processMessage(QLocalSocket *socket, const QByteArray &record)
+{
+    Peer &peer = m_peers[socket];
+    QDataStream stream(record);
+    quint8 type;
+    stream >> type;
+    switch (type) {
+    case MessageHello: {
+        QString name;
+        stream >> name;
+        for (QHash<QLocalSocket*, Peer>::const_iterator it = m_peers.constBegin(); it != m_peers.constEnd(); ++it) {
+            if (it.key() != socket && it->name == name) {
+                qCWarning(dbgServer) << "Cluster: Node" << name << "is already connected. Dropping the new connection.";
+                socket->abort();
+                return;
+            }
+        }
+        if (peer.name.isEmpty()) {
+            qCDebug(dbgServer) << "Cluster: Node" << name << "connected";
+        }
+        peer.name = name;
+        break;
+    }
+    case MessageAddFilters:
+    case MessageRemoveFilters: {
+        QStringList filters;
+        stream >> filters;
+        foreach (const QString &filter, filters) {
+            if (type == MessageAddFilters) {
+                peer.filters.insert(filter);
+            } else {
+                peer.filters.remove(filter);
+            }
+        }
+        break;
+    }
+    case MessagePublish: {
+        QString topic;
+        QByteArray payload;
+        qint64 expiry;
+        stream >> topic >> payload >> expiry;
+        // Only for the clients of this node, the sending node forwarded it to all others with subscribers
+        m_server->watchExpiry(expiry);
+        m_server->route(topic, payload, expiry);
+        break;
+    }
+    case MessageRetain: {
+        QString topic, origin;
+        QByteArray data;
+        qint64 stamp, expiry;
+        stream >> topic >> stamp >> origin >> data >> expiry;
+        applyRetained(topic, data, expiry, stamp, origin);
+        break;
+    }
+    case MessageRemoveRetained: {
+        QString topic, origin;
+        qint64 stamp;
+        stream >> topic >> stamp >> origin;
+        applyRemoveRetained(topic, stamp, origin);
+        break;
+    }
+    default:
+        qCWarning(dbgServer) << "Cluster: Unknown message type" << type << "from node" << peer.name;
+        break;
+    }
+}
+
+void MqttClusterNode::applyRetained(const QString &topic, const QByteArray &data, qint64 expiry, qint64 stamp, const QString &origin)
+{
+    if (!isNewer(topic, stamp, origin)) {
+        return;
+    }
+    MqttPacket packet;
+    if (packet.parse(data) <= 0) {
+        qCWarning(dbgServer) << "Cluster: Invalid retained message for topic" << topic;
+        return;
+    }
+    packet.setExpiry(expiry);
+    m_retainedStamps.insert(topic, qMakePair(stamp, origin));
+    if (m_server->retainedMessages->insert(topic, packet) && expiry > 0) {
+        m_server->retainedExpiries.insert(expiry, topic);
+        m_server->watchExpiry(expiry);
+    }
+}
+
+void MqttClusterNode::applyRemoveRetained(const QString &topic, qint64 stamp, const QString &origin)
+{
+    if (!isNewer(topic, stamp, origin)) {
+        return;
+    }
+    m_retainedStamps.insert(topic, qMakePair(stamp, origin));
+    m_server->retainedMessages->remove(topic);
+}
+
+bool MqttClusterNode::isNewer(const QString &topic, qint64 stamp, const QString &origin) const
+{
+    QPair<qint64, QString> current = this->stamp(topic);
+    return stamp > current.first || (stamp == current.first && origin > current.second);
+}
+
+QPair<qint64, QString> MqttClusterNode::stamp(const QString &topic) const
+{
+    // Retained messages set before joining the cluster are the oldest possible
+    return m_retainedStamps.value(topic, qMakePair(qint64(0), m_nodeName));
+}
+
+void MqttClusterNode::updateFilters()
+{
+    QSet<QString> filters;
+    foreach (ClientContext *ctx, m_server->clientList) {
+        foreach (const MqttSubscription &subscription, ctx->subscriptions) {
+            filters.insert(QString::fromUtf8(subscription.topicFilter()));
+        }
+    }
+    foreach (ClientContext *ctx, m_server->offlineSessions) {
+        foreach (const MqttSubscription &subscription, ctx->subscriptions) {
+            filters.insert(QString::fromUtf8(subscription.topicFilter()));
+        }
+    }
+
+    QSet<QString> added = filters - m_filters;
+    QSet<QString> removed = m_filters - filters;
+    m_filters = filters;
+    if (!added.isEmpty()) {
+        broadcast(filtersRecord(MessageAddFilters, added));
+    }
+    if (!removed.isEmpty()) {
+        broadcast(filtersRecord(MessageRemoveFilters, removed));
+    }
+}
+
+void MqttClusterNode::sendState(QLocalSocket *socket)
+{
+    send(socket, helloRecord());
+    if (!m_filters.isEmpty()) {
+        send(socket, filtersRecord(MessageAddFilters, m_filters));
+    }
+    QSet<QString> retainedTopics;
+    foreach (const QString &topic, m_server->retainedMessages->topics()) {
+        retainedTopics.insert(topic);
+        QPair<qint64, QString> current = stamp(topic);
+        foreach (const MqttPacket &packet, m_server->retainedMessages->value(topic)) {
+            send(socket, retainRecord(topic, packet, current.first, current.second));
+        }
+    }
+    for (QHash<QString, QPair<qint64, QString> >::const_iterator it = m_retainedStamps.constBegin(); it != m_retainedStamps.constEnd(); ++it) {
+        if (!retainedTopics.contains(it.key())) {
+            send(socket, removeRetainedRecord(it.key(), it->first, it->second));
+        }
+    }
+}
+
+void MqttClusterNode::send(QLocalSocket *socket, const QByteArray &record)
+{
+    uchar header[frameHeaderSize];
+    qToBigEndian<quint32>(static_cast<quint32>(record.size()), header);
+    socket->write(reinterpret_cast<const char*>(header), frameHeaderSize);
+    socket->write(record);
+}
+
+void MqttClusterNode::broadcast(const QByteArray &record)
+{
+    foreach (QLocalSocket *socket, m_peers.keys()) {
+        send(socket, record);
+    }
+}
+
+QByteArray MqttClusterNode::helloRecord() const
+{
+    QByteArray record;
+    QDataStream stream(&record, QIODevice::WriteOnly);
+    stream << static_cast<quint8>(MessageHello) << m_nodeName;
+    return record;
+}
+
+QByteArray MqttClusterNode::filtersRecord(MessageType type, const QSet<QString> &filters) const
+{
+    QByteArray record;
+    QDataStream stream(&record, QIODevice::WriteOnly);
+    stream << static_cast<quint8>(type) << filters.toList();
+    return record;
+}
+
+QByteArray MqttClusterNode::retainRecord(const QString &topic, const MqttPacket &packet, qint64 stamp, const QString &origin) const
+{
+    QByteArray record;
+    QDataStream stream(&record, QIODevice::WriteOnly);
+    stream << static_cast<quint8>(MessageRetain) << topic << stamp << origin << packet.serialize() << packet.expiry();
+    return record;
+}
+
+QByteArray MqttClusterNode::removeRetainedRecord(const QString &topic, qint64 stamp, const QString &origin) const
+{
+    QByteArray record;
+    QDataStream stream(&record, QIODevice::WriteOnly);
+    stream << static_cast<quint8>(MessageRemoveRetained) << topic << stamp << origin;
+    return record;
+}
@@ -0,0 +1,120 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+*
+* Copyright 2013 - 2020, nymea GmbH
+* Contact: contact@nymea.io
+*
+* This file is part of nymea.
+* This project including source code and documentation is protected by copyright law, and
+* remains the property of nymea GmbH. All rights, including reproduction, publication,
+* editing and translation, are reserved. The use of this project is subject to the terms of a
+* license agreement to be concluded with nymea GmbH in accordance with the terms
+* of use of nymea GmbH, available under https://nymea.io/license
+*
+* GNU Lesser General Public License Usage
+* Alternatively, this project may be redistributed and/or modified under the terms of the GNU
+* Lesser General Public License as published by the Free Software Foundation; version 3.
+* this project is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+* without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License along with this project.
+* If not, see <https://www.gnu.org/licenses/>.
+*
+* For any further details and any questions please contact us under contact@nymea.io
+* or see our FAQ/Licensing Information on https://nymea.io/license/faq
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef MQTTCLUSTER_P_H
+#define MQTTCLUSTER_P_H
+
+#include <QObject>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QHash>
+#include <QSet>
+#include <QTimer>
+
+#include "mqttpacket.h"
+
+class MqttServerPrivate;
+
+// A node of a cluster of MqttServer processes on one host, connected over local sockets. Every node connects
+// to the peers sorting before its own name and accepts connections from the others, so each pair of nodes
+// shares exactly one connection.
+//
+// Nodes tell each other the set of distinct topic filters their clients are subscribed to, changes are sent as
+// they happen. A publish is forwarded to the peers with a matching filter and delivered there to the local
+// clients only. Retained messages are replicated to all peers. Every change carries the time it was made,
+// when nodes (re)connect and exchange their retained messages the newer one wins.
+//
+// Messages are frames of the record length (quint32, big endian) and a QDataStream record starting with the
+// message type.
+class MqttClusterNode: public QObject
+{
+    Q_OBJECT
+public:
+    enum MessageType {
+        MessageHello = 1,
+        MessageAddFilters,
+        MessageRemoveFilters,
+        MessagePublish,
+        MessageRetain,
+        MessageRemoveRetained
+    };
+
+    MqttClusterNode(MqttServerPrivate *server, const QString &nodeName, const QStringList &peerNames);
+    ~MqttClusterNode() override;
+
+    bool listen();
+    QString nodeName() const;
+    QStringList connectedPeers() const;
+
+    void forwardPublish(const QString &topic, const QByteArray &payload, qint64 expiry);
+    void replicateRetained(const QString &topic, const MqttPacket &packet);
+    void removeRetained(const QString &topic);
+    void scheduleFilterUpdate();
+
+private:
+    struct Peer {
+        QString name;
+        QByteArray buffer;
+        QSet<QString> filters;
+    };
+
+    void connectToPeers();
+    void addPeer(QLocalSocket *socket, const QString &name);
+    void onReadyRead(QLocalSocket *socket);
+    void onDisconnected(QLocalSocket *socket);
+    void processMessage(QLocalSocket *socket, const QByteArray &record);
+    void applyRetained(const QString &topic, const QByteArray &data, qint64 expiry, qint64 stamp, const QString &origin);
+    void applyRemoveRetained(const QString &topic, qint64 stamp, const QString &origin);
+    bool isNewer(const QString &topic, qint64 stamp, const QString &origin) const;
+    void updateFilters();
+
+    void send(QLocalSocket *socket, const QByteArray &record);
+    void broadcast(const QByteArray &record);
+    QByteArray helloRecord() const;
+    QByteArray filtersRecord(MessageType type, const QSet<QString> &filters) const;
+    QByteArray retainRecord(const QString &topic, const MqttPacket &packet, qint64 stamp, const QString &origin) const;
+    QByteArray removeRetainedRecord(const QString &topic, qint64 stamp, const QString &origin) const;
+    QPair<qint64, QString> stamp(const QString &topic) const;
+    void sendState(QLocalSocket *socket);
+
+    MqttServerPrivate *m_server = nullptr;
+    QString m_nodeName;
+    QStringList m_peerNames;
+    QLocalServer m_localServer;
+    QHash<QLocalSocket*, Peer> m_peers;
+    QHash<QString, QLocalSocket*> m_connecting;
+    QTimer m_reconnectTimer;
+    QTimer m_filterTimer;
+
+    // The filters advertised to the peers
+    QSet<QString> m_filters;
+    // Time of the last change of each retained topic (ms since epoch) and the node it came from, for
+    // resolving conflicting changes. Removed topics are kept.
+    QHash<QString, QPair<qint64, QString> > m_retainedStamps;
+};
+
+#endif // MQTTCLUSTER_P_H
@@ -0,0 +1,406 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+*
+* Copyright 2013 - 2020, nymea GmbH
+* Contact: contact@nymea.io
+*
+* This file is part of nymea.
+* This project including source code and documentation is protected by copyright law, and
+* remains the property of nymea GmbH. All rights, including reproduction, publication,
+* editing and translation, are reserved. The use of this project is subject to the terms of a
+* license agreement to be concluded with nymea GmbH in accordance with the terms
+* of use of nymea GmbH, available under https://nymea.io/license
+*
+* GNU Lesser General Public License Usage
+* Alternatively, this project may be redistributed and/or modified under the terms of the GNU
+* Lesser General Public License as published by the Free Software Foundation; version 3.
+* this project is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+* without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License along with this project.
+* If not, see <https://www.gnu.org/licenses/>.
+*
+* For any further details and any questions please contact us under contact@nymea.io
+* or see our FAQ/Licensing Information on https://nymea.io/license/faq
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "mqtthandover_p.h"
+
+#include <QDir>
+#include <QFile>
+#include <QElapsedTimer>
+#include <QLoggingCategory>
+
+#ifdef Q_OS_UNIX
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#endif
+
+Q_DECLARE_LOGGING_CATEGORY(dbgServer)
+
+static const quint32 handoverMagic = 0x4e4d5148; // "NMQH"
+
+// Descriptors are sent in chunks to stay below the kernel limit of descriptors per message (SCM_MAX_FD)
+static const int maxFdsPerMessage = 250;
+
+MqttHandoverConnection::~MqttHandoverConnection()
+{
+    close();
+}
+
+QString MqttHandoverConnection::socketPath(const QString &serverName)
+{
+    // Same rules as for QLocalServer/QLocalSocket
+    if (serverName.startsWith(QLatin1Char('/'))) {
+        return serverName;
+    }
+    return QDir::tempPath() + QLatin1Char('/') + serverName;
+}
+
+#ifdef Q_OS_UNIX
+
+void MqttHandoverConnection::closeDescriptors(const QVector<int> &fds)
+{
+    foreach (int fd, fds) {
+        ::close(fd);
+    }
+}
+
+bool MqttHandoverConnection::connectToServer(const QString &serverName, int timeout)
+{
+    close();
+    QByteArray path = QFile::encodeName(socketPath(serverName));
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (static_cast<size_t>(path.size()) >= sizeof(address.sun_path)) {
+        return fail(QStringLiteral("Handover socket path too long"));
+    }
+    memcpy(address.sun_path, path.constData(), static_cast<size_t>(path.size()));
+
+    // The new process might still be starting up, retry until it is listening
+    QElapsedTimer timer;
+    timer.start();
+    forever {
+        m_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (m_fd < 0) {
+            return fail(QString::fromLocal8Bit(strerror(errno)));
+        }
+        if (::connect(m_fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) == 0) {
+            return true;
+        }
+        QString error = QString::fromLocal8Bit(strerror(errno));
+        close();
+        if (timer.elapsed() >= timeout) {
+            return fail(error);
+        }
+        usleep(50000);
+    }
+}
+
+bool MqttHandoverConnection::send(const QByteArray &state, const QVector<int> &fds)
+{
+    quint32 header[3] = { handoverMagic, static_cast<quint32>(state.size()), static_cast<quint32>(fds.count()) };
+    if (!writeAll(reinterpret_cast<const char*>(header), sizeof(header))) {
+        return false;
+    }
+
+    int sent = 0;
+    while (sent < fds.count()) {
+        int count = qMin(maxFdsPerMessage, fds.count() - sent);
+        char chunkSize = static_cast<char>(count);
+        struct iovec data;
+        data.iov_base = &chunkSize;
+        data.iov_len = 1;
+
+        QByteArray control(static_cast<int>(CMSG_SPACE(sizeof(int) * static_cast<size_t>(count))), 0);
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = &data;
+        message.msg_iovlen = 1;
+        message.msg_control = control.data();
+        message.msg_controllen = static_cast<size_t>(control.size());
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * static_cast<size_t>(count));
+        memcpy(CMSG_DATA(cmsg), fds.constData() + sent, sizeof(int) * static_cast<size_t>(count));
+
+        ssize_t ret;
+        do {
+            ret = ::sendmsg(m_fd, &message, MSG_NOSIGNAL);
+        } while (ret < 0 && errno == EINTR);
+        if (ret != 1) {
+            return fail(QString::fromLocal8Bit(strerror(errno)));
+        }
+        sent += count;
+    }
+
+    return writeAll(state.constData(), state.size());
+}
+
+bool MqttHandoverConnection::waitForAcknowledge(int timeout)
+{
+    char ack = 0;
+    if (!readAll(&ack, 1, timeout)) {
+        return false;
+    }
+    if (ack != 'A') {
+        return fail(QStringLiteral("The new process refused the handover"));
+    }
+    return true;
+}
+
+bool MqttHandoverConnection::listenAndAccept(const QString &serverName, int timeout)
+{
+    close();
+    QByteArray path = QFile::encodeName(socketPath(serverName));
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (static_cast<size_t>(path.size()) >= sizeof(address.sun_path)) {
+        return fail(QStringLiteral("Handover socket path too long"));
+    }
+    memcpy(address.sun_path, path.constData(), static_cast<size_t>(path.size()));
+
+    int listenFd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenFd < 0) {
+        return fail(QString::fromLocal8Bit(strerror(errno)));
+    }
+    ::unlink(path.constData());
+    if (::bind(listenFd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) != 0 || ::listen(listenFd, 1) != 0) {
+        QString error = QString::fromLocal8Bit(strerror(errno));
+        ::close(listenFd);
+        return fail(error);
+    }
+
+    bool ready = waitFor(listenFd, POLLIN, timeout);
+    if (ready) {
+        do {
+            m_fd = ::accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        } while (m_fd < 0 && errno == EINTR);
+        if (m_fd < 0) {
+            fail(QString::fromLocal8Bit(strerror(errno)));
+        }
+    }
+    ::close(listenFd);
+    ::unlink(path.constData());
+    return m_fd >= 0;
+}
+
+bool MqttHandoverConnection::receive(QByteArray *state, QVector<int> *fds, int timeout)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    quint32 header[3];
+    if (!readAll(reinterpret_cast<char*>(header), sizeof(header), timeout)) {
+        return false;
+    }
+    if (header[0] != handoverMagic) {
+        return fail(QStringLiteral("Invalid handover data"));
+    }
+
+    int fdCount = static_cast<int>(header[2]);
+    QByteArray control(static_cast<int>(CMSG_SPACE(sizeof(int) * maxFdsPerMessage)), 0);
+    while (fds->count() < fdCount) {
+        if (!waitFor(m_fd, POLLIN, static_cast<int>(qMax<qint64>(0, timeout - timer.elapsed())))) {
+            return false;
+        }
+        char chunkSize = 0;
+        struct iovec data;
+        data.iov_base = &chunkSize;
+        data.iov_len = 1;
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = &data;
+        message.msg_iovlen = 1;
+        message.msg_control = control.data();
+        message.msg_controllen = static_cast<size_t>(control.size());
+
+        ssize_t ret;
+        do {
+            ret = ::recvmsg(m_fd, &message, MSG_CMSG_CLOEXEC);
+        } while (ret < 0 && errno == EINTR);
+        if (ret != 1) {
+            return fail(ret == 0 ? QStringLiteral("Connection closed") : QString::fromLocal8Bit(strerror(errno)));
+        }
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            int count = static_cast<int>((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            int offset = fds->count();
+            fds->resize(offset + count);
+            memcpy(fds->data() + offset, CMSG_DATA(cmsg), sizeof(int) * static_cast<size_t>(count));
+        }
+        if (message.msg_flags & MSG_CTRUNC) {
+            return fail(QStringLiteral("Descriptors have been truncated"));
+        }
+    }
+
+    state->resize(static_cast<int>(header[1]));
+    return readAll(state->data(), state->size(), static_cast<int>(qMax<qint64>(0, timeout - timer.elapsed())));
+}
+
+bool MqttHandoverConnection::acknowledge(bool success)
+{
+    char ack = success ? 'A' : 'N';
+    return writeAll(&ack, 1);
+}
+
+bool MqttHandoverConnection::waitForClosed(int timeout)
+{
+    char data;
+    if (!waitFor(m_fd, POLLIN, timeout)) {
+        return false;
+    }
+    ssize_t ret;
+    do {
+        ret = ::recv(m_fd, &data, 1, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret == 0;
+}
+
+void MqttHandoverConnection::close()
+{
+    if (m_fd >= 0) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+}
+
+bool MqttHandoverConnection::waitFor(int fd, short events, int timeout)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = events;
+    pfd.revents = 0;
+    int ret;
+    do {
+        ret = ::poll(&pfd, 1, timeout);
+    } while (ret < 0 && errno == EINTR);
+    if (ret == 0) {
+        return fail(QStringLiteral("Timed out"));
+    }
+    if (ret < 0) {
+        return fail(QString::fromLocal8Bit(strerror(errno)));
+    }
+    return true;
+}
+
+bool MqttHandoverConnection::writeAll(const char *data, int size)
+{
+    int written = 0;
+    while (written < size) {
+        ssize_t ret = ::send(m_fd, data + written, static_cast<size_t>(size - written), MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return fail(QString::fromLocal8Bit(strerror(errno)));
+        }
+        written += static_cast<int>(ret);
+    }
+    return true;
+}
+
+bool MqttHandoverConnection::readAll(char *data, int size, int timeout)
+{
+    QElapsedTimer timer;
+    timer.start();
+    int received = 0;
+    while (received < size) {
+        if (!waitFor(m_fd, POLLIN, static_cast<int>(qMax<qint64>(0, timeout - timer.elapsed())))) {
+            return false;
+        }
+        ssize_t ret = ::recv(m_fd, data + received, static_cast<size_t>(size - received), 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return fail(QString::fromLocal8Bit(strerror(errno)));
+        }
+        if (ret == 0) {
+            return fail(QStringLiteral("Connection closed"));
+        }
+        received += static_cast<int>(ret);
+    }
+    return true;
+}
+
+#else
+
+void MqttHandoverConnection::closeDescriptors(const QVector<int> &fds)
+{
+    Q_UNUSED(fds)
+}
+
+bool MqttHandoverConnection::connectToServer(const QString &serverName, int timeout)
+{
+    Q_UNUSED(serverName)
+    Q_UNUSED(timeout)
+    return fail(QStringLiteral("Handover is not supported on this platform"));
+}
+
+bool MqttHandoverConnection::send(const QByteArray &state, const QVector<int> &fds)
+{
+    Q_UNUSED(state)
+    Q_UNUSED(fds)
+    return false;
+}
+
+bool MqttHandoverConnection::waitForAcknowledge(int timeout)
+{
+    Q_UNUSED(timeout)
+    return false;
+}
+
+bool MqttHandoverConnection::listenAndAccept(const QString &serverName, int timeout)
+{
+    Q_UNUSED(serverName)
+    Q_UNUSED(timeout)
+    return fail(QStringLiteral("Handover is not supported on this platform"));
+}
+
+bool MqttHandoverConnection::receive(QByteArray *state, QVector<int> *fds, int timeout)
+{
+    Q_UNUSED(state)
+    Q_UNUSED(fds)
+    Q_UNUSED(timeout)
+    return false;
+}
+
+bool MqttHandoverConnection::acknowledge(bool success)
+{
+    Q_UNUSED(success)
+    return false;
+}
+
+bool MqttHandoverConnection::waitForClosed(int timeout)
+{
+    Q_UNUSED(timeout)
+    return false;
+}
+
+void MqttHandoverConnection::close()
+{
+}
+
+#endif
+
+QString MqttHandoverConnection::errorString() const
+{
+    return m_errorString;
+}
+
+bool MqttHandoverConnection::fail(const QString &error)
+{
+    m_errorString = error;
+    return false;
+}
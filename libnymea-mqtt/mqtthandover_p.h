@@ -0,0 +1,75 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+*
+* Copyright 2013 - 2020, nymea GmbH
+* Contact: contact@nymea.io
+*
+* This file is part of nymea.
+* This project including source code and documentation is protected by copyright law, and
+* remains the property of nymea GmbH. All rights, including reproduction, publication,
+* editing and translation, are reserved. The use of this project is subject to the terms of a
+* license agreement to be concluded with nymea GmbH in accordance with the terms
+* of use of nymea GmbH, available under https://nymea.io/license
+*
+* GNU Lesser General Public License Usage
+* Alternatively, this project may be redistributed and/or modified under the terms of the GNU
+* Lesser General Public License as published by the Free Software Foundation; version 3.
+* this project is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+* without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License along with this project.
+* If not, see <https://www.gnu.org/licenses/>.
+*
+* For any further details and any questions please contact us under contact@nymea.io
+* or see our FAQ/Licensing Information on https://nymea.io/license/faq
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef MQTTHANDOVER_P_H
+#define MQTTHANDOVER_P_H
+
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+
+// The connection used for handing over a running MqttServer to a new process. Besides the serialized
+// server state it transfers file descriptors (SCM_RIGHTS) and therefore works on plain Unix domain sockets.
+// All calls are blocking, a handover happens while neither of the two servers processes any events.
+//
+// The protocol is: the old process sends a header (magic, state size, descriptor count), the descriptors in
+// chunks and the state. The new process answers with a single byte acknowledging whether it took over. On
+// success the old process releases everything it handed over and closes the connection.
+class MqttHandoverConnection
+{
+public:
+    MqttHandoverConnection() = default;
+    ~MqttHandoverConnection();
+
+    static QString socketPath(const QString &serverName);
+    static void closeDescriptors(const QVector<int> &fds);
+
+    // Old process
+    bool connectToServer(const QString &serverName, int timeout);
+    bool send(const QByteArray &state, const QVector<int> &fds);
+    bool waitForAcknowledge(int timeout);
+
+    // New process
+    bool listenAndAccept(const QString &serverName, int timeout);
+    bool receive(QByteArray *state, QVector<int> *fds, int timeout);
+    bool acknowledge(bool success);
+    bool waitForClosed(int timeout);
+
+    void close();
+    QString errorString() const;
+
+private:
+    bool waitFor(int fd, short events, int timeout);
+    bool writeAll(const char *data, int size);
+    bool readAll(char *data, int size, int timeout);
+    bool fail(const QString &error);
+
+    int m_fd = -1;
+    QString m_errorString;
+};
+
+#endif // MQTTHANDOVER_P_H
@@ -0,0 +1,166 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+*
+* Copyright 2013 - 2020, nymea GmbH
+* Contact: contact@nymea.io
+*
+* This file is part of nymea.
+* This project including source code and documentation is protected by copyright law, and
+* remains the property of nymea GmbH. All rights, including reproduction, publication,
+* editing and translation, are reserved. The use of this project is subject to the terms of a
+* license agreement to be concluded with nymea GmbH in accordance with the terms
+* of use of nymea GmbH, available under https://nymea.io/license
+*
+* GNU Lesser General Public License Usage
+* Alternatively, this project may be redistributed and/or modified under the terms of the GNU
+* Lesser General Public License as published by the Free Software Foundation; version 3.
+* this project is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+* without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License along with this project.
+* If not, see <https://www.gnu.org/licenses/>.
+*
+* For any further details and any questions please contact us under contact@nymea.io
+* or see our FAQ/Licensing Information on https://nymea.io/license/faq
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "mqttinflightpackets_p.h"
+
+#include <QtAlgorithms>
+
+quint16 MqttInflightPackets::newPacketId()
+{
+    if (m_entries.count() >= 0xffff) {
+        return 0;
+    }
+    quint32 packetId = m_nextId;
+    if (!m_entries.isEmpty()) {
+        forever {
+            int word = packetId / 64;
+            quint64 bits = m_used.at(word) | ((Q_UINT64_C(1) << (packetId % 64)) - 1);
+            if (word == 0) {
+                // Packet ID 0 is not valid
+                bits |= 1;
+            }
+            if (bits != ~Q_UINT64_C(0)) {
+                packetId = word * 64 + qCountTrailingZeroBits(~bits);
+                break;
+            }
+            packetId = ((word + 1) * 64) & 0xffff;
+        }
+    }
+    m_nextId = packetId == 0xffff ? 1 : packetId + 1;
+    return static_cast<quint16>(packetId);
+}
+
+int MqttInflightPackets::count() const
+{
+    return m_entries.count();
+}
+
+bool MqttInflightPackets::isEmpty() const
+{
+    return m_entries.isEmpty();
+}
+
+bool MqttInflightPackets::contains(quint16 packetId) const
+{
+    return m_entries.contains(packetId);
+}
+
+MqttPacket MqttInflightPackets::value(quint16 packetId) const
+{
+    return m_entries.value(packetId).packet;
+}
+
+void MqttInflightPackets::insert(const MqttPacket &packet)
+{
+    quint16 packetId = packet.packetId();
+    QHash<quint16, Entry>::iterator it = m_entries.find(packetId);
+    if (it != m_entries.end()) {
+        it->packet = packet;
+        return;
+    }
+
+    Entry entry;
+    entry.packet = packet;
+    entry.previous = m_last;
+    m_entries.insert(packetId, entry);
+    if (m_last >= 0) {
+        m_entries[static_cast<quint16>(m_last)].next = packetId;
+    } else {
+        m_first = packetId;
+    }
+    m_last = packetId;
+
+    if (m_used.isEmpty()) {
+        m_used.fill(0, 1024);
+    }
+    m_used[packetId / 64] |= Q_UINT64_C(1) << (packetId % 64);
+}
+
+MqttPacket MqttInflightPackets::take(quint16 packetId)
+{
+    QHash<quint16, Entry>::iterator it = m_entries.find(packetId);
+    if (it == m_entries.end()) {
+        return MqttPacket();
+    }
+    Entry entry = it.value();
+    m_entries.erase(it);
+
+    if (entry.previous >= 0) {
+        m_entries[static_cast<quint16>(entry.previous)].next = entry.next;
+    } else {
+        m_first = entry.next;
+    }
+    if (entry.next >= 0) {
+        m_entries[static_cast<quint16>(entry.next)].previous = entry.previous;
+    } else {
+        m_last = entry.previous;
+    }
+
+    if (m_entries.isEmpty()) {
+        m_used.clear();
+        m_used.squeeze();
+    } else {
+        m_used[packetId / 64] &= ~(Q_UINT64_C(1) << (packetId % 64));
+    }
+    return entry.packet;
+}
+
+void MqttInflightPackets::remove(quint16 packetId)
+{
+    take(packetId);
+}
+
+void MqttInflightPackets::clear()
+{
+    m_entries.clear();
+    m_first = -1;
+    m_last = -1;
+    m_used.clear();
+    m_used.squeeze();
+}
+
+QVector<quint16> MqttInflightPackets::packetIds() const
+{
+    QVector<quint16> packetIds;
+    packetIds.reserve(m_entries.count());
+    for (int packetId = m_first; packetId >= 0; packetId = m_entries.constFind(static_cast<quint16>(packetId))->next) {
+        packetIds.append(static_cast<quint16>(packetId));
+    }
+    return packetIds;
+}
+
+QList<MqttPacket> MqttInflightPackets::packets() const
+{
+    QList<MqttPacket> packets;
+    packets.reserve(m_entries.count());
+    for (int packetId = m_first; packetId >= 0;) {
+        QHash<quint16, Entry>::const_iterator it = m_entries.constFind(static_cast<quint16>(packetId));
+        packets.append(it->packet);
+        packetId = it->next;
+    }
+    return packets;
+}
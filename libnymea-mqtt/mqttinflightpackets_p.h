@@ -0,0 +1,78 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+*
+* Copyright 2013 - 2020, nymea GmbH
+* Contact: contact@nymea.io
+*
+* This file is part of nymea.
+* This project including source code and documentation is protected by copyright law, and
+* remains the property of nymea GmbH. All rights, including reproduction, publication,
+* editing and translation, are reserved. The use of this project is subject to the terms of a
+* license agreement to be concluded with nymea GmbH in accordance with the terms
+* of use of nymea GmbH, available under https://nymea.io/license
+*
+* GNU Lesser General Public License Usage
+* Alternatively, this project may be redistributed and/or modified under the terms of the GNU
+* Lesser General Public License as published by the Free Software Foundation; version 3.
+* this project is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+* without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License along with this project.
+* If not, see <https://www.gnu.org/licenses/>.
+*
+* For any further details and any questions please contact us under contact@nymea.io
+* or see our FAQ/Licensing Information on https://nymea.io/license/faq
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef MQTTINFLIGHTPACKETS_P_H
+#define MQTTINFLIGHTPACKETS_P_H
+
+#include <QHash>
+#include <QVector>
+
+#include "mqttpacket.h"
+
+// The unacknowledged packets of a session, in the order they were first inserted, and the packet IDs in use.
+//
+// Packets are kept in a hash, linked to each other by their packet IDs, so inserting, replacing (e.g. PUBLISH
+// by PUBREL) and removing a packet is O(1) while walking them in order for resending stays possible. IDs in use
+// are tracked in a bitmap of 65536 bits which is only allocated while packets are in flight. New IDs are taken
+// from a cursor moving through the bitmap, skipping whole words of IDs in use at once.
+class MqttInflightPackets
+{
+public:
+    // Returns the next free packet ID, which is taken once a packet with it is inserted. 0 if all are in use.
+    quint16 newPacketId();
+
+    int count() const;
+    bool isEmpty() const;
+    bool contains(quint16 packetId) const;
+    MqttPacket value(quint16 packetId) const;
+
+    // Appends the packet, or replaces the one with the same packet ID in place
+    void insert(const MqttPacket &packet);
+    MqttPacket take(quint16 packetId);
+    void remove(quint16 packetId);
+    void clear();
+
+    // In insertion order
+    QVector<quint16> packetIds() const;
+    QList<MqttPacket> packets() const;
+
+private:
+    struct Entry {
+        MqttPacket packet;
+        int previous = -1;
+        int next = -1;
+    };
+
+    QHash<quint16, Entry> m_entries;
+    int m_first = -1;
+    int m_last = -1;
+
+    QVector<quint64> m_used;
+    quint16 m_nextId = 1;
+};
+
+#endif // MQTTINFLIGHTPACKETS_P_H
@@ -0,0 +1,137 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+*
+* Copyright 2013 - 2020, nymea GmbH
+* Contact: contact@nymea.io
+*
+* This file is part of nymea.
+* This project including source code and documentation is protected by copyright law, and
+* remains the property of nymea GmbH. All rights, including reproduction, publication,
+* editing and translation, are reserved. The use of this project is subject to the terms of a
+* license agreement to be concluded with nymea GmbH in accordance with the terms
+* of use of nymea GmbH, available under https://nymea.io/license
+*
+* GNU Lesser General Public License Usage
+* Alternatively, this project may be redistributed and/or modified under the terms of the GNU
+* Lesser General Public License as published by the Free Software Foundation; version 3.
+* this project is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+* without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License along with this project.
+* If not, see <https://www.gnu.org/licenses/>.
+*
+* For any further details and any questions please contact us under contact@nymea.io
+* or see our FAQ/Licensing Information on https://nymea.io/license/faq
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "mqttinprocesschannel_p.h"
+
+#include <QTimer>
+#include <QLoggingCategory>
+
+Q_DECLARE_LOGGING_CATEGORY(dbgServer)
+
+MqttInProcessChannel::MqttInProcessChannel(QObject *parent):
+    QIODevice(parent)
+{
+    open(QIODevice::ReadWrite);
+}
+
+MqttInProcessChannel::~MqttInProcessChannel()
+{
+    // Don't emit anything while being destroyed, just let the other end know
+    if (m_peer) {
+        m_peer->m_peer = nullptr;
+        m_peer->m_peerClosed = true;
+        m_peer->scheduleDelivery();
+    }
+}
+
+void MqttInProcessChannel::connectChannels(MqttInProcessChannel *first, MqttInProcessChannel *second)
+{
+    first->m_peer = second;
+    second->m_peer = first;
+}
+
+bool MqttInProcessChannel::isSequential() const
+{
+    return true;
+}
+
+void MqttInProcessChannel::close()
+{
+    if (!isOpen()) {
+        return;
+    }
+    QIODevice::close();
+    m_pendingPackets.clear();
+    if (m_peer) {
+        // Packets sent before closing are still delivered to the peer before it is closed too
+        m_peer->m_peer = nullptr;
+        m_peer->m_peerClosed = true;
+        m_peer->scheduleDelivery();
+        m_peer = nullptr;
+    }
+    emit disconnected();
+}
+
+bool MqttInProcessChannel::sendPacket(const MqttPacket &packet)
+{
+    if (!isOpen() || !m_peer) {
+        return false;
+    }
+    m_peer->m_pendingPackets.enqueue(packet);
+    m_peer->scheduleDelivery();
+    return true;
+}
+
+bool MqttInProcessChannel::hasPendingPackets() const
+{
+    return !m_pendingPackets.isEmpty();
+}
+
+MqttPacket MqttInProcessChannel::takePacket()
+{
+    return m_pendingPackets.dequeue();
+}
+
+qint64 MqttInProcessChannel::readData(char *data, qint64 maxSize)
+{
+    Q_UNUSED(data)
+    Q_UNUSED(maxSize)
+    return -1;
+}
+
+qint64 MqttInProcessChannel::writeData(const char *data, qint64 maxSize)
+{
+    Q_UNUSED(data)
+    Q_UNUSED(maxSize)
+    qCWarning(dbgServer) << "Writing raw data to an in-process channel is not supported. Use sendPacket() instead.";
+    return -1;
+}
+
+void MqttInProcessChannel::scheduleDelivery()
+{
+    if (m_deliveryScheduled) {
+        return;
+    }
+    m_deliveryScheduled = true;
+    QTimer::singleShot(0, this, [this]() {
+        deliver();
+    });
+}
+
+void MqttInProcessChannel::deliver()
+{
+    m_deliveryScheduled = false;
+    if (!isOpen()) {
+        return;
+    }
+    if (!m_pendingPackets.isEmpty()) {
+        emit packetsAvailable();
+    }
+    if (m_peerClosed && isOpen()) {
+        close();
+    }
+}
@@ -0,0 +1,75 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+*
+* Copyright 2013 - 2020, nymea GmbH
+* Contact: contact@nymea.io
+*
+* This file is part of nymea.
+* This project including source code and documentation is protected by copyright law, and
+* remains the property of nymea GmbH. All rights, including reproduction, publication,
+* editing and translation, are reserved. The use of this project is subject to the terms of a
+* license agreement to be concluded with nymea GmbH in accordance with the terms
+* of use of nymea GmbH, available under https://nymea.io/license
+*
+* GNU Lesser General Public License Usage
+* Alternatively, this project may be redistributed and/or modified under the terms of the GNU
+* Lesser General Public License as published by the Free Software Foundation; version 3.
+* this project is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+* without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License along with this project.
+* If not, see <https://www.gnu.org/licenses/>.
+*
+* For any further details and any questions please contact us under contact@nymea.io
+* or see our FAQ/Licensing Information on https://nymea.io/license/faq
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef MQTTINPROCESSCHANNEL_P_H
+#define MQTTINPROCESSCHANNEL_P_H
+
+#include <QIODevice>
+#include <QPointer>
+#include <QQueue>
+
+#include "mqttpacket.h"
+
+// One end of an in-process connection between a MqttClient and a MqttServer living in the same process.
+// Instead of a byte stream, MqttPacket objects are handed over to the peer's queue. Packets are implicitly
+// shared, so neither encoding nor copying of the payload takes place. Like a socket, the peer is notified
+// through the event loop, multiple packets sent in one go are delivered in one notification.
+class MqttInProcessChannel: public QIODevice
+{
+    Q_OBJECT
+public:
+    explicit MqttInProcessChannel(QObject *parent = nullptr);
+    ~MqttInProcessChannel() override;
+
+    static void connectChannels(MqttInProcessChannel *first, MqttInProcessChannel *second);
+
+    bool isSequential() const override;
+    void close() override;
+
+    bool sendPacket(const MqttPacket &packet);
+    bool hasPendingPackets() const;
+    MqttPacket takePacket();
+
+signals:
+    void packetsAvailable();
+    void disconnected();
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override;
+    qint64 writeData(const char *data, qint64 maxSize) override;
+
+private:
+    void scheduleDelivery();
+    void deliver();
+
+    QPointer<MqttInProcessChannel> m_peer;
+    QQueue<MqttPacket> m_pendingPackets;
+    bool m_deliveryScheduled = false;
+    bool m_peerClosed = false;
+};
+
+#endif // MQTTINPROCESSCHANNEL_P_H
@@ -0,0 +1,1218 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+*
+* Copyright 2013 - 2020, nymea GmbH
+* Contact: contact@nymea.io
+*
+* This file is part of nymea.
+* This project including source code and documentation is protected by copyright law, and
+* remains the property of nymea GmbH. All rights, including reproduction, publication,
+* editing and translation, are reserved. The use of this project is subject to the terms of a
+* license agreement to be concluded with nymea GmbH in accordance with the terms
+* of use of nymea GmbH, available under https://nymea.io/license
+*
+* GNU Lesser General Public License Usage
+* Alternatively, this project may be redistributed and/or modified under the terms of the GNU
+* Lesser General Public License as published by the Free Software Foundation; version 3.
+* this project is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+* without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License along with this project.
+* If not, see <https://www.gnu.org/licenses/>.
+*
+* For any further details and any questions please contact us under contact@nymea.io
+* or see our FAQ/Licensing Information on https://nymea.io/license/faq
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "mqttiouring_p.h"
+
+#include <QSocketNotifier>
+#include <QElapsedTimer>
+#include <QLoggingCategory>
+
+#include <errno.h>
+#include <string.h>
+
+#ifdef Q_OS_UNIX
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#if defined(Q_OS_LINUX) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+// Multishot receives came last of what is used here, older headers lack parts of the provided buffer rings too
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+#define MQTT_IO_URING
+#endif
+#endif
+#endif
+
+Q_DECLARE_LOGGING_CATEGORY(dbgServer)
+
+// Sizes of the ring of each listener. The receive buffers are only used between a completion and copying the data
+// into the socket, a few hundred are plenty for any number of connections.
+static const quint32 queueEntries = 1024;
+static const quint32 receiveBufferCount = 256;
+static const quint32 receiveBufferSize = 4096;
+
+#ifdef Q_OS_UNIX
+static void closeDescriptor(int fd)
+{
+    int ret;
+    do {
+        ret = ::close(fd);
+    } while (ret < 0 && errno == EINTR);
+}
+
+static bool waitReadable(int fd, int timeout)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int ret;
+    do {
+        ret = ::poll(&pfd, 1, timeout);
+    } while (ret < 0 && errno == EINTR);
+    return ret > 0;
+}
+
+static QHostAddress socketAddress(int fd, bool peer, quint16 *port = nullptr)
+{
+    struct sockaddr_storage storage;
+    memset(&storage, 0, sizeof(storage));
+    socklen_t length = sizeof(storage);
+    struct sockaddr *address = reinterpret_cast<struct sockaddr*>(&storage);
+    if (fd < 0 || (peer ? ::getpeername(fd, address, &length) : ::getsockname(fd, address, &length)) < 0) {
+        return QHostAddress();
+    }
+    if (port) {
+        *port = ntohs(storage.ss_family == AF_INET6 ? reinterpret_cast<struct sockaddr_in6*>(&storage)->sin6_port
+                                                     : reinterpret_cast<struct sockaddr_in*>(&storage)->sin_port);
+    }
+    return QHostAddress(address);
+}
+#else
+static void closeDescriptor(int fd)
+{
+    Q_UNUSED(fd)
+}
+
+static bool waitReadable(int fd, int timeout)
+{
+    Q_UNUSED(fd)
+    Q_UNUSED(timeout)
+    return false;
+}
+
+static QHostAddress socketAddress(int fd, bool peer, quint16 *port = nullptr)
+{
+    Q_UNUSED(fd)
+    Q_UNUSED(peer)
+    Q_UNUSED(port)
+    return QHostAddress();
+}
+#endif
+
+#ifdef MQTT_IO_URING
+
+static int ioUringSetup(quint32 entries, struct io_uring_params *params)
+{
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int ioUringEnter(int fd, quint32 toSubmit, quint32 minComplete, quint32 flags)
+{
+    return static_cast<int>(::syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0));
+}
+
+static int ioUringRegister(int fd, quint32 opcode, void *arg, quint32 count)
+{
+    return static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode, arg, count));
+}
+
+MqttIoUringQueue::~MqttIoUringQueue()
+{
+    release();
+}
+
+bool MqttIoUringQueue::setup(quint32 entries, quint32 bufferCount, quint32 bufferSize)
+{
+    release();
+
+    // Completions of multishot requests don't consume submissions, leave them more room
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+    params.cq_entries = entries * 4;
+    m_fd = ioUringSetup(entries, &params);
+    if (m_fd < 0) {
+        qCDebug(dbgServer) << "io_uring is not available:" << strerror(errno);
+        m_fd = -1;
+        return false;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+        qCDebug(dbgServer) << "io_uring of this kernel is too old.";
+        release();
+        return false;
+    }
+
+    m_ringSize = qMax<size_t>(params.sq_off.array + params.sq_entries * sizeof(quint32),
+                              params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+    void *ring = ::mmap(nullptr, m_ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED) {
+        qCWarning(dbgServer) << "Cannot map io_uring queues:" << strerror(errno);
+        release();
+        return false;
+    }
+    m_ring = ring;
+    m_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = ::mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        qCWarning(dbgServer) << "Cannot map io_uring submission entries:" << strerror(errno);
+        m_sqesSize = 0;
+        release();
+        return false;
+    }
+    m_sqes = static_cast<struct io_uring_sqe*>(sqes);
+
+    char *base = static_cast<char*>(m_ring);
+    m_sqHead = reinterpret_cast<quint32*>(base + params.sq_off.head);
+    m_sqTail = reinterpret_cast<quint32*>(base + params.sq_off.tail);
+    m_sqArray = reinterpret_cast<quint32*>(base + params.sq_off.array);
+    m_sqFlags = reinterpret_cast<quint32*>(base + params.sq_off.flags);
+    m_sqMask = *reinterpret_cast<quint32*>(base + params.sq_off.ring_mask);
+    m_sqEntries = params.sq_entries;
+    m_sqLocalTail = *m_sqTail;
+    m_cqHead = reinterpret_cast<quint32*>(base + params.cq_off.head);
+    m_cqTail = reinterpret_cast<quint32*>(base + params.cq_off.tail);
+    m_cqMask = *reinterpret_cast<quint32*>(base + params.cq_off.ring_mask);
+    m_cqes = base + params.cq_off.cqes;
+
+    // The ring of buffer descriptors and the buffers themselves in one mapping, the ring needs to be page aligned.
+    // The count must be a power of 2.
+    m_bufferRingSize = bufferCount * (sizeof(struct io_uring_buf) + bufferSize);
+    void *buffers = ::mmap(nullptr, m_bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers == MAP_FAILED) {
+        qCWarning(dbgServer) << "Cannot allocate io_uring receive buffers:" << strerror(errno);
+        m_bufferRingSize = 0;
+        release();
+        return false;
+    }
+    m_bufferRing = buffers;
+    m_buffers = static_cast<char*>(buffers) + bufferCount * sizeof(struct io_uring_buf);
+    m_bufferCount = bufferCount;
+    m_bufferSize = bufferSize;
+    m_bufferTail = 0;
+
+    struct io_uring_buf_reg registration;
+    memset(&registration, 0, sizeof(registration));
+    registration.ring_addr = reinterpret_cast<quint64>(m_bufferRing);
+    registration.ring_entries = bufferCount;
+    registration.bgid = 0;
+    if (ioUringRegister(m_fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+        qCDebug(dbgServer) << "io_uring of this kernel does not support provided buffer rings:" << strerror(errno);
+        release();
+        return false;
+    }
+    for (quint32 i = 0; i < bufferCount; i++) {
+        recycleBuffer(static_cast<int>(i));
+    }
+    return true;
+}
+
+int MqttIoUringQueue::descriptor() const
+{
+    return m_fd;
+}
+
+bool MqttIoUringQueue::prepareAccept(int fd, quint64 userData)
+{
+    struct io_uring_sqe *sqe = prepare(IORING_OP_ACCEPT, fd, userData);
+    if (!sqe) {
+        return false;
+    }
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    return true;
+}
+
+bool MqttIoUringQueue::prepareReceive(int fd, quint64 userData, bool multishot)
+{
+    struct io_uring_sqe *sqe = prepare(IORING_OP_RECV, fd, userData);
+    if (!sqe) {
+        return false;
+    }
+    // The kernel picks a buffer once data arrives, a connection doesn't tie up memory while idle
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->ioprio = multishot ? IORING_RECV_MULTISHOT : 0;
+    return true;
+}
+
+bool MqttIoUringQueue::prepareSend(int fd, quint64 userData, const char *data, quint32 size)
+{
+    struct io_uring_sqe *sqe = prepare(IORING_OP_SEND, fd, userData);
+    if (!sqe) {
+        return false;
+    }
+    sqe->addr = reinterpret_cast<quint64>(data);
+    sqe->len = size;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    return true;
+}
+
+bool MqttIoUringQueue::prepareCancel(quint64 target, quint64 userData)
+{
+    struct io_uring_sqe *sqe = prepare(IORING_OP_ASYNC_CANCEL, -1, userData);
+    if (!sqe) {
+        return false;
+    }
+    sqe->addr = target;
+    return true;
+}
+
+bool MqttIoUringQueue::submit()
+{
+    __atomic_store_n(m_sqTail, m_sqLocalTail, __ATOMIC_RELEASE);
+    while (m_sqLocalTail != __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE)) {
+        int ret = ioUringEnter(m_fd, m_sqLocalTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE), 0, 0);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            // EBUSY if completions are backing up, the entries stay queued until they are picked up
+            if (errno != EBUSY && errno != EAGAIN) {
+                qCWarning(dbgServer) << "Error submitting to io_uring:" << strerror(errno);
+            }
+            return false;
+        }
+        if (ret == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool MqttIoUringQueue::takeCompletion(quint64 *userData, qint32 *result, quint32 *flags)
+{
+    quint32 head = *m_cqHead;
+    if (head == __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE)) {
+        if (!(__atomic_load_n(m_sqFlags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW)) {
+            return false;
+        }
+        // Completions which didn't fit into the queue are held back by the kernel until asked for
+        ioUringEnter(m_fd, 0, 0, IORING_ENTER_GETEVENTS);
+        if (head == __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE)) {
+            return false;
+        }
+    }
+    const struct io_uring_cqe *cqe = static_cast<const struct io_uring_cqe*>(m_cqes) + (head & m_cqMask);
+    *userData = cqe->user_data;
+    *result = cqe->res;
+    *flags = cqe->flags;
+    __atomic_store_n(m_cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool MqttIoUringQueue::isFinal(quint32 flags)
+{
+    return !(flags & IORING_CQE_F_MORE);
+}
+
+int MqttIoUringQueue::bufferId(quint32 flags)
+{
+    if (!(flags & IORING_CQE_F_BUFFER)) {
+        return -1;
+    }
+    return static_cast<int>(flags >> IORING_CQE_BUFFER_SHIFT);
+}
+
+const char *MqttIoUringQueue::buffer(int bufferId) const
+{
+    return m_buffers + static_cast<quint32>(bufferId) * m_bufferSize;
+}
+
+void MqttIoUringQueue::recycleBuffer(int bufferId)
+{
+    struct io_uring_buf_ring *ring = static_cast<struct io_uring_buf_ring*>(m_bufferRing);
+    // Not using ring->bufs, with some kernel headers it is misplaced in C++. The tail shares its place with the
+    // reserved field of the first entry, only touch the fields in use.
+    struct io_uring_buf *entry = static_cast<struct io_uring_buf*>(m_bufferRing) + (m_bufferTail & (m_bufferCount - 1));
+    entry->addr = reinterpret_cast<quint64>(buffer(bufferId));
+    entry->len = m_bufferSize;
+    entry->bid = static_cast<quint16>(bufferId);
+    m_bufferTail++;
+    __atomic_store_n(&ring->tail, m_bufferTail, __ATOMIC_RELEASE);
+}
+
+void MqttIoUringQueue::release()
+{
+    // Closing the ring cancels anything still in flight
+    if (m_fd >= 0) {
+        closeDescriptor(m_fd);
+        m_fd = -1;
+    }
+    if (m_bufferRing) {
+        ::munmap(m_bufferRing, m_bufferRingSize);
+        m_bufferRing = nullptr;
+        m_buffers = nullptr;
+    }
+    if (m_sqes) {
+        ::munmap(m_sqes, m_sqesSize);
+        m_sqes = nullptr;
+    }
+    if (m_ring) {
+        ::munmap(m_ring, m_ringSize);
+        m_ring = nullptr;
+    }
+}
+
+struct io_uring_sqe *MqttIoUringQueue::prepare(quint8 opcode, int fd, quint64 userData)
+{
+    if (m_fd < 0) {
+        return nullptr;
+    }
+    if (m_sqLocalTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries) {
+        // Full, make room by handing the queued entries to the kernel
+        if (!submit()) {
+            return nullptr;
+        }
+    }
+    quint32 index = m_sqLocalTail & m_sqMask;
+    struct io_uring_sqe *sqe = &m_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = userData;
+    m_sqArray[index] = index;
+    m_sqLocalTail++;
+    return sqe;
+}
+
+#else
+
+MqttIoUringQueue::~MqttIoUringQueue()
+{
+}
+
+bool MqttIoUringQueue::setup(quint32 entries, quint32 bufferCount, quint32 bufferSize)
+{
+    Q_UNUSED(entries)
+    Q_UNUSED(bufferCount)
+    Q_UNUSED(bufferSize)
+    return false;
+}
+
+int MqttIoUringQueue::descriptor() const
+{
+    return -1;
+}
+
+bool MqttIoUringQueue::prepareAccept(int fd, quint64 userData)
+{
+    Q_UNUSED(fd)
+    Q_UNUSED(userData)
+    return false;
+}
+
+bool MqttIoUringQueue::prepareReceive(int fd, quint64 userData, bool multishot)
+{
+    Q_UNUSED(fd)
+    Q_UNUSED(userData)
+    Q_UNUSED(multishot)
+    return false;
+}
+
+bool MqttIoUringQueue::prepareSend(int fd, quint64 userData, const char *data, quint32 size)
+{
+    Q_UNUSED(fd)
+    Q_UNUSED(userData)
+    Q_UNUSED(data)
+    Q_UNUSED(size)
+    return false;
+}
+
+bool MqttIoUringQueue::prepareCancel(quint64 target, quint64 userData)
+{
+    Q_UNUSED(target)
+    Q_UNUSED(userData)
+    return false;
+}
+
+bool MqttIoUringQueue::submit()
+{
+    return false;
+}
+
+bool MqttIoUringQueue::takeCompletion(quint64 *userData, qint32 *result, quint32 *flags)
+{
+    Q_UNUSED(userData)
+    Q_UNUSED(result)
+    Q_UNUSED(flags)
+    return false;
+}
+
+bool MqttIoUringQueue::isFinal(quint32 flags)
+{
+    Q_UNUSED(flags)
+    return true;
+}
+
+int MqttIoUringQueue::bufferId(quint32 flags)
+{
+    Q_UNUSED(flags)
+    return -1;
+}
+
+const char *MqttIoUringQueue::buffer(int bufferId) const
+{
+    Q_UNUSED(bufferId)
+    return nullptr;
+}
+
+void MqttIoUringQueue::recycleBuffer(int bufferId)
+{
+    Q_UNUSED(bufferId)
+}
+
+void MqttIoUringQueue::release()
+{
+}
+
+struct io_uring_sqe *MqttIoUringQueue::prepare(quint8 opcode, int fd, quint64 userData)
+{
+    Q_UNUSED(opcode)
+    Q_UNUSED(fd)
+    Q_UNUSED(userData)
+    return nullptr;
+}
+
+#endif // MQTT_IO_URING
+
+MqttIoUringServer::MqttIoUringServer(QObject *parent):
+    QObject(parent)
+{
+    // Everything queued while handling events goes out in one system call
+    m_submitTimer.setSingleShot(true);
+    m_submitTimer.setInterval(0);
+    connect(&m_submitTimer, &QTimer::timeout, this, &MqttIoUringServer::submitPending);
+}
+
+MqttIoUringServer::~MqttIoUringServer()
+{
+    close();
+    foreach (MqttIoUringSocket *socket, findChildren<MqttIoUringSocket*>(QString(), Qt::FindDirectChildrenOnly)) {
+        delete socket;
+    }
+    foreach (quint64 connectionId, m_connections.keys()) {
+        closeConnection(connectionId, false);
+    }
+    // The kernel may still write into the buffers of receives and read the data of sends, wait for them to go away
+    submitPending();
+    QElapsedTimer timer;
+    timer.start();
+    while (m_operations > 0 && timer.elapsed() < 1000) {
+        waitForCompletions(static_cast<int>(1000 - timer.elapsed()));
+    }
+}
+
+bool MqttIoUringServer::isSupported()
+{
+    static const bool supported = []() {
+        MqttIoUringQueue queue;
+        return queue.setup(4, 4, 64);
+    }();
+    return supported;
+}
+
+bool MqttIoUringServer::setSocketDescriptor(int socketDescriptor)
+{
+    if (m_listenFd >= 0 || !setup()) {
+        return false;
+    }
+    m_listenFd = socketDescriptor;
+    if (!armAccept()) {
+        // Left to the caller
+        m_listenFd = -1;
+        return false;
+    }
+    return true;
+}
+
+int MqttIoUringServer::socketDescriptor() const
+{
+    return m_listenFd;
+}
+
+bool MqttIoUringServer::isListening() const
+{
+    return m_listenFd >= 0;
+}
+
+QHostAddress MqttIoUringServer::serverAddress() const
+{
+    return socketAddress(m_listenFd, false);
+}
+
+quint16 MqttIoUringServer::serverPort() const
+{
+    quint16 port = 0;
+    socketAddress(m_listenFd, false, &port);
+    return port;
+}
+
+void MqttIoUringServer::pauseAccepting()
+{
+    if (m_acceptingPaused) {
+        return;
+    }
+    m_acceptingPaused = true;
+    // The kernel accepts on its own, connections must not pile up in completions while paused. Connections accepted
+    // until the cancellation went through are still reported.
+    if (m_accepting && cancel(0, OperationAccept)) {
+        submitPending();
+        QElapsedTimer timer;
+        timer.start();
+        while (m_accepting && timer.elapsed() < 1000) {
+            waitForCompletions(static_cast<int>(1000 - timer.elapsed()));
+        }
+    }
+}
+
+void MqttIoUringServer::resumeAccepting()
+{
+    m_acceptingPaused = false;
+    armAccept();
+}
+
+void MqttIoUringServer::close()
+{
+    if (m_listenFd < 0) {
+        return;
+    }
+    // The accept request keeps the socket alive in the kernel even after closing the descriptor. Stop it before,
+    // whatever it accepts in the meantime is dropped.
+    int fd = m_listenFd;
+    m_listenFd = -1;
+    if (m_accepting && cancel(0, OperationAccept)) {
+        submitPending();
+        QElapsedTimer timer;
+        timer.start();
+        while (m_accepting && timer.elapsed() < 1000) {
+            waitForCompletions(static_cast<int>(1000 - timer.elapsed()));
+        }
+    }
+    closeDescriptor(fd);
+}
+
+MqttIoUringSocket *MqttIoUringServer::adoptSocket(int socketDescriptor)
+{
+    if (!setup()) {
+        return nullptr;
+    }
+    quint64 connectionId = ++m_lastConnectionId;
+    Connection connection;
+    connection.fd = socketDescriptor;
+    MqttIoUringSocket *socket = new MqttIoUringSocket(this, connectionId);
+    connection.socket = socket;
+    m_connections.insert(connectionId, connection);
+    connect(socket, &MqttIoUringSocket::readyRead, this, &MqttIoUringServer::onSocketReadyRead);
+    connect(socket, &MqttIoUringSocket::disconnected, this, &MqttIoUringServer::onClientDisconnected);
+
+    m_receivePending.insert(connectionId);
+    scheduleSubmit();
+    return socket;
+}
+
+void MqttIoUringServer::processCompletions()
+{
+    quint64 data;
+    qint32 result;
+    quint32 flags;
+    while (m_queue.takeCompletion(&data, &result, &flags)) {
+        handleCompletion(data, result, flags);
+    }
+}
+
+void MqttIoUringServer::submitPending()
+{
+    m_submitTimer.stop();
+
+    QSet<quint64> sendPending;
+    sendPending.swap(m_sendPending);
+    foreach (quint64 connectionId, sendPending) {
+        if (!startSend(connectionId)) {
+            m_sendPending.insert(connectionId);
+        }
+    }
+    QSet<quint64> receivePending;
+    receivePending.swap(m_receivePending);
+    foreach (quint64 connectionId, receivePending) {
+        if (!armReceive(connectionId)) {
+            m_receivePending.insert(connectionId);
+        }
+    }
+    m_queue.submit();
+
+    // Try again with the next event loop iteration, most likely completions need to be picked up first
+    if (!m_sendPending.isEmpty() || !m_receivePending.isEmpty()) {
+        m_submitTimer.start();
+    }
+}
+
+void MqttIoUringServer::onClientDisconnected()
+{
+    MqttIoUringSocket *socket = static_cast<MqttIoUringSocket*>(sender());
+    qCDebug(dbgServer) << "Client socket disconnected:" << socket;
+    emit clientDisconnected(socket);
+    socket->deleteLater();
+}
+
+void MqttIoUringServer::onSocketReadyRead()
+{
+    MqttIoUringSocket *socket = static_cast<MqttIoUringSocket*>(sender());
+    emit dataAvailable(socket);
+}
+
+bool MqttIoUringServer::setup()
+{
+    if (m_notifier) {
+        return true;
+    }
+    if (!m_queue.setup(queueEntries, receiveBufferCount, receiveBufferSize)) {
+        return false;
+    }
+    // The ring descriptor is readable while completions are waiting
+    m_notifier = new QSocketNotifier(m_queue.descriptor(), QSocketNotifier::Read, this);
+    connect(m_notifier, SIGNAL(activated(int)), this, SLOT(processCompletions()));
+    return true;
+}
+
+quint64 MqttIoUringServer::userData(quint64 connectionId, Operation operation)
+{
+    return (connectionId << 3) | operation;
+}
+
+void MqttIoUringServer::scheduleSubmit()
+{
+    if (!m_submitTimer.isActive()) {
+        m_submitTimer.start();
+    }
+}
+
+bool MqttIoUringServer::armAccept()
+{
+    if (m_listenFd < 0 || m_accepting || m_acceptingPaused || m_acceptDelayed) {
+        return true;
+    }
+    if (!m_queue.prepareAccept(m_listenFd, userData(0, OperationAccept))) {
+        qCWarning(dbgServer) << "Cannot queue accepting connections on io_uring.";
+        return false;
+    }
+    m_accepting = true;
+    m_operations++;
+    scheduleSubmit();
+    return true;
+}
+
+bool MqttIoUringServer::armReceive(quint64 connectionId)
+{
+    QHash<quint64, Connection>::iterator it = m_connections.find(connectionId);
+    if (it == m_connections.end() || it->fd < 0 || it->closing || it->receiving || !it->receiveEnabled) {
+        return true;
+    }
+    if (!m_queue.prepareReceive(it->fd, userData(connectionId, OperationReceive), m_multishotReceive)) {
+        return false;
+    }
+    it->receiving = true;
+    it->operations++;
+    m_operations++;
+    return true;
+}
+
+bool MqttIoUringServer::startSend(quint64 connectionId)
+{
+    QHash<quint64, Connection>::iterator it = m_connections.find(connectionId);
+    if (it == m_connections.end() || it->fd < 0 || it->sendInFlight) {
+        return true;
+    }
+    // Whatever was written since the last send goes out in one piece. The data stays untouched until completed.
+    if (it->sending.isEmpty()) {
+        it->sending.swap(it->pending);
+        it->sendOffset = 0;
+    }
+    if (it->sending.isEmpty()) {
+        if (it->closing) {
+            shutdownConnection(connectionId);
+        }
+        return true;
+    }
+    if (!m_queue.prepareSend(it->fd, userData(connectionId, OperationSend), it->sending.constData() + it->sendOffset,
+                             static_cast<quint32>(it->sending.size() - it->sendOffset))) {
+        return false;
+    }
+    it->sendInFlight = true;
+    it->operations++;
+    m_operations++;
+    return true;
+}
+
+bool MqttIoUringServer::cancel(quint64 connectionId, Operation operation)
+{
+    QHash<quint64, Connection>::iterator it = m_connections.find(connectionId);
+    if (connectionId != 0 && it == m_connections.end()) {
+        return false;
+    }
+    if (!m_queue.prepareCancel(userData(connectionId, operation), userData(connectionId, OperationCancel))) {
+        return false;
+    }
+    if (connectionId != 0) {
+        it->operations++;
+    }
+    m_operations++;
+    scheduleSubmit();
+    return true;
+}
+
+void MqttIoUringServer::handleCompletion(quint64 userData, qint32 result, quint32 flags)
+{
+    quint64 connectionId = userData >> 3;
+    Operation operation = static_cast<Operation>(userData & 7);
+    switch (operation) {
+    case OperationAccept:
+        handleAccept(result, flags);
+        return;
+    case OperationReceive:
+        handleReceive(connectionId, result, flags);
+        return;
+    case OperationSend:
+        handleSend(connectionId, result);
+        return;
+    case OperationCancel:
+        // The cancelled request completes on its own
+        m_operations--;
+        if (connectionId != 0 && m_connections.contains(connectionId)) {
+            m_connections[connectionId].operations--;
+            finishConnection(connectionId);
+        }
+        return;
+    }
+}
+
+void MqttIoUringServer::handleAccept(qint32 result, quint32 flags)
+{
+    if (MqttIoUringQueue::isFinal(flags)) {
+        m_accepting = false;
+        m_operations--;
+    }
+
+    if (result >= 0) {
+        if (m_listenFd < 0) {
+            closeDescriptor(result);
+        } else {
+            MqttIoUringSocket *socket = adoptSocket(result);
+            qCDebug(dbgServer) << "New client socket connection:" << socket;
+            emit clientConnected(socket);
+        }
+    } else if (result != -ECANCELED) {
+        // Most likely out of descriptors, give the other connections a moment to close
+        qCWarning(dbgServer) << "Error accepting connection:" << strerror(-result);
+        if (!m_acceptDelayed) {
+            m_acceptDelayed = true;
+            QTimer::singleShot(100, this, [this]() {
+                m_acceptDelayed = false;
+                armAccept();
+            });
+        }
+    }
+
+    // Multishot accepts end on errors, and once cancelled
+    if (!m_accepting) {
+        armAccept();
+    }
+}
+
+void MqttIoUringServer::handleReceive(quint64 connectionId, qint32 result, quint32 flags)
+{
+    QHash<quint64, Connection>::iterator it = m_connections.find(connectionId);
+    if (it == m_connections.end()) {
+        return;
+    }
+    int buffer = MqttIoUringQueue::bufferId(flags);
+    if (buffer >= 0) {
+        if (result > 0 && it->socket) {
+            it->socket->receive(m_queue.buffer(buffer), result);
+        }
+        m_queue.recycleBuffer(buffer);
+    }
+
+    bool final = MqttIoUringQueue::isFinal(flags);
+    if (final) {
+        it->receiving = false;
+        it->operations--;
+        m_operations--;
+    }
+
+    if (result == -EINVAL && m_multishotReceive) {
+        qCDebug(dbgServer) << "io_uring of this kernel does not support multishot receives. Receiving one by one.";
+        m_multishotReceive = false;
+    } else if (result == 0 || (result < 0 && result != -ENOBUFS && result != -ECANCELED)) {
+        // Closed by the peer or broken
+        if (it->socket) {
+            it->socket->setPeerClosed();
+        }
+        finishConnection(connectionId);
+        return;
+    }
+
+    // Re-armed after a single shot receive, when running out of buffers and when cancelled by stopReceiving() in
+    // the meantime undone by startReceiving()
+    if (final) {
+        m_receivePending.insert(connectionId);
+        scheduleSubmit();
+        finishConnection(connectionId);
+    }
+}
+
+void MqttIoUringServer::handleSend(quint64 connectionId, qint32 result)
+{
+    QHash<quint64, Connection>::iterator it = m_connections.find(connectionId);
+    if (it == m_connections.end()) {
+        return;
+    }
+    it->sendInFlight = false;
+    it->operations--;
+    m_operations--;
+
+    if (result < 0) {
+        if (result != -ECANCELED) {
+            qCDebug(dbgServer) << "Error sending to client:" << strerror(-result);
+            if (it->socket) {
+                it->socket->setPeerClosed();
+            }
+        }
+        it->sending.clear();
+        it->pending.clear();
+        if (it->closing) {
+            shutdownConnection(connectionId);
+        }
+        finishConnection(connectionId);
+        return;
+    }
+
+    it->sendOffset += result;
+    if (it->sendOffset >= it->sending.size()) {
+        it->sending.clear();
+        it->sendOffset = 0;
+    }
+    // The rest of a partial send, data written in the meantime and closing once everything is out
+    if (!it->sending.isEmpty() || !it->pending.isEmpty() || it->closing) {
+        m_sendPending.insert(connectionId);
+        scheduleSubmit();
+    }
+}
+
+void MqttIoUringServer::shutdownConnection(quint64 connectionId)
+{
+    QHash<quint64, Connection>::iterator it = m_connections.find(connectionId);
+    if (it == m_connections.end() || it->fd < 0) {
+        return;
+    }
+    // No shutdown(), after a handover the other process shares the connection. Requests still in flight keep the
+    // socket open in the kernel until they are completed or cancelled.
+    if (it->receiving) {
+        cancel(connectionId, OperationReceive);
+    }
+    if (it->sendInFlight) {
+        cancel(connectionId, OperationSend);
+    }
+    closeDescriptor(it->fd);
+    it->fd = -1;
+    m_sendPending.remove(connectionId);
+    m_receivePending.remove(connectionId);
+    finishConnection(connectionId);
+}
+
+void MqttIoUringServer::finishConnection(quint64 connectionId)
+{
+    QHash<quint64, Connection>::iterator it = m_connections.find(connectionId);
+    if (it != m_connections.end() && it->fd < 0 && it->operations == 0) {
+        m_connections.erase(it);
+    }
+}
+
+bool MqttIoUringServer::waitForCompletions(int timeout)
+{
+    m_queue.submit();
+    if (!waitReadable(m_queue.descriptor(), timeout)) {
+        return false;
+    }
+    processCompletions();
+    return true;
+}
+
+int MqttIoUringServer::descriptor(quint64 connectionId) const
+{
+    return m_connections.value(connectionId).fd;
+}
+
+void MqttIoUringServer::releaseSocket(quint64 connectionId)
+{
+    QHash<quint64, Connection>::iterator it = m_connections.find(connectionId);
+    if (it == m_connections.end()) {
+        return;
+    }
+    it->socket = nullptr;
+    // Sockets closed gracefully finish sending on their own
+    if (!it->closing) {
+        closeConnection(connectionId, false);
+    }
+}
+
+void MqttIoUringServer::write(quint64 connectionId, const char *data, qint64 size)
+{
+    QHash<quint64, Connection>::iterator it = m_connections.find(connectionId);
+    if (it == m_connections.end() || it->fd < 0 || it->closing) {
+        return;
+    }
+    it->pending.append(data, static_cast<int>(size));
+    m_sendPending.insert(connectionId);
+    scheduleSubmit();
+}
+
+qint64 MqttIoUringServer::bytesToWrite(quint64 connectionId) const
+{
+    QHash<quint64, Connection>::const_iterator it = m_connections.constFind(connectionId);
+    if (it == m_connections.constEnd()) {
+        return 0;
+    }
+    return it->pending.size() + it->sending.size() - it->sendOffset;
+}
+
+bool MqttIoUringServer::waitForBytesWritten(quint64 connectionId, int timeout)
+{
+    QElapsedTimer timer;
+    timer.start();
+    submitPending();
+    while (bytesToWrite(connectionId) > 0) {
+        if (descriptor(connectionId) < 0) {
+            return false;
+        }
+        int remaining = timeout < 0 ? -1 : timeout - static_cast<int>(timer.elapsed());
+        if (timeout >= 0 && remaining <= 0) {
+            return false;
+        }
+        if (!waitForCompletions(remaining)) {
+            return false;
+        }
+        // Partial sends continue right away
+        submitPending();
+    }
+    return true;
+}
+
+void MqttIoUringServer::stopReceiving(quint64 connectionId, int timeout)
+{
+    QHash<quint64, Connection>::iterator it = m_connections.find(connectionId);
+    if (it == m_connections.end()) {
+        return;
+    }
+    it->receiveEnabled = false;
+    m_receivePending.remove(connectionId);
+    if (!it->receiving || !cancel(connectionId, OperationReceive)) {
+        return;
+    }
+    submitPending();
+    QElapsedTimer timer;
+    timer.start();
+    while (m_connections.value(connectionId).receiving && timer.elapsed() < timeout) {
+        waitForCompletions(timeout - static_cast<int>(timer.elapsed()));
+    }
+}
+
+void MqttIoUringServer::startReceiving(quint64 connectionId)
+{
+    QHash<quint64, Connection>::iterator it = m_connections.find(connectionId);
+    if (it == m_connections.end()) {
+        return;
+    }
+    it->receiveEnabled = true;
+    m_receivePending.insert(connectionId);
+    scheduleSubmit();
+}
+
+void MqttIoUringServer::closeConnection(quint64 connectionId, bool flush)
+{
+    QHash<quint64, Connection>::iterator it = m_connections.find(connectionId);
+    if (it == m_connections.end() || it->fd < 0) {
+        return;
+    }
+    it->receiveEnabled = false;
+    if (!flush) {
+        it->pending.clear();
+        shutdownConnection(connectionId);
+        return;
+    }
+    // Nothing more to receive, the descriptor is closed once the last send completed
+    it->closing = true;
+    if (it->receiving) {
+        cancel(connectionId, OperationReceive);
+    }
+    m_sendPending.insert(connectionId);
+    scheduleSubmit();
+}
+
+MqttIoUringSocket::MqttIoUringSocket(MqttIoUringServer *server, quint64 connectionId):
+    QIODevice(server),
+    m_server(server),
+    m_connectionId(connectionId)
+{
+    // The received data is buffered here already
+    open(QIODevice::ReadWrite | QIODevice::Unbuffered);
+}
+
+MqttIoUringSocket::~MqttIoUringSocket()
+{
+    m_server->releaseSocket(m_connectionId);
+}
+
+bool MqttIoUringSocket::isSequential() const
+{
+    return true;
+}
+
+qint64 MqttIoUringSocket::bytesAvailable() const
+{
+    return m_readBuffer.size() + QIODevice::bytesAvailable();
+}
+
+qint64 MqttIoUringSocket::bytesToWrite() const
+{
+    return m_server->bytesToWrite(m_connectionId);
+}
+
+void MqttIoUringSocket::close()
+{
+    if (!isOpen()) {
+        return;
+    }
+    QIODevice::close();
+    m_readBuffer.clear();
+    m_server->closeConnection(m_connectionId, true);
+    emit disconnected();
+}
+
+int MqttIoUringSocket::socketDescriptor() const
+{
+    return m_server->descriptor(m_connectionId);
+}
+
+QHostAddress MqttIoUringSocket::peerAddress() const
+{
+    return socketAddress(socketDescriptor(), true);
+}
+
+bool MqttIoUringSocket::flush()
+{
+    bool pending = bytesToWrite() > 0;
+    m_server->submitPending();
+    return pending;
+}
+
+bool MqttIoUringSocket::waitForBytesWritten(int msecs)
+{
+    return m_server->waitForBytesWritten(m_connectionId, msecs);
+}
+
+void MqttIoUringSocket::abort()
+{
+    if (!isOpen()) {
+        return;
+    }
+    QIODevice::close();
+    m_readBuffer.clear();
+    m_server->closeConnection(m_connectionId, false);
+    emit disconnected();
+}
+
+QByteArray MqttIoUringSocket::takeReceivedData()
+{
+    QByteArray data;
+    data.swap(m_readBuffer);
+    return data;
+}
+
+void MqttIoUringSocket::stopReceiving(int msecs)
+{
+    m_server->stopReceiving(m_connectionId, msecs);
+}
+
+void MqttIoUringSocket::startReceiving()
+{
+    m_server->startReceiving(m_connectionId);
+}
+
+qint64 MqttIoUringSocket::readData(char *data, qint64 maxSize)
+{
+    int size = static_cast<int>(qMin<qint64>(maxSize, m_readBuffer.size()));
+    memcpy(data, m_readBuffer.constData(), static_cast<size_t>(size));
+    m_readBuffer.remove(0, size);
+    return size;
+}
+
+qint64 MqttIoUringSocket::writeData(const char *data, qint64 maxSize)
+{
+    if (socketDescriptor() < 0) {
+        return -1;
+    }
+    m_server->write(m_connectionId, data, maxSize);
+    return maxSize;
+}
+
+void MqttIoUringSocket::receive(const char *data, int size)
+{
+    if (!isOpen()) {
+        return;
+    }
+    m_readBuffer.append(data, size);
+    scheduleDelivery();
+}
+
+void MqttIoUringSocket::setPeerClosed()
+{
+    m_peerClosed = true;
+    scheduleDelivery();
+}
+
+void MqttIoUringSocket::scheduleDelivery()
+{
+    if (m_deliveryScheduled) {
+        return;
+    }
+    m_deliveryScheduled = true;
+    QTimer::singleShot(0, this, [this]() {
+        deliver();
+    });
+}
+
+void MqttIoUringSocket::deliver()
+{
+    // Like a QTcpSocket, data received before the peer closed the connection is delivered first
+    m_deliveryScheduled = false;
+    if (!isOpen()) {
+        return;
+    }
+    if (!m_readBuffer.isEmpty()) {
+        emit readyRead();
+    }
+    if (m_peerClosed && isOpen()) {
+        close();
+    }
+}
@@ -0,0 +1,262 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+*
+* Copyright 2013 - 2020, nymea GmbH
+* Contact: contact@nymea.io
+*
+* This file is part of nymea.
+* This project including source code and documentation is protected by copyright law, and
+* remains the property of nymea GmbH. All rights, including reproduction, publication,
+* editing and translation, are reserved. The use of this project is subject to the terms of a
+* license agreement to be concluded with nymea GmbH in accordance with the terms
+* of use of nymea GmbH, available under https://nymea.io/license
+*
+* GNU Lesser General Public License Usage
+* Alternatively, this project may be redistributed and/or modified under the terms of the GNU
+* Lesser General Public License as published by the Free Software Foundation; version 3.
+* this project is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+* without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License along with this project.
+* If not, see <https://www.gnu.org/licenses/>.
+*
+* For any further details and any questions please contact us under contact@nymea.io
+* or see our FAQ/Licensing Information on https://nymea.io/license/faq
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef MQTTIOURING_P_H
+#define MQTTIOURING_P_H
+
+#include <QObject>
+#include <QIODevice>
+#include <QHash>
+#include <QSet>
+#include <QTimer>
+#include <QHostAddress>
+
+class QSocketNotifier;
+class MqttIoUringSocket;
+struct io_uring_sqe;
+
+// The submission and completion queues of an io_uring instance and the ring of buffers provided to the kernel for
+// receiving. Uses the system calls directly, liburing is not needed. Only built on Linux with kernel headers
+// providing multishot receives, setup() fails everywhere else and on kernels older than 5.19.
+class MqttIoUringQueue
+{
+public:
+    MqttIoUringQueue() = default;
+    ~MqttIoUringQueue();
+
+    bool setup(quint32 entries, quint32 bufferCount, quint32 bufferSize);
+    // Becomes readable when completions are waiting
+    int descriptor() const;
+
+    // Queue a request, false if the queue stays full even after submitting
+    bool prepareAccept(int fd, quint64 userData);
+    bool prepareReceive(int fd, quint64 userData, bool multishot);
+    bool prepareSend(int fd, quint64 userData, const char *data, quint32 size);
+    bool prepareCancel(quint64 target, quint64 userData);
+    bool submit();
+
+    bool takeCompletion(quint64 *userData, qint32 *result, quint32 *flags);
+    // Whether a completion is the last one of its request, multishot requests complete many times
+    static bool isFinal(quint32 flags);
+    // Receive completions carry one of the provided buffers, -1 if none. It needs to be recycled once the data is
+    // copied out.
+    static int bufferId(quint32 flags);
+    const char *buffer(int bufferId) const;
+    void recycleBuffer(int bufferId);
+
+private:
+    void release();
+    struct io_uring_sqe *prepare(quint8 opcode, int fd, quint64 userData);
+
+    int m_fd = -1;
+    void *m_ring = nullptr;
+    size_t m_ringSize = 0;
+    struct io_uring_sqe *m_sqes = nullptr;
+    size_t m_sqesSize = 0;
+
+    quint32 *m_sqHead = nullptr;
+    quint32 *m_sqTail = nullptr;
+    quint32 *m_sqArray = nullptr;
+    quint32 *m_sqFlags = nullptr;
+    quint32 m_sqMask = 0;
+    quint32 m_sqEntries = 0;
+    // Includes the entries prepared but not published to the kernel yet
+    quint32 m_sqLocalTail = 0;
+
+    quint32 *m_cqHead = nullptr;
+    quint32 *m_cqTail = nullptr;
+    quint32 m_cqMask = 0;
+    void *m_cqes = nullptr;
+
+    void *m_bufferRing = nullptr;
+    size_t m_bufferRingSize = 0;
+    char *m_buffers = nullptr;
+    quint32 m_bufferCount = 0;
+    quint32 m_bufferSize = 0;
+    quint16 m_bufferTail = 0;
+};
+
+// A plain TCP listener driven by io_uring instead of the Qt event dispatcher, see MqttServer::setTransport(). It
+// mirrors the parts of QTcpServer used by MqttServer and emits the same signals as its SslServer.
+//
+// Each listener has its own ring. New connections come from a multishot accept, each connection has a multishot
+// receive armed which picks its buffers from the provided buffer ring. Writes are collected and submitted together
+// with any re-armed requests in one system call per event loop iteration. All state the kernel may still access,
+// like the data of a send in flight, is kept here and not in the socket objects, these may be deleted any time.
+class MqttIoUringServer: public QObject
+{
+    Q_OBJECT
+public:
+    explicit MqttIoUringServer(QObject *parent = nullptr);
+    ~MqttIoUringServer() override;
+
+    // Whether io_uring can be used on this system, checked once per process
+    static bool isSupported();
+
+    bool setSocketDescriptor(int socketDescriptor);
+    int socketDescriptor() const;
+    bool isListening() const;
+    QHostAddress serverAddress() const;
+    quint16 serverPort() const;
+    void pauseAccepting();
+    void resumeAccepting();
+    void close();
+
+    // Creates a client socket for an already connected descriptor
+    MqttIoUringSocket *adoptSocket(int socketDescriptor);
+
+signals:
+    void clientConnected(QIODevice *socket);
+    void clientDisconnected(QIODevice *socket);
+    void dataAvailable(QIODevice *socket);
+
+private slots:
+    void processCompletions();
+    void submitPending();
+    void onClientDisconnected();
+    void onSocketReadyRead();
+
+private:
+    friend class MqttIoUringSocket;
+
+    enum Operation {
+        OperationAccept = 1,
+        OperationReceive,
+        OperationSend,
+        OperationCancel
+    };
+
+    struct Connection {
+        int fd = -1;
+        MqttIoUringSocket *socket = nullptr;
+        // Owned here while the kernel reads from it
+        QByteArray sending;
+        int sendOffset = 0;
+        QByteArray pending;
+        int operations = 0;
+        bool sendInFlight = false;
+        bool receiving = false;
+        bool receiveEnabled = true;
+        // Shut down once everything is sent
+        bool closing = false;
+    };
+
+    bool setup();
+    static quint64 userData(quint64 connectionId, Operation operation);
+    void scheduleSubmit();
+    bool armAccept();
+    bool armReceive(quint64 connectionId);
+    bool startSend(quint64 connectionId);
+    bool cancel(quint64 connectionId, Operation operation);
+    void handleCompletion(quint64 userData, qint32 result, quint32 flags);
+    void handleAccept(qint32 result, quint32 flags);
+    void handleReceive(quint64 connectionId, qint32 result, quint32 flags);
+    void handleSend(quint64 connectionId, qint32 result);
+    void shutdownConnection(quint64 connectionId);
+    void finishConnection(quint64 connectionId);
+    bool waitForCompletions(int timeout);
+
+    // Called by the sockets
+    int descriptor(quint64 connectionId) const;
+    void releaseSocket(quint64 connectionId);
+    void write(quint64 connectionId, const char *data, qint64 size);
+    qint64 bytesToWrite(quint64 connectionId) const;
+    bool waitForBytesWritten(quint64 connectionId, int timeout);
+    void stopReceiving(quint64 connectionId, int timeout);
+    void startReceiving(quint64 connectionId);
+    void closeConnection(quint64 connectionId, bool flush);
+
+    MqttIoUringQueue m_queue;
+    QSocketNotifier *m_notifier = nullptr;
+    QTimer m_submitTimer;
+
+    int m_listenFd = -1;
+    bool m_accepting = false;
+    bool m_acceptingPaused = false;
+    // Set for a moment after accepting failed, e.g. when running out of descriptors
+    bool m_acceptDelayed = false;
+    bool m_multishotReceive = true;
+
+    quint64 m_lastConnectionId = 0;
+    QHash<quint64, Connection> m_connections;
+    QSet<quint64> m_receivePending;
+    QSet<quint64> m_sendPending;
+    // Requests in flight, all of them need to complete before the ring may go away
+    int m_operations = 0;
+};
+
+// A connection accepted by a MqttIoUringServer. Like a QTcpSocket it buffers the received data and emits
+// readyRead(), and disconnected() once the peer closed the connection, both through the event loop. Data written
+// is sent with the next submission of the server. close() sends any pending data first, abort() does not.
+class MqttIoUringSocket: public QIODevice
+{
+    Q_OBJECT
+public:
+    ~MqttIoUringSocket() override;
+
+    bool isSequential() const override;
+    qint64 bytesAvailable() const override;
+    qint64 bytesToWrite() const override;
+    void close() override;
+
+    int socketDescriptor() const;
+    QHostAddress peerAddress() const;
+    bool flush();
+    bool waitForBytesWritten(int msecs = 30000) override;
+    void abort();
+
+    // Stops picking up data from the connection, e.g. while handing it over to another process. Anything received
+    // until then is available for reading.
+    void stopReceiving(int msecs = 1000);
+    void startReceiving();
+    // Hands out the data received so far without copying it
+    QByteArray takeReceivedData();
+
+signals:
+    void disconnected();
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override;
+    qint64 writeData(const char *data, qint64 maxSize) override;
+
+private:
+    friend class MqttIoUringServer;
+    MqttIoUringSocket(MqttIoUringServer *server, quint64 connectionId);
+
+    void receive(const char *data, int size);
+    void setPeerClosed();
+    void scheduleDelivery();
+    void deliver();
+
+    MqttIoUringServer *m_server;
+    quint64 m_connectionId;
+    QByteArray m_readBuffer;
+    bool m_deliveryScheduled = false;
+    bool m_peerClosed = false;
+};
+
+#endif // MQTTIOURING_P_H
@@ -332,6 +332,48 @@ QByteArray MqttPacket::payload() const
 void MqttPacket::setPayload(const QByteArray &payload)
 {
     d_ptr->payload = payload;
+    d_ptr->payloadCompressed = false;
+}
+
+qint64 MqttPacket::expiry() const
+{
+    return d_ptr->expiry;
+}
+
+void MqttPacket::setExpiry(qint64 expiry)
+{
+    d_ptr->expiry = expiry;
+}
+
+bool MqttPacket::isExpired(qint64 now) const
+{
+    return d_ptr->expiry > 0 && d_ptr->expiry <= now;
+}
+
+bool MqttPacket::isPayloadCompressed() const
+{
+    return d_ptr->payloadCompressed;
+}
+
+void MqttPacket::compressPayload()
+{
+    if (d_ptr->payloadCompressed) {
+        return;
+    }
+    QByteArray compressed = qCompress(d_ptr->payload);
+    if (compressed.size() < d_ptr->payload.size()) {
+        d_ptr->payload = compressed;
+        d_ptr->payloadCompressed = true;
+    }
+}
+
+void MqttPacket::decompressPayload()
+{
+    if (!d_ptr->payloadCompressed) {
+        return;
+    }
+    d_ptr->payload = qUncompress(d_ptr->payload);
+    d_ptr->payloadCompressed = false;
 }
 
 MqttSubscriptions MqttPacket::subscriptions() const
@@ -628,6 +670,22 @@ int MqttPacket::parse(const QByteArray &buffer)
 
 QByteArray MqttPacket::serialize() const
 {
+    return serialize(true);
+}
+
+QByteArray MqttPacket::serializeHeader() const
+{
+    return serialize(false);
+}
+
+QByteArray MqttPacket::serialize(bool includePayload) const
+{
+    if (d_ptr->payloadCompressed) {
+        MqttPacket packet(*this);
+        packet.decompressPayload();
+        return packet.serialize(includePayload);
+    }
+
     QByteArray ret;
     QDataStream stream(&ret, QIODevice::WriteOnly);
     stream << d_ptr->header;
@@ -739,7 +797,9 @@ QByteArray MqttPacket::serialize() const
         if (qos() == Mqtt::QoS1 || qos() == Mqtt::QoS2) {
             stream << d_ptr->packetId;
         }
-        stream.writeRawData(d_ptr->payload.data(), d_ptr->payload.length());
+        if (includePayload) {
+            stream.writeRawData(d_ptr->payload.data(), d_ptr->payload.length());
+        }
         break;
     case TypePuback:
     case TypePubrec:
@@ -809,6 +869,8 @@ MqttPacketPrivate::MqttPacketPrivate(const MqttPacketPrivate &other):
     packetId(other.packetId),
     topic(other.topic),
     payload(other.payload),
+    expiry(other.expiry),
+    payloadCompressed(other.payloadCompressed),
     connectReturnCode(other.connectReturnCode),
     subscriptions(other.subscriptions),
     subscribeReturnCodes(other.subscribeReturnCodes)
@@ -114,6 +114,16 @@ public:
     void setTopic(const QByteArray &topic);
     QByteArray payload() const;
     void setPayload(const QByteArray &payload);
+    // Time the message expires at in ms since the epoch, 0 if it does not expire. This is not sent over the
+    // wire, MQTT 3.1.1 has no message expiry. The server uses it for queued, in-flight and retained messages.
+    qint64 expiry() const;
+    void setExpiry(qint64 expiry);
+    bool isExpired(qint64 now) const;
+    // Keeps the payload zlib compressed while the packet is held in memory, if that makes it smaller. payload()
+    // returns the compressed data then, serialize() and serializeHeader() still use the original payload.
+    bool isPayloadCompressed() const;
+    void compressPayload();
+    void decompressPayload();
     // SUBSCRIBE
     MqttSubscriptions subscriptions() const;
     void setSubscriptions(const MqttSubscriptions &subscriptions);
@@ -129,11 +139,15 @@ public:
     // Returns 0 if input data is ok, but not long enough, bad() will return true
     int parse(const QByteArray &buffer);
     QByteArray serialize() const;
+    // Like serialize(), but leaves out the payload of PUBLISH packets. The payload is expected to be sent right after.
+    QByteArray serializeHeader() const;
 
     bool operator==(const MqttPacket &other) const;
     MqttPacket &operator=(const MqttPacket &other);
 
 private:
+    QByteArray serialize(bool includePayload) const;
+
     QSharedDataPointer<MqttPacketPrivate> d_ptr;
 };
 
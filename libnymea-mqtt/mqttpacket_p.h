@@ -68,6 +68,8 @@ public:
     quint16 packetId = 0;
     QByteArray topic;
     QByteArray payload;
+    qint64 expiry = 0;
+    bool payloadCompressed = false;
 
     Mqtt::ConnectReturnCode connectReturnCode = Mqtt::ConnectReturnCodeAccepted;
 
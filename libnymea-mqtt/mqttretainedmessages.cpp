@@ -0,0 +1,722 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+*
+* Copyright 2013 - 2020, nymea GmbH
+* Contact: contact@nymea.io
+*
+* This file is part of nymea.
+* This project including source code and documentation is protected by copyright law, and
+* remains the property of nymea GmbH. All rights, including reproduction, publication,
+* editing and translation, are reserved. The use of this project is subject to the terms of a
+* license agreement to be concluded with nymea GmbH in accordance with the terms
+* of use of nymea GmbH, available under https://nymea.io/license
+*
+* GNU Lesser General Public License Usage
+* Alternatively, this project may be redistributed and/or modified under the terms of the GNU
+* Lesser General Public License as published by the Free Software Foundation; version 3.
+* this project is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+* without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License along with this project.
+* If not, see <https://www.gnu.org/licenses/>.
+*
+* For any further details and any questions please contact us under contact@nymea.io
+* or see our FAQ/Licensing Information on https://nymea.io/license/faq
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "mqttretainedmessages_p.h"
+#include "mqttserver_p.h"
+
+#include <QDataStream>
+#include <QFileInfo>
+#include <QVector>
+#include <QtEndian>
+
+#include <cstdio>
+
+#ifdef Q_OS_UNIX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static const quint32 snapshotMagic = 0x4e4d5253;
+static const quint32 snapshotVersion = 2;
+static const int snapshotHeaderSize = 12;
+static const int logFrameHeaderSize = 6;
+static const int maximumDecompressedTopics = 16;
+
+static bool syncFile(QFile *file)
+{
+    if (!file->isOpen() || !file->flush()) {
+        return false;
+    }
+#if defined(Q_OS_LINUX)
+    return ::fdatasync(file->handle()) == 0;
+#elif defined(Q_OS_UNIX)
+    return ::fsync(file->handle()) == 0;
+#else
+    return true;
+#endif
+}
+
+// Makes renaming a file within its directory durable
+static bool syncDirectory(const QString &fileName)
+{
+#ifdef Q_OS_UNIX
+    int fd = ::open(QFile::encodeName(QFileInfo(fileName).absolutePath()).constData(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = ::fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+#else
+    Q_UNUSED(fileName)
+    return true;
+#endif
+}
+
+MqttRetainedMessages::~MqttRetainedMessages()
+{
+    if (isPersistent()) {
+        writeSnapshot();
+        unmapSnapshot();
+    }
+}
+
+bool MqttRetainedMessages::open(const QString &fileName)
+{
+    if (isPersistent()) {
+        writeSnapshot();
+        m_logFile.close();
+        unmapSnapshot();
+    }
+    clearEntries();
+    m_fileName = fileName;
+
+    if (QFile::exists(fileName) && !mapSnapshot(true)) {
+        m_fileName.clear();
+        return false;
+    }
+    if (!replayLog()) {
+        unmapSnapshot();
+        clearEntries();
+        m_fileName.clear();
+        return false;
+    }
+    qCDebug(dbgServer) << "Opened retained messages" << fileName << "with" << m_entries.count() << "topics";
+    enforceLimits();
+    return true;
+}
+
+void MqttRetainedMessages::close()
+{
+    if (!isPersistent()) {
+        return;
+    }
+    writeSnapshot();
+    m_logFile.close();
+    // Continue in memory only
+    for (QHash<QString, Entry>::iterator it = m_entries.begin(); it != m_entries.end(); ++it) {
+        if (!it->loaded) {
+            it->packets = load(it.value());
+            compress(&it->packets);
+            it->loaded = true;
+        }
+    }
+    unmapSnapshot();
+    m_fileName.clear();
+}
+
+bool MqttRetainedMessages::isPersistent() const
+{
+    return !m_fileName.isEmpty();
+}
+
+QString MqttRetainedMessages::fileName() const
+{
+    return m_fileName;
+}
+
+int MqttRetainedMessages::count() const
+{
+    return m_entries.count();
+}
+
+QStringList MqttRetainedMessages::topics() const
+{
+    return m_entries.keys();
+}
+
+bool MqttRetainedMessages::contains(const QString &topic) const
+{
+    return m_entries.contains(topic);
+}
+
+MqttPackets MqttRetainedMessages::value(const QString &topic)
+{
+    QHash<QString, Entry>::iterator it = m_entries.find(topic);
+    if (it == m_entries.end()) {
+        return MqttPackets();
+    }
+    if (!it->loaded) {
+        it->packets = load(it.value());
+        compress(&it->packets);
+        it->loaded = true;
+    }
+    touch(topic, &it.value());
+    return decompressed(topic, it->packets);
+}
+
+bool MqttRetainedMessages::insert(const QString &topic, const MqttPacket &packet)
+{
+    Entry entry;
+    entry.packets.append(packet);
+    compress(&entry.packets);
+    entry.bytes = packet.topic().size() + entry.packets.first().payload().size();
+
+    QString quota = quotaFor(topic);
+    qint64 quotaBytes = quota.isNull() ? 0 : m_quotas.value(quota).maximumBytes;
+    if ((m_maximumBytes > 0 && entry.bytes > m_maximumBytes) || (quotaBytes > 0 && entry.bytes > quotaBytes)) {
+        qCWarning(dbgServer) << "Retained message on" << topic << "with" << entry.bytes << "bytes exceeds the limits for retained messages. Not retaining it.";
+        // The previous one is outdated either way
+        remove(topic);
+        return false;
+    }
+
+    removeEntry(topic);
+    addEntry(topic, entry);
+    writeLog(LogRecordInsert, topic, packet);
+    enforceLimits();
+    return true;
+}
+
+void MqttRetainedMessages::remove(const QString &topic)
+{
+    if (removeEntry(topic)) {
+        writeLog(LogRecordRemove, topic);
+    }
+}
+
+qint64 MqttRetainedMessages::maximumBytes() const
+{
+    return m_maximumBytes;
+}
+
+void MqttRetainedMessages::setMaximumBytes(qint64 maximumBytes)
+{
+    m_maximumBytes = qMax<qint64>(0, maximumBytes);
+    enforceLimits();
+}
+
+qint64 MqttRetainedMessages::quota(const QString &topicPrefix) const
+{
+    return m_quotas.value(topicPrefix).maximumBytes;
+}
+
+void MqttRetainedMessages::setQuota(const QString &topicPrefix, qint64 maximumBytes)
+{
+    if (maximumBytes > 0) {
+        m_quotas[topicPrefix].maximumBytes = maximumBytes;
+    } else {
+        m_quotas.remove(topicPrefix);
+    }
+    rebuildQuotas();
+    enforceLimits();
+}
+
+MqttRetainedMessages::EvictionPolicy MqttRetainedMessages::evictionPolicy() const
+{
+    return m_evictionPolicy;
+}
+
+void MqttRetainedMessages::setEvictionPolicy(EvictionPolicy evictionPolicy)
+{
+    m_evictionPolicy = evictionPolicy;
+}
+
+qint64 MqttRetainedMessages::bytes() const
+{
+    return m_bytes;
+}
+
+quint64 MqttRetainedMessages::evictions() const
+{
+    return m_evictions;
+}
+
+int MqttRetainedMessages::compressionThreshold() const
+{
+    return m_compressionThreshold;
+}
+
+void MqttRetainedMessages::setCompressionThreshold(int bytes)
+{
+    // Applies to messages retained from now on
+    m_compressionThreshold = qMax(0, bytes);
+}
+
+bool MqttRetainedMessages::writeSnapshot()
+{
+    if (!isPersistent()) {
+        return false;
+    }
+
+    // In eviction order, so it carries over to the next start
+    QStringList topics = m_order.values();
+    QVector<QByteArray> encodedTopics(topics.count());
+    QVector<QByteArray> loadedData(topics.count());
+    QVector<quint32> offsets(topics.count());
+    QVector<quint32> sizes(topics.count());
+
+    qint64 offset = snapshotHeaderSize;
+    for (int i = 0; i < topics.count(); i++) {
+        encodedTopics[i] = topics.at(i).toUtf8().left(0xffff);
+        offset += 2 + encodedTopics.at(i).size() + 8;
+    }
+    for (int i = 0; i < topics.count(); i++) {
+        const Entry &entry = m_entries[topics.at(i)];
+        // Untouched topics are copied over as they are, unless the mapped snapshot has an older layout
+        if (entry.loaded || m_snapshotVersion != snapshotVersion) {
+            MqttPackets packets = entry.loaded ? entry.packets : load(entry);
+            QByteArray data;
+            uchar field[8];
+            qToBigEndian<quint16>(static_cast<quint16>(packets.count()), field);
+            data.append(reinterpret_cast<const char*>(field), 2);
+            foreach (const MqttPacket &packet, packets) {
+                QByteArray serialized = packet.serialize();
+                qToBigEndian<qint64>(packet.expiry(), field);
+                data.append(reinterpret_cast<const char*>(field), 8);
+                qToBigEndian<quint32>(static_cast<quint32>(serialized.size()), field);
+                data.append(reinterpret_cast<const char*>(field), 4);
+                data.append(serialized);
+            }
+            loadedData[i] = data;
+            sizes[i] = static_cast<quint32>(data.size());
+        } else {
+            sizes[i] = entry.size;
+        }
+        offsets[i] = static_cast<quint32>(offset);
+        offset += sizes.at(i);
+    }
+    if (offset > 0xffffffffLL) {
+        qCWarning(dbgServer) << "Retained messages don't fit into a snapshot.";
+        return false;
+    }
+
+    QString newFileName = m_fileName + QStringLiteral(".new");
+    QFile file(newFileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qCWarning(dbgServer) << "Cannot write retained messages snapshot" << newFileName << file.errorString();
+        return false;
+    }
+
+    QByteArray index(snapshotHeaderSize, 0);
+    uchar *header = reinterpret_cast<uchar*>(index.data());
+    qToBigEndian<quint32>(snapshotMagic, header);
+    qToBigEndian<quint32>(snapshotVersion, header + 4);
+    qToBigEndian<quint32>(static_cast<quint32>(topics.count()), header + 8);
+    for (int i = 0; i < topics.count(); i++) {
+        uchar field[4];
+        qToBigEndian<quint16>(static_cast<quint16>(encodedTopics.at(i).size()), field);
+        index.append(reinterpret_cast<const char*>(field), 2);
+        index.append(encodedTopics.at(i));
+        qToBigEndian<quint32>(offsets.at(i), field);
+        index.append(reinterpret_cast<const char*>(field), 4);
+        qToBigEndian<quint32>(sizes.at(i), field);
+        index.append(reinterpret_cast<const char*>(field), 4);
+    }
+    bool ok = file.write(index) == index.size();
+    for (int i = 0; i < topics.count() && ok; i++) {
+        const Entry &entry = m_entries[topics.at(i)];
+        if (entry.loaded || m_snapshotVersion != snapshotVersion) {
+            ok = file.write(loadedData.at(i)) == loadedData.at(i).size();
+        } else {
+            ok = file.write(reinterpret_cast<const char*>(m_snapshot + entry.offset), entry.size) == entry.size;
+        }
+    }
+    // On disk before it replaces the old snapshot, which the log is truncated for
+    ok = ok && syncFile(&file);
+    file.close();
+
+    // Renaming over the mapped snapshot is fine, the mapping keeps the old file alive until unmapped
+    if (!ok || std::rename(QFile::encodeName(newFileName).constData(), QFile::encodeName(m_fileName).constData()) != 0) {
+        qCWarning(dbgServer) << "Writing retained messages snapshot" << m_fileName << "failed.";
+        QFile::remove(newFileName);
+        return false;
+    }
+
+    unmapSnapshot();
+    for (int i = 0; i < topics.count(); i++) {
+        Entry &entry = m_entries[topics.at(i)];
+        entry.offset = offsets.at(i);
+        entry.size = sizes.at(i);
+    }
+    if (!mapSnapshot(false)) {
+        // Keep serving from memory
+        for (int i = 0; i < topics.count(); i++) {
+            Entry &entry = m_entries[topics.at(i)];
+            entry.loaded = true;
+        }
+    }
+
+    if (!syncDirectory(m_fileName)) {
+        // Replaying the log on top of the new snapshot gives the same state, keep it until the rename is durable
+        qCWarning(dbgServer) << "Syncing the directory of the retained messages snapshot" << m_fileName << "failed. Keeping the log.";
+        return true;
+    }
+    m_logFile.resize(0);
+    m_logFile.seek(0);
+    qCDebug(dbgServer) << "Wrote retained messages snapshot" << m_fileName << "with" << topics.count() << "topics," << offset << "bytes";
+    return true;
+}
+
+bool MqttRetainedMessages::sync()
+{
+    return syncFile(&m_logFile);
+}
+
+bool MqttRetainedMessages::mapSnapshot(bool readIndex)
+{
+    m_snapshotFile.setFileName(m_fileName);
+    if (!m_snapshotFile.open(QIODevice::ReadOnly)) {
+        qCWarning(dbgServer) << "Cannot open retained messages snapshot" << m_fileName << m_snapshotFile.errorString();
+        return false;
+    }
+    m_snapshotSize = m_snapshotFile.size();
+    if (m_snapshotSize < snapshotHeaderSize || m_snapshotSize > 0xffffffffLL) {
+        qCWarning(dbgServer) << "Invalid retained messages snapshot" << m_fileName;
+        unmapSnapshot();
+        return false;
+    }
+    m_snapshot = m_snapshotFile.map(0, m_snapshotSize);
+    if (!m_snapshot) {
+        qCWarning(dbgServer) << "Cannot map retained messages snapshot" << m_fileName << m_snapshotFile.errorString();
+        unmapSnapshot();
+        return false;
+    }
+    m_snapshotVersion = qFromBigEndian<quint32>(m_snapshot + 4);
+    if (qFromBigEndian<quint32>(m_snapshot) != snapshotMagic || m_snapshotVersion < 1 || m_snapshotVersion > snapshotVersion) {
+        qCWarning(dbgServer) << "Unsupported retained messages snapshot" << m_fileName;
+        unmapSnapshot();
+        return false;
+    }
+    if (!readIndex) {
+        return true;
+    }
+
+    quint32 count = qFromBigEndian<quint32>(m_snapshot + 8);
+    qint64 pos = snapshotHeaderSize;
+    for (quint32 i = 0; i < count; i++) {
+        if (pos + 2 > m_snapshotSize) {
+            break;
+        }
+        quint16 topicLength = qFromBigEndian<quint16>(m_snapshot + pos);
+        pos += 2;
+        if (pos + topicLength + 8 > m_snapshotSize) {
+            break;
+        }
+        QString topic = QString::fromUtf8(reinterpret_cast<const char*>(m_snapshot + pos), topicLength);
+        pos += topicLength;
+        Entry entry;
+        entry.offset = qFromBigEndian<quint32>(m_snapshot + pos);
+        entry.size = qFromBigEndian<quint32>(m_snapshot + pos + 4);
+        entry.bytes = topicLength + entry.size;
+        entry.loaded = false;
+        pos += 8;
+        if (static_cast<qint64>(entry.offset) + entry.size > m_snapshotSize) {
+            break;
+        }
+        addEntry(topic, entry);
+    }
+    if (m_entries.count() != static_cast<int>(count)) {
+        qCWarning(dbgServer) << "Retained messages snapshot" << m_fileName << "is corrupt.";
+        unmapSnapshot();
+        clearEntries();
+        return false;
+    }
+    return true;
+}
+
+void MqttRetainedMessages::unmapSnapshot()
+{
+    if (m_snapshot) {
+        m_snapshotFile.unmap(const_cast<uchar*>(m_snapshot));
+        m_snapshot = nullptr;
+    }
+    m_snapshotFile.close();
+    m_snapshotSize = 0;
+    m_snapshotVersion = 0;
+}
+
+MqttPackets MqttRetainedMessages::load(const Entry &entry) const
+{
+    MqttPackets packets;
+    if (!m_snapshot || entry.size < 2) {
+        return packets;
+    }
+    const uchar *data = m_snapshot + entry.offset;
+    quint16 count = qFromBigEndian<quint16>(data);
+    quint32 pos = 2;
+    quint32 expirySize = m_snapshotVersion >= 2 ? 8 : 0;
+    for (int i = 0; i < count; i++) {
+        if (pos + expirySize + 4 > entry.size) {
+            break;
+        }
+        qint64 expiry = expirySize > 0 ? qFromBigEndian<qint64>(data + pos) : 0;
+        pos += expirySize;
+        quint32 length = qFromBigEndian<quint32>(data + pos);
+        pos += 4;
+        if (length > entry.size - pos) {
+            break;
+        }
+        MqttPacket packet;
+        if (packet.parse(QByteArray::fromRawData(reinterpret_cast<const char*>(data + pos), static_cast<int>(length))) > 0) {
+            packet.setExpiry(expiry);
+            packets.append(packet);
+        }
+        pos += length;
+    }
+    return packets;
+}
+
+bool MqttRetainedMessages::replayLog()
+{
+    m_logFile.setFileName(m_fileName + QStringLiteral(".log"));
+    if (!m_logFile.open(QIODevice::ReadWrite)) {
+        qCWarning(dbgServer) << "Cannot open retained messages log" << m_logFile.fileName() << m_logFile.errorString();
+        return false;
+    }
+    QByteArray data = m_logFile.readAll();
+    int records = 0;
+    int offset = 0;
+    while (offset + logFrameHeaderSize <= data.size()) {
+        const uchar *header = reinterpret_cast<const uchar*>(data.constData() + offset);
+        quint32 length = qFromBigEndian<quint32>(header);
+        quint16 checksum = qFromBigEndian<quint16>(header + 4);
+        if (length > static_cast<quint32>(data.size() - offset - logFrameHeaderSize)) {
+            break;
+        }
+        QByteArray record = QByteArray::fromRawData(data.constData() + offset + logFrameHeaderSize, static_cast<int>(length));
+        if (qChecksum(record.constData(), length) != checksum) {
+            break;
+        }
+        offset += logFrameHeaderSize + static_cast<int>(length);
+        records++;
+
+        QDataStream stream(record);
+        quint8 type;
+        QString topic;
+        stream >> type >> topic;
+        if (type == LogRecordRemove) {
+            removeEntry(topic);
+        } else if (type == LogRecordInsert) {
+            QByteArray serialized;
+            stream >> serialized;
+            MqttPacket packet;
+            if (packet.parse(serialized) <= 0) {
+                continue;
+            }
+            if (!stream.atEnd()) {
+                qint64 expiry;
+                stream >> expiry;
+                packet.setExpiry(expiry);
+            }
+            Entry entry;
+            entry.packets.append(packet);
+            compress(&entry.packets);
+            entry.bytes = packet.topic().size() + entry.packets.first().payload().size();
+            removeEntry(topic);
+            addEntry(topic, entry);
+        }
+    }
+    if (offset < data.size()) {
+        qCWarning(dbgServer) << "Discarding" << data.size() - offset << "bytes of incomplete data at the end of" << m_logFile.fileName();
+        m_logFile.resize(offset);
+    }
+    m_logFile.seek(offset);
+    if (records > 0) {
+        qCDebug(dbgServer) << "Replayed" << records << "retained message changes from" << m_logFile.fileName();
+    }
+    return true;
+}
+
+void MqttRetainedMessages::writeLog(LogRecord type, const QString &topic, const MqttPacket &packet)
+{
+    if (!m_logFile.isOpen()) {
+        return;
+    }
+    QByteArray record;
+    QDataStream stream(&record, QIODevice::WriteOnly);
+    stream << static_cast<quint8>(type) << topic;
+    if (type == LogRecordInsert) {
+        stream << packet.serialize();
+        if (packet.expiry() > 0) {
+            stream << packet.expiry();
+        }
+    }
+
+    uchar header[logFrameHeaderSize];
+    qToBigEndian<quint32>(static_cast<quint32>(record.size()), header);
+    qToBigEndian<quint16>(qChecksum(record.constData(), static_cast<uint>(record.size())), header + 4);
+    record.prepend(reinterpret_cast<const char*>(header), logFrameHeaderSize);
+    if (m_logFile.write(record) != record.size() || !m_logFile.flush()) {
+        qCWarning(dbgServer) << "Error writing retained messages log" << m_logFile.fileName() << m_logFile.errorString();
+    }
+
+    if (m_logFile.size() > qMax<qint64>(m_snapshotSize, 64 * 1024)) {
+        writeSnapshot();
+    }
+}
+
+void MqttRetainedMessages::addEntry(const QString &topic, Entry entry)
+{
+    entry.stamp = ++m_clock;
+    entry.quota = quotaFor(topic);
+    m_bytes += entry.bytes;
+    m_order.insert(entry.stamp, topic);
+    if (!entry.quota.isNull()) {
+        Quota &quota = m_quotas[entry.quota];
+        quota.bytes += entry.bytes;
+        quota.order.insert(entry.stamp, topic);
+    }
+    m_entries.insert(topic, entry);
+}
+
+bool MqttRetainedMessages::removeEntry(const QString &topic)
+{
+    QHash<QString, Entry>::iterator it = m_entries.find(topic);
+    if (it == m_entries.end()) {
+        return false;
+    }
+    m_bytes -= it->bytes;
+    m_order.remove(it->stamp);
+    QHash<QString, Quota>::iterator quota = m_quotas.find(it->quota);
+    if (!it->quota.isNull() && quota != m_quotas.end()) {
+        quota->bytes -= it->bytes;
+        quota->order.remove(it->stamp);
+    }
+    m_entries.erase(it);
+    if (m_decompressed.remove(topic) > 0) {
+        m_decompressedOrder.removeOne(topic);
+    }
+    return true;
+}
+
+void MqttRetainedMessages::clearEntries()
+{
+    m_entries.clear();
+    m_decompressed.clear();
+    m_decompressedOrder.clear();
+    m_order.clear();
+    m_bytes = 0;
+    for (QHash<QString, Quota>::iterator it = m_quotas.begin(); it != m_quotas.end(); ++it) {
+        it->bytes = 0;
+        it->order.clear();
+    }
+}
+
+void MqttRetainedMessages::touch(const QString &topic, Entry *entry)
+{
+    if (m_evictionPolicy != EvictLeastRecentlyUsed) {
+        return;
+    }
+    quint64 stamp = ++m_clock;
+    m_order.remove(entry->stamp);
+    m_order.insert(stamp, topic);
+    QHash<QString, Quota>::iterator quota = m_quotas.find(entry->quota);
+    if (!entry->quota.isNull() && quota != m_quotas.end()) {
+        quota->order.remove(entry->stamp);
+        quota->order.insert(stamp, topic);
+    }
+    entry->stamp = stamp;
+}
+
+QString MqttRetainedMessages::quotaFor(const QString &topic) const
+{
+    QString prefix;
+    for (QHash<QString, Quota>::const_iterator it = m_quotas.constBegin(); it != m_quotas.constEnd(); ++it) {
+        if (topic.startsWith(it.key()) && (prefix.isNull() || it.key().length() > prefix.length())) {
+            prefix = it.key();
+        }
+    }
+    return prefix;
+}
+
+void MqttRetainedMessages::rebuildQuotas()
+{
+    for (QHash<QString, Quota>::iterator it = m_quotas.begin(); it != m_quotas.end(); ++it) {
+        it->bytes = 0;
+        it->order.clear();
+    }
+    for (QHash<QString, Entry>::iterator it = m_entries.begin(); it != m_entries.end(); ++it) {
+        it->quota = quotaFor(it.key());
+        if (!it->quota.isNull()) {
+            Quota &quota = m_quotas[it->quota];
+            quota.bytes += it->bytes;
+            quota.order.insert(it->stamp, it.key());
+        }
+    }
+}
+
+void MqttRetainedMessages::enforceLimits()
+{
+    foreach (const QString &prefix, m_quotas.keys()) {
+        forever {
+            QHash<QString, Quota>::const_iterator quota = m_quotas.constFind(prefix);
+            if (quota->bytes <= quota->maximumBytes || quota->order.isEmpty()) {
+                break;
+            }
+            evict(quota->order.first());
+        }
+    }
+    while (m_maximumBytes > 0 && m_bytes > m_maximumBytes && !m_order.isEmpty()) {
+        evict(m_order.first());
+    }
+}
+
+void MqttRetainedMessages::evict(const QString &topic)
+{
+    qCDebug(dbgServer) << "Evicting retained message on" << topic;
+    remove(topic);
+    m_evictions++;
+}
+
+void MqttRetainedMessages::compress(MqttPackets *packets) const
+{
+    if (m_compressionThreshold <= 0) {
+        return;
+    }
+    for (int i = 0; i < packets->count(); i++) {
+        if ((*packets)[i].payload().size() >= m_compressionThreshold) {
+            (*packets)[i].compressPayload();
+        }
+    }
+}
+
+MqttPackets MqttRetainedMessages::decompressed(const QString &topic, const MqttPackets &packets)
+{
+    bool compressed = false;
+    foreach (const MqttPacket &packet, packets) {
+        compressed |= packet.isPayloadCompressed();
+    }
+    if (!compressed) {
+        return packets;
+    }
+    QHash<QString, MqttPackets>::const_iterator it = m_decompressed.constFind(topic);
+    if (it != m_decompressed.constEnd()) {
+        return it.value();
+    }
+
+    MqttPackets plain = packets;
+    for (int i = 0; i < plain.count(); i++) {
+        plain[i].decompressPayload();
+    }
+    m_decompressed.insert(topic, plain);
+    m_decompressedOrder.append(topic);
+    while (m_decompressedOrder.count() > maximumDecompressedTopics) {
+        m_decompressed.remove(m_decompressedOrder.takeFirst());
+    }
+    return plain;
+}
@@ -0,0 +1,158 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+*
+* Copyright 2013 - 2020, nymea GmbH
+* Contact: contact@nymea.io
+*
+* This file is part of nymea.
+* This project including source code and documentation is protected by copyright law, and
+* remains the property of nymea GmbH. All rights, including reproduction, publication,
+* editing and translation, are reserved. The use of this project is subject to the terms of a
+* license agreement to be concluded with nymea GmbH in accordance with the terms
+* of use of nymea GmbH, available under https://nymea.io/license
+*
+* GNU Lesser General Public License Usage
+* Alternatively, this project may be redistributed and/or modified under the terms of the GNU
+* Lesser General Public License as published by the Free Software Foundation; version 3.
+* this project is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+* without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License along with this project.
+* If not, see <https://www.gnu.org/licenses/>.
+*
+* For any further details and any questions please contact us under contact@nymea.io
+* or see our FAQ/Licensing Information on https://nymea.io/license/faq
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef MQTTRETAINEDMESSAGES_P_H
+#define MQTTRETAINEDMESSAGES_P_H
+
+#include <QFile>
+#include <QHash>
+#include <QMap>
+#include <QStringList>
+
+#include "mqttpacket.h"
+
+// The retained messages of a MqttServer, optionally persisted in a file.
+//
+// The file is a snapshot, memory mapped when opening it, and a change log next to it (<file>.log). Opening
+// only reads the topic index of the snapshot, the packets of a topic are parsed from the mapped snapshot
+// when they are requested the first time. Every change is appended to the log, which is folded into a new
+// snapshot once it grows larger than the snapshot itself. Topics never touched are copied over as raw bytes.
+//
+// Snapshot layout: magic, version and topic count (quint32 each, big endian), followed by the index with
+// topic length (quint16), UTF-8 topic, data offset and data size (quint32) per topic, followed by the data.
+// The data of a topic is the packet count (quint16) and for each packet its expiry (qint64, since version 2),
+// length (quint32) and the serialized packet. Topics are written in eviction order.
+//
+// Memory is accounted as topic plus payload size per topic. When the total or the bytes of the topics under a
+// quota prefix exceed their limit, topics are evicted in order of last use or insertion.
+//
+// Payloads at or above the compression threshold are kept compressed in memory and accounted with their
+// compressed size. value() hands out decompressed packets, the most recently requested topics are cached
+// decompressed so fanning out to many subscribers decompresses only once.
+class MqttRetainedMessages
+{
+public:
+    enum EvictionPolicy {
+        EvictLeastRecentlyUsed,
+        EvictOldest
+    };
+
+    MqttRetainedMessages() = default;
+    ~MqttRetainedMessages();
+
+    bool open(const QString &fileName);
+    void close();
+    bool isPersistent() const;
+    QString fileName() const;
+
+    int count() const;
+    QStringList topics() const;
+    bool contains(const QString &topic) const;
+    MqttPackets value(const QString &topic);
+
+    // Replaces the retained message of the topic. Returns false if it exceeds the limits on its own.
+    bool insert(const QString &topic, const MqttPacket &packet);
+    void remove(const QString &topic);
+
+    qint64 maximumBytes() const;
+    void setMaximumBytes(qint64 maximumBytes);
+    qint64 quota(const QString &topicPrefix) const;
+    void setQuota(const QString &topicPrefix, qint64 maximumBytes);
+    EvictionPolicy evictionPolicy() const;
+    void setEvictionPolicy(EvictionPolicy evictionPolicy);
+    qint64 bytes() const;
+    quint64 evictions() const;
+    int compressionThreshold() const;
+    void setCompressionThreshold(int bytes);
+
+    bool writeSnapshot();
+    bool sync();
+
+private:
+    enum LogRecord {
+        LogRecordInsert = 1,
+        LogRecordRemove = 2
+    };
+
+    struct Entry {
+        MqttPackets packets;
+        QString quota;
+        quint64 stamp = 0;
+        qint64 bytes = 0;
+        quint32 offset = 0;
+        quint32 size = 0;
+        bool loaded = true;
+    };
+
+    struct Quota {
+        qint64 maximumBytes = 0;
+        qint64 bytes = 0;
+        QMap<quint64, QString> order;
+    };
+
+    bool mapSnapshot(bool readIndex);
+    void unmapSnapshot();
+    MqttPackets load(const Entry &entry) const;
+    bool replayLog();
+    void writeLog(LogRecord type, const QString &topic, const MqttPacket &packet = MqttPacket());
+
+    void addEntry(const QString &topic, Entry entry);
+    bool removeEntry(const QString &topic);
+    void clearEntries();
+    void touch(const QString &topic, Entry *entry);
+    QString quotaFor(const QString &topic) const;
+    void rebuildQuotas();
+    void enforceLimits();
+    void evict(const QString &topic);
+    void compress(MqttPackets *packets) const;
+    MqttPackets decompressed(const QString &topic, const MqttPackets &packets);
+
+    QHash<QString, Entry> m_entries;
+
+    // Topics by stamp, the first one is evicted first
+    QMap<quint64, QString> m_order;
+    quint64 m_clock = 0;
+    qint64 m_bytes = 0;
+    qint64 m_maximumBytes = 0;
+    QHash<QString, Quota> m_quotas;
+    EvictionPolicy m_evictionPolicy = EvictLeastRecentlyUsed;
+    quint64 m_evictions = 0;
+    int m_compressionThreshold = 0;
+
+    // Decompressed copies of the most recently requested compressed topics, oldest first
+    QHash<QString, MqttPackets> m_decompressed;
+    QStringList m_decompressedOrder;
+
+    QString m_fileName;
+    QFile m_snapshotFile;
+    const uchar *m_snapshot = nullptr;
+    qint64 m_snapshotSize = 0;
+    quint32 m_snapshotVersion = 0;
+    QFile m_logFile;
+};
+
+#endif // MQTTRETAINEDMESSAGES_P_H
@@ -56,11 +56,33 @@
        The \l MqttServer will call the authorizer methods on any incoming connect, publish or subscribe
        packets. This can be used to check any user/policy database and authorize/reject such requests
        for particular clients.
+
+       Checking credentials may take a while, e.g. when deriving a key from the password or asking a
+       directory service. Such authorizers reimplement \l authorizeConnectAsync() instead of blocking in
+       \l authorizeConnect(), the server keeps serving the other clients meanwhile.
+*/
+
+/*!
+       \class MqttConnectAuthorization
+       \brief The pending result of an asynchronous connect authorization
+       \inmodule nymea-mqtt
+       \ingroup mqtt
+
+       Returned by \l MqttAuthorizer::authorizeConnectAsync(). The authorizer calls \l complete() once the
+       decision is made, from any thread. The server takes ownership and deletes the object after it has been
+       completed, also if the client went away or timed out before. Every authorization must be completed
+       eventually.
 */
 
 
 #include "mqttserver.h"
 #include "mqttserver_p.h"
+#include "mqttinprocesschannel_p.h"
+#include "mqttiouring_p.h"
+#include "mqtthandover_p.h"
+#include "mqttsessionstore.h"
+#include "mqttcluster_p.h"
+#include "mqttbroker_p.h"
 #include "mqttpacket.h"
 
 #include <QDebug>
@@ -68,20 +90,74 @@
 #include <QUuid>
 #include <QtGlobal>
 #include <QRegExp>
+#include <QDateTime>
+
+#ifdef Q_OS_UNIX
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <string.h>
+#endif
 
 Q_LOGGING_CATEGORY(dbgServer, "nymea.mqtt.server")
 
 MqttServerPrivate::MqttServerPrivate(MqttServer *q):
     QObject(q),
-    q_ptr(q)
+    q_ptr(q),
+    sessionExpiries(1000)
 {
     qRegisterMetaType<Mqtt::QoS>();
+
+    connectionTimeouts.setExpiryHandler([this](const QList<QIODevice*> &clients) {
+        onConnectionsTimedOut(clients);
+    });
+    sessionExpiries.setExpiryHandler([this](const QList<QString> &clientIds) {
+        onSessionsExpired(clientIds);
+    });
+    retransmissions.setExpiryHandler([this](const QList<QIODevice*> &clients) {
+        onRetransmissionsDue(clients);
+    });
+
+    admissionClock.start();
+    connect(&connectQueueTimer, &QTimer::timeout, this, &MqttServerPrivate::processQueuedConnects);
+
+    groupCommitTimer.setSingleShot(true);
+    connect(&groupCommitTimer, &QTimer::timeout, this, &MqttServerPrivate::commitAcknowledgements);
+
+    expirySweepTimer.setInterval(5000);
+    connect(&expirySweepTimer, &QTimer::timeout, this, &MqttServerPrivate::sweepExpiredMessages);
+
+    uptime.start();
+    connect(&statisticsTimer, &QTimer::timeout, this, &MqttServerPrivate::publishStatistics);
 }
 
-QHash<QString, quint16> MqttServerPrivate::publish(const QString &topic, const QByteArray &payload)
+MqttServerPrivate::~MqttServerPrivate()
 {
-    QHash<QTcpSocket*, Mqtt::QoS> receivers;
-    foreach (QTcpSocket *c, clientList.keys()) {
+    foreach (QIODevice *client, pendingAuthorizations.keys()) {
+        dropPendingAuthorization(client);
+    }
+    if (broker) {
+        broker->detach(this);
+    }
+}
+
+QHash<QString, quint16> MqttServerPrivate::route(const QString &topic, const QByteArray &payload, qint64 expiry)
+{
+    if (!broker) {
+        return publish(topic, payload, expiry);
+    }
+    QHash<QString, quint16> packets;
+    foreach (MqttServerPrivate *server, broker->servers) {
+        packets.unite(server->publish(topic, payload, expiry));
+    }
+    return packets;
+}
+
+QHash<QString, quint16> MqttServerPrivate::publish(const QString &topic, const QByteArray &payload, qint64 expiry)
+{
+    QHash<QIODevice*, Mqtt::QoS> receivers;
+    foreach (QIODevice *c, clientList.keys()) {
         foreach (const MqttSubscription &subscription, clientList.value(c)->subscriptions) {
             if (matchTopic(subscription.topicFilter(), topic)) {
                 if (!receivers.contains(c) || receivers.value(c) < subscription.qoS()) {
@@ -92,29 +168,93 @@ QHash<QString, quint16> MqttServerPrivate::publish(const QString &topic, const Q
     }
 
     QHash<QString, quint16> packets;
-    foreach (QTcpSocket *receiver, receivers.keys()) {
+    foreach (QIODevice *receiver, receivers.keys()) {
         ClientContext *ctx = clientList.value(receiver);
         qCDebug(dbgServer) << "Relaying packet to subscribed client:" << ctx->clientId;
-        Mqtt::QoS qos = receivers.value(receiver);
-        MqttPacket packet(MqttPacket::TypePublish, qos >= Mqtt::QoS0 ? newPacketId(ctx) : 0, qos);
-        packet.setTopic(topic.toUtf8());
-        packet.setPayload(payload);
-        receiver->write(packet.serialize());
+        MqttPacket packet = deliverMessage(receiver, ctx, topic, payload, receivers.value(receiver), expiry);
+        if (packet.type() != MqttPacket::TypePublish) {
+            continue;
+        }
         packets.insert(ctx->clientId, packet.packetId());
         if (packet.qos() == Mqtt::QoS0) {
             QString clientId = ctx->clientId;
             QTimer::singleShot(0, this, [this, clientId, packet](){
                 emit q_ptr->published(clientId, packet.packetId(), packet.topic(), packet.payload());
             });
-        } else {
-            ClientContext *ctx = clientList.value(receiver);
-            ctx->unackedPackets.insert(packet.packetId(), packet);
-            ctx->unackedPacketList.append(packet.packetId());
+        }
+    }
+
+    foreach (ClientContext *ctx, offlineSessions) {
+        bool matching = false;
+        Mqtt::QoS qos = Mqtt::QoS0;
+        foreach (const MqttSubscription &subscription, ctx->subscriptions) {
+            if (matchTopic(subscription.topicFilter(), topic)) {
+                matching = true;
+                qos = qMax(qos, subscription.qoS());
+            }
+        }
+        // QoS 0 messages are not queued for offline clients
+        if (matching && qos >= Mqtt::QoS1) {
+            queueMessage(ctx, topic, payload, qos, expiry);
         }
     }
     return packets;
 }
 
+MqttConnectAuthorization::MqttConnectAuthorization(QObject *parent):
+    QObject(parent)
+{
+}
+
+bool MqttConnectAuthorization::isFinished() const
+{
+    return m_state.loadAcquire() == 2;
+}
+
+Mqtt::ConnectReturnCode MqttConnectAuthorization::returnCode() const
+{
+    return static_cast<Mqtt::ConnectReturnCode>(m_returnCode.loadAcquire());
+}
+
+/*!
+ * \brief Completes the authorization with \a returnCode, Mqtt::ConnectReturnCodeAccepted lets the client
+ * connect. This method is thread-safe, only the first call has an effect. The authorization is finished, and
+ * finished() emitted, from the event loop of the thread it lives in, so it must not be touched after calling this
+ * from another thread.
+ */
+void MqttConnectAuthorization::complete(Mqtt::ConnectReturnCode returnCode)
+{
+    if (!m_state.testAndSetOrdered(0, 1)) {
+        return;
+    }
+    m_returnCode.storeRelease(returnCode);
+    QMetaObject::invokeMethod(this, "finish", Qt::QueuedConnection);
+}
+
+void MqttConnectAuthorization::finish()
+{
+    m_state.storeRelease(2);
+    emit finished();
+}
+
+/*!
+ * \brief Starts authorizing a client without blocking the server. Returns an authorization to be completed
+ * later, from any thread. Until then the server holds back further input from the client, see
+ * MqttServer::setAuthorizationTimeout() and MqttServer::setMaximumPendingAuthorizations() for the limits.
+ *
+ * The parameters are the same as for authorizeConnect(), which the server calls instead if this returns
+ * nullptr. That's what the default implementation does.
+ */
+MqttConnectAuthorization *MqttAuthorizer::authorizeConnectAsync(int serverAddressId, const QString &clientId, const QString &username, const QString &password, const QHostAddress &peerAddress)
+{
+    Q_UNUSED(serverAddressId)
+    Q_UNUSED(clientId)
+    Q_UNUSED(username)
+    Q_UNUSED(password)
+    Q_UNUSED(peerAddress)
+    return nullptr;
+}
+
 MqttServer::MqttServer(QObject *parent):
     QObject(parent),
     d_ptr(new MqttServerPrivate(this))
@@ -132,314 +272,2348 @@ void MqttServer::setMaximumSubscriptionsQoS(Mqtt::QoS maximumSubscriptionQoS)
     d_ptr->maximumSubscriptionQoS = maximumSubscriptionQoS;
 }
 
-void MqttServer::setAuthorizer(MqttAuthorizer *authorizer)
+int MqttServer::maximumConcurrentHandshakes() const
 {
-    d_ptr->authorizer = authorizer;
+    return d_ptr->maximumConcurrentHandshakes;
 }
 
-int MqttServer::listen(const QHostAddress &address, quint16 port, const QSslConfiguration &sslConfiguration)
+void MqttServer::setMaximumConcurrentHandshakes(int maximumConcurrentHandshakes)
 {
-    SslServer *server = new SslServer(sslConfiguration, this);
-    connect(server, &SslServer::clientConnected, d_ptr, &MqttServerPrivate::onClientConnected);
-    connect(server, &SslServer::clientDisconnected, d_ptr, &MqttServerPrivate::onClientDisconnected);
-    connect(server, &SslServer::dataAvailable, d_ptr, &MqttServerPrivate::onDataAvailable);
+    d_ptr->maximumConcurrentHandshakes = maximumConcurrentHandshakes;
+    d_ptr->updateAccepting();
+}
 
-    if (!server->listen(address, port)) {
-        qCWarning(dbgServer) << "Error listening on port" << port;
-        server->deleteLater();
-        return -1;
-    }
-    static int addressId = -1;
-    d_ptr->servers.insert(++addressId, server);
-    qCDebug(dbgServer) << "nymea MQTT server running on" << address.toString() << ":" << port << "( Address ID" << addressId << ")";
-    return addressId;
+void MqttServer::setConnectRateLimit(int connectsPerSecond, int burst)
+{
+    d_ptr->connectRate = connectsPerSecond;
+    d_ptr->connectBurst = burst > 0 ? burst : qMax(1, connectsPerSecond);
+    d_ptr->listenerConnectBuckets.clear();
 }
 
-bool MqttServer::isListening(const QHostAddress &address, quint16 port) const
+void MqttServer::setConnectRateLimitPerAddress(int connectsPerSecond, int burst)
 {
-    foreach (SslServer *server, d_ptr->servers) {
-        if (server->serverAddress() == address && server->serverPort() == port && server->isListening()) {
-            return true;
+    d_ptr->addressConnectRate = connectsPerSecond;
+    d_ptr->addressConnectBurst = burst > 0 ? burst : qMax(1, connectsPerSecond);
+    d_ptr->addressConnectBuckets.clear();
+}
+
+int MqttServer::maximumQueuedConnects() const
+{
+    return d_ptr->maximumQueuedConnects;
+}
+
+void MqttServer::setMaximumQueuedConnects(int maximumQueuedConnects)
+{
+    d_ptr->maximumQueuedConnects = maximumQueuedConnects;
+}
+
+/*!
+ * \brief Returns the number of seconds persistent sessions are kept after their client disconnected.
+ * \sa setSessionExpiryInterval()
+ */
+int MqttServer::sessionExpiryInterval() const
+{
+    return d_ptr->sessionExpiryInterval;
+}
+
+/*!
+ * \brief Keeps the sessions of clients connecting without the clean session flag for \a seconds after they disconnected.
+ *
+ * While a session is offline, QoS 1 and QoS 2 messages matching its subscriptions are queued and delivered in order
+ * once the client reconnects without the clean session flag. Subscriptions of offline sessions are reported as
+ * unsubscribed only when the session expires. Setting this to 0 drops all offline sessions and restores the default
+ * behavior of discarding sessions on disconnect.
+ */
+void MqttServer::setSessionExpiryInterval(int seconds)
+{
+    d_ptr->sessionExpiryInterval = qMax(0, seconds);
+    if (d_ptr->sessionExpiryInterval == 0) {
+        foreach (const QString &clientId, d_ptr->offlineSessions.keys()) {
+            d_ptr->sessionExpiries.remove(clientId);
+            d_ptr->discardSession(d_ptr->offlineSessions.take(clientId));
         }
     }
-    return false;
 }
 
-QList<int> MqttServer::listeningAddressIds() const
+int MqttServer::maximumInflightMessages(int addressId) const
 {
-    return d_ptr->servers.keys();
+    return d_ptr->listenerMaximumInflightMessages.value(addressId, d_ptr->maximumInflightMessages);
 }
 
-void MqttServer::close(int interfaceId)
+/*!
+ * \brief Limits the number of unacknowledged QoS 1 and 2 messages sent to a client to \a maximumInflightMessages.
+ *
+ * Messages beyond the window wait in the message queue of the client, which is bounded by the same limits as the
+ * queue of offline sessions, see setMaximumOfflineQueueCount(). Each PUBACK or PUBCOMP releases the next queued
+ * message. This bounds the memory held by slow subscribers and keeps them from filling their socket buffers.
+ * With an \a addressId the limit applies to clients connecting on that listener only, -1 sets the default for all
+ * listeners. 0 disables the limit. Changes take effect for clients connecting afterwards.
+ */
+void MqttServer::setMaximumInflightMessages(int maximumInflightMessages, int addressId)
 {
-    if (!d_ptr->servers.contains(interfaceId)) {
-        qCWarning(dbgServer) << "No such server address ID" << interfaceId;
-        return;
+    if (addressId < 0) {
+        d_ptr->maximumInflightMessages = maximumInflightMessages;
+    } else {
+        d_ptr->listenerMaximumInflightMessages.insert(addressId, maximumInflightMessages);
     }
-    SslServer *server = d_ptr->servers.take(interfaceId);
-    while (!d_ptr->clientServerMap.keys(server).isEmpty()) {
-        d_ptr->cleanupClient(d_ptr->clientServerMap.keys(server).first());
+}
+
+int MqttServer::maximumRetransmissions() const
+{
+    return d_ptr->maximumRetransmissions;
+}
+
+/*!
+ * \brief Resends QoS 1 and 2 messages a client did not acknowledge up to \a maximumRetransmissions times.
+ *
+ * The timeout follows the acknowledgement round trip time measured for each client, smoothed as in RFC 6298, and
+ * lies between 1 and 60 seconds. It doubles with every retransmission until a packet gets acknowledged that was
+ * sent only once. Acknowledgements of retransmitted packets are not used for measuring as they are ambiguous. A
+ * client still not acknowledging a message after the last retransmission is dropped, a persistent session keeps
+ * the message for when it reconnects. 0 disables retransmissions on open connections.
+ */
+void MqttServer::setMaximumRetransmissions(int maximumRetransmissions)
+{
+    d_ptr->maximumRetransmissions = qMax(0, maximumRetransmissions);
+}
+
+int MqttServer::messageExpiryInterval(const QString &topic) const
+{
+    return d_ptr->expiryInterval(topic);
+}
+
+/*!
+ * \brief Lets messages on topics starting with \a topicPrefix expire after \a seconds.
+ *
+ * MQTT 3.1.1 publishers can't give an expiry for their messages, this sets one for them. Messages which are
+ * expired are not delivered anymore. They are dropped from message queues, from the packets waiting for an
+ * acknowledgement and from the retained messages, lazily when they would be delivered and by a sweep every few
+ * seconds. If several prefixes match a topic, the longest one applies. 0 removes the default for \a topicPrefix.
+ */
+void MqttServer::setMessageExpiryInterval(const QString &topicPrefix, int seconds)
+{
+    if (seconds > 0) {
+        d_ptr->messageExpiryIntervals.insert(topicPrefix, seconds);
+        d_ptr->expirySweepTimer.start();
+    } else {
+        d_ptr->messageExpiryIntervals.remove(topicPrefix);
     }
-    server->close();
-    server->deleteLater();
 }
 
-QStringList MqttServer::clients() const
+int MqttServer::maximumOfflineQueueCount() const
 {
-    QStringList clientIds;
-    foreach (ClientContext *ctx, d_ptr->clientList) {
-        clientIds << ctx->clientId;
+    return d_ptr->maximumOfflineQueueCount;
+}
+
+/*!
+ * \brief Limits the number of messages queued for each session, offline or waiting for a free in-flight slot.
+ * The oldest messages are dropped first.
+ */
+void MqttServer::setMaximumOfflineQueueCount(int maximumOfflineQueueCount)
+{
+    d_ptr->maximumOfflineQueueCount = maximumOfflineQueueCount;
+}
+
+qint64 MqttServer::maximumOfflineQueueBytes() const
+{
+    return d_ptr->maximumOfflineQueueBytes;
+}
+
+/*!
+ * \brief Limits the total size of topics and payloads queued for each session. The oldest messages are dropped first.
+ */
+void MqttServer::setMaximumOfflineQueueBytes(qint64 maximumOfflineQueueBytes)
+{
+    d_ptr->maximumOfflineQueueBytes = maximumOfflineQueueBytes;
+}
+
+/*!
+ * \brief Persists the sessions of clients connecting without the clean session flag in \a sessionStore.
+ *
+ * All sessions found in the store are restored immediately as offline sessions, see setSessionExpiryInterval().
+ * Without a session expiry interval they are discarded, so set the interval before setting the store. Their
+ * subscriptions are announced with clientSubscribed(). The store must outlive the server.
+ */
+void MqttServer::setSessionStore(MqttSessionStore *sessionStore)
+{
+    d_ptr->sessionStore = sessionStore;
+    if (sessionStore) {
+        d_ptr->restoreStoredSessions();
     }
-    return clientIds;
 }
 
-void MqttServer::disconnectClient(const QString &clientId)
+bool MqttServer::durableAcknowledgements() const
 {
-    foreach (ClientContext *ctx, d_ptr->clientList) {
-        if (ctx->clientId == clientId) {
-            d_ptr->cleanupClient(d_ptr->clientList.key(ctx));
-            return;
-        }
+    return d_ptr->durableAcknowledgements;
+}
+
+/*!
+ * \brief Enables durable acknowledgements.
+ *
+ * By default QoS 1 and 2 messages are acknowledged right away, changes to the session store and the retained
+ * messages file may still be in the page cache at that point. With durable acknowledgements, PUBACK and PUBREC
+ * are held back until the changes caused by the message are synced to disk. Syncing per message would limit
+ * throughput to the sync rate of the disk, so acknowledgements are collected and committed as a group, see
+ * setGroupCommit(). This trades latency for throughput: every acknowledgement is delayed by up to the group
+ * commit interval.
+ *
+ * If syncing fails, the clients waiting for acknowledgements are disconnected without them. They keep the
+ * messages and retransmit them once they reconnected.
+ */
+void MqttServer::setDurableAcknowledgements(bool durableAcknowledgements)
+{
+    d_ptr->durableAcknowledgements = durableAcknowledgements;
+    if (!durableAcknowledgements) {
+        d_ptr->commitAcknowledgements();
     }
 }
 
-QHash<QString, quint16> MqttServer::publish(const QString &topic, const QByteArray &payload)
+int MqttServer::groupCommitInterval() const
 {
-    return d_ptr->publish(topic, payload);
+    return d_ptr->groupCommitInterval;
 }
 
-void MqttServerPrivate::onClientConnected(QSslSocket *client)
+int MqttServer::groupCommitBatchSize() const
 {
-    SslServer *server = static_cast<SslServer*>(sender());
+    return d_ptr->groupCommitBatchSize;
+}
 
-    // Start a 10 second timer to clean up the connection if we don't get data until then.
-    QTimer *timeoutTimer = new QTimer(this);
-    connect(timeoutTimer, &QTimer::timeout, client, [this, client]() {
-        qCWarning(dbgServer) << "A client connected but did not send data in 10 seconds. Dropping connection.";
-        client->abort();
-        pendingConnections.take(client)->deleteLater();
-        client->deleteLater();
-    });
-    timeoutTimer->start(10000);
-    clientServerMap.insert(client, server);
-    pendingConnections.insert(client, timeoutTimer);
+/*!
+ * \brief Commits held acknowledgements \a interval milliseconds after the first one was held back, or as soon
+ * as \a batchSize acknowledgements are waiting. An interval of 0 commits once the event loop is idle, a batch
+ * size of 0 disables the limit. Defaults to 5 ms and 64 acknowledgements.
+ */
+void MqttServer::setGroupCommit(int interval, int batchSize)
+{
+    d_ptr->groupCommitInterval = qMax(0, interval);
+    d_ptr->groupCommitBatchSize = qMax(0, batchSize);
 }
 
-void MqttServerPrivate::onDataAvailable(QSslSocket *client, const QByteArray &data)
+/*!
+ * \brief Returns the file retained messages are persisted in, or an empty string if they're kept in memory only.
+ */
+QString MqttServer::retainedMessagesFile() const
 {
-    clientBuffers[client].append(data);
+    return d_ptr->retainedMessages->fileName();
+}
 
-    do {
-        MqttPacket packet;
-        int ret = packet.parse(clientBuffers[client]);
-        if (ret == 0) {
-            qCDebug(dbgServer) << "Packet too short... Waiting for more...";
-            return;
-        }
+/*!
+ * \brief Persists retained messages in \a fileName so they survive a restart.
+ *
+ * The file is a snapshot which is memory mapped on startup, changes are appended to a log next to it
+ * (\a fileName with the suffix ".log") and folded into the snapshot from time to time and when the server
+ * is destroyed. Retained messages are only parsed from the snapshot when a subscription needs them, so
+ * startup time doesn't depend on the number of retained messages. The retained messages held so far are
+ * replaced by the ones stored in the file, so call this before listening. An empty \a fileName stops
+ * persisting and keeps the current retained messages in memory only.
+ *
+ * Returns false if the file can't be opened or is corrupt. Retained messages are kept in memory only then.
+ */
+bool MqttServer::setRetainedMessagesFile(const QString &fileName)
+{
+    if (fileName.isEmpty()) {
+        d_ptr->retainedMessages->close();
+        return true;
+    }
+    return d_ptr->retainedMessages->open(fileName);
+}
 
-        // Ok, we've got a full packet (or garbage data). If this client is still pending
-        // we can stop the timer, the protocol will take it from here.
-        if (pendingConnections.contains(client)) {
-            pendingConnections.take(client)->deleteLater();
-        }
+qint64 MqttServer::maximumRetainedBytes() const
+{
+    return d_ptr->retainedMessages->maximumBytes();
+}
 
-        if (ret == -1) {
-            qCWarning(dbgServer) << "Bad MQTT packet data, Dropping connection" << packet.serialize().toHex();
-            cleanupClient(client);
-            return;
-        }
+/*!
+ * \brief Limits the memory used by retained messages to \a maximumBytes, counting topic and payload sizes.
+ *
+ * When exceeded, retained messages are evicted according to the retainedEvictionPolicy(). A single retained
+ * message exceeding the limit on its own is not retained at all. 0 (the default) disables the limit.
+ */
+void MqttServer::setMaximumRetainedBytes(qint64 maximumBytes)
+{
+    d_ptr->retainedMessages->setMaximumBytes(maximumBytes);
+}
+
+qint64 MqttServer::retainedQuota(const QString &topicPrefix) const
+{
+    return d_ptr->retainedMessages->quota(topicPrefix);
+}
+
+/*!
+ * \brief Limits the memory used by retained messages on topics starting with \a topicPrefix to \a maximumBytes.
+ *
+ * Use it to keep a single device or tenant from taking up the whole budget for retained messages. When exceeded,
+ * retained messages under the prefix are evicted. If several prefixes match a topic, the longest one applies. 0
+ * removes the quota.
+ */
+void MqttServer::setRetainedQuota(const QString &topicPrefix, qint64 maximumBytes)
+{
+    d_ptr->retainedMessages->setQuota(topicPrefix, maximumBytes);
+}
+
+MqttServer::RetainedEvictionPolicy MqttServer::retainedEvictionPolicy() const
+{
+    return static_cast<RetainedEvictionPolicy>(d_ptr->retainedMessages->evictionPolicy());
+}
 
-        clientBuffers[client].remove(0, ret);
+/*!
+ * \brief Sets which retained messages are evicted first when a limit is exceeded: the ones not delivered for the
+ * longest time (the default) or the ones set first.
+ */
+void MqttServer::setRetainedEvictionPolicy(RetainedEvictionPolicy policy)
+{
+    d_ptr->retainedMessages->setEvictionPolicy(static_cast<MqttRetainedMessages::EvictionPolicy>(policy));
+}
 
-        processPacket(packet, client);
+int MqttServer::retainedMessageCount() const
+{
+    return d_ptr->retainedMessages->count();
+}
 
-    } while (!clientBuffers.value(client).isEmpty());
+qint64 MqttServer::retainedBytes() const
+{
+    return d_ptr->retainedMessages->bytes();
 }
 
-void MqttServerPrivate::onClientDisconnected(QSslSocket *client)
+quint64 MqttServer::retainedEvictions() const
 {
-    cleanupClient(client);
+    return d_ptr->retainedMessages->evictions();
 }
 
-void MqttServerPrivate::cleanupClient(QTcpSocket *client)
+int MqttServer::payloadCompressionThreshold() const
 {
-    if (clientBuffers.contains(client)) {
-        clientBuffers.remove(client);
+    return d_ptr->payloadCompressionThreshold;
+}
+
+/*!
+ * \brief Keeps payloads of retained messages and of messages queued for offline sessions compressed in memory
+ * if they are at least \a bytes large. They are decompressed when delivered, a retained message is decompressed
+ * once for all subscribers receiving it. Payloads which don't get smaller are kept as they are. Persisted data
+ * and the messages sent on the network are not affected. 0, the default, disables the compression.
+ */
+void MqttServer::setPayloadCompressionThreshold(int bytes)
+{
+    d_ptr->payloadCompressionThreshold = qMax(0, bytes);
+    d_ptr->retainedMessages->setCompressionThreshold(d_ptr->payloadCompressionThreshold);
+}
+
+void MqttServer::setAuthorizer(MqttAuthorizer *authorizer)
+{
+    d_ptr->authorizer = authorizer;
+    invalidateAuthorizationCache();
+}
+
+int MqttServer::authorizationCacheSize() const
+{
+    return d_ptr->authorizationCacheSize;
+}
+
+/*!
+ * \brief Caches the results of MqttAuthorizer::authorizePublish() and MqttAuthorizer::authorizeSubscribe() for
+ * up to \a entries topics and topic filters in each session, so the authorizer is asked once per topic instead
+ * of for every message. A full cache starts over. Cached decisions are dropped when the client connects again.
+ *
+ * The server can't know when the policies of the authorizer change, call invalidateAuthorizationCache() then.
+ * 0, the default, disables the cache.
+ */
+void MqttServer::setAuthorizationCacheSize(int entries)
+{
+    d_ptr->authorizationCacheSize = qMax(0, entries);
+    invalidateAuthorizationCache();
+}
+
+/*!
+ * \brief Drops all cached authorizer decisions, e.g. after the policies of the authorizer changed.
+ */
+void MqttServer::invalidateAuthorizationCache()
+{
+    foreach (ClientContext *ctx, d_ptr->clientList) {
+        MqttServerPrivate::clearAuthorizations(ctx);
     }
-    if (clientServerMap.contains(client)) {
-        clientServerMap.remove(client);
+}
+
+/*!
+ * \brief Drops the cached authorizer decisions for the client with the ID \a clientId, e.g. after its
+ * permissions changed.
+ */
+void MqttServer::invalidateAuthorizationCache(const QString &clientId)
+{
+    foreach (ClientContext *ctx, d_ptr->clientList) {
+        if (ctx->clientId == clientId) {
+            MqttServerPrivate::clearAuthorizations(ctx);
+        }
+    }
+}
+
+MqttAccessControl MqttServer::accessControl() const
+{
+    return d_ptr->accessControl;
+}
+
+/*!
+ * \brief Checks publish and subscribe requests against the rules in \a accessControl, see MqttAccessControl.
+ * The rules are compiled for each client when it connects, the connected clients get the new rules right away.
+ * Requests denied by the rules are not passed on to the authorizer. Empty rules disable the access control,
+ * which is the default.
+ */
+void MqttServer::setAccessControl(const MqttAccessControl &accessControl)
+{
+    d_ptr->accessControl = accessControl;
+    foreach (ClientContext *ctx, d_ptr->clientList) {
+        d_ptr->compilePermissions(ctx);
     }
-    if (pendingConnections.contains(client)) {
-        delete pendingConnections.take(client);
+}
+
+int MqttServer::statisticsInterval() const
+{
+    return d_ptr->statisticsTimer.isActive() ? d_ptr->statisticsTimer.interval() / 1000 : 0;
+}
+
+/*!
+ * \brief Publishes statistics of the server every \a seconds seconds below $SYS/broker/, 0 stops it, which is
+ * the default. Clients receive them by subscribing to e.g. $SYS/broker/#, wildcards at the first level don't
+ * match $SYS topics.
+ *
+ * Published are the numbers of connected clients (clients/connected), offline sessions (clients/disconnected)
+ * and subscriptions (subscriptions/count), the retained messages (retained messages/count and
+ * retained messages/bytes), the messages waiting for an acknowledgement (messages/inflight) or in a session
+ * queue (messages/queued) and the uptime in seconds (uptime). Since the start of the server, PUBLISH messages
+ * received from and sent to clients are counted (messages/received, messages/sent), as well as bytes received
+ * and sent (bytes/received, bytes/sent) and the messages dropped from full or expired queues (messages/dropped).
+ * The load/ topics give the messages and bytes per second since the last time the statistics were published.
+ *
+ * The counters are always maintained, they cost an increment each.
+ */
+void MqttServer::setStatisticsInterval(int seconds)
+{
+    if (seconds <= 0) {
+        d_ptr->statisticsTimer.stop();
+        return;
     }
-    if (clientList.contains(client)) {
-        ClientContext *ctx = clientList.value(client);
-        qCDebug(dbgServer) << "Client" << ctx->clientId << "disconnected.";
-        ctx->keepAliveTimer.stop();
+    d_ptr->previousStatistics = d_ptr->statistics;
+    d_ptr->statisticsClock.start();
+    d_ptr->statisticsTimer.start(seconds * 1000);
+}
 
-        if (!ctx->willTopic.isEmpty()) {
-            qCDebug(dbgServer) << "Publishing will message for client" << ctx->clientId << "on topic" << ctx->willTopic << "( Retain:" << ctx->willRetain << ")";
-            MqttPacket willPacket(MqttPacket::TypePublish, ctx->willQoS >= Mqtt::QoS1 ? newPacketId(ctx) : 0, ctx->willQoS, ctx->willRetain);
-            willPacket.setTopic(ctx->willTopic);
-            willPacket.setPayload(ctx->willMessage);
-            processPacket(willPacket, client);
-        }
+int MqttServer::authorizationTimeout() const
+{
+    return d_ptr->authorizationTimeout;
+}
 
-        while (!ctx->subscriptions.isEmpty()) {
-            emit q_ptr->clientUnsubscribed(ctx->clientId, ctx->subscriptions.takeFirst().topicFilter());
-        }
+/*!
+ * \brief Rejects clients with Mqtt::ConnectReturnCodeServerUnavailable if their asynchronous authorization is
+ * not completed within \a timeout milliseconds. The default is 10 seconds, 0 waits forever.
+ */
+void MqttServer::setAuthorizationTimeout(int timeout)
+{
+    d_ptr->authorizationTimeout = qMax(0, timeout);
+}
+
+int MqttServer::maximumPendingAuthorizations() const
+{
+    return d_ptr->maximumPendingAuthorizations;
+}
+
+/*!
+ * \brief Rejects new clients with Mqtt::ConnectReturnCodeServerUnavailable while \a maximumPendingAuthorizations
+ * asynchronous authorizations are pending, without asking the authorizer. The default is 100, 0 disables the
+ * limit. Pending authorizations also count as handshakes for setMaximumConcurrentHandshakes().
+ */
+void MqttServer::setMaximumPendingAuthorizations(int maximumPendingAuthorizations)
+{
+    d_ptr->maximumPendingAuthorizations = qMax(0, maximumPendingAuthorizations);
+}
+
+bool MqttServer::reusePort() const
+{
+    return d_ptr->reusePort;
+}
+
+/*!
+ * \brief Sets SO_REUSEPORT on the sockets created by listen() from now on. Several processes, e.g. the nodes of a
+ * cluster (see joinCluster()), can then listen on the same address and port and the kernel distributes incoming
+ * connections among them. Only supported on Linux and other systems providing SO_REUSEPORT.
+ */
+void MqttServer::setReusePort(bool reusePort)
+{
+    d_ptr->reusePort = reusePort;
+}
+
+MqttServer::Transport MqttServer::transport() const
+{
+    return d_ptr->transport;
+}
+
+/*!
+ * \brief Sets the \a transport used by plain TCP listeners created by listen() from now on.
+ *
+ * With TransportIoUring, a listener accepts its connections and receives and sends their data through an io_uring
+ * instance on Linux. Incoming data is picked up without a readiness notification and a system call per socket, and
+ * the data written to all connections during an event loop iteration is sent with a single system call. Requires
+ * Linux 5.19 or newer. If it is not available, listen() falls back to the Qt sockets with a warning, see
+ * isTransportAvailable(). TLS listeners always use the Qt sockets. Plain TCP listeners taken over with
+ * receiveHandover() use the transport set when calling it.
+ */
+void MqttServer::setTransport(Transport transport)
+{
+    d_ptr->transport = transport;
+}
+
+/*!
+ * \brief Returns whether \a transport can be used on this system.
+ */
+bool MqttServer::isTransportAvailable(Transport transport)
+{
+    return transport == TransportQt || MqttIoUringServer::isSupported();
+}
+
+int MqttServer::listen(const QHostAddress &address, quint16 port, const QSslConfiguration &sslConfiguration)
+{
+    bool ioUring = d_ptr->transport == TransportIoUring && sslConfiguration.isNull();
+    if (ioUring && !MqttIoUringServer::isSupported()) {
+        qCWarning(dbgServer) << "io_uring is not available on this system. Using the Qt sockets for port" << port;
+        ioUring = false;
+    }
+    if (ioUring) {
+        MqttIoUringServer *server = new MqttIoUringServer(this);
+        int fd = d_ptr->listeningSocket(address, port, d_ptr->reusePort);
+        if (fd < 0 || !server->setSocketDescriptor(fd)) {
+            qCWarning(dbgServer) << "Error listening on port" << port << "with io_uring";
+            if (fd >= 0) {
+                MqttHandoverConnection::closeDescriptors(QVector<int>() << fd);
+            }
+            delete server;
+            return -1;
+        }
+        int addressId = d_ptr->newAddressId();
+        d_ptr->addIoUringServer(addressId, server);
+        qCDebug(dbgServer) << "nymea MQTT server running on" << address.toString() << ":" << port << "with io_uring ( Address ID" << addressId << ")";
+        return addressId;
+    }
+
+    SslServer *server = new SslServer(sslConfiguration, this);
+    if (d_ptr->reusePort) {
+        int fd = d_ptr->listeningSocket(address, port, true);
+        if (fd < 0 || !server->setSocketDescriptor(fd)) {
+            qCWarning(dbgServer) << "Error listening on port" << port << "with SO_REUSEPORT";
+            if (fd >= 0) {
+                MqttHandoverConnection::closeDescriptors(QVector<int>() << fd);
+            }
+            server->deleteLater();
+            return -1;
+        }
+    } else if (!server->listen(address, port)) {
+        qCWarning(dbgServer) << "Error listening on port" << port;
+        server->deleteLater();
+        return -1;
+    }
+    int addressId = d_ptr->newAddressId();
+    d_ptr->addServer(addressId, server);
+    qCDebug(dbgServer) << "nymea MQTT server running on" << address.toString() << ":" << port << "( Address ID" << addressId << ")";
+    return addressId;
+}
+
+int MqttServer::listenLocal(const QString &serverName, QLocalServer::SocketOptions socketOptions)
+{
+    LocalServer *server = new LocalServer(this);
+    server->setSocketOptions(socketOptions);
+    if (!server->listen(serverName)) {
+        if (server->serverError() != QAbstractSocket::AddressInUseError) {
+            qCWarning(dbgServer) << "Error listening on local socket" << serverName << server->errorString();
+            server->deleteLater();
+            return -1;
+        }
+        // Most likely a leftover from a previous instance which didn't shut down cleanly
+        qCWarning(dbgServer) << "Local socket" << serverName << "already exists. Removing it.";
+        QLocalServer::removeServer(serverName);
+        if (!server->listen(serverName)) {
+            qCWarning(dbgServer) << "Error listening on local socket" << serverName << server->errorString();
+            server->deleteLater();
+            return -1;
+        }
+    }
+    int addressId = d_ptr->newAddressId();
+    d_ptr->addLocalServer(addressId, server);
+    qCDebug(dbgServer) << "nymea MQTT server running on local socket" << server->fullServerName() << "( Address ID" << addressId << ")";
+    return addressId;
+}
+
+bool MqttServer::isListening(const QHostAddress &address, quint16 port) const
+{
+    foreach (SslServer *server, d_ptr->servers) {
+        if (server->serverAddress() == address && server->serverPort() == port && server->isListening()) {
+            return true;
+        }
+    }
+    foreach (MqttIoUringServer *server, d_ptr->ioUringServers) {
+        if (server->serverAddress() == address && server->serverPort() == port && server->isListening()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*!
+ * \brief Accepts connections of MqttClient objects living in the same process, see MqttClient::connectToServer().
+ *
+ * In-process clients exchange MqttPacket objects with the server directly instead of going through a socket.
+ * Returns the address ID used for in-process clients. Calling this multiple times returns the same ID.
+ */
+int MqttServer::listenInProcess()
+{
+    if (d_ptr->inProcessAddressId < 0) {
+        d_ptr->inProcessAddressId = d_ptr->newAddressId();
+        qCDebug(dbgServer) << "nymea MQTT server accepting in-process clients ( Address ID" << d_ptr->inProcessAddressId << ")";
+    }
+    return d_ptr->inProcessAddressId;
+}
+
+/*!
+ * \brief Hands this server over to a new process for a restart without dropping connections.
+ *
+ * The new process is expected to wait in \l receiveHandover() on the local socket \a serverName. All
+ * listening sockets and all plain TCP and local socket connections are passed to it, together with the
+ * session state of the clients and the retained messages. TLS connections and in-process clients can't be
+ * transferred and stay with this server, they'll reconnect to the new process once this one shuts down.
+ *
+ * Returns true if the new process took over. This server is then left without listeners and the handed
+ * over clients are released without sending anything to them. On failure, the server continues as before.
+ */
+bool MqttServer::handOver(const QString &serverName, int timeout)
+{
+    d_ptr->commitAcknowledgements();
+
+    MqttHandoverConnection connection;
+    if (!connection.connectToServer(serverName, timeout)) {
+        qCWarning(dbgServer) << "Handover: Cannot connect to" << serverName << connection.errorString();
+        return false;
+    }
+
+    QVector<int> fds;
+    QList<QIODevice*> handedOverClients;
+    QByteArray state = d_ptr->saveHandoverState(&fds, &handedOverClients);
+    qCDebug(dbgServer) << "Handover: Passing" << (d_ptr->servers.count() + d_ptr->ioUringServers.count() + d_ptr->localServers.count()) << "listeners and" << handedOverClients.count() << "clients to" << serverName;
+    if (!connection.send(state, fds) || !connection.waitForAcknowledge(timeout)) {
+        qCWarning(dbgServer) << "Handover to" << serverName << "failed:" << connection.errorString() << "Continuing to serve.";
+        // Input may have been picked up from the sockets while saving the state
+        foreach (QIODevice *client, handedOverClients) {
+            if (MqttIoUringSocket *socket = qobject_cast<MqttIoUringSocket*>(client)) {
+                socket->startReceiving();
+            }
+            if (d_ptr->clientServerMap.contains(client)) {
+                d_ptr->processBuffer(client);
+            }
+        }
+        if (!d_ptr->acceptingPaused) {
+            foreach (MqttIoUringServer *server, d_ptr->ioUringServers) {
+                server->resumeAccepting();
+            }
+        }
+        return false;
+    }
+
+    // The new process owns duplicates of all descriptors now, release ours without touching the connections
+    foreach (QIODevice *client, handedOverClients) {
+        d_ptr->releaseClient(client);
+    }
+    // Offline sessions live on in the new process
+    qDeleteAll(d_ptr->offlineSessions);
+    d_ptr->offlineSessions.clear();
+    d_ptr->listenerConnectBuckets.clear();
+    foreach (SslServer *server, d_ptr->servers) {
+        server->close();
+        server->deleteLater();
+    }
+    d_ptr->servers.clear();
+    foreach (MqttIoUringServer *server, d_ptr->ioUringServers) {
+        server->close();
+        server->deleteLater();
+    }
+    d_ptr->ioUringServers.clear();
+    // Closing a local server removes the socket file, the new process creates it again once we're done here
+    foreach (LocalServer *server, d_ptr->localServers) {
+        server->close();
+        server->deleteLater();
+    }
+    d_ptr->localServers.clear();
+    connection.close();
+    qCDebug(dbgServer) << "Handover to" << serverName << "completed.";
+    return true;
+}
+
+/*!
+ * \brief Takes over listeners and clients from a server calling \l handOver() in another process.
+ *
+ * Waits up to \a timeout milliseconds on the local socket \a serverName. Handed over listeners keep their address ID.
+ * The configuration of TLS listeners can't be transferred, \a sslConfiguration is used for them instead. If it is
+ * null, TLS listeners are not taken over. clientConnected() and clientSubscribed() are emitted for all resumed
+ * sessions. Offline sessions are only taken over if a session expiry interval is set. Call this before listening on
+ * any addresses.
+ */
+bool MqttServer::receiveHandover(const QString &serverName, const QSslConfiguration &sslConfiguration, int timeout)
+{
+    MqttHandoverConnection connection;
+    if (!connection.listenAndAccept(serverName, timeout)) {
+        qCWarning(dbgServer) << "Handover: No server connected on" << serverName << connection.errorString();
+        return false;
+    }
+    QByteArray state;
+    QVector<int> fds;
+    if (!connection.receive(&state, &fds, timeout)) {
+        qCWarning(dbgServer) << "Handover: Error receiving state:" << connection.errorString();
+        MqttHandoverConnection::closeDescriptors(fds);
+        return false;
+    }
+
+    QList<MqttServerPrivate::LocalListener> localListeners;
+    bool success = d_ptr->restoreHandoverState(state, fds, sslConfiguration, &localListeners);
+    if (!connection.acknowledge(success) || !success) {
+        qCWarning(dbgServer) << "Handover: Taking over failed." << connection.errorString();
+        return false;
+    }
+
+    // Local sockets are recreated once the old process released them
+    if (!connection.waitForClosed(timeout)) {
+        qCWarning(dbgServer) << "Handover: The old server did not finish the handover." << connection.errorString();
+    }
+    foreach (const MqttServerPrivate::LocalListener &listener, localListeners) {
+        LocalServer *server = d_ptr->localServers.value(listener.addressId);
+        server->setSocketOptions(listener.socketOptions);
+        QLocalServer::removeServer(listener.serverName);
+        if (!server->listen(listener.serverName)) {
+            qCWarning(dbgServer) << "Handover: Error listening on local socket" << listener.serverName << server->errorString();
+        }
+    }
+
+    d_ptr->resumeHandedOverClients();
+    qCDebug(dbgServer) << "Handover from" << serverName << "completed. Serving" << d_ptr->clientServerMap.count() << "clients.";
+    return true;
+}
+
+QList<int> MqttServer::listeningAddressIds() const
+{
+    QList<int> addressIds = d_ptr->servers.keys() + d_ptr->ioUringServers.keys() + d_ptr->localServers.keys();
+    if (d_ptr->inProcessAddressId >= 0) {
+        addressIds.append(d_ptr->inProcessAddressId);
+    }
+    return addressIds;
+}
+
+void MqttServer::close(int interfaceId)
+{
+    if (!d_ptr->servers.contains(interfaceId) && !d_ptr->ioUringServers.contains(interfaceId) && !d_ptr->localServers.contains(interfaceId)
+            && d_ptr->inProcessAddressId != interfaceId) {
+        qCWarning(dbgServer) << "No such server address ID" << interfaceId;
+        return;
+    }
+    d_ptr->listenerConnectBuckets.remove(interfaceId);
+    d_ptr->listenerMaximumInflightMessages.remove(interfaceId);
+    while (!d_ptr->clientServerMap.keys(interfaceId).isEmpty()) {
+        d_ptr->cleanupClient(d_ptr->clientServerMap.keys(interfaceId).first());
+    }
+    if (d_ptr->inProcessAddressId == interfaceId) {
+        d_ptr->inProcessAddressId = -1;
+    } else if (d_ptr->servers.contains(interfaceId)) {
+        SslServer *server = d_ptr->servers.take(interfaceId);
+        server->close();
+        server->deleteLater();
+    } else if (d_ptr->ioUringServers.contains(interfaceId)) {
+        MqttIoUringServer *server = d_ptr->ioUringServers.take(interfaceId);
+        server->close();
+        server->deleteLater();
+    } else {
+        LocalServer *server = d_ptr->localServers.take(interfaceId);
+        server->close();
+        server->deleteLater();
+    }
+}
+
+QStringList MqttServer::clients() const
+{
+    QStringList clientIds;
+    foreach (ClientContext *ctx, d_ptr->clientList) {
+        clientIds << ctx->clientId;
+    }
+    return clientIds;
+}
+
+/*!
+ * \brief Returns the client IDs of persistent sessions whose clients are currently disconnected.
+ */
+QStringList MqttServer::offlineSessions() const
+{
+    return d_ptr->offlineSessions.keys();
+}
+
+void MqttServer::disconnectClient(const QString &clientId)
+{
+    foreach (ClientContext *ctx, d_ptr->clientList) {
+        if (ctx->clientId == clientId) {
+            d_ptr->cleanupClient(d_ptr->clientList.key(ctx));
+            return;
+        }
+    }
+}
+
+/*!
+ * \brief Joins a cluster of server processes running on this host.
+ *
+ * The node listens on the local socket \a nodeName and connects to the nodes in \a peerNames, the list may
+ * contain all nodes of the cluster including this one. Nodes not running yet are connected once they come up.
+ *
+ * Nodes tell each other the distinct topic filters their clients are subscribed to rather than every single
+ * subscription. A message published on one node is forwarded to the nodes with a matching filter and
+ * delivered to the subscribers there. Retained messages are replicated to all nodes, when nodes reconnect
+ * the most recent change of a topic wins. Sessions are not shared, a client resuming its session needs to
+ * connect to the same node again.
+ *
+ * Combined with setReusePort() all nodes can listen on the same port and share the incoming connections.
+ */
+bool MqttServer::joinCluster(const QString &nodeName, const QStringList &peerNames)
+{
+    leaveCluster();
+    d_ptr->cluster = new MqttClusterNode(d_ptr, nodeName, peerNames);
+    if (!d_ptr->cluster->listen()) {
+        leaveCluster();
+        return false;
+    }
+    return true;
+}
+
+void MqttServer::leaveCluster()
+{
+    delete d_ptr->cluster;
+    d_ptr->cluster = nullptr;
+}
+
+QStringList MqttServer::clusterPeers() const
+{
+    return d_ptr->cluster ? d_ptr->cluster->connectedPeers() : QStringList();
+}
+
+QHash<QString, quint16> MqttServer::publish(const QString &topic, const QByteArray &payload)
+{
+    qint64 expiry = d_ptr->defaultExpiry(topic);
+    if (d_ptr->cluster) {
+        d_ptr->cluster->forwardPublish(topic, payload, expiry);
+    }
+    return d_ptr->route(topic, payload, expiry);
+}
+
+/*!
+ * \brief Publishes a message which expires after \a messageExpiryInterval seconds, regardless of the default
+ * for its topic. 0 publishes a message which does not expire.
+ */
+QHash<QString, quint16> MqttServer::publish(const QString &topic, const QByteArray &payload, int messageExpiryInterval)
+{
+    qint64 expiry = messageExpiryInterval > 0 ? QDateTime::currentMSecsSinceEpoch() + messageExpiryInterval * 1000LL : 0;
+    d_ptr->watchExpiry(expiry);
+    if (d_ptr->cluster) {
+        d_ptr->cluster->forwardPublish(topic, payload, expiry);
+    }
+    return d_ptr->route(topic, payload, expiry);
+}
+
+QByteArray MqttServerPrivate::saveHandoverState(QVector<int> *fds, QList<QIODevice*> *clients)
+{
+    QByteArray state;
+    QDataStream stream(&state, QIODevice::WriteOnly);
+    stream << handoverStateVersion;
+
+    // io_uring keeps accepting on its own, connections must not pile up here while the new process takes over.
+    // Anything accepted until it stopped is handed over with the other clients.
+    foreach (MqttIoUringServer *server, ioUringServers) {
+        server->pauseAccepting();
+    }
+
+    stream << servers.count() + ioUringServers.count();
+    foreach (int addressId, servers.keys()) {
+        SslServer *server = servers.value(addressId);
+        fds->append(static_cast<int>(server->socketDescriptor()));
+        stream << addressId << fds->count() - 1 << server->isEncrypted();
+    }
+    foreach (int addressId, ioUringServers.keys()) {
+        fds->append(ioUringServers.value(addressId)->socketDescriptor());
+        stream << addressId << fds->count() - 1 << false;
+    }
+    stream << localServers.count();
+    foreach (int addressId, localServers.keys()) {
+        LocalServer *server = localServers.value(addressId);
+        stream << addressId << server->fullServerName() << static_cast<int>(server->socketOptions());
+    }
+
+    stream << retainedMessages->count();
+    foreach (const QString &topic, retainedMessages->topics()) {
+        MqttPackets packets = retainedMessages->value(topic);
+        stream << topic << packets.count();
+        foreach (const MqttPacket &packet, packets) {
+            stream << packet.serialize() << packet.expiry();
+        }
+    }
+
+    // Only plain connections can be handed over, the state of a TLS session can't be transferred
+    foreach (QIODevice *client, clientServerMap.keys()) {
+        QTcpSocket *tcpSocket = plainTcpSocket(client);
+        QLocalSocket *localSocket = qobject_cast<QLocalSocket*>(client);
+        MqttIoUringSocket *ioUringSocket = qobject_cast<MqttIoUringSocket*>(client);
+        if (ioUringSocket && ioUringSocket->isOpen() && ioUringSocket->socketDescriptor() >= 0) {
+            ioUringSocket->flush();
+            if (ioUringSocket->bytesToWrite() > 0) {
+                ioUringSocket->waitForBytesWritten(1000);
+            }
+            // Input arriving from now on is left to the new process
+            ioUringSocket->stopReceiving();
+        } else if (tcpSocket && tcpSocket->state() == QAbstractSocket::ConnectedState) {
+            tcpSocket->flush();
+            if (tcpSocket->bytesToWrite() > 0) {
+                tcpSocket->waitForBytesWritten(1000);
+            }
+        } else if (localSocket && localSocket->state() == QLocalSocket::ConnectedState) {
+            localSocket->flush();
+            if (localSocket->bytesToWrite() > 0) {
+                localSocket->waitForBytesWritten(1000);
+            }
+        } else {
+            continue;
+        }
+        clients->append(client);
+    }
+
+    stream << clients->count();
+    foreach (QIODevice *client, *clients) {
+        QTcpSocket *tcpSocket = plainTcpSocket(client);
+        MqttIoUringSocket *ioUringSocket = qobject_cast<MqttIoUringSocket*>(client);
+        if (ioUringSocket) {
+            fds->append(ioUringSocket->socketDescriptor());
+        } else {
+            fds->append(static_cast<int>(tcpSocket ? tcpSocket->socketDescriptor() : qobject_cast<QLocalSocket*>(client)->socketDescriptor()));
+        }
+
+        // Unprocessed input, including anything not read from the socket yet and a CONNECT still waiting for admission
+        // or authorization
+        if (client->bytesAvailable() > 0) {
+            clientBuffers[client].append(client->readAll());
+        }
+        QByteArray input = clientBuffers.value(client);
+        if (queuedConnectPackets.contains(client)) {
+            input.prepend(queuedConnectPackets.value(client).serialize());
+        } else if (pendingAuthorizations.contains(client)) {
+            // Authorized anew by the receiving process
+            input.prepend(pendingAuthorizations.value(client).packet.serialize());
+        }
+
+        stream << fds->count() - 1 << clientServerMap.value(client) << input;
+
+        ClientContext *ctx = clientList.value(client);
+        stream << (ctx != nullptr);
+        if (!ctx) {
+            continue;
+        }
+        writeSession(stream, ctx);
+    }
+
+    stream << offlineSessions.count();
+    foreach (ClientContext *ctx, offlineSessions) {
+        writeSession(stream, ctx);
+    }
+    return state;
+}
+
+void MqttServerPrivate::writeSession(QDataStream &stream, const ClientContext *ctx)
+{
+    stream << static_cast<quint8>(ctx->version) << ctx->keepAlive << ctx->clientId << ctx->username << ctx->cleanSession;
+    stream << ctx->willTopic << ctx->willMessage << static_cast<quint8>(ctx->willQoS) << ctx->willRetain;
+    stream << ctx->subscriptions.count();
+    foreach (const MqttSubscription &subscription, ctx->subscriptions) {
+        stream << subscription.topicFilter() << static_cast<quint8>(subscription.qoS());
+    }
+    stream << ctx->unackedPackets.packetIds();
+    stream << ctx->unackedPackets.count();
+    foreach (const MqttPacket &packet, ctx->unackedPackets.packets()) {
+        stream << packet.packetId() << packet.serialize() << packet.expiry();
+    }
+    stream << ctx->messageQueue.count();
+    foreach (const MqttPacket &packet, ctx->messageQueue) {
+        stream << packet.serialize() << packet.expiry();
+    }
+}
+
+ClientContext *MqttServerPrivate::readSession(QDataStream &stream)
+{
+    ClientContext *ctx = new ClientContext();
+    quint8 protocol, willQoS;
+    stream >> protocol >> ctx->keepAlive >> ctx->clientId >> ctx->username >> ctx->cleanSession;
+    stream >> ctx->willTopic >> ctx->willMessage >> willQoS >> ctx->willRetain;
+    ctx->version = static_cast<Mqtt::Protocol>(protocol);
+    ctx->willQoS = static_cast<Mqtt::QoS>(willQoS);
+    int subscriptionCount;
+    stream >> subscriptionCount;
+    for (int i = 0; i < subscriptionCount; i++) {
+        QByteArray topicFilter;
+        quint8 qos;
+        stream >> topicFilter >> qos;
+        ctx->subscriptions.append(MqttSubscription(topicFilter, static_cast<Mqtt::QoS>(qos)));
+    }
+    // Packets go back in the order of the ID list
+    QVector<quint16> unackedPacketIds;
+    stream >> unackedPacketIds;
+    QHash<quint16, MqttPacket> unackedPackets;
+    int unackedCount;
+    stream >> unackedCount;
+    for (int i = 0; i < unackedCount; i++) {
+        quint16 packetId;
+        QByteArray data;
+        qint64 expiry;
+        stream >> packetId >> data >> expiry;
+        MqttPacket packet;
+        packet.parse(data);
+        packet.setExpiry(expiry);
+        unackedPackets.insert(packetId, packet);
+    }
+    foreach (quint16 packetId, unackedPacketIds) {
+        if (unackedPackets.contains(packetId)) {
+            ctx->unackedPackets.insert(unackedPackets.take(packetId));
+        }
+    }
+    foreach (const MqttPacket &packet, unackedPackets) {
+        ctx->unackedPackets.insert(packet);
+    }
+    countInflight(ctx);
+    int queuedCount;
+    stream >> queuedCount;
+    for (int i = 0; i < queuedCount; i++) {
+        QByteArray data;
+        qint64 expiry;
+        stream >> data >> expiry;
+        MqttPacket packet;
+        if (packet.parse(data) > 0) {
+            packet.setExpiry(expiry);
+            ctx->messageQueue.enqueue(packet);
+            ctx->messageQueueBytes += packet.topic().size() + packet.payload().size();
+        }
+    }
+    return ctx;
+}
+
+bool MqttServerPrivate::restoreHandoverState(const QByteArray &state, const QVector<int> &fds, const QSslConfiguration &sslConfiguration, QList<LocalListener> *localListeners)
+{
+    QDataStream stream(state);
+    quint16 version;
+    stream >> version;
+    if (version != handoverStateVersion) {
+        qCWarning(dbgServer) << "Handover: Unsupported state version" << version;
+        MqttHandoverConnection::closeDescriptors(fds);
+        return false;
+    }
+
+    // Any descriptor not adopted by a listener or a client is closed at the end
+    QSet<int> adoptedFds;
+
+    int count;
+    stream >> count;
+    for (int i = 0; i < count; i++) {
+        int addressId, fdIndex;
+        bool encrypted;
+        stream >> addressId >> fdIndex >> encrypted;
+        if (encrypted && sslConfiguration.isNull()) {
+            qCWarning(dbgServer) << "Handover: No SSL configuration given. Not taking over TLS listener" << addressId;
+            continue;
+        }
+        if (!encrypted && transport == MqttServer::TransportIoUring && MqttIoUringServer::isSupported()) {
+            MqttIoUringServer *server = new MqttIoUringServer(q_ptr);
+            if (!server->setSocketDescriptor(fds.value(fdIndex))) {
+                qCWarning(dbgServer) << "Handover: Cannot take over listener" << addressId << "with io_uring";
+                delete server;
+                continue;
+            }
+            adoptedFds.insert(fds.value(fdIndex));
+            addIoUringServer(newAddressId(addressId), server);
+            qCDebug(dbgServer) << "Handover: Took over listener on" << server->serverAddress().toString() << ":" << server->serverPort() << "with io_uring ( Address ID" << addressId << ")";
+            continue;
+        }
+        SslServer *server = new SslServer(encrypted ? sslConfiguration : QSslConfiguration(), q_ptr);
+        if (!server->setSocketDescriptor(fds.value(fdIndex))) {
+            qCWarning(dbgServer) << "Handover: Cannot take over listener" << addressId << server->errorString();
+            delete server;
+            continue;
+        }
+        adoptedFds.insert(fds.value(fdIndex));
+        addServer(newAddressId(addressId), server);
+        qCDebug(dbgServer) << "Handover: Took over listener on" << server->serverAddress().toString() << ":" << server->serverPort() << "( Address ID" << addressId << ")";
+    }
+
+    stream >> count;
+    for (int i = 0; i < count; i++) {
+        LocalListener listener;
+        int socketOptions;
+        stream >> listener.addressId >> listener.serverName >> socketOptions;
+        listener.socketOptions = QLocalServer::SocketOptions(socketOptions);
+        addLocalServer(newAddressId(listener.addressId), new LocalServer(q_ptr));
+        localListeners->append(listener);
+    }
+
+    stream >> count;
+    for (int i = 0; i < count; i++) {
+        QString topic;
+        int packetCount;
+        stream >> topic >> packetCount;
+        retainedMessages->remove(topic);
+        for (int j = 0; j < packetCount; j++) {
+            QByteArray data;
+            qint64 expiry;
+            stream >> data >> expiry;
+            MqttPacket packet;
+            if (packet.parse(data) > 0) {
+                packet.setExpiry(expiry);
+                retainedMessages->insert(topic, packet);
+                if (expiry > 0) {
+                    retainedExpiries.insert(expiry, topic);
+                    watchExpiry(expiry);
+                }
+            }
+        }
+    }
+
+    stream >> count;
+    for (int i = 0; i < count; i++) {
+        int fdIndex, addressId;
+        QByteArray input;
+        bool hasContext;
+        stream >> fdIndex >> addressId >> input >> hasContext;
+
+        ClientContext *ctx = hasContext ? readSession(stream) : nullptr;
+
+        QIODevice *client = nullptr;
+        if (servers.contains(addressId)) {
+            client = servers.value(addressId)->adoptSocket(fds.value(fdIndex));
+        } else if (ioUringServers.contains(addressId)) {
+            client = ioUringServers.value(addressId)->adoptSocket(fds.value(fdIndex));
+        } else if (localServers.contains(addressId)) {
+            client = localServers.value(addressId)->adoptSocket(fds.value(fdIndex));
+        }
+        if (!client) {
+            qCWarning(dbgServer) << "Handover: Cannot take over client" << (ctx ? ctx->clientId : QString());
+            delete ctx;
+            continue;
+        }
+        adoptedFds.insert(fds.value(fdIndex));
+
+        clientServerMap.insert(client, addressId);
+        if (!input.isEmpty()) {
+            clientBuffers.insert(client, input);
+        }
+        if (ctx) {
+            clientList.insert(client, ctx);
+            compilePermissions(ctx);
+            applyInflightLimit(ctx, addressId);
+            // Send times did not survive the handover, the timers start anew
+            foreach (const MqttPacket &packet, ctx->unackedPackets.packets()) {
+                if (packet.type() == MqttPacket::TypePublish || packet.type() == MqttPacket::TypePubrel) {
+                    trackTransmission(client, ctx, packet.packetId());
+                }
+            }
+            if (ctx->keepAlive > 0) {
+                connectionTimeouts.add(client, ctx->keepAlive * 1500);
+            }
+        } else {
+            pendingConnections.insert(client);
+            connectionTimeouts.add(client, 10000);
+        }
+    }
+
+    // Offline sessions start expiring anew in this process
+    stream >> count;
+    for (int i = 0; i < count; i++) {
+        ClientContext *ctx = readSession(stream);
+        if (sessionExpiryInterval == 0 || stream.status() != QDataStream::Ok) {
+            delete ctx;
+            continue;
+        }
+        offlineSessions.insert(ctx->clientId, ctx);
+        sessionExpiries.add(ctx->clientId, sessionExpiryInterval * 1000LL);
+    }
+
+    QVector<int> unusedFds;
+    foreach (int fd, fds) {
+        if (!adoptedFds.contains(fd)) {
+            unusedFds.append(fd);
+        }
+    }
+    MqttHandoverConnection::closeDescriptors(unusedFds);
+
+    if (stream.status() != QDataStream::Ok) {
+        qCWarning(dbgServer) << "Handover: State data is corrupt.";
+        return false;
+    }
+    updateAccepting();
+    return true;
+}
+
+void MqttServerPrivate::resumeHandedOverClients()
+{
+    foreach (QIODevice *client, clientList.keys()) {
+        ClientContext *ctx = clientList.value(client);
+        emit q_ptr->clientConnected(clientServerMap.value(client), ctx->clientId, ctx->username, peerAddress(client));
+        foreach (const MqttSubscription &subscription, ctx->subscriptions) {
+            emit q_ptr->clientSubscribed(ctx->clientId, subscription.topicFilter(), subscription.qoS());
+        }
+    }
+    foreach (ClientContext *ctx, offlineSessions) {
+        foreach (const MqttSubscription &subscription, ctx->subscriptions) {
+            emit q_ptr->clientSubscribed(ctx->clientId, subscription.topicFilter(), subscription.qoS());
+        }
+    }
+    // Continue with any input the old process did not get to process
+    foreach (QIODevice *client, clientBuffers.keys()) {
+        if (clientServerMap.contains(client)) {
+            processBuffer(client);
+        }
+    }
+}
+
+void MqttServerPrivate::releaseClient(QIODevice *client)
+{
+    // Forget about a client without sending anything or publishing its will. The connection lives on elsewhere.
+    clientBuffers.remove(client);
+    clientServerMap.remove(client);
+    pendingConnections.remove(client);
+    connectionTimeouts.remove(client);
+    retransmissions.remove(client);
+    dropHeldAcknowledgements(client);
+    if (queuedConnectPackets.remove(client) > 0) {
+        queuedConnects.removeOne(client);
+    }
+    dropPendingAuthorization(client);
+    delete clientList.take(client);
+    client->blockSignals(true);
+    if (QAbstractSocket *socket = qobject_cast<QAbstractSocket*>(client)) {
+        socket->abort();
+    } else if (QLocalSocket *socket = qobject_cast<QLocalSocket*>(client)) {
+        socket->abort();
+    } else if (MqttIoUringSocket *socket = qobject_cast<MqttIoUringSocket*>(client)) {
+        socket->abort();
+    }
+    client->deleteLater();
+}
+
+int MqttServerPrivate::newAddressId(int addressId)
+{
+    // Address IDs are unique among all servers in the process. Handed over listeners keep their ID.
+    static int lastAddressId = -1;
+    if (addressId < 0) {
+        return ++lastAddressId;
+    }
+    lastAddressId = qMax(lastAddressId, addressId);
+    return addressId;
+}
+
+void MqttServerPrivate::addServer(int addressId, SslServer *server)
+{
+    if (acceptingPaused) {
+        server->pauseAccepting();
+    }
+    servers.insert(addressId, server);
+    connect(server, &SslServer::clientConnected, this, [this, addressId](QIODevice *client) {
+        onClientConnected(addressId, client);
+    });
+    connect(server, &SslServer::clientDisconnected, this, &MqttServerPrivate::onClientDisconnected);
+    connect(server, &SslServer::dataAvailable, this, &MqttServerPrivate::onDataAvailable);
+}
+
+void MqttServerPrivate::addIoUringServer(int addressId, MqttIoUringServer *server)
+{
+    if (acceptingPaused) {
+        server->pauseAccepting();
+    }
+    ioUringServers.insert(addressId, server);
+    connect(server, &MqttIoUringServer::clientConnected, this, [this, addressId](QIODevice *client) {
+        onClientConnected(addressId, client);
+    });
+    connect(server, &MqttIoUringServer::clientDisconnected, this, &MqttServerPrivate::onClientDisconnected);
+    connect(server, &MqttIoUringServer::dataAvailable, this, &MqttServerPrivate::onDataAvailable);
+}
+
+void MqttServerPrivate::addLocalServer(int addressId, LocalServer *server)
+{
+    localServers.insert(addressId, server);
+    connect(server, &LocalServer::clientConnected, this, [this, addressId](QIODevice *client) {
+        onClientConnected(addressId, client);
+    });
+    connect(server, &LocalServer::clientDisconnected, this, &MqttServerPrivate::onClientDisconnected);
+    connect(server, &LocalServer::dataAvailable, this, &MqttServerPrivate::onDataAvailable);
+}
+
+QTcpSocket *MqttServerPrivate::plainTcpSocket(QIODevice *client)
+{
+    // Listeners without TLS create plain QTcpSockets, a QSslSocket is only ever used for encrypted connections
+    QSslSocket *sslSocket = qobject_cast<QSslSocket*>(client);
+    if (sslSocket && sslSocket->mode() != QSslSocket::UnencryptedMode) {
+        return nullptr;
+    }
+    return qobject_cast<QTcpSocket*>(client);
+}
+
+QHostAddress MqttServerPrivate::peerAddress(QIODevice *client) const
+{
+    QAbstractSocket *socket = qobject_cast<QAbstractSocket*>(client);
+    if (socket) {
+        return socket->peerAddress();
+    }
+    if (MqttIoUringSocket *ioUringSocket = qobject_cast<MqttIoUringSocket*>(client)) {
+        return ioUringSocket->peerAddress();
+    }
+    // Clients on local sockets are on this host
+    return QHostAddress(QHostAddress::LocalHost);
+}
+
+void MqttServerPrivate::flush(QIODevice *client)
+{
+    if (QAbstractSocket *socket = qobject_cast<QAbstractSocket*>(client)) {
+        socket->flush();
+    } else if (QLocalSocket *socket = qobject_cast<QLocalSocket*>(client)) {
+        socket->flush();
+    } else if (MqttIoUringSocket *socket = qobject_cast<MqttIoUringSocket*>(client)) {
+        socket->flush();
+    }
+}
+
+void MqttServerPrivate::onClientConnected(int addressId, QIODevice *client)
+{
+    // Clean up the connection if we don't get data within 10 seconds.
+    clientServerMap.insert(client, addressId);
+    pendingConnections.insert(client);
+    connectionTimeouts.add(client, 10000);
+    updateAccepting();
+}
+
+void MqttServerPrivate::onDataAvailable(QIODevice *client)
+{
+    // Appending to an empty buffer takes over the data read without copying it. Only a partial packet left over
+    // from the last read is copied.
+    MqttIoUringSocket *ioUringSocket = qobject_cast<MqttIoUringSocket*>(client);
+    const QByteArray data = ioUringSocket ? ioUringSocket->takeReceivedData() : client->readAll();
+    clientBuffers[client].append(data);
+    statistics.bytesReceived += static_cast<quint64>(data.size());
+
+    processBuffer(client);
+}
+
+void MqttServerPrivate::processBuffer(QIODevice *client)
+{
+    // Input of clients waiting for their CONNECT to be admitted or authorized is held back until it is processed.
+    MqttInProcessChannel *channel = qobject_cast<MqttInProcessChannel*>(client);
+    if (channel) {
+        // In-process clients hand over complete packets, there's nothing to parse
+        while (channel->hasPendingPackets() && !isConnectHeld(client)) {
+            if (!processIncomingPacket(channel->takePacket(), client)) {
+                return;
+            }
+        }
+        return;
+    }
+
+    // Process all complete packets in the buffer as one batch and drop the consumed data only once at the end.
+    // Parsing copies what it needs out of the buffer. The reference held here keeps the data alive even if the client
+    // is removed while processing a packet.
+    QByteArray buffer = clientBuffers.value(client);
+    int offset = 0;
+    while (offset < buffer.size() && !isConnectHeld(client)) {
+        MqttPacket packet;
+        int ret = packet.parse(QByteArray::fromRawData(buffer.constData() + offset, buffer.size() - offset));
+        if (ret == 0) {
+            qCDebug(dbgServer) << "Packet too short... Waiting for more...";
+            break;
+        }
+
+        if (ret == -1) {
+            qCWarning(dbgServer) << "Bad MQTT packet data, Dropping connection" << packet.serialize().toHex();
+            cleanupClient(client);
+            return;
+        }
+
+        offset += ret;
+
+        if (!processIncomingPacket(packet, client)) {
+            return;
+        }
+    }
+
+    // Let go of the reference first, the rest is then moved to the front in place instead of being copied
+    int size = buffer.size();
+    buffer.clear();
+    if (offset == size) {
+        clientBuffers.remove(client);
+    } else if (offset > 0) {
+        clientBuffers[client].remove(0, offset);
+    }
+}
+
+bool MqttServerPrivate::processIncomingPacket(const MqttPacket &packet, QIODevice *client)
+{
+    // Ok, we've got a full packet. If this client is still pending we can stop the timeout,
+    // the protocol will take it from here.
+    if (pendingConnections.remove(client)) {
+        connectionTimeouts.remove(client);
+        updateAccepting();
+    }
+
+    processPacket(packet, client);
+
+    // The client may have been dropped while processing the packet
+    return clientServerMap.contains(client);
+}
+
+void MqttServerPrivate::sendPacket(QIODevice *client, const MqttPacket &packet)
+{
+    if (packet.type() == MqttPacket::TypePublish) {
+        statistics.messagesSent++;
+    }
+    MqttInProcessChannel *channel = qobject_cast<MqttInProcessChannel*>(client);
+    if (channel) {
+        channel->sendPacket(packet);
+        return;
+    }
+    if (packet.type() == MqttPacket::TypePublish && !packet.isPayloadCompressed() && packet.payload().size() >= scatterGatherThreshold && sendScatterGather(client, packet)) {
+        return;
+    }
+    const QByteArray data = packet.serialize();
+    statistics.bytesSent += static_cast<quint64>(data.size());
+    client->write(data);
+}
+
+bool MqttServerPrivate::sendScatterGather(QIODevice *client, const MqttPacket &packet)
+{
+#ifdef Q_OS_UNIX
+    // Only for plain TCP connections. With TLS the payload needs to go through the encryption anyways.
+    QTcpSocket *socket = plainTcpSocket(client);
+    if (!socket || socket->state() != QAbstractSocket::ConnectedState || socket->socketDescriptor() < 0) {
+        return false;
+    }
+    // Anything still buffered in the socket needs to go out first to keep the stream in order
+    if (socket->bytesToWrite() > 0) {
+        return false;
+    }
+
+    // Send the header and the payload from where they are, the payload is never copied into a frame
+    const QByteArray header = packet.serializeHeader();
+    const QByteArray payload = packet.payload();
+    struct iovec segments[2];
+    segments[0].iov_base = const_cast<char*>(header.constData());
+    segments[0].iov_len = static_cast<size_t>(header.size());
+    segments[1].iov_base = const_cast<char*>(payload.constData());
+    segments[1].iov_len = static_cast<size_t>(payload.size());
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = segments;
+    message.msg_iovlen = 2;
+
+    ssize_t written;
+    do {
+        written = ::sendmsg(static_cast<int>(socket->socketDescriptor()), &message, MSG_NOSIGNAL);
+    } while (written < 0 && errno == EINTR);
+    if (written < 0) {
+        // Let the socket deal with it, it either buffers the data (EAGAIN) or reports the error
+        return false;
+    }
+
+    // The kernel buffer is full, queue whatever is left in the socket. It will be flushed once writable.
+    if (written < header.size()) {
+        socket->write(header.constData() + written, header.size() - written);
+        socket->write(payload);
+    } else if (written < header.size() + payload.size()) {
+        int offset = static_cast<int>(written) - header.size();
+        socket->write(payload.constData() + offset, payload.size() - offset);
+    }
+    statistics.bytesSent += static_cast<quint64>(header.size() + payload.size());
+    return true;
+#else
+    Q_UNUSED(client)
+    Q_UNUSED(packet)
+    return false;
+#endif
+}
+
+int MqttServerPrivate::listeningSocket(const QHostAddress &address, quint16 port, bool reusePort)
+{
+#ifdef Q_OS_UNIX
+#ifndef SO_REUSEPORT
+    if (reusePort) {
+        qCWarning(dbgServer) << "SO_REUSEPORT is not supported on this platform";
+        return -1;
+    }
+#endif
+    // Like QTcpServer, Any is a dual stack IPv6 socket
+    bool ipv6 = address.protocol() != QAbstractSocket::IPv4Protocol;
+    struct sockaddr_storage storage;
+    memset(&storage, 0, sizeof(storage));
+    socklen_t length;
+    if (ipv6) {
+        struct sockaddr_in6 *address6 = reinterpret_cast<struct sockaddr_in6*>(&storage);
+        address6->sin6_family = AF_INET6;
+        address6->sin6_port = htons(port);
+        Q_IPV6ADDR ip = address == QHostAddress::Any ? QHostAddress(QHostAddress::AnyIPv6).toIPv6Address() : address.toIPv6Address();
+        memcpy(&address6->sin6_addr, &ip, sizeof(ip));
+        length = sizeof(struct sockaddr_in6);
+    } else {
+        struct sockaddr_in *address4 = reinterpret_cast<struct sockaddr_in*>(&storage);
+        address4->sin_family = AF_INET;
+        address4->sin_port = htons(port);
+        address4->sin_addr.s_addr = htonl(address.toIPv4Address());
+        length = sizeof(struct sockaddr_in);
+    }
+
+    int fd = ::socket(ipv6 ? AF_INET6 : AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int on = 1;
+    int v6only = address == QHostAddress::Any ? 0 : 1;
+    if (::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0
+#ifdef SO_REUSEPORT
+            || (reusePort && ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+#endif
+            || (ipv6 && ::setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) < 0)
+            || ::bind(fd, reinterpret_cast<struct sockaddr*>(&storage), length) < 0
+            || ::listen(fd, 50) < 0) {
+        qCWarning(dbgServer) << "Cannot listen on port" << port << (reusePort ? "with SO_REUSEPORT:" : ":") << strerror(errno);
+        MqttHandoverConnection::closeDescriptors(QVector<int>() << fd);
+        return -1;
+    }
+    return fd;
+#else
+    Q_UNUSED(address)
+    Q_UNUSED(port)
+    Q_UNUSED(reusePort)
+    qCWarning(dbgServer) << "Listening sockets can't be created on this platform";
+    return -1;
+#endif
+}
+
+MqttInProcessChannel *MqttServerPrivate::connectInProcess(QObject *clientParent)
+{
+    if (inProcessAddressId < 0) {
+        qCWarning(dbgServer) << "In-process connection refused. The server is not listening for in-process clients.";
+        return nullptr;
+    }
+    MqttInProcessChannel *serverChannel = new MqttInProcessChannel(this);
+    MqttInProcessChannel *clientChannel = new MqttInProcessChannel(clientParent);
+    MqttInProcessChannel::connectChannels(serverChannel, clientChannel);
+    connect(serverChannel, &MqttInProcessChannel::packetsAvailable, this, [this, serverChannel]() {
+        processBuffer(serverChannel);
+    });
+    connect(serverChannel, &MqttInProcessChannel::disconnected, this, [this, serverChannel]() {
+        onClientDisconnected(serverChannel);
+    });
+    qCDebug(dbgServer) << "New in-process client connection:" << serverChannel;
+    onClientConnected(inProcessAddressId, serverChannel);
+    return clientChannel;
+}
+
+void MqttServerPrivate::onClientDisconnected(QIODevice *client)
+{
+    cleanupClient(client);
+}
+
+void MqttServerPrivate::cleanupClient(QIODevice *client)
+{
+    if (clientBuffers.contains(client)) {
+        clientBuffers.remove(client);
+    }
+    if (clientServerMap.contains(client)) {
+        clientServerMap.remove(client);
+    }
+    pendingConnections.remove(client);
+    connectionTimeouts.remove(client);
+    retransmissions.remove(client);
+    if (queuedConnectPackets.remove(client) > 0) {
+        queuedConnects.removeOne(client);
+    }
+    dropPendingAuthorization(client);
+    updateAccepting();
+    if (clientList.contains(client)) {
+        ClientContext *ctx = clientList.value(client);
+        qCDebug(dbgServer) << "Client" << ctx->clientId << "disconnected.";
+
+        if (!ctx->willTopic.isEmpty()) {
+            qCDebug(dbgServer) << "Publishing will message for client" << ctx->clientId << "on topic" << ctx->willTopic << "( Retain:" << ctx->willRetain << ")";
+            // The will is not received from the connection, there is nothing to acknowledge and no packet ID to track
+            MqttPacket willPacket(MqttPacket::TypePublish, 0, ctx->willQoS, ctx->willRetain);
+            willPacket.setTopic(ctx->willTopic);
+            willPacket.setPayload(ctx->willMessage);
+            statistics.messagesReceived++;
+            distributePublish(client, ctx, willPacket);
+        }
+
+        bool keepSession = !ctx->cleanSession && sessionExpiryInterval > 0;
+        if (!keepSession) {
+            while (!ctx->subscriptions.isEmpty()) {
+                emit q_ptr->clientUnsubscribed(ctx->clientId, ctx->subscriptions.takeFirst().topicFilter());
+            }
+        }
+
+        emit q_ptr->clientDisconnected(ctx->clientId);
+
+        clientList.remove(client);
+        ctx->transmissions.clear();
+        if (keepSession) {
+            qCDebug(dbgServer) << "Keeping session of" << ctx->clientId << "for" << sessionExpiryInterval << "seconds.";
+            offlineSessions.insert(ctx->clientId, ctx);
+            sessionExpiries.add(ctx->clientId, sessionExpiryInterval * 1000LL);
+        } else {
+            if (isPersisted(ctx)) {
+                sessionStore->removeSession(ctx->clientId);
+            }
+            delete ctx;
+        }
+    }
+
+    // Last, after the will went out, as the client is deleted before the next group commit
+    dropHeldAcknowledgements(client);
+    if (client->isOpen()) {
+        flush(client);
+        client->close();
+    }
+    client->deleteLater();
+}
+
+void MqttServerPrivate::distributePublish(QIODevice *client, ClientContext *ctx, const MqttPacket &packet)
+{
+    // Checked first, a client without write access may not set or clear the retained message either
+    if (!authorizePublish(client, ctx, packet.topic())) {
+        qCDebug(dbgServer) << "Client not authorized to publish to this topic. Discarding packet";
+        return;
+    }
+
+    // Topics starting with $ are reserved for the server, clients can't publish to other clients there
+    bool reserved = packet.topic().startsWith('$');
+    qint64 expiry = defaultExpiry(packet.topic());
+    if (packet.retain() && !reserved) {
+        if (packet.payload().isEmpty()) {
+            qCDebug(dbgServer) << "Clearing retained message for topic" << packet.topic();
+            retainedMessages->remove(packet.topic());
+            if (cluster) {
+                cluster->removeRetained(packet.topic());
+            }
+        } else {
+            // A retained message replaces the previous one, regardless of its QoS
+            qCDebug(dbgServer) << "Setting retained message for topic" << packet.topic();
+            MqttPacket retainedPacket = packet;
+            retainedPacket.setExpiry(expiry);
+            if (retainedMessages->insert(packet.topic(), retainedPacket) && expiry > 0) {
+                retainedExpiries.insert(expiry, packet.topic());
+            }
+            if (cluster) {
+                cluster->replicateRetained(packet.topic(), retainedPacket);
+            }
+        }
+    }
+
+    emit q_ptr->publishReceived(ctx->clientId, packet.packetId(), packet.topic(), packet.payload());
+    if (reserved) {
+        return;
+    }
+    if (cluster) {
+        cluster->forwardPublish(packet.topic(), packet.payload(), expiry);
+    }
+    route(packet.topic(), packet.payload(), expiry);
+}
+
+bool MqttServerPrivate::authorizePublish(QIODevice *client, ClientContext *ctx, const QByteArray &topic)
+{
+    if (!accessControl.isEmpty() && !(ctx->permissions.access(topic) & MqttAccessControl::AccessWrite)) {
+        return false;
+    }
+    if (!authorizer) {
+        return true;
+    }
+    QHash<QByteArray, bool>::const_iterator it = ctx->publishAuthorizations.constFind(topic);
+    if (it != ctx->publishAuthorizations.constEnd()) {
+        return it.value();
+    }
+    bool allowed = authorizer->authorizePublish(clientServerMap.value(client), ctx->clientId, topic);
+    cacheAuthorization(&ctx->publishAuthorizations, topic, allowed);
+    return allowed;
+}
+
+bool MqttServerPrivate::authorizeSubscribe(QIODevice *client, ClientContext *ctx, const QByteArray &topicFilter)
+{
+    if (!accessControl.isEmpty() && !(ctx->permissions.access(topicFilter) & MqttAccessControl::AccessRead)) {
+        return false;
+    }
+    if (!authorizer) {
+        return true;
+    }
+    QHash<QByteArray, bool>::const_iterator it = ctx->subscribeAuthorizations.constFind(topicFilter);
+    if (it != ctx->subscribeAuthorizations.constEnd()) {
+        return it.value();
+    }
+    bool allowed = authorizer->authorizeSubscribe(clientServerMap.value(client), ctx->clientId, topicFilter);
+    cacheAuthorization(&ctx->subscribeAuthorizations, topicFilter, allowed);
+    return allowed;
+}
+
+void MqttServerPrivate::cacheAuthorization(QHash<QByteArray, bool> *cache, const QByteArray &topic, bool allowed)
+{
+    if (authorizationCacheSize <= 0) {
+        return;
+    }
+    if (cache->count() >= authorizationCacheSize) {
+        // Starting over is cheaper than tracking the use of every entry, the busy topics are back in no time
+        cache->clear();
+    }
+    cache->insert(topic, allowed);
+}
+
+void MqttServerPrivate::clearAuthorizations(ClientContext *ctx)
+{
+    ctx->publishAuthorizations.clear();
+    ctx->subscribeAuthorizations.clear();
+}
+
+void MqttServerPrivate::compilePermissions(ClientContext *ctx)
+{
+    ctx->permissions = accessControl.isEmpty() ? MqttAccessTrie() : accessControl.compile(ctx->clientId, ctx->username);
+}
+
+MqttPacket MqttServerPrivate::deliverMessage(QIODevice *client, ClientContext *ctx, const QString &topic, const QByteArray &payload, Mqtt::QoS qos, qint64 expiry, bool retain)
+{
+    if (qos >= Mqtt::QoS1 && (!ctx->messageQueue.isEmpty() || (ctx->maximumInflight > 0 && ctx->outboundInflight >= ctx->maximumInflight))) {
+        // The in-flight window is full, the message is sent once acknowledgements come in
+        queueMessage(ctx, topic, payload, qos, expiry, retain);
+        return MqttPacket();
+    }
+    MqttPacket packet(MqttPacket::TypePublish, qos >= Mqtt::QoS1 ? newPacketId(ctx) : 0, qos, retain);
+    packet.setTopic(topic.toUtf8());
+    packet.setPayload(payload);
+    packet.setExpiry(expiry);
+    sendPacket(client, packet);
+    if (qos >= Mqtt::QoS1) {
+        addInflight(client, ctx, packet);
+    }
+    return packet;
+}
+
+void MqttServerPrivate::queueMessage(ClientContext *ctx, const QString &topic, const QByteArray &payload, Mqtt::QoS qos, qint64 expiry, bool retain)
+{
+    MqttPacket packet(MqttPacket::TypePublish, 0, qos, retain);
+    packet.setTopic(topic.toUtf8());
+    packet.setPayload(payload);
+    packet.setExpiry(expiry);
+    if (payloadCompressionThreshold > 0 && payload.size() >= payloadCompressionThreshold) {
+        packet.compressPayload();
+    }
+    ctx->messageQueue.enqueue(packet);
+    ctx->messageQueueBytes += packet.topic().size() + packet.payload().size();
+    if (isPersisted(ctx)) {
+        sessionStore->queueMessage(ctx->clientId, packet);
+    }
+
+    int dropped = 0;
+    while (!ctx->messageQueue.isEmpty()
+           && (ctx->messageQueue.count() > maximumOfflineQueueCount || ctx->messageQueueBytes > maximumOfflineQueueBytes)) {
+        MqttPacket droppedPacket = ctx->messageQueue.dequeue();
+        ctx->messageQueueBytes -= droppedPacket.topic().size() + droppedPacket.payload().size();
+        qCDebug(dbgServer) << "Message queue of" << ctx->clientId << "is full. Dropping message on" << droppedPacket.topic();
+        dropped++;
+        statistics.messagesDropped++;
+    }
+    if (isPersisted(ctx) && dropped > 0) {
+        sessionStore->dequeueMessages(ctx->clientId, dropped);
+    }
+}
+
+void MqttServerPrivate::deliverQueuedMessages(QIODevice *client, ClientContext *ctx)
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    int delivered = 0;
+    int expired = 0;
+    while (!ctx->messageQueue.isEmpty() && (ctx->maximumInflight == 0 || ctx->outboundInflight < ctx->maximumInflight)) {
+        MqttPacket queued = ctx->messageQueue.dequeue();
+        ctx->messageQueueBytes -= queued.topic().size() + queued.payload().size();
+        if (queued.isExpired(now)) {
+            expired++;
+            continue;
+        }
+        queued.decompressPayload();
+        MqttPacket packet(MqttPacket::TypePublish, newPacketId(ctx), queued.qos(), queued.retain());
+        packet.setTopic(queued.topic());
+        packet.setPayload(queued.payload());
+        packet.setExpiry(queued.expiry());
+        sendPacket(client, packet);
+        addInflight(client, ctx, packet);
+        delivered++;
+    }
+    if (delivered + expired == 0) {
+        return;
+    }
+    qCDebug(dbgServer) << "Delivered" << delivered << "queued messages to" << ctx->clientId << "," << expired << "expired," << ctx->messageQueue.count() << "still queued";
+    // Stored as in flight before being removed from the queue, a crash in between leads to a duplicate rather than a loss
+    if (isPersisted(ctx)) {
+        sessionStore->dequeueMessages(ctx->clientId, delivered + expired);
+    }
+}
+
+void MqttServerPrivate::addInflight(QIODevice *client, ClientContext *ctx, const MqttPacket &packet)
+{
+    ctx->unackedPackets.insert(packet);
+    ctx->outboundInflight++;
+    if (isPersisted(ctx)) {
+        sessionStore->storePacket(ctx->clientId, packet);
+    }
+    trackTransmission(client, ctx, packet.packetId());
+}
+
+void MqttServerPrivate::countInflight(ClientContext *ctx)
+{
+    ctx->outboundInflight = 0;
+    foreach (const MqttPacket &packet, ctx->unackedPackets.packets()) {
+        if (packet.type() == MqttPacket::TypePublish || packet.type() == MqttPacket::TypePubrel) {
+            ctx->outboundInflight++;
+        }
+    }
+}
+
+void MqttServerPrivate::applyInflightLimit(ClientContext *ctx, int addressId)
+{
+    int maximum = listenerMaximumInflightMessages.value(addressId, maximumInflightMessages);
+    ctx->maximumInflight = static_cast<quint16>(qBound(0, maximum, 0xffff));
+}
+
+void MqttServerPrivate::discardSession(ClientContext *ctx)
+{
+    qCDebug(dbgServer) << "Discarding session of" << ctx->clientId << "with" << ctx->messageQueue.count() << "queued messages.";
+    while (!ctx->subscriptions.isEmpty()) {
+        emit q_ptr->clientUnsubscribed(ctx->clientId, ctx->subscriptions.takeFirst().topicFilter());
+    }
+    if (sessionStore) {
+        sessionStore->removeSession(ctx->clientId);
+    }
+    delete ctx;
+}
+
+bool MqttServerPrivate::isPersisted(const ClientContext *ctx) const
+{
+    return sessionStore && !ctx->cleanSession;
+}
+
+void MqttServerPrivate::persistSession(ClientContext *ctx)
+{
+    sessionStore->addSession(ctx->clientId, ctx->username);
+    foreach (const MqttSubscription &subscription, ctx->subscriptions) {
+        sessionStore->addSubscription(ctx->clientId, subscription);
+    }
+    foreach (const MqttPacket &packet, ctx->unackedPackets.packets()) {
+        sessionStore->storePacket(ctx->clientId, packet);
+    }
+    foreach (const MqttPacket &packet, ctx->messageQueue) {
+        sessionStore->queueMessage(ctx->clientId, packet);
+    }
+}
+
+void MqttServerPrivate::restoreStoredSessions()
+{
+    QList<MqttSessionStore::Session> sessions = sessionStore->restoreSessions();
+    qCDebug(dbgServer) << "Restoring" << sessions.count() << "sessions from the session store.";
+    foreach (const MqttSessionStore::Session &session, sessions) {
+        bool active = offlineSessions.contains(session.clientId);
+        foreach (ClientContext *ctx, clientList) {
+            active |= ctx->clientId == session.clientId;
+        }
+        if (active) {
+            continue;
+        }
+        if (sessionExpiryInterval == 0) {
+            sessionStore->removeSession(session.clientId);
+            continue;
+        }
+        ClientContext *ctx = new ClientContext();
+        ctx->clientId = session.clientId;
+        ctx->username = session.username;
+        ctx->cleanSession = false;
+        ctx->subscriptions = session.subscriptions;
+        foreach (const MqttPacket &packet, session.inflightPackets) {
+            ctx->unackedPackets.insert(packet);
+        }
+        countInflight(ctx);
+        foreach (const MqttPacket &packet, session.queuedMessages) {
+            ctx->messageQueue.enqueue(packet);
+            ctx->messageQueueBytes += packet.topic().size() + packet.payload().size();
+        }
+        offlineSessions.insert(ctx->clientId, ctx);
+        sessionExpiries.add(ctx->clientId, sessionExpiryInterval * 1000LL);
+        foreach (const MqttSubscription &subscription, ctx->subscriptions) {
+            emit q_ptr->clientSubscribed(ctx->clientId, subscription.topicFilter(), subscription.qoS());
+        }
+    }
+}
+
+void MqttServerPrivate::acknowledge(QIODevice *client, const MqttPacket &packet)
+{
+    if (!durableAcknowledgements) {
+        sendPacket(client, packet);
+        return;
+    }
+    // The message is processed after this, the ack is sent with the next group commit
+    heldAcknowledgements.append(qMakePair(client, packet));
+    if (groupCommitBatchSize > 0 && heldAcknowledgements.count() >= groupCommitBatchSize) {
+        // Commit once processing of the current packet is done
+        groupCommitTimer.start(0);
+    } else if (!groupCommitTimer.isActive()) {
+        groupCommitTimer.start(groupCommitInterval);
+    }
+}
+
+void MqttServerPrivate::commitAcknowledgements()
+{
+    groupCommitTimer.stop();
+    if (heldAcknowledgements.isEmpty()) {
+        return;
+    }
+    bool synced = true;
+    if (sessionStore && !sessionStore->sync()) {
+        qCWarning(dbgServer) << "Syncing the session store failed.";
+        synced = false;
+    }
+    if (retainedMessages->isPersistent() && !retainedMessages->sync()) {
+        qCWarning(dbgServer) << "Syncing the retained messages failed.";
+        synced = false;
+    }
+    QList<QPair<QIODevice*, MqttPacket> > acknowledgements;
+    acknowledgements.swap(heldAcknowledgements);
+    if (!synced) {
+        // The messages may not survive a crash, so they must not be acknowledged. Without an acknowledgement
+        // the clients keep them and retransmit them once they reconnected.
+        QList<QIODevice*> clients;
+        for (int i = 0; i < acknowledgements.count(); i++) {
+            if (!clients.contains(acknowledgements.at(i).first)) {
+                clients.append(acknowledgements.at(i).first);
+            }
+        }
+        foreach (QIODevice *client, clients) {
+            if (clientList.contains(client)) {
+                qCWarning(dbgServer) << "Dropping client" << clientList.value(client)->clientId << "to have it retransmit unacknowledged messages.";
+                cleanupClient(client);
+            }
+        }
+        return;
+    }
+    for (int i = 0; i < acknowledgements.count(); i++) {
+        QIODevice *client = acknowledgements.at(i).first;
+        sendPacket(client, acknowledgements.at(i).second);
+        if (i == acknowledgements.count() - 1 || acknowledgements.at(i + 1).first != client) {
+            flush(client);
+        }
+    }
+}
+
+void MqttServerPrivate::dropHeldAcknowledgements(QIODevice *client)
+{
+    for (int i = heldAcknowledgements.count() - 1; i >= 0; i--) {
+        if (heldAcknowledgements.at(i).first == client) {
+            heldAcknowledgements.removeAt(i);
+        }
+    }
+}
+
+void MqttServerPrivate::onSessionsExpired(const QList<QString> &clientIds)
+{
+    foreach (const QString &clientId, clientIds) {
+        ClientContext *ctx = offlineSessions.take(clientId);
+        if (ctx) {
+            qCDebug(dbgServer) << "Session of" << clientId << "expired.";
+            discardSession(ctx);
+        }
+    }
+}
+
+bool MqttServerPrivate::admitConnect(const MqttPacket &packet, QIODevice *client)
+{
+    if (connectRate <= 0 && addressConnectRate <= 0) {
+        return true;
+    }
+
+    // Keep the order of the queue, new clients only pass if nobody is waiting
+    if (queuedConnects.isEmpty() && takeConnectToken(client)) {
+        return true;
+    }
+
+    if (queuedConnects.count() >= maximumQueuedConnects) {
+        qCWarning(dbgServer) << "Connect queue is full. Rejecting connection from" << peerAddress(client).toString();
+        MqttPacket response(MqttPacket::TypeConnack, packet.packetId());
+        response.setConnectReturnCode(Mqtt::ConnectReturnCodeServerUnavailable);
+        sendPacket(client, response);
+        cleanupClient(client);
+        return false;
+    }
+
+    qCDebug(dbgServer) << "Connect rate limit reached. Queueing connection from" << peerAddress(client).toString();
+    queuedConnects.append(client);
+    queuedConnectPackets.insert(client, packet);
+    updateAccepting();
+    if (!connectQueueTimer.isActive()) {
+        int fastestRate = qMax(connectRate, addressConnectRate);
+        connectQueueTimer.start(qBound(10, 1000 / fastestRate, 1000));
+    }
+    return false;
+}
+
+bool MqttServerPrivate::takeConnectToken(QIODevice *client)
+{
+    qint64 now = admissionClock.elapsed();
+
+    TokenBucket *listenerBucket = nullptr;
+    if (connectRate > 0) {
+        listenerBucket = &listenerConnectBuckets[clientServerMap.value(client)];
+        if (!listenerBucket->available(now, connectRate, connectBurst)) {
+            return false;
+        }
+    }
+
+    TokenBucket *addressBucket = nullptr;
+    if (addressConnectRate > 0) {
+        QHostAddress address = peerAddress(client);
+        if (!addressConnectBuckets.contains(address) && addressConnectBuckets.count() >= 1024) {
+            // Forget about addresses which have been quiet long enough to have a full bucket again
+            QHash<QHostAddress, TokenBucket>::iterator it = addressConnectBuckets.begin();
+            while (it != addressConnectBuckets.end()) {
+                if (it->isFull(now, addressConnectRate, addressConnectBurst)) {
+                    it = addressConnectBuckets.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+        addressBucket = &addressConnectBuckets[address];
+        if (!addressBucket->available(now, addressConnectRate, addressConnectBurst)) {
+            return false;
+        }
+    }
+
+    if (listenerBucket) {
+        listenerBucket->take();
+    }
+    if (addressBucket) {
+        addressBucket->take();
+    }
+    return true;
+}
+
+void MqttServerPrivate::processQueuedConnects()
+{
+    foreach (QIODevice *client, queuedConnects) {
+        // Handling a CONNECT may drop other clients (e.g. on session takeover)
+        if (!queuedConnectPackets.contains(client) || !takeConnectToken(client)) {
+            continue;
+        }
+        queuedConnects.removeOne(client);
+        MqttPacket packet = queuedConnectPackets.take(client);
+        processConnect(packet, client);
+
+        // Continue with anything the client sent after the CONNECT
+        if (clientList.contains(client)) {
+            processBuffer(client);
+        }
+    }
+
+    if (queuedConnects.isEmpty()) {
+        connectQueueTimer.stop();
+    }
+    updateAccepting();
+}
+
+void MqttServerPrivate::onAuthorizationFinished(QIODevice *client, MqttConnectAuthorization *authorization)
+{
+    // An authorization living in another thread finishes queued, the client may have gone away meanwhile. Don't
+    // touch it before knowing it's still waiting for this one.
+    QHash<QIODevice*, PendingAuthorization>::iterator it = pendingAuthorizations.find(client);
+    if (it == pendingAuthorizations.end() || it->authorization != authorization) {
+        return;
+    }
+    PendingAuthorization pending = *it;
+    pendingAuthorizations.erase(it);
+    connectionTimeouts.remove(client);
+    updateAccepting();
+
+    Mqtt::ConnectReturnCode returnCode = authorization->returnCode();
+    authorization->deleteLater();
+    if (returnCode != Mqtt::ConnectReturnCodeAccepted) {
+        qCWarning(dbgServer) << "Rejecting connection due to user validation.";
+        MqttPacket response(MqttPacket::TypeConnack, pending.packet.packetId());
+        response.setConnectReturnCode(returnCode);
+        sendPacket(client, response);
+        cleanupClient(client);
+        return;
+    }
+
+    acceptConnect(pending.packet, client, pending.clientId);
+
+    // Continue with anything the client sent after the CONNECT
+    if (clientList.contains(client)) {
+        processBuffer(client);
+    }
+}
+
+void MqttServerPrivate::dropPendingAuthorization(QIODevice *client)
+{
+    if (!pendingAuthorizations.contains(client)) {
+        return;
+    }
+    // Nobody waits for the result anymore, delete the authorization once it's finished. That happens in its own
+    // thread, so it's either finished by now or finished() is still to come.
+    MqttConnectAuthorization *authorization = pendingAuthorizations.take(client).authorization;
+    disconnect(authorization, nullptr, this, nullptr);
+    if (authorization->isFinished()) {
+        authorization->deleteLater();
+    } else {
+        connect(authorization, &MqttConnectAuthorization::finished, authorization, &QObject::deleteLater);
+    }
+}
 
-        emit q_ptr->clientDisconnected(ctx->clientId);
+bool MqttServerPrivate::isConnectHeld(QIODevice *client) const
+{
+    return queuedConnectPackets.contains(client) || pendingAuthorizations.contains(client);
+}
 
-        clientList.remove(client);
-        delete ctx;
+void MqttServerPrivate::updateAccepting()
+{
+    bool pause = maximumConcurrentHandshakes > 0
+            && pendingConnections.count() + queuedConnects.count() + pendingAuthorizations.count() >= maximumConcurrentHandshakes;
+    if (pause == acceptingPaused) {
+        return;
     }
-
-    if (client->isOpen()) {
-        client->flush();
-        client->close();
+    acceptingPaused = pause;
+    qCDebug(dbgServer) << (pause ? "Maximum concurrent handshakes reached. Pausing" : "Resuming") << "accepting new connections.";
+    foreach (SslServer *server, servers) {
+        if (pause) {
+            server->pauseAccepting();
+        } else {
+            server->resumeAccepting();
+        }
+    }
+    foreach (MqttIoUringServer *server, ioUringServers) {
+        if (pause) {
+            server->pauseAccepting();
+        } else {
+            server->resumeAccepting();
+        }
     }
-    client->deleteLater();
 }
 
-void MqttServerPrivate::processPacket(const MqttPacket &packet, QTcpSocket *client)
+void MqttServerPrivate::processConnect(const MqttPacket &packet, QIODevice *client)
 {
-    if (packet.type() == MqttPacket::TypeConnect) {
-        if (clientList.contains(client)) {
-            ClientContext *ctx = clientList.value(client);
-            qCWarning(dbgServer) << "Client" << ctx->clientId << "sends duplicate CONNECT packets. Dropping connection.";
+    MqttPacket response(MqttPacket::TypeConnack, packet.packetId());
+
+    if (packet.protocolLevel() != Mqtt::Protocol310 && packet.protocolLevel() != Mqtt::Protocol311) {
+        qCWarning(dbgServer) << "This MQTT broker only supports Protocol version 3.1.0 and 3.1.1 but client is" << packet.protocolLevel();
+        response.setConnectReturnCode(Mqtt::ConnectReturnCodeUnacceptableProtocolVersion);
+        sendPacket(client, response);
+        cleanupClient(client);
+        return;
+    }
+
+    QString clientId = packet.clientId();
+    if (clientId.isEmpty()) {
+        if (!packet.cleanSession()) {
+            qCWarning(dbgServer) << "Empty client id provided but clean session flag not set. Rejecting connection.";
+            response.setConnectReturnCode(Mqtt::ConnectReturnCodeIdentifierRejected);
+            sendPacket(client, response);
             cleanupClient(client);
             return;
         }
+        clientId = QUuid::createUuid().toString().remove(QRegExp("[{}-]*"));
+    }
 
-        MqttPacket response(MqttPacket::TypeConnack, packet.packetId());
-
-        if (packet.protocolLevel() != Mqtt::Protocol310 && packet.protocolLevel() != Mqtt::Protocol311) {
-            qCWarning(dbgServer) << "This MQTT broker only supports Protocol version 3.1.0 and 3.1.1 but client is" << packet.protocolLevel();
-            response.setConnectReturnCode(Mqtt::ConnectReturnCodeUnacceptableProtocolVersion);
-            client->write(response.serialize());
+    if (authorizer) {
+        QString username;
+        if (packet.connectFlags().testFlag(Mqtt::ConnectFlagUsername)) {
+            username = packet.username();
+        }
+        QString password;
+        if (packet.connectFlags().testFlag(Mqtt::ConnectFlagPassword)) {
+            password = packet.password();
+        }
+        int serverAddressId = clientServerMap.value(client);
+        if (maximumPendingAuthorizations > 0 && pendingAuthorizations.count() >= maximumPendingAuthorizations) {
+            qCWarning(dbgServer) << "Too many pending authorizations. Rejecting connection from" << peerAddress(client).toString();
+            response.setConnectReturnCode(Mqtt::ConnectReturnCodeServerUnavailable);
+            sendPacket(client, response);
             cleanupClient(client);
             return;
         }
-
-        QString clientId = packet.clientId();
-        if (clientId.isEmpty()) {
-            if (!packet.cleanSession()) {
-                qCWarning(dbgServer) << "Empty client id provided but clean session flag not set. Rejecting connection.";
-                response.setConnectReturnCode(Mqtt::ConnectReturnCodeIdentifierRejected);
-                client->write(response.serialize());
-                cleanupClient(client);
-                return;
+        Mqtt::ConnectReturnCode userValidationReturnCode = Mqtt::ConnectReturnCodeAccepted;
+        MqttConnectAuthorization *authorization = authorizer->authorizeConnectAsync(serverAddressId, clientId, username, password, peerAddress(client));
+        if (authorization && !authorization->isFinished()) {
+            qCDebug(dbgServer).nospace() << clientId << ": Waiting for authorization.";
+            PendingAuthorization pending;
+            pending.authorization = authorization;
+            pending.packet = packet;
+            pending.clientId = clientId;
+            pendingAuthorizations.insert(client, pending);
+            // It finishes from the event loop, also when completed from another thread or right away in this one
+            connect(authorization, &MqttConnectAuthorization::finished, this, [this, client, authorization]() {
+                onAuthorizationFinished(client, authorization);
+            });
+            if (authorizationTimeout > 0) {
+                connectionTimeouts.add(client, authorizationTimeout);
             }
-            clientId = QUuid::createUuid().toString().remove(QRegExp("[{}-]*"));
+            updateAccepting();
+            return;
+        } else if (authorization) {
+            userValidationReturnCode = authorization->returnCode();
+            authorization->deleteLater();
+        } else {
+            userValidationReturnCode = authorizer->authorizeConnect(serverAddressId, clientId, username, password, peerAddress(client));
         }
-
-        if (authorizer) {
-            QString username;
-            if (packet.connectFlags().testFlag(Mqtt::ConnectFlagUsername)) {
-                username = packet.username();
-            }
-            QString password;
-            if (packet.connectFlags().testFlag(Mqtt::ConnectFlagPassword)) {
-                password = packet.password();
-            }
-            SslServer *server = clientServerMap.value(client);
-            int serverAddressId = servers.key(server);
-            Mqtt::ConnectReturnCode userValidationReturnCode = authorizer->authorizeConnect(serverAddressId, clientId, username, password, client->peerAddress());
-            if (userValidationReturnCode != Mqtt::ConnectReturnCodeAccepted) {
-                qCWarning(dbgServer) << "Rejecting connection due to user validation.";
-                response.setConnectReturnCode(userValidationReturnCode);
-                client->write(response.serialize());
-                cleanupClient(client);
-                return;
-            }
+        if (userValidationReturnCode != Mqtt::ConnectReturnCodeAccepted) {
+            qCWarning(dbgServer) << "Rejecting connection due to user validation.";
+            response.setConnectReturnCode(userValidationReturnCode);
+            sendPacket(client, response);
+            cleanupClient(client);
+            return;
         }
+    }
 
-        ClientContext *ctx = nullptr;
-
-        QList<QTcpSocket*> existingSockets = clientList.keys();
-        for (int i = 0; i < existingSockets.count(); i++) {
-            QTcpSocket *existingClient = existingSockets.at(i);
-            if (clientId == clientList.value(existingClient)->clientId) {
-                if (!packet.connectFlags().testFlag(Mqtt::ConnectFlagCleanSession)) {
-                    qCDebug(dbgServer).nospace() << clientId << ": Already have a session for this client ID. Taking over existing session.";
+    acceptConnect(packet, client, clientId);
+}
 
-                    response.setConnackFlags(Mqtt::ConnackFlagSessionPresent);
-                    ctx = clientList.value(existingClient);
+void MqttServerPrivate::acceptConnect(const MqttPacket &packet, QIODevice *client, const QString &clientId)
+{
+    MqttPacket response(MqttPacket::TypeConnack, packet.packetId());
+    ClientContext *ctx = nullptr;
 
-                    // remove old client manually, we don't want to clean up the context, nor send any will message or emit disconnected signals
-                    clientList.remove(existingClient);
-                    clientBuffers.remove(existingClient);
-                    existingClient->flush();
-                    existingClient->deleteLater();
-                } else {
-                    qCDebug(dbgServer).nospace() << clientId << ": Already have a session for this client ID. Dropping old session.";
-                    cleanupClient(existingClient);
-                }
-                break;
-            }
-        }
+    if (broker) {
+        // Client IDs are unique across the broker, a session elsewhere moves over to this server
+        broker->releaseClientId(this, clientId);
+    }
 
-        if (!ctx) {
+    QList<QIODevice*> existingSockets = clientList.keys();
+    for (int i = 0; i < existingSockets.count(); i++) {
+        QIODevice *existingClient = existingSockets.at(i);
+        if (clientId == clientList.value(existingClient)->clientId) {
             if (!packet.connectFlags().testFlag(Mqtt::ConnectFlagCleanSession)) {
-                qCWarning(dbgServer).nospace() << clientId << ": Request to take over existing session but we don't have an existing session.";
+                qCDebug(dbgServer).nospace() << clientId << ": Already have a session for this client ID. Taking over existing session.";
+
+                response.setConnackFlags(Mqtt::ConnackFlagSessionPresent);
+                ctx = clientList.value(existingClient);
+
+                // remove old client manually, we don't want to clean up the context, nor send any will message or emit disconnected signals
+                clientList.remove(existingClient);
+                clientBuffers.remove(existingClient);
+                clientServerMap.remove(existingClient);
+                connectionTimeouts.remove(existingClient);
+                retransmissions.remove(existingClient);
+                ctx->transmissions.clear();
+                dropHeldAcknowledgements(existingClient);
+                flush(existingClient);
+                existingClient->deleteLater();
+            } else {
+                qCDebug(dbgServer).nospace() << clientId << ": Already have a session for this client ID. Dropping old session.";
+                cleanupClient(existingClient);
             }
+            break;
+        }
+    }
 
-            ctx = new ClientContext();
-            ctx->clientId = clientId;
-
-            connect(&ctx->keepAliveTimer, &QTimer::timeout, this, [this, client](){
-                qCWarning(dbgServer) << "Keep alive timeout reached for client:" << clientList.value(client)->clientId;
-                cleanupClient(client);
-            });
+    if (!ctx && offlineSessions.contains(clientId)) {
+        ClientContext *offlineCtx = offlineSessions.take(clientId);
+        sessionExpiries.remove(clientId);
+        if (!packet.connectFlags().testFlag(Mqtt::ConnectFlagCleanSession)) {
+            qCDebug(dbgServer).nospace() << clientId << ": Resuming offline session.";
+            response.setConnackFlags(Mqtt::ConnackFlagSessionPresent);
+            ctx = offlineCtx;
+        } else {
+            discardSession(offlineCtx);
         }
+    }
 
-        ctx->keepAlive = packet.keepAlive();
-        ctx->version = packet.protocolLevel();
+    if (!ctx) {
+        if (!packet.connectFlags().testFlag(Mqtt::ConnectFlagCleanSession)) {
+            qCWarning(dbgServer).nospace() << clientId << ": Request to take over existing session but we don't have an existing session.";
+        }
 
+        ctx = new ClientContext();
+        ctx->clientId = clientId;
+    }
 
-        if (packet.connectFlags().testFlag(Mqtt::ConnectFlagWill)) {
-            ctx->willTopic = packet.willTopic();
-            ctx->willMessage = packet.willMessage();
-            ctx->willRetain = packet.willRetain();
-            if (packet.connectFlags().testFlag(Mqtt::ConnectFlagWillQoS2)) {
-                ctx->willQoS = Mqtt::QoS2;
-            } else if (packet.connectFlags().testFlag(Mqtt::ConnectFlagWillQoS1)) {
-                ctx->willQoS = Mqtt::QoS1;
-            }
-        }
-        if (packet.connectFlags().testFlag(Mqtt::ConnectFlagUsername)) {
-            ctx->username = packet.username();
-        }
-        if (packet.connectFlags().testFlag(Mqtt::ConnectFlagPassword)) {
+    // Decisions for a resumed session may not apply to the listener or user of this connection
+    clearAuthorizations(ctx);
+    ctx->keepAlive = packet.keepAlive();
+    ctx->version = packet.protocolLevel();
+    applyInflightLimit(ctx, clientServerMap.value(client));
+    bool wasPersisted = isPersisted(ctx);
+    ctx->cleanSession = packet.connectFlags().testFlag(Mqtt::ConnectFlagCleanSession);
+
+    // The will of a resumed session is replaced by the one in this CONNECT
+    ctx->willTopic.clear();
+    ctx->willMessage.clear();
+    ctx->willQoS = Mqtt::QoS0;
+    ctx->willRetain = false;
+
+    if (packet.connectFlags().testFlag(Mqtt::ConnectFlagWill)) {
+        ctx->willTopic = packet.willTopic();
+        ctx->willMessage = packet.willMessage();
+        ctx->willRetain = packet.willRetain();
+        if (packet.connectFlags().testFlag(Mqtt::ConnectFlagWillQoS2)) {
+            ctx->willQoS = Mqtt::QoS2;
+        } else if (packet.connectFlags().testFlag(Mqtt::ConnectFlagWillQoS1)) {
+            ctx->willQoS = Mqtt::QoS1;
         }
+    }
+    // A resumed session may have been connected with another username before
+    ctx->username = packet.connectFlags().testFlag(Mqtt::ConnectFlagUsername) ? QString(packet.username()) : QString();
+    compilePermissions(ctx);
+    if (packet.connectFlags().testFlag(Mqtt::ConnectFlagPassword)) {
+    }
+    if (isPersisted(ctx) && !wasPersisted) {
+        persistSession(ctx);
+    }
 
-        qCDebug(dbgServer).nospace().noquote()
-                << "New MQTT client: \"" << clientId << '\"'
-                << ", Protocol: " << packet.protocolName() << " (" << packet.protocolLevel() << ')'
-                << ", Flags: " << packet.connectFlags()
-                << ", KeepAlive: " << packet.keepAlive()
-                << ", Will Topic: \"" << packet.willTopic() << '\"'
-                << ", Will Message: \"" << packet.willMessage() << '\"'
-                << ", Will Retain: " << packet.willRetain()
-                << ", Username: " << packet.username()
-                << ", Password: " << QString(packet.password()).replace(QRegExp("."), "*");
+    qCDebug(dbgServer).nospace().noquote()
+            << "New MQTT client: \"" << clientId << '\"'
+            << ", Protocol: " << packet.protocolName() << " (" << packet.protocolLevel() << ')'
+            << ", Flags: " << packet.connectFlags()
+            << ", KeepAlive: " << packet.keepAlive()
+            << ", Will Topic: \"" << packet.willTopic() << '\"'
+            << ", Will Message: \"" << packet.willMessage() << '\"'
+            << ", Will Retain: " << packet.willRetain()
+            << ", Username: " << packet.username()
+            << ", Password: " << QString(packet.password()).replace(QRegExp("."), "*");
+
+    if (ctx->keepAlive > 0) {
+        connectionTimeouts.add(client, ctx->keepAlive * 1500);
+    }
 
-        if (ctx->keepAlive > 0) {
-            ctx->keepAliveTimer.start(ctx->keepAlive * 1500);
+    clientList.insert(client, ctx);
+    response.setConnectReturnCode(Mqtt::ConnectReturnCodeAccepted);
+    sendPacket(client, response);
+    emit q_ptr->clientConnected(clientServerMap.value(client), ctx->clientId, ctx->username, peerAddress(client));
+
+    dropExpiredInflight(ctx, QDateTime::currentMSecsSinceEpoch());
+    foreach (MqttPacket retryPacket, ctx->unackedPackets.packets()) {
+        qCDebug(dbgServer) << "Resending unacked packet" << retryPacket.packetId() << "to" << ctx->clientId;
+        retryPacket.setDup(true);
+        sendPacket(client, retryPacket);
+        if (retryPacket.type() == MqttPacket::TypePublish || retryPacket.type() == MqttPacket::TypePubrel) {
+            trackTransmission(client, ctx, retryPacket.packetId(), 1);
         }
+    }
+    deliverQueuedMessages(client, ctx);
+}
 
-        clientList.insert(client, ctx);
-        response.setConnectReturnCode(Mqtt::ConnectReturnCodeAccepted);
-        client->write(response.serialize());
-        emit q_ptr->clientConnected(servers.key(clientServerMap.value(client)), ctx->clientId, ctx->username, client->peerAddress());
+void MqttServerPrivate::processPacket(const MqttPacket &packet, QIODevice *client)
+{
+    if (packet.type() == MqttPacket::TypeConnect) {
+        if (clientList.contains(client)) {
+            ClientContext *ctx = clientList.value(client);
+            qCWarning(dbgServer) << "Client" << ctx->clientId << "sends duplicate CONNECT packets. Dropping connection.";
+            cleanupClient(client);
+            return;
+        }
 
-        foreach (quint16 retryPacketId, ctx->unackedPacketList) {
-            qCDebug(dbgServer) << "Resending unacked packet" << retryPacketId << "to" << ctx->clientId;;
-            MqttPacket retryPacket = ctx->unackedPackets.value(retryPacketId);
-            retryPacket.setDup(true);
-            client->write(retryPacket.serialize());
+        if (!admitConnect(packet, client)) {
+            return;
         }
+        processConnect(packet, client);
         return;
     }
 
@@ -450,27 +2624,26 @@ void MqttServerPrivate::processPacket(const MqttPacket &packet, QTcpSocket *clie
     }
 
     ClientContext *ctx = clientList.value(client);
-    if (ctx->keepAlive > 0) {
-        ctx->keepAliveTimer.start();
-    }
+    connectionTimeouts.touch(client);
     emit q_ptr->clientAlive(ctx->clientId);
 
     if (packet.type() == MqttPacket::TypePublish) {
+        statistics.messagesReceived++;
         qCDebug(dbgServer).nospace() << "Publish received from client " << ctx->clientId << ": Topic: " << packet.topic() << ", Payload: " << packet.payload() << " (Packet ID: " << packet.packetId() << ", DUP: " << packet.dup() << ", QoS: " << packet.qos() << ", Retain: " << packet.retain() << ')';
         switch (packet.qos()) {
         case Mqtt::QoS0:
             break;
         case Mqtt::QoS1: {
             MqttPacket response(MqttPacket::TypePuback, packet.packetId());
-            client->write(response.serialize());
+            acknowledge(client, response);
             break;
         }
         case Mqtt::QoS2: {
-            if (packet.dup() && ctx->unackedPacketList.contains(packet.packetId())) {
+            if (packet.dup() && ctx->unackedPackets.contains(packet.packetId())) {
                 // We received this message before but the client keeps on trying... Just send a PUBREC and stop processing
-                client->write(ctx->unackedPackets.value(packet.packetId()).serialize());
+                acknowledge(client, ctx->unackedPackets.value(packet.packetId()));
                 return;
-            } else if (ctx->unackedPacketList.contains(packet.packetId())) {
+            } else if (ctx->unackedPackets.contains(packet.packetId())) {
                 // Hmm... Client says this is a new packet, but the ID is not released yet! Drop client connection.
                 qCWarning(dbgServer()).nospace() << "Received a bad packet from \"" << ctx->clientId << "\". DUP is not set but packet ID is already used and not released. Dropping client connection.";
                 cleanupClient(client);
@@ -478,60 +2651,78 @@ void MqttServerPrivate::processPacket(const MqttPacket &packet, QTcpSocket *clie
             }
             // Ok, a new packet, ack it with a PUBREC and store the number
             MqttPacket response(MqttPacket::TypePubrec, packet.packetId());
-            ctx->unackedPackets.insert(response.packetId(), response);
-            ctx->unackedPacketList.append(packet.packetId());
-            client->write(response.serialize());
-            break;
-        }
-        }
-        if (packet.retain()) {
-            if (packet.payload().isEmpty()) {
-                qCDebug(dbgServer) << "Clearing retained messages for topic" << packet.topic();
-                retainedMessages.remove(packet.topic());
-            } else {
-                if (packet.qos() == Mqtt::QoS0) {
-                    qCDebug(dbgServer) << "Clearing retained messages for topic" << packet.topic();
-                    retainedMessages.remove(packet.topic());
-                }
-                qCDebug(dbgServer) << "Adding retained message for topic" << packet.topic();
-                retainedMessages[packet.topic()].append(packet);
+            ctx->unackedPackets.insert(response);
+            if (isPersisted(ctx)) {
+                sessionStore->storePacket(ctx->clientId, response);
             }
+            acknowledge(client, response);
+            break;
         }
-
-        if (authorizer && !authorizer->authorizePublish(servers.key(clientServerMap.value(client)), ctx->clientId, packet.topic())) {
-            qCDebug(dbgServer) << "Client not authorized to publish to this topic. Discarding packet";
-            return;
         }
-
-        emit q_ptr->publishReceived(ctx->clientId, packet.packetId(), packet.topic(), packet.payload());
-        publish(packet.topic(), packet.payload());
+        distributePublish(client, ctx, packet);
 
         return;
     }
     if (packet.type() == MqttPacket::TypePuback) {
-        ctx->unackedPacketList.removeAll(packet.packetId());
+        completeTransmission(client, ctx, packet.packetId());
         MqttPacket publishedPacket = ctx->unackedPackets.take(packet.packetId());
+        if (isPersisted(ctx)) {
+            sessionStore->removePacket(ctx->clientId, packet.packetId());
+        }
         emit q_ptr->published(ctx->clientId, packet.packetId(), publishedPacket.topic(), publishedPacket.payload());
+        if (publishedPacket.type() == MqttPacket::TypePublish && clientList.contains(client)) {
+            if (ctx->outboundInflight > 0) {
+                ctx->outboundInflight--;
+            }
+            deliverQueuedMessages(client, ctx);
+        }
         return;
     }
     if (packet.type() == MqttPacket::TypePubrec) {
+        MqttPacket pubrel(MqttPacket::TypePubrel, packet.packetId());
+        if (ctx->unackedPackets.value(packet.packetId()).type() != MqttPacket::TypePublish) {
+            // A duplicate for a PUBREL sent before, or an unknown packet ID. Only (re)send the PUBREL, the message
+            // is not published again.
+            sendPacket(client, pubrel);
+            return;
+        }
         MqttPacket publishedPacket = ctx->unackedPackets.take(packet.packetId());
         emit q_ptr->published(ctx->clientId, packet.packetId(), publishedPacket.topic(), publishedPacket.payload());
-        MqttPacket pubrel(MqttPacket::TypePubrel, packet.packetId());
-        ctx->unackedPackets.insert(packet.packetId(), pubrel);
-        client->write(pubrel.serialize());
+        ctx->unackedPackets.insert(pubrel);
+        if (isPersisted(ctx)) {
+            sessionStore->storePacket(ctx->clientId, pubrel);
+        }
+        sendPacket(client, pubrel);
+        if (clientList.contains(client)) {
+            completeTransmission(client, ctx, packet.packetId());
+            trackTransmission(client, ctx, packet.packetId());
+        }
         return;
     }
     if (packet.type() == MqttPacket::TypePubrel) {
         ctx->unackedPackets.remove(packet.packetId());
-        ctx->unackedPacketList.removeAll(packet.packetId());
+        if (isPersisted(ctx)) {
+            sessionStore->removePacket(ctx->clientId, packet.packetId());
+        }
         MqttPacket response(MqttPacket::TypePubcomp, packet.packetId());
-        client->write(response.serialize());
+        sendPacket(client, response);
         return;
     }
     if (packet.type() == MqttPacket::TypePubcomp) {
+        bool completed = ctx->unackedPackets.value(packet.packetId()).type() == MqttPacket::TypePubrel;
+        if (completed) {
+            completeTransmission(client, ctx, packet.packetId());
+        }
         ctx->unackedPackets.remove(packet.packetId());
-        ctx->unackedPacketList.removeAll(packet.packetId());
+        if (isPersisted(ctx)) {
+            sessionStore->removePacket(ctx->clientId, packet.packetId());
+        }
+        if (completed) {
+            if (ctx->outboundInflight > 0) {
+                ctx->outboundInflight--;
+            }
+            deliverQueuedMessages(client, ctx);
+        }
         return;
     }
     if (packet.type() == MqttPacket::TypeSubscribe) {
@@ -540,7 +2731,7 @@ void MqttServerPrivate::processPacket(const MqttPacket &packet, QTcpSocket *clie
         QByteArray payload;
         MqttSubscriptions effectiveSubscriptions;
         foreach (MqttSubscription subscription, packet.subscriptions()) {
-            if (authorizer && !authorizer->authorizeSubscribe(servers.key(clientServerMap.value(client)), ctx->clientId, subscription.topicFilter())) {
+            if (!authorizeSubscribe(client, ctx, subscription.topicFilter())) {
                 qCWarning(dbgServer).nospace().noquote() << "Subscription topic filter not allowed for client \"" << ctx->clientId << "\": \"" << subscription.topicFilter() << '\"';
                 response.addSubscribeReturnCode(Mqtt::SubscribeReturnCodeFailure);
                 continue;
@@ -562,6 +2753,9 @@ void MqttServerPrivate::processPacket(const MqttPacket &packet, QTcpSocket *clie
             if (!updated) {
                 ctx->subscriptions.append(subscription);
             }
+            if (isPersisted(ctx)) {
+                sessionStore->addSubscription(ctx->clientId, subscription);
+            }
             qCDebug(dbgServer).noquote().nospace() << "Subscribed client \"" << ctx->clientId << "\" to topic filter: \"" << subscription.topicFilter() << "\" with QoS " << subscription.qoS();
             effectiveSubscriptions << subscription;
             emit q_ptr->clientSubscribed(ctx->clientId, subscription.topicFilter(), subscription.qoS());
@@ -577,15 +2771,15 @@ void MqttServerPrivate::processPacket(const MqttPacket &packet, QTcpSocket *clie
                 break;
             }
         }
-        client->write(response.serialize());
+        sendPacket(client, response);
 
         // Deliver any retained messages for this topic
         foreach (MqttSubscription subscription, effectiveSubscriptions) {
-            foreach (const QString &topic, retainedMessages.keys()) {
+            foreach (const QString &topic, retainedMessages->topics()) {
                 if (matchTopic(subscription.topicFilter(), topic)) {
-                    foreach (MqttPacket packet, retainedMessages.value(topic)) {
-                        packet.setRetain(true);
-                        client->write(packet.serialize());
+                    // Like any other message, with a packet ID of this client and within its in-flight window
+                    foreach (const MqttPacket &packet, retainedPackets(topic)) {
+                        deliverMessage(client, ctx, topic, packet.payload(), qMin(packet.qos(), subscription.qoS()), packet.expiry(), true);
                     }
                 }
             }
@@ -600,6 +2794,9 @@ void MqttServerPrivate::processPacket(const MqttPacket &packet, QTcpSocket *clie
                 if (existingSubscription.topicFilter() == unsub.topicFilter()) {
                     qCDebug(dbgServer) << "Unsubscribing client" << ctx->clientId << "from" << unsub.topicFilter();
                     emit q_ptr->clientUnsubscribed(ctx->clientId, unsub.topicFilter());
+                    if (isPersisted(ctx)) {
+                        sessionStore->removeSubscription(ctx->clientId, unsub.topicFilter());
+                    }
                     matching = true;
                     break;
                 }
@@ -610,13 +2807,13 @@ void MqttServerPrivate::processPacket(const MqttPacket &packet, QTcpSocket *clie
         }
         ctx->subscriptions = newSubscriptions;
         MqttPacket response(MqttPacket::TypeUnsuback, packet.packetId());
-        client->write(response.serialize());
+        sendPacket(client, response);
         return;
     }
     if (packet.type() == MqttPacket::TypePingreq) {
 //        qCDebug(dbgServer).nospace() << ctx->clientId << ": Pingreq received";
         MqttPacket response(MqttPacket::TypePingresp, packet.packetId());
-        client->write(response.serialize());
+        sendPacket(client, response);
         return;
     }
     if (packet.type() == MqttPacket::TypeDisconnect) {
@@ -651,7 +2848,8 @@ bool MqttServerPrivate::validateTopicFilter(const QString &topicFilter)
 
 bool MqttServerPrivate::matchTopic(const QString &topicFilter, const QString &topic)
 {
-    if (topic.startsWith('$')) {
+    // Topics starting with $ are only matched by filters starting with the same level, not by wildcards
+    if (topic.startsWith('$') && (topicFilter.startsWith('+') || topicFilter.startsWith('#'))) {
         return false;
     }
 
@@ -683,47 +2881,403 @@ bool MqttServerPrivate::matchTopic(const QString &topicFilter, const QString &to
 
 quint16 MqttServerPrivate::newPacketId(ClientContext *ctx)
 {
-    static quint16 packetId = 0;
-    do {
-        packetId++;
-    } while(ctx->unackedPacketList.contains(packetId));
-    return packetId;
+    return ctx->unackedPackets.newPacketId();
 }
 
-void SslServer::incomingConnection(qintptr socketDescriptor)
+void MqttServerPrivate::trackTransmission(QIODevice *client, ClientContext *ctx, quint16 packetId, quint16 count)
+{
+    ClientContext::Transmission transmission;
+    transmission.sentAt = admissionClock.elapsed();
+    transmission.count = count;
+    ctx->transmissions.insert(packetId, transmission);
+    if (maximumRetransmissions > 0 && !retransmissions.contains(client)) {
+        retransmissions.add(client, retransmissionTimeout(ctx));
+    }
+}
+
+void MqttServerPrivate::completeTransmission(QIODevice *client, ClientContext *ctx, quint16 packetId)
+{
+    if (!ctx->transmissions.contains(packetId)) {
+        return;
+    }
+    ClientContext::Transmission transmission = ctx->transmissions.take(packetId);
+    if (ctx->transmissions.isEmpty()) {
+        retransmissions.remove(client);
+    }
+
+    // Karn's algorithm: The ack of a retransmitted packet can't be told apart from the ack of the original one
+    if (transmission.count > 0) {
+        return;
+    }
+    // RFC 6298
+    quint32 rtt = static_cast<quint32>(qMax<qint64>(1, admissionClock.elapsed() - transmission.sentAt));
+    if (ctx->smoothedRtt == 0) {
+        ctx->smoothedRtt = rtt;
+        ctx->rttVariance = rtt / 2;
+    } else {
+        quint32 deviation = ctx->smoothedRtt > rtt ? ctx->smoothedRtt - rtt : rtt - ctx->smoothedRtt;
+        ctx->rttVariance = (3 * ctx->rttVariance + deviation) / 4;
+        ctx->smoothedRtt = (7 * ctx->smoothedRtt + rtt) / 8;
+    }
+    ctx->retransmissionBackoff = 0;
+}
+
+qint64 MqttServerPrivate::retransmissionTimeout(const ClientContext *ctx)
+{
+    qint64 timeout = 1000;
+    if (ctx->smoothedRtt > 0) {
+        timeout = qBound<qint64>(1000, ctx->smoothedRtt + 4LL * ctx->rttVariance, 60000);
+    }
+    return qMin<qint64>(timeout << ctx->retransmissionBackoff, 60000);
+}
+
+void MqttServerPrivate::onRetransmissionsDue(const QList<QIODevice *> &clients)
+{
+    qint64 now = admissionClock.elapsed();
+    foreach (QIODevice *client, clients) {
+        ClientContext *ctx = clientList.value(client);
+        if (!ctx) {
+            continue;
+        }
+        if (dropExpiredInflight(ctx, QDateTime::currentMSecsSinceEpoch()) > 0) {
+            deliverQueuedMessages(client, ctx);
+        }
+        if (ctx->transmissions.isEmpty() || maximumRetransmissions <= 0) {
+            continue;
+        }
+
+        qint64 timeout = retransmissionTimeout(ctx);
+        qint64 next = timeout;
+        QList<quint16> due;
+        bool exhausted = false;
+        foreach (quint16 packetId, ctx->unackedPackets.packetIds()) {
+            if (!ctx->transmissions.contains(packetId)) {
+                continue;
+            }
+            const ClientContext::Transmission &transmission = ctx->transmissions[packetId];
+            if (transmission.sentAt + timeout > now) {
+                next = qMin(next, transmission.sentAt + timeout - now);
+            } else if (transmission.count >= maximumRetransmissions) {
+                exhausted = true;
+                break;
+            } else {
+                due.append(packetId);
+            }
+        }
+        if (exhausted) {
+            qCWarning(dbgServer) << "Client" << ctx->clientId << "did not acknowledge a packet after" << maximumRetransmissions << "retransmissions. Dropping connection.";
+            cleanupClient(client);
+            continue;
+        }
+
+        if (!due.isEmpty()) {
+            qCDebug(dbgServer) << "Retransmitting" << due.count() << "unacknowledged packets to" << ctx->clientId << "after" << timeout << "ms";
+            // Back off until a packet gets acknowledged without having been retransmitted
+            ctx->retransmissionBackoff = static_cast<quint8>(qMin(ctx->retransmissionBackoff + 1, 6));
+            next = qMin(next, retransmissionTimeout(ctx));
+            foreach (quint16 packetId, due) {
+                MqttPacket packet = ctx->unackedPackets.value(packetId);
+                packet.setDup(packet.type() == MqttPacket::TypePublish);
+                sendPacket(client, packet);
+                ClientContext::Transmission &transmission = ctx->transmissions[packetId];
+                transmission.sentAt = now;
+                transmission.count++;
+            }
+        }
+        retransmissions.add(client, next);
+    }
+}
+
+int MqttServerPrivate::expiryInterval(const QString &topic) const
+{
+    int interval = 0;
+    int prefixLength = -1;
+    for (QHash<QString, int>::const_iterator it = messageExpiryIntervals.constBegin(); it != messageExpiryIntervals.constEnd(); ++it) {
+        if (it.key().length() > prefixLength && topic.startsWith(it.key())) {
+            interval = it.value();
+            prefixLength = it.key().length();
+        }
+    }
+    return interval;
+}
+
+qint64 MqttServerPrivate::defaultExpiry(const QString &topic) const
+{
+    if (messageExpiryIntervals.isEmpty()) {
+        return 0;
+    }
+    int interval = expiryInterval(topic);
+    return interval > 0 ? QDateTime::currentMSecsSinceEpoch() + interval * 1000LL : 0;
+}
+
+void MqttServerPrivate::watchExpiry(qint64 expiry)
+{
+    if (expiry > 0 && !expirySweepTimer.isActive()) {
+        expirySweepTimer.start();
+    }
+}
+
+MqttPackets MqttServerPrivate::retainedPackets(const QString &topic)
+{
+    MqttPackets packets = retainedMessages->value(topic);
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    MqttPackets valid;
+    foreach (const MqttPacket &packet, packets) {
+        if (!packet.isExpired(now)) {
+            valid.append(packet);
+        }
+    }
+    if (valid.count() != packets.count()) {
+        qCDebug(dbgServer) << "Dropping" << packets.count() - valid.count() << "expired retained messages on" << topic;
+        retainedMessages->remove(topic);
+        if (!valid.isEmpty()) {
+            retainedMessages->insert(topic, valid.last());
+            valid = MqttPackets() << valid.last();
+        }
+    }
+    return valid;
+}
+
+int MqttServerPrivate::dropExpiredInflight(ClientContext *ctx, qint64 now)
+{
+    // Only PUBLISH packets, once PUBREL is sent the message is delivered already
+    int dropped = 0;
+    foreach (const MqttPacket &packet, ctx->unackedPackets.packets()) {
+        if (packet.type() != MqttPacket::TypePublish || !packet.isExpired(now)) {
+            continue;
+        }
+        ctx->unackedPackets.remove(packet.packetId());
+        ctx->transmissions.remove(packet.packetId());
+        if (ctx->outboundInflight > 0) {
+            ctx->outboundInflight--;
+        }
+        if (isPersisted(ctx)) {
+            sessionStore->removePacket(ctx->clientId, packet.packetId());
+        }
+        dropped++;
+    }
+    if (dropped > 0) {
+        qCDebug(dbgServer) << "Dropped" << dropped << "expired unacknowledged messages for" << ctx->clientId;
+        statistics.messagesDropped += static_cast<quint64>(dropped);
+    }
+    return dropped;
+}
+
+int MqttServerPrivate::dropExpiredQueued(ClientContext *ctx, qint64 now)
+{
+    // Only from the head of the queue, anything expired further back is skipped when delivering
+    int dropped = 0;
+    while (!ctx->messageQueue.isEmpty() && ctx->messageQueue.head().isExpired(now)) {
+        MqttPacket packet = ctx->messageQueue.dequeue();
+        ctx->messageQueueBytes -= packet.topic().size() + packet.payload().size();
+        dropped++;
+    }
+    if (dropped > 0) {
+        qCDebug(dbgServer) << "Dropped" << dropped << "expired queued messages for" << ctx->clientId;
+        statistics.messagesDropped += static_cast<quint64>(dropped);
+        if (isPersisted(ctx)) {
+            sessionStore->dequeueMessages(ctx->clientId, dropped);
+        }
+    }
+    return dropped;
+}
+
+void MqttServerPrivate::publishStatistics()
+{
+    double seconds = qMax<qint64>(1, statisticsClock.restart()) / 1000.0;
+
+    int subscriptions = 0;
+    int inflight = 0;
+    int queued = 0;
+    foreach (ClientContext *ctx, clientList) {
+        subscriptions += ctx->subscriptions.count();
+        inflight += ctx->unackedPackets.count();
+        queued += ctx->messageQueue.count();
+    }
+    foreach (ClientContext *ctx, offlineSessions) {
+        subscriptions += ctx->subscriptions.count();
+        inflight += ctx->unackedPackets.count();
+        queued += ctx->messageQueue.count();
+    }
+
+    QList<QPair<QString, QByteArray> > values;
+    values.append(qMakePair(QString("uptime"), QByteArray::number(uptime.elapsed() / 1000)));
+    values.append(qMakePair(QString("clients/connected"), QByteArray::number(clientList.count())));
+    values.append(qMakePair(QString("clients/disconnected"), QByteArray::number(offlineSessions.count())));
+    values.append(qMakePair(QString("subscriptions/count"), QByteArray::number(subscriptions)));
+    values.append(qMakePair(QString("retained messages/count"), QByteArray::number(retainedMessages->count())));
+    values.append(qMakePair(QString("retained messages/bytes"), QByteArray::number(retainedMessages->bytes())));
+    values.append(qMakePair(QString("messages/inflight"), QByteArray::number(inflight)));
+    values.append(qMakePair(QString("messages/queued"), QByteArray::number(queued)));
+    values.append(qMakePair(QString("messages/received"), QByteArray::number(statistics.messagesReceived)));
+    values.append(qMakePair(QString("messages/sent"), QByteArray::number(statistics.messagesSent)));
+    values.append(qMakePair(QString("messages/dropped"), QByteArray::number(statistics.messagesDropped)));
+    values.append(qMakePair(QString("bytes/received"), QByteArray::number(statistics.bytesReceived)));
+    values.append(qMakePair(QString("bytes/sent"), QByteArray::number(statistics.bytesSent)));
+    values.append(qMakePair(QString("load/messages/received"), QByteArray::number((statistics.messagesReceived - previousStatistics.messagesReceived) / seconds, 'f', 1)));
+    values.append(qMakePair(QString("load/messages/sent"), QByteArray::number((statistics.messagesSent - previousStatistics.messagesSent) / seconds, 'f', 1)));
+    values.append(qMakePair(QString("load/bytes/received"), QByteArray::number((statistics.bytesReceived - previousStatistics.bytesReceived) / seconds, 'f', 1)));
+    values.append(qMakePair(QString("load/bytes/sent"), QByteArray::number((statistics.bytesSent - previousStatistics.bytesSent) / seconds, 'f', 1)));
+    previousStatistics = statistics;
+
+    // The statistics of this server only, also when attached to a broker or cluster
+    for (int i = 0; i < values.count(); i++) {
+        publish("$SYS/broker/" + values.at(i).first, values.at(i).second);
+    }
+}
+
+void MqttServerPrivate::sweepExpiredMessages()
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    QSet<QString> topics;
+    QMultiMap<qint64, QString>::iterator it = retainedExpiries.begin();
+    while (it != retainedExpiries.end() && it.key() <= now) {
+        topics.insert(it.value());
+        it = retainedExpiries.erase(it);
+    }
+    foreach (const QString &topic, topics) {
+        retainedPackets(topic);
+    }
+
+    foreach (ClientContext *ctx, offlineSessions) {
+        dropExpiredQueued(ctx, now);
+        dropExpiredInflight(ctx, now);
+    }
+    foreach (ClientContext *ctx, clientList) {
+        dropExpiredQueued(ctx, now);
+    }
+
+    if (messageExpiryIntervals.isEmpty() && retainedExpiries.isEmpty()) {
+        expirySweepTimer.stop();
+    }
+}
+
+void MqttServerPrivate::onConnectionsTimedOut(const QList<QIODevice *> &clients)
+{
+    foreach (QIODevice *client, clients) {
+        if (pendingConnections.contains(client)) {
+            qCWarning(dbgServer) << "A client connected but did not send data in 10 seconds. Dropping connection.";
+        } else if (pendingAuthorizations.contains(client)) {
+            qCWarning(dbgServer) << "Authorization of" << pendingAuthorizations.value(client).clientId << "timed out. Dropping connection.";
+            MqttPacket response(MqttPacket::TypeConnack, pendingAuthorizations.value(client).packet.packetId());
+            response.setConnectReturnCode(Mqtt::ConnectReturnCodeServerUnavailable);
+            sendPacket(client, response);
+        } else if (clientList.contains(client)) {
+            qCWarning(dbgServer) << "Keep alive timeout reached for client:" << clientList.value(client)->clientId;
+        }
+        cleanupClient(client);
+    }
+}
+
+bool TokenBucket::available(qint64 now, int rate, int burst)
+{
+    if (m_tokens < 0) {
+        m_tokens = burst;
+    } else {
+        m_tokens = qMin<double>(burst, m_tokens + (now - m_lastRefill) * rate / 1000.0);
+    }
+    m_lastRefill = now;
+    return m_tokens >= 1;
+}
+
+void TokenBucket::take()
+{
+    m_tokens -= 1;
+}
+
+bool TokenBucket::isFull(qint64 now, int rate, int burst) const
 {
-    QSslSocket *sslSocket = new QSslSocket(this);
+    return m_tokens < 0 || m_tokens + (now - m_lastRefill) * rate / 1000.0 >= burst;
+}
 
-    qCDebug(dbgServer) << "New client socket connection:" << sslSocket;
+bool SslServer::isEncrypted() const
+{
+    return !m_config.isNull();
+}
 
-    connect(sslSocket, &QSslSocket::encrypted, [this, sslSocket](){ emit clientConnected(sslSocket); });
-    connect(sslSocket, &QSslSocket::readyRead, this, &SslServer::onSocketReadyRead);
-    connect(sslSocket, &QSslSocket::disconnected, this, &SslServer::onClientDisconnected);
+QTcpSocket *SslServer::adoptSocket(qintptr socketDescriptor)
+{
+    // A QSslSocket carries a second, internal socket and the TLS backend state. Only pay for it when needed.
+    QTcpSocket *socket = m_config.isNull() ? new QTcpSocket(this) : new QSslSocket(this);
+    connect(socket, &QTcpSocket::readyRead, this, &SslServer::onSocketReadyRead);
+    connect(socket, &QTcpSocket::disconnected, this, &SslServer::onClientDisconnected);
+
+    if (!socket->setSocketDescriptor(socketDescriptor)) {
+        qCWarning(dbgServer) << "Failed to set socket descriptor.";
+        delete socket;
+        return nullptr;
+    }
+    return socket;
+}
 
-    if (!sslSocket->setSocketDescriptor(socketDescriptor)) {
-        qCWarning(dbgServer) << "Failed to set SSL socket descriptor.";
-        delete sslSocket;
+void SslServer::incomingConnection(qintptr socketDescriptor)
+{
+    QTcpSocket *socket = adoptSocket(socketDescriptor);
+    if (!socket) {
         return;
     }
+
+    qCDebug(dbgServer) << "New client socket connection:" << socket;
+
     if (!m_config.isNull()) {
+        QSslSocket *sslSocket = static_cast<QSslSocket*>(socket);
+        connect(sslSocket, &QSslSocket::encrypted, [this, sslSocket](){ emit clientConnected(sslSocket); });
         sslSocket->setSslConfiguration(m_config);
         sslSocket->startServerEncryption();
     } else {
-        emit clientConnected(sslSocket);
+        emit clientConnected(socket);
     }
 }
 
 void SslServer::onClientDisconnected()
 {
-    QSslSocket *socket = static_cast<QSslSocket*>(sender());
+    QTcpSocket *socket = static_cast<QTcpSocket*>(sender());
     qCDebug(dbgServer) << "Client socket disconnected:" << socket;
     emit clientDisconnected(socket);
     socket->deleteLater();
 }
 
+QLocalSocket *LocalServer::adoptSocket(qintptr socketDescriptor)
+{
+    QLocalSocket *socket = new QLocalSocket(this);
+    connect(socket, &QLocalSocket::readyRead, this, &LocalServer::onSocketReadyRead);
+    connect(socket, &QLocalSocket::disconnected, this, &LocalServer::onClientDisconnected);
+
+    if (!socket->setSocketDescriptor(socketDescriptor)) {
+        qCWarning(dbgServer) << "Failed to set local socket descriptor.";
+        delete socket;
+        return nullptr;
+    }
+    return socket;
+}
+
+void LocalServer::incomingConnection(quintptr socketDescriptor)
+{
+    QLocalSocket *socket = adoptSocket(static_cast<qintptr>(socketDescriptor));
+    if (!socket) {
+        return;
+    }
+    qCDebug(dbgServer) << "New client local socket connection:" << socket;
+    emit clientConnected(socket);
+}
+
+void LocalServer::onClientDisconnected()
+{
+    QLocalSocket *socket = static_cast<QLocalSocket*>(sender());
+    qCDebug(dbgServer) << "Client local socket disconnected:" << socket;
+    emit clientDisconnected(socket);
+    socket->deleteLater();
+}
+
+void LocalServer::onSocketReadyRead()
+{
+    QLocalSocket *socket = static_cast<QLocalSocket*>(sender());
+    emit dataAvailable(socket);
+}
+
 void SslServer::onSocketReadyRead()
 {
-    QSslSocket *socket = static_cast<QSslSocket*>(sender());
-    QByteArray data = socket->readAll();
-    emit dataAvailable(socket, data);
+    QTcpSocket *socket = static_cast<QTcpSocket*>(sender());
+    emit dataAvailable(socket);
 }
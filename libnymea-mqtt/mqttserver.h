@@ -31,19 +31,49 @@
 #include <QObject>
 #include <QTcpServer>
 #include <QTcpSocket>
+#include <QLocalServer>
 #include <QTimer>
 #include <QLoggingCategory>
 #include <QSslConfiguration>
+#include <QAtomicInt>
 
 #include "mqttpacket.h"
+#include "mqttaccesscontrol.h"
 
 class MqttServerPrivate;
+class MqttSessionStore;
 class Subscription;
 
+// The pending result of MqttAuthorizer::authorizeConnectAsync(). complete() may be called from any thread, the
+// server deletes the object once it is completed.
+class MqttConnectAuthorization: public QObject
+{
+    Q_OBJECT
+public:
+    explicit MqttConnectAuthorization(QObject *parent = nullptr);
+
+    bool isFinished() const;
+    Mqtt::ConnectReturnCode returnCode() const;
+    void complete(Mqtt::ConnectReturnCode returnCode);
+
+signals:
+    void finished();
+
+private slots:
+    void finish();
+
+private:
+    QAtomicInt m_state;
+    QAtomicInt m_returnCode;
+};
+
 class MqttAuthorizer {
 public:
     virtual ~MqttAuthorizer() = default;
     virtual Mqtt::ConnectReturnCode authorizeConnect(int serverAddressId, const QString &clientId, const QString &username, const QString &password, const QHostAddress &peerAddress) = 0;
+    // Non-blocking variant of authorizeConnect(), the server keeps serving other clients until the returned
+    // authorization is completed. Returning nullptr, as the default implementation does, uses authorizeConnect().
+    virtual MqttConnectAuthorization *authorizeConnectAsync(int serverAddressId, const QString &clientId, const QString &username, const QString &password, const QHostAddress &peerAddress);
     virtual bool authorizeSubscribe(int serverAddressId, const QString &clientId, const QString &topicFilter) = 0;
     virtual bool authorizePublish(int serverAddressId, const QString &clientId, const QString &topic) = 0;
 };
@@ -52,24 +82,152 @@ class MqttServer : public QObject
 {
     Q_OBJECT
 public:
+    enum RetainedEvictionPolicy {
+        RetainedEvictionPolicyLeastRecentlyUsed,
+        RetainedEvictionPolicyOldest
+    };
+    Q_ENUM(RetainedEvictionPolicy)
+
+    enum Transport {
+        TransportQt,
+        TransportIoUring
+    };
+    Q_ENUM(Transport)
+
     explicit MqttServer(QObject *parent = nullptr);
 
     Mqtt::QoS maximumSubscriptionsQoS() const;
     void setMaximumSubscriptionsQoS(Mqtt::QoS maximumSubscriptionQoS);
 
+    // Admission control for incoming connections. Accepting new connections is paused while the given number of
+    // connections is waiting for their CONNECT to be handled. 0 disables the limit.
+    int maximumConcurrentHandshakes() const;
+    void setMaximumConcurrentHandshakes(int maximumConcurrentHandshakes);
+    // Limits the rate of accepted CONNECT packets for each listening address and each client address. Exceeding CONNECT packets
+    // are queued and served at the given rate. When the queue is full, clients are rejected with ConnectReturnCodeServerUnavailable.
+    // 0 disables the limit. The burst defaults to one second worth of connects.
+    void setConnectRateLimit(int connectsPerSecond, int burst = 0);
+    void setConnectRateLimitPerAddress(int connectsPerSecond, int burst = 0);
+    int maximumQueuedConnects() const;
+    void setMaximumQueuedConnects(int maximumQueuedConnects);
+
+    // Sessions of clients connecting without the clean session flag are kept for the given number of seconds after
+    // the client disconnected. QoS 1 and 2 messages matching their subscriptions are queued meanwhile and delivered
+    // when the client resumes the session. 0 (the default) drops sessions as soon as the client disconnects.
+    int sessionExpiryInterval() const;
+    void setSessionExpiryInterval(int seconds);
+    // Limits the number of unacknowledged QoS 1 and 2 messages sent to a client. Further messages wait in the
+    // message queue of the client and are sent as acknowledgements come in. 0 (the default) disables the limit.
+    // An address ID sets the limit for clients connecting on that listener, -1 the default for all listeners.
+    int maximumInflightMessages(int addressId = -1) const;
+    void setMaximumInflightMessages(int maximumInflightMessages, int addressId = -1);
+    // Unacknowledged QoS 1 and 2 messages are resent after a timeout adapting to the round trip time measured
+    // for each client. Clients are dropped when a message is still unacknowledged after this many retransmissions.
+    // 0 disables retransmissions on open connections, messages are then only resent when a session is resumed.
+    int maximumRetransmissions() const;
+    void setMaximumRetransmissions(int maximumRetransmissions);
+    // Messages on topics starting with the given prefix expire after the given number of seconds. Expired messages
+    // are dropped from message queues, in-flight messages and retained messages. The longest matching prefix
+    // applies, 0 removes the default for a prefix.
+    int messageExpiryInterval(const QString &topic) const;
+    void setMessageExpiryInterval(const QString &topicPrefix, int seconds);
+    // Limits for the messages queued for each session, offline or waiting for a free in-flight slot. When
+    // exceeded, the oldest messages are dropped.
+    int maximumOfflineQueueCount() const;
+    void setMaximumOfflineQueueCount(int maximumOfflineQueueCount);
+    qint64 maximumOfflineQueueBytes() const;
+    void setMaximumOfflineQueueBytes(qint64 maximumOfflineQueueBytes);
+    // Persists sessions of clients connected without the clean session flag. Stored sessions are restored as
+    // offline sessions right away, set the session expiry interval first. The store is not owned by the server.
+    void setSessionStore(MqttSessionStore *sessionStore);
+
+    // Holds back PUBACK and PUBREC for QoS 1 and 2 messages until the session store and the retained messages
+    // file are synced to disk. Syncs are group committed: after the given interval in milliseconds or once the
+    // given number of acknowledgements is waiting, whichever comes first.
+    bool durableAcknowledgements() const;
+    void setDurableAcknowledgements(bool durableAcknowledgements);
+    int groupCommitInterval() const;
+    int groupCommitBatchSize() const;
+    void setGroupCommit(int interval, int batchSize);
+
+    QString retainedMessagesFile() const;
+    bool setRetainedMessagesFile(const QString &fileName);
+    // Memory budget for retained messages, in total and for the topics starting with a prefix. Retained messages
+    // are evicted when exceeded. 0 disables the limits.
+    qint64 maximumRetainedBytes() const;
+    void setMaximumRetainedBytes(qint64 maximumBytes);
+    qint64 retainedQuota(const QString &topicPrefix) const;
+    void setRetainedQuota(const QString &topicPrefix, qint64 maximumBytes);
+    RetainedEvictionPolicy retainedEvictionPolicy() const;
+    void setRetainedEvictionPolicy(RetainedEvictionPolicy policy);
+    int retainedMessageCount() const;
+    qint64 retainedBytes() const;
+    quint64 retainedEvictions() const;
+    // Retained and offline queued payloads of at least this size are kept compressed in memory. 0 disables it.
+    int payloadCompressionThreshold() const;
+    void setPayloadCompressionThreshold(int bytes);
+
     void setAuthorizer(MqttAuthorizer *authorizer);
+    // Caches the decisions of the authorizer for publish and subscribe requests in each session, up to the given
+    // number of topics each. Invalidate the cache whenever the policies of the authorizer change. 0 disables it.
+    int authorizationCacheSize() const;
+    void setAuthorizationCacheSize(int entries);
+    void invalidateAuthorizationCache();
+    void invalidateAuthorizationCache(const QString &clientId);
+    // Access control rules checked for every publish and subscribe before asking the authorizer, if any. They
+    // are compiled for each client when it connects. Setting them applies to the connected clients right away.
+    MqttAccessControl accessControl() const;
+    void setAccessControl(const MqttAccessControl &accessControl);
+    // Publishes statistics below $SYS/broker/ at the given interval, see the documentation of
+    // setStatisticsInterval() for the topics. 0 disables it.
+    int statisticsInterval() const;
+    void setStatisticsInterval(int seconds);
+    // Limits for asynchronous connect authorizations: clients are rejected if not authorized within the given
+    // number of milliseconds or when the given number of authorizations is pending already. 0 disables a limit.
+    int authorizationTimeout() const;
+    void setAuthorizationTimeout(int timeout);
+    int maximumPendingAuthorizations() const;
+    void setMaximumPendingAuthorizations(int maximumPendingAuthorizations);
 
+    // Lets several processes listen on the same TCP port (SO_REUSEPORT), the kernel spreads new connections
+    // across them. Applies to listen() calls made afterwards.
+    bool reusePort() const;
+    void setReusePort(bool reusePort);
+    // How plain TCP listeners and their connections do I/O, applies to listen() calls made afterwards. TLS listeners
+    // always use the Qt sockets.
+    Transport transport() const;
+    void setTransport(Transport transport);
+    static bool isTransportAvailable(Transport transport);
     int listen(const QHostAddress &address = QHostAddress::Any, quint16 port = 1883, const QSslConfiguration &sslConfiguration = QSslConfiguration());
+    // Listens on a local (Unix domain) socket, see QLocalServer::listen() for the server name. Clients connected this way are
+    // reported with QHostAddress::LocalHost as their address.
+    int listenLocal(const QString &serverName, QLocalServer::SocketOptions socketOptions = QLocalServer::NoOptions);
+    int listenInProcess();
+
+    // Hot restart: hands listeners and plain connections including their sessions over to a new process
+    // waiting in receiveHandover(). See the documentation of both methods for details.
+    bool handOver(const QString &serverName, int timeout = 10000);
+    bool receiveHandover(const QString &serverName, const QSslConfiguration &sslConfiguration = QSslConfiguration(), int timeout = 30000);
     QList<int> listeningAddressIds() const;
     QPair<QHostAddress, quint16> listeningAddress(int addressId);
     void close(int addressId);
     bool isListening(const QHostAddress &address, quint16 port) const;
 
+    // Forms a cluster with other server processes on this host, connected over local sockets named after the
+    // nodes. Messages published on one node are delivered to the matching subscribers on all nodes and
+    // retained messages are replicated. See the documentation of joinCluster() for details.
+    bool joinCluster(const QString &nodeName, const QStringList &peerNames);
+    void leaveCluster();
+    QStringList clusterPeers() const;
+
     QStringList clients() const;
+    QStringList offlineSessions() const;
     void disconnectClient(const QString &clientId);
 
     // allows publishing from the server, including topcis starting with $
     QHash<QString, quint16> publish(const QString &topic, const QByteArray &payload = QByteArray());
+    // Like the above, the message expires after the given number of seconds instead of the default for its topic
+    QHash<QString, quint16> publish(const QString &topic, const QByteArray &payload, int messageExpiryInterval);
 
 signals:
     // emitted whenever a client connects, after the mqtt connect handshake has been done.
@@ -89,6 +247,8 @@ signals:
 
 private:
     MqttServerPrivate *d_ptr;
+    friend class MqttClientPrivate;
+    friend class MqttBroker;
 };
 
 #endif // MQTTSERVER_H
@@ -31,71 +31,298 @@
 #include <QObject>
 #include <QTcpServer>
 #include <QTcpSocket>
+#include <QLocalServer>
+#include <QLocalSocket>
 #include <QTimer>
+#include <QElapsedTimer>
+#include <QDataStream>
+#include <QQueue>
+#include <QMultiMap>
 #include <QLoggingCategory>
 
 #include "mqttpacket.h"
 #include "mqttserver.h"
+#include "mqtttimerwheel_p.h"
+#include "mqttretainedmessages_p.h"
+#include "mqttinflightpackets_p.h"
+#include "mqttaccesscontrol.h"
+#include "mqttaccesscontrol_p.h"
 
 Q_DECLARE_LOGGING_CATEGORY(dbgServer)
 
 class ClientContext;
 class Subscription;
 class SslServer;
+class LocalServer;
+class MqttIoUringServer;
+class MqttInProcessChannel;
+class MqttSessionStore;
+class MqttClusterNode;
+class MqttBrokerPrivate;
+
+class TokenBucket
+{
+public:
+    // Refills the bucket and returns whether a token can be taken
+    bool available(qint64 now, int rate, int burst);
+    void take();
+    bool isFull(qint64 now, int rate, int burst) const;
+
+private:
+    double m_tokens = -1;
+    qint64 m_lastRefill = 0;
+};
 
 class MqttServerPrivate: public QObject
 {
     Q_OBJECT
 public:
     explicit MqttServerPrivate(MqttServer *q);
+    ~MqttServerPrivate() override;
 
-    QHash<QString, quint16> publish(const QString &topic, const QByteArray &payload = QByteArray());
+    QHash<QString, quint16> publish(const QString &topic, const QByteArray &payload = QByteArray(), qint64 expiry = 0);
+    // Publishes to the clients of all servers attached to the same broker
+    QHash<QString, quint16> route(const QString &topic, const QByteArray &payload, qint64 expiry);
 
 public:
-    void cleanupClient(QTcpSocket *client);
+    int newAddressId(int addressId = -1);
+    void addServer(int addressId, SslServer *server);
+    void addLocalServer(int addressId, LocalServer *server);
+    void addIoUringServer(int addressId, MqttIoUringServer *server);
+
+    struct LocalListener {
+        int addressId = -1;
+        QString serverName;
+        QLocalServer::SocketOptions socketOptions = QLocalServer::NoOptions;
+    };
+    static const quint16 handoverStateVersion = 3;
+    QByteArray saveHandoverState(QVector<int> *fds, QList<QIODevice*> *clients);
+    bool restoreHandoverState(const QByteArray &state, const QVector<int> &fds, const QSslConfiguration &sslConfiguration, QList<LocalListener> *localListeners);
+    void resumeHandedOverClients();
+    static void writeSession(QDataStream &stream, const ClientContext *ctx);
+    static ClientContext *readSession(QDataStream &stream);
+    void releaseClient(QIODevice *client);
 
-    void processPacket(const MqttPacket &packet, QTcpSocket *client);
+    static QTcpSocket *plainTcpSocket(QIODevice *client);
+    QHostAddress peerAddress(QIODevice *client) const;
+    void flush(QIODevice *client);
+    void cleanupClient(QIODevice *client);
+    bool authorizePublish(QIODevice *client, ClientContext *ctx, const QByteArray &topic);
+    // Retains, authorizes and routes a message published by a client, once it is acknowledged or as its will
+    void distributePublish(QIODevice *client, ClientContext *ctx, const MqttPacket &packet);
+    bool authorizeSubscribe(QIODevice *client, ClientContext *ctx, const QByteArray &topicFilter);
+    void cacheAuthorization(QHash<QByteArray, bool> *cache, const QByteArray &topic, bool allowed);
+    static void clearAuthorizations(ClientContext *ctx);
+    void compilePermissions(ClientContext *ctx);
+    // Sends a message to a connected client, or queues it while the in-flight window is full. Returns the packet
+    // sent, an invalid one if queued.
+    MqttPacket deliverMessage(QIODevice *client, ClientContext *ctx, const QString &topic, const QByteArray &payload, Mqtt::QoS qos, qint64 expiry, bool retain = false);
+    void queueMessage(ClientContext *ctx, const QString &topic, const QByteArray &payload, Mqtt::QoS qos, qint64 expiry, bool retain = false);
+    void deliverQueuedMessages(QIODevice *client, ClientContext *ctx);
+    void addInflight(QIODevice *client, ClientContext *ctx, const MqttPacket &packet);
+    static void countInflight(ClientContext *ctx);
+    void applyInflightLimit(ClientContext *ctx, int addressId);
+    void discardSession(ClientContext *ctx);
+    bool isPersisted(const ClientContext *ctx) const;
+    void persistSession(ClientContext *ctx);
+    void restoreStoredSessions();
+    void onSessionsExpired(const QList<QString> &clientIds);
+    void acknowledge(QIODevice *client, const MqttPacket &packet);
+    void commitAcknowledgements();
+    void dropHeldAcknowledgements(QIODevice *client);
+    void trackTransmission(QIODevice *client, ClientContext *ctx, quint16 packetId, quint16 count = 0);
+    void completeTransmission(QIODevice *client, ClientContext *ctx, quint16 packetId);
+    static qint64 retransmissionTimeout(const ClientContext *ctx);
+    void onRetransmissionsDue(const QList<QIODevice*> &clients);
+    int expiryInterval(const QString &topic) const;
+    qint64 defaultExpiry(const QString &topic) const;
+    void watchExpiry(qint64 expiry);
+    MqttPackets retainedPackets(const QString &topic);
+    int dropExpiredInflight(ClientContext *ctx, qint64 now);
+    int dropExpiredQueued(ClientContext *ctx, qint64 now);
+    void sweepExpiredMessages();
+    void publishStatistics();
+
+    void processBuffer(QIODevice *client);
+    bool processIncomingPacket(const MqttPacket &packet, QIODevice *client);
+    void sendPacket(QIODevice *client, const MqttPacket &packet);
+    bool sendScatterGather(QIODevice *client, const MqttPacket &packet);
+    // Returns a listening socket, optionally with SO_REUSEPORT set, or -1
+    static int listeningSocket(const QHostAddress &address, quint16 port, bool reusePort);
+    MqttInProcessChannel *connectInProcess(QObject *clientParent);
+    bool admitConnect(const MqttPacket &packet, QIODevice *client);
+    bool takeConnectToken(QIODevice *client);
+    void processQueuedConnects();
+    void updateAccepting();
+    void processConnect(const MqttPacket &packet, QIODevice *client);
+    void acceptConnect(const MqttPacket &packet, QIODevice *client, const QString &clientId);
+    void onAuthorizationFinished(QIODevice *client, MqttConnectAuthorization *authorization);
+    void dropPendingAuthorization(QIODevice *client);
+    // Whether the input of a client is held back while its CONNECT waits for admission or authorization
+    bool isConnectHeld(QIODevice *client) const;
+    void processPacket(const MqttPacket &packet, QIODevice *client);
     bool validateTopicFilter(const QString &topicFilter);
-    bool matchTopic(const QString &topicFilter, const QString &topic);
+    static bool matchTopic(const QString &topicFilter, const QString &topic);
     quint16 newPacketId(ClientContext *ctx);
+    void onConnectionsTimedOut(const QList<QIODevice*> &clients);
 
 public slots:
-    void onClientConnected(QSslSocket *client);
-    void onDataAvailable(QSslSocket *client, const QByteArray &data);
-    void onClientDisconnected(QSslSocket *client);
+    void onClientConnected(int addressId, QIODevice *client);
+    void onDataAvailable(QIODevice *client);
+    void onClientDisconnected(QIODevice *client);
 
 public:
     MqttServer *q_ptr;
 
     QHash<int, SslServer*> servers;
+    QHash<int, LocalServer*> localServers;
+    // Plain TCP listeners using io_uring, see MqttServer::setTransport()
+    QHash<int, MqttIoUringServer*> ioUringServers;
+    MqttServer::Transport transport = MqttServer::TransportQt;
+    int inProcessAddressId = -1;
+
+    // PUBLISH packets with payloads of at least this size are sent with scatter/gather I/O on plain TCP connections
+    int scatterGatherThreshold = 1024;
     MqttAuthorizer *authorizer = nullptr;
+    // Maximum number of authorizer decisions cached per session and kind, 0 disables the cache
+    int authorizationCacheSize = 0;
+    MqttAccessControl accessControl;
 
     Mqtt::QoS maximumSubscriptionQoS = Mqtt::QoS2;
 
-    QHash<QTcpSocket*, QTimer*> pendingConnections;
-    QHash<QTcpSocket*, ClientContext*> clientList;
-    QHash<QTcpSocket*, QByteArray> clientBuffers;
-    QHash<QString, MqttPackets> retainedMessages;
-    QHash<QTcpSocket*, SslServer*> clientServerMap;
+    // Tracks both, the CONNECT timeout of pending connections and the keep alive of connected clients
+    MqttTimerWheel<QIODevice*> connectionTimeouts;
+    QSet<QIODevice*> pendingConnections;
+    QHash<QIODevice*, ClientContext*> clientList;
+    QHash<QIODevice*, QByteArray> clientBuffers;
+    MqttRetainedMessages ownRetainedMessages;
+    // The own ones or the ones shared with the other servers of the broker
+    MqttRetainedMessages *retainedMessages = &ownRetainedMessages;
+    QHash<QIODevice*, int> clientServerMap;
+
+    // Persistent sessions of disconnected clients, see MqttServer::setSessionExpiryInterval()
+    int sessionExpiryInterval = 0;
+    int maximumOfflineQueueCount = 1000;
+    qint64 maximumOfflineQueueBytes = 1024 * 1024;
+    int payloadCompressionThreshold = 0;
+
+    // Cluster of server processes on this host, see MqttServer::joinCluster()
+    MqttClusterNode *cluster = nullptr;
+    bool reusePort = false;
+
+    // Routing domain shared with other servers in this process, see MqttBroker
+    MqttBrokerPrivate *broker = nullptr;
+    QHash<QString, ClientContext*> offlineSessions;
+    MqttTimerWheel<QString> sessionExpiries;
+    MqttSessionStore *sessionStore = nullptr;
+
+    // In-flight window
+    int maximumInflightMessages = 0;
+    QHash<int, int> listenerMaximumInflightMessages;
+
+    // Durable acknowledgements with group commit
+    bool durableAcknowledgements = false;
+    int groupCommitInterval = 5;
+    int groupCommitBatchSize = 64;
+    QList<QPair<QIODevice*, MqttPacket> > heldAcknowledgements;
+    QTimer groupCommitTimer;
+
+    // Retransmission of unacknowledged QoS 1 and 2 messages. Clients with outgoing packets in flight have a single
+    // entry in the wheel which fires when the oldest of them is due.
+    int maximumRetransmissions = 5;
+    MqttTimerWheel<QIODevice*> retransmissions;
+
+    // Message expiry. Expired messages are skipped wherever they are about to be delivered, the sweeper drops the
+    // ones nobody asks for: retained messages by their expiry and the heads of offline queues.
+    QHash<QString, int> messageExpiryIntervals;
+    QMultiMap<qint64, QString> retainedExpiries;
+    QTimer expirySweepTimer;
+
+    // Counters published to the $SYS topics, see MqttServer::setStatisticsInterval(). The rates are computed from
+    // the counters at the previous publish.
+    struct Statistics {
+        quint64 messagesReceived = 0;
+        quint64 messagesSent = 0;
+        quint64 messagesDropped = 0;
+        quint64 bytesReceived = 0;
+        quint64 bytesSent = 0;
+    };
+    Statistics statistics;
+    Statistics previousStatistics;
+    QElapsedTimer statisticsClock;
+    QElapsedTimer uptime;
+    QTimer statisticsTimer;
+
+    // Admission control
+    int maximumConcurrentHandshakes = 0;
+    bool acceptingPaused = false;
+    int connectRate = 0;
+    int connectBurst = 1;
+    int addressConnectRate = 0;
+    int addressConnectBurst = 1;
+    int maximumQueuedConnects = 1000;
+    QElapsedTimer admissionClock;
+    QHash<int, TokenBucket> listenerConnectBuckets;
+    QHash<QHostAddress, TokenBucket> addressConnectBuckets;
+    QList<QIODevice*> queuedConnects;
+    QHash<QIODevice*, MqttPacket> queuedConnectPackets;
+    QTimer connectQueueTimer;
+
+    // CONNECTs waiting for an asynchronous authorization, the input of these clients is held back meanwhile
+    struct PendingAuthorization {
+        MqttConnectAuthorization *authorization = nullptr;
+        MqttPacket packet;
+        QString clientId;
+    };
+    QHash<QIODevice*, PendingAuthorization> pendingAuthorizations;
+    int authorizationTimeout = 10000;
+    int maximumPendingAuthorizations = 100;
 };
 
+// One of these exists for every connected client, keep it small. Empty Qt containers and strings share a
+// single null instance and don't allocate anything.
 class ClientContext {
 public:
-    Mqtt::Protocol version = Mqtt::ProtocolUnknown;
-    quint16 keepAlive = 0;
-    QTimer keepAliveTimer;
     QString clientId;
     QString username;
     QByteArray willTopic;
     QByteArray willMessage;
-    Mqtt::QoS willQoS = Mqtt::QoS0;
-    bool willRetain = false;
-
-    QByteArray inputBuffer;
     MqttSubscriptions subscriptions;
 
-    QVector<quint16> unackedPacketList;
-    QHash<quint16, MqttPacket> unackedPackets;
+    // Decisions of the authorizer for the topics published to and the topic filters subscribed to on the
+    // current connection
+    QHash<QByteArray, bool> publishAuthorizations;
+    QHash<QByteArray, bool> subscribeAuthorizations;
+    // Compiled from the access control rules when connecting
+    MqttAccessTrie permissions;
+
+    MqttInflightPackets unackedPackets;
+
+    // Messages waiting while the session is offline or the in-flight window is full. They have no packet ID yet.
+    QQueue<MqttPacket> messageQueue;
+    qint64 messageQueueBytes = 0;
+
+    // Outgoing PUBLISH and PUBREL packets sent on the current connection
+    struct Transmission {
+        qint64 sentAt = 0;
+        quint16 count = 0;
+    };
+    QHash<quint16, Transmission> transmissions;
+
+    // Smoothed ack round trip time and its variance in ms, 0 until the first sample
+    quint32 smoothedRtt = 0;
+    quint32 rttVariance = 0;
+
+    // Small members last to avoid padding in between
+    Mqtt::Protocol version = Mqtt::ProtocolUnknown;
+    Mqtt::QoS willQoS = Mqtt::QoS0;
+    quint16 keepAlive = 0;
+    // Outgoing PUBLISH and PUBREL packets in unackedPackets
+    quint16 outboundInflight = 0;
+    quint16 maximumInflight = 0;
+    bool willRetain = false;
+    bool cleanSession = true;
+    quint8 retransmissionBackoff = 0;
 };
 
 class SslServer: public QTcpServer
@@ -109,10 +336,14 @@ public:
 
     }
 
+    bool isEncrypted() const;
+    // Creates a client socket for an already connected descriptor without starting the TLS handshake
+    QTcpSocket *adoptSocket(qintptr socketDescriptor);
+
 signals:
-    void clientConnected(QSslSocket *socket);
-    void clientDisconnected(QSslSocket *socket);
-    void dataAvailable(QSslSocket *socket, const QByteArray &data);
+    void clientConnected(QIODevice *socket);
+    void clientDisconnected(QIODevice *socket);
+    void dataAvailable(QIODevice *socket);
 
 protected:
     void incomingConnection(qintptr socketDescriptor) override;
@@ -125,4 +356,29 @@ private:
     QSslConfiguration m_config;
 };
 
+class LocalServer: public QLocalServer
+{
+    Q_OBJECT
+public:
+    LocalServer(QObject *parent = nullptr):
+        QLocalServer(parent)
+    {
+
+    }
+
+    QLocalSocket *adoptSocket(qintptr socketDescriptor);
+
+signals:
+    void clientConnected(QIODevice *socket);
+    void clientDisconnected(QIODevice *socket);
+    void dataAvailable(QIODevice *socket);
+
+protected:
+    void incomingConnection(quintptr socketDescriptor) override;
+
+private slots:
+    void onClientDisconnected();
+    void onSocketReadyRead();
+};
+
 #endif // MQTTSERVER_P_H
@@ -0,0 +1,635 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+*
+* Copyright 2013 - 2020, nymea GmbH
+* Contact: contact@nymea.io
+*
+* This file is part of nymea.
+* This project including source code and documentation is protected by copyright law, and
+* remains the property of nymea GmbH. All rights, including reproduction, publication,
+* editing and translation, are reserved. The use of this project is subject to the terms of a
+* license agreement to be concluded with nymea GmbH in accordance with the terms
+* of use of nymea GmbH, available under https://nymea.io/license
+*
+* GNU Lesser General Public License Usage
+* Alternatively, this project may be redistributed and/or modified under the terms of the GNU
+* Lesser General Public License as published by the Free Software Foundation; version 3.
+* this project is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+* without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License along with this project.
+* If not, see <https://www.gnu.org/licenses/>.
+*
+* For any further details and any questions please contact us under contact@nymea.io
+* or see our FAQ/Licensing Information on https://nymea.io/license/faq
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*!
+    \class MqttSessionStore
+    \brief Interface for persisting the sessions of an MqttServer.
+    \inmodule nymea-mqtt
+    \ingroup mqtt
+
+    The server reports all changes to persistent sessions to the store: sessions being added and removed,
+    subscriptions, unacknowledged packets and messages queued for offline sessions. On startup the server
+    restores the sessions from the store, see MqttServer::setSessionStore().
+*/
+
+/*!
+    \class MqttFileSessionStore
+    \brief A MqttSessionStore keeping the sessions in an append-only log file.
+    \inmodule nymea-mqtt
+    \ingroup mqtt
+
+    Every change is appended to the log. Writes are collected and written once control returns to the
+    event loop, so a burst of changes results in a single write. The log is only synced to disk in sync(),
+    without that it survives a crash of the process but not necessarily a power loss.
+
+    Once the log has grown beyond the compaction threshold, a snapshot of the current sessions is written
+    to a new log in a background thread which replaces the old log when done.
+*/
+
+#include "mqttsessionstore.h"
+#include "mqttsessionstore_p.h"
+
+#include <QDataStream>
+#include <QFileInfo>
+#include <QTimer>
+#include <QtEndian>
+
+#include <cstdio>
+
+#ifdef Q_OS_UNIX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+Q_LOGGING_CATEGORY(dbgSessionStore, "nymea.mqtt.sessionstore")
+
+static const int frameHeaderSize = 6;
+
+MqttFileSessionStore::MqttFileSessionStore(const QString &fileName, QObject *parent):
+    QObject(parent),
+    d_ptr(new MqttFileSessionStorePrivate(this))
+{
+    d_ptr->fileName = fileName;
+}
+
+MqttFileSessionStore::~MqttFileSessionStore()
+{
+    if (d_ptr->compactor) {
+        d_ptr->compactor->wait();
+        d_ptr->onCompactionFinished();
+    }
+    d_ptr->writePending();
+}
+
+QString MqttFileSessionStore::fileName() const
+{
+    return d_ptr->fileName;
+}
+
+qint64 MqttFileSessionStore::compactionThreshold() const
+{
+    return d_ptr->compactionThreshold;
+}
+
+void MqttFileSessionStore::setCompactionThreshold(qint64 compactionThreshold)
+{
+    d_ptr->compactionThreshold = compactionThreshold;
+}
+
+bool MqttFileSessionStore::isCompacting() const
+{
+    return d_ptr->compactor != nullptr;
+}
+
+/*! Starts compacting the log in a background thread. compactionFinished() is emitted when done. */
+void MqttFileSessionStore::compact()
+{
+    d_ptr->writePending();
+    d_ptr->startCompaction();
+}
+
+/*! Writes all pending changes to the log immediately. */
+void MqttFileSessionStore::flush()
+{
+    d_ptr->writePending();
+}
+
+/*! Replays the log and returns the stored sessions. A truncated frame at the end of the log, left over
+    from a crash while writing, is discarded. */
+QList<MqttSessionStore::Session> MqttFileSessionStore::restoreSessions()
+{
+    d_ptr->file.close();
+    d_ptr->sessions.clear();
+    d_ptr->pendingWrites.clear();
+
+    qint64 validSize = 0;
+    QFile file(d_ptr->fileName);
+    if (file.exists()) {
+        if (!file.open(QIODevice::ReadOnly)) {
+            qCWarning(dbgSessionStore) << "Cannot open session log" << d_ptr->fileName << file.errorString();
+            return QList<Session>();
+        }
+        QByteArray data = file.readAll();
+        file.close();
+
+        int records = 0;
+        int offset = 0;
+        while (offset + frameHeaderSize <= data.size()) {
+            const uchar *header = reinterpret_cast<const uchar*>(data.constData() + offset);
+            quint32 length = qFromBigEndian<quint32>(header);
+            quint16 checksum = qFromBigEndian<quint16>(header + 4);
+            if (length > static_cast<quint32>(data.size() - offset - frameHeaderSize)) {
+                break;
+            }
+            QByteArray record = QByteArray::fromRawData(data.constData() + offset + frameHeaderSize, static_cast<int>(length));
+            if (qChecksum(record.constData(), length) != checksum) {
+                break;
+            }
+            if (!MqttFileSessionStorePrivate::replayRecord(record, &d_ptr->sessions)) {
+                qCWarning(dbgSessionStore) << "Skipping invalid record in session log" << d_ptr->fileName;
+            }
+            offset += frameHeaderSize + static_cast<int>(length);
+            records++;
+        }
+        if (offset < data.size()) {
+            qCWarning(dbgSessionStore) << "Discarding" << data.size() - offset << "bytes of incomplete data at the end of session log" << d_ptr->fileName;
+        }
+        validSize = offset;
+        qCDebug(dbgSessionStore) << "Replayed" << records << "records," << d_ptr->sessions.count() << "sessions from" << d_ptr->fileName;
+    }
+
+    d_ptr->openLog(validSize);
+    d_ptr->compactedSize = d_ptr->logSize;
+
+    QList<Session> sessions;
+    foreach (const QString &clientId, d_ptr->sessions.keys()) {
+        const StoredSession &stored = d_ptr->sessions[clientId];
+        Session session;
+        session.clientId = clientId;
+        session.username = stored.username;
+        session.subscriptions = stored.subscriptions;
+        foreach (quint16 packetId, stored.inflightPacketList) {
+            session.inflightPackets.append(stored.inflightPackets.value(packetId));
+        }
+        session.queuedMessages = stored.queuedMessages;
+        sessions.append(session);
+    }
+    return sessions;
+}
+
+void MqttFileSessionStore::addSession(const QString &clientId, const QString &username)
+{
+    StoredSession session;
+    session.username = username;
+    d_ptr->sessions.insert(clientId, session);
+    d_ptr->append(MqttFileSessionStorePrivate::addSessionRecord(clientId, username));
+}
+
+void MqttFileSessionStore::removeSession(const QString &clientId)
+{
+    if (d_ptr->sessions.remove(clientId) > 0) {
+        d_ptr->append(MqttFileSessionStorePrivate::sessionRecord(MqttFileSessionStorePrivate::RecordRemoveSession, clientId));
+    }
+}
+
+void MqttFileSessionStore::addSubscription(const QString &clientId, const MqttSubscription &subscription)
+{
+    StoredSessions::iterator it = d_ptr->sessions.find(clientId);
+    if (it == d_ptr->sessions.end()) {
+        return;
+    }
+    MqttFileSessionStorePrivate::addSubscription(&it.value(), subscription);
+    d_ptr->append(MqttFileSessionStorePrivate::subscriptionRecord(clientId, subscription));
+}
+
+void MqttFileSessionStore::removeSubscription(const QString &clientId, const QByteArray &topicFilter)
+{
+    StoredSessions::iterator it = d_ptr->sessions.find(clientId);
+    if (it == d_ptr->sessions.end()) {
+        return;
+    }
+    MqttFileSessionStorePrivate::removeSubscription(&it.value(), topicFilter);
+    QByteArray record = MqttFileSessionStorePrivate::sessionRecord(MqttFileSessionStorePrivate::RecordRemoveSubscription, clientId);
+    QDataStream stream(&record, QIODevice::Append);
+    stream << topicFilter;
+    d_ptr->append(record);
+}
+
+void MqttFileSessionStore::storePacket(const QString &clientId, const MqttPacket &packet)
+{
+    StoredSessions::iterator it = d_ptr->sessions.find(clientId);
+    if (it == d_ptr->sessions.end()) {
+        return;
+    }
+    MqttFileSessionStorePrivate::storePacket(&it.value(), packet);
+    d_ptr->append(MqttFileSessionStorePrivate::packetRecord(MqttFileSessionStorePrivate::RecordStorePacket, clientId, packet));
+}
+
+void MqttFileSessionStore::removePacket(const QString &clientId, quint16 packetId)
+{
+    StoredSessions::iterator it = d_ptr->sessions.find(clientId);
+    if (it == d_ptr->sessions.end() || !it->inflightPackets.contains(packetId)) {
+        return;
+    }
+    MqttFileSessionStorePrivate::removePacket(&it.value(), packetId);
+    QByteArray record = MqttFileSessionStorePrivate::sessionRecord(MqttFileSessionStorePrivate::RecordRemovePacket, clientId);
+    QDataStream stream(&record, QIODevice::Append);
+    stream << packetId;
+    d_ptr->append(record);
+}
+
+void MqttFileSessionStore::queueMessage(const QString &clientId, const MqttPacket &packet)
+{
+    StoredSessions::iterator it = d_ptr->sessions.find(clientId);
+    if (it == d_ptr->sessions.end()) {
+        return;
+    }
+    it->queuedMessages.append(packet);
+    d_ptr->append(MqttFileSessionStorePrivate::packetRecord(MqttFileSessionStorePrivate::RecordQueueMessage, clientId, packet));
+}
+
+void MqttFileSessionStore::dequeueMessages(const QString &clientId, int count)
+{
+    StoredSessions::iterator it = d_ptr->sessions.find(clientId);
+    if (it == d_ptr->sessions.end() || count <= 0) {
+        return;
+    }
+    MqttFileSessionStorePrivate::dequeueMessages(&it.value(), count);
+    QByteArray record = MqttFileSessionStorePrivate::sessionRecord(MqttFileSessionStorePrivate::RecordDequeueMessages, clientId);
+    QDataStream stream(&record, QIODevice::Append);
+    stream << count;
+    d_ptr->append(record);
+}
+
+/*! Writes all pending changes and syncs the log to disk. */
+bool MqttFileSessionStore::sync()
+{
+    d_ptr->writePending();
+    if (!d_ptr->file.isOpen()) {
+        return false;
+    }
+    if (d_ptr->directorySyncPending) {
+        if (!MqttFileSessionStorePrivate::syncDirectory(d_ptr->fileName)) {
+            return false;
+        }
+        d_ptr->directorySyncPending = false;
+    }
+    return MqttFileSessionStorePrivate::syncFile(&d_ptr->file);
+}
+
+MqttFileSessionStorePrivate::MqttFileSessionStorePrivate(MqttFileSessionStore *q):
+    QObject(q),
+    q_ptr(q)
+{
+
+}
+
+QByteArray MqttFileSessionStorePrivate::sessionRecord(RecordType type, const QString &clientId)
+{
+    QByteArray record;
+    QDataStream stream(&record, QIODevice::WriteOnly);
+    stream << static_cast<quint8>(type) << clientId;
+    return record;
+}
+
+QByteArray MqttFileSessionStorePrivate::addSessionRecord(const QString &clientId, const QString &username)
+{
+    QByteArray record = sessionRecord(RecordAddSession, clientId);
+    QDataStream stream(&record, QIODevice::Append);
+    stream << username;
+    return record;
+}
+
+QByteArray MqttFileSessionStorePrivate::subscriptionRecord(const QString &clientId, const MqttSubscription &subscription)
+{
+    QByteArray record = sessionRecord(RecordAddSubscription, clientId);
+    QDataStream stream(&record, QIODevice::Append);
+    stream << subscription.topicFilter() << static_cast<quint8>(subscription.qoS());
+    return record;
+}
+
+QByteArray MqttFileSessionStorePrivate::packetRecord(RecordType type, const QString &clientId, const MqttPacket &packet)
+{
+    QByteArray record = sessionRecord(type, clientId);
+    QDataStream stream(&record, QIODevice::Append);
+    stream << packet.serialize();
+    // Optional, records without it are still read
+    if (packet.expiry() > 0) {
+        stream << packet.expiry();
+    }
+    return record;
+}
+
+bool MqttFileSessionStorePrivate::syncFile(QFile *file)
+{
+    if (!file->flush()) {
+        return false;
+    }
+#if defined(Q_OS_LINUX)
+    return ::fdatasync(file->handle()) == 0;
+#elif defined(Q_OS_UNIX)
+    return ::fsync(file->handle()) == 0;
+#else
+    return true;
+#endif
+}
+
+bool MqttFileSessionStorePrivate::syncDirectory(const QString &fileName)
+{
+#ifdef Q_OS_UNIX
+    int fd = ::open(QFile::encodeName(QFileInfo(fileName).absolutePath()).constData(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = ::fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+#else
+    Q_UNUSED(fileName)
+    return true;
+#endif
+}
+
+void MqttFileSessionStorePrivate::appendFrame(QByteArray *buffer, const QByteArray &record)
+{
+    uchar header[frameHeaderSize];
+    qToBigEndian<quint32>(static_cast<quint32>(record.size()), header);
+    qToBigEndian<quint16>(qChecksum(record.constData(), static_cast<uint>(record.size())), header + 4);
+    buffer->append(reinterpret_cast<const char*>(header), frameHeaderSize);
+    buffer->append(record);
+}
+
+void MqttFileSessionStorePrivate::appendSessionFrames(QByteArray *buffer, const QString &clientId, const StoredSession &session)
+{
+    appendFrame(buffer, addSessionRecord(clientId, session.username));
+    foreach (const MqttSubscription &subscription, session.subscriptions) {
+        appendFrame(buffer, subscriptionRecord(clientId, subscription));
+    }
+    foreach (quint16 packetId, session.inflightPacketList) {
+        appendFrame(buffer, packetRecord(RecordStorePacket, clientId, session.inflightPackets.value(packetId)));
+    }
+    foreach (const MqttPacket &packet, session.queuedMessages) {
+        appendFrame(buffer, packetRecord(RecordQueueMessage, clientId, packet));
+    }
+}
+
+bool MqttFileSessionStorePrivate::replayRecord(const QByteArray &record, StoredSessions *sessions)
+{
+    QDataStream stream(record);
+    quint8 type;
+    QString clientId;
+    stream >> type >> clientId;
+
+    if (type == RecordAddSession) {
+        StoredSession session;
+        stream >> session.username;
+        sessions->insert(clientId, session);
+        return stream.status() == QDataStream::Ok;
+    }
+    if (type == RecordRemoveSession) {
+        sessions->remove(clientId);
+        return stream.status() == QDataStream::Ok;
+    }
+
+    StoredSessions::iterator it = sessions->find(clientId);
+    if (it == sessions->end()) {
+        return false;
+    }
+    switch (type) {
+    case RecordAddSubscription: {
+        QByteArray topicFilter;
+        quint8 qos;
+        stream >> topicFilter >> qos;
+        addSubscription(&it.value(), MqttSubscription(topicFilter, static_cast<Mqtt::QoS>(qos)));
+        break;
+    }
+    case RecordRemoveSubscription: {
+        QByteArray topicFilter;
+        stream >> topicFilter;
+        removeSubscription(&it.value(), topicFilter);
+        break;
+    }
+    case RecordStorePacket:
+    case RecordQueueMessage: {
+        QByteArray data;
+        stream >> data;
+        MqttPacket packet;
+        if (packet.parse(data) <= 0) {
+            return false;
+        }
+        if (!stream.atEnd()) {
+            qint64 expiry;
+            stream >> expiry;
+            packet.setExpiry(expiry);
+        }
+        if (type == RecordStorePacket) {
+            storePacket(&it.value(), packet);
+        } else {
+            it->queuedMessages.append(packet);
+        }
+        break;
+    }
+    case RecordRemovePacket: {
+        quint16 packetId;
+        stream >> packetId;
+        removePacket(&it.value(), packetId);
+        break;
+    }
+    case RecordDequeueMessages: {
+        int count;
+        stream >> count;
+        dequeueMessages(&it.value(), count);
+        break;
+    }
+    default:
+        return false;
+    }
+    return stream.status() == QDataStream::Ok;
+}
+
+void MqttFileSessionStorePrivate::addSubscription(StoredSession *session, const MqttSubscription &subscription)
+{
+    for (int i = 0; i < session->subscriptions.count(); i++) {
+        if (session->subscriptions.at(i).topicFilter() == subscription.topicFilter()) {
+            session->subscriptions.replace(i, subscription);
+            return;
+        }
+    }
+    session->subscriptions.append(subscription);
+}
+
+void MqttFileSessionStorePrivate::removeSubscription(StoredSession *session, const QByteArray &topicFilter)
+{
+    for (int i = 0; i < session->subscriptions.count(); i++) {
+        if (session->subscriptions.at(i).topicFilter() == topicFilter) {
+            session->subscriptions.remove(i);
+            return;
+        }
+    }
+}
+
+void MqttFileSessionStorePrivate::storePacket(StoredSession *session, const MqttPacket &packet)
+{
+    if (!session->inflightPackets.contains(packet.packetId())) {
+        session->inflightPacketList.append(packet.packetId());
+    }
+    session->inflightPackets.insert(packet.packetId(), packet);
+}
+
+void MqttFileSessionStorePrivate::removePacket(StoredSession *session, quint16 packetId)
+{
+    session->inflightPackets.remove(packetId);
+    session->inflightPacketList.removeAll(packetId);
+}
+
+void MqttFileSessionStorePrivate::dequeueMessages(StoredSession *session, int count)
+{
+    count = qMin(count, session->queuedMessages.count());
+    session->queuedMessages.erase(session->queuedMessages.begin(), session->queuedMessages.begin() + count);
+}
+
+bool MqttFileSessionStorePrivate::openLog(qint64 validSize)
+{
+    file.setFileName(fileName);
+    if (!file.open(QIODevice::ReadWrite)) {
+        qCWarning(dbgSessionStore) << "Cannot open session log" << fileName << file.errorString();
+        return false;
+    }
+    if (validSize >= 0 && file.size() > validSize) {
+        file.resize(validSize);
+    }
+    file.seek(file.size());
+    logSize = file.size();
+    return true;
+}
+
+void MqttFileSessionStorePrivate::append(const QByteArray &record)
+{
+    int start = pendingWrites.size();
+    appendFrame(&pendingWrites, record);
+    if (compactor) {
+        compactionBacklog.append(pendingWrites.constData() + start, pendingWrites.size() - start);
+    }
+    if (!writeScheduled) {
+        writeScheduled = true;
+        QTimer::singleShot(0, this, &MqttFileSessionStorePrivate::writePending);
+    }
+}
+
+void MqttFileSessionStorePrivate::writePending()
+{
+    writeScheduled = false;
+    if (pendingWrites.isEmpty()) {
+        return;
+    }
+    if (!file.isOpen() && !openLog()) {
+        pendingWrites.clear();
+        return;
+    }
+    if (file.write(pendingWrites) != pendingWrites.size() || !file.flush()) {
+        qCWarning(dbgSessionStore) << "Error writing session log" << fileName << file.errorString();
+    }
+    logSize += pendingWrites.size();
+    pendingWrites.clear();
+
+    if (compactionThreshold > 0 && !compactor && logSize > compactionThreshold && logSize > 2 * compactedSize) {
+        startCompaction();
+    }
+}
+
+void MqttFileSessionStorePrivate::startCompaction()
+{
+    if (compactor) {
+        return;
+    }
+    qCDebug(dbgSessionStore) << "Compacting session log" << fileName << "of" << logSize << "bytes";
+    // The copy of the sessions is cheap, all containers are implicitly shared
+    compactor = new MqttSessionCompactor(sessions, fileName + QStringLiteral(".compact"), this);
+    connect(compactor, &QThread::finished, this, &MqttFileSessionStorePrivate::onCompactionFinished);
+    compactor->start(QThread::LowPriority);
+}
+
+void MqttFileSessionStorePrivate::onCompactionFinished()
+{
+    if (!compactor) {
+        return;
+    }
+    MqttSessionCompactor *finishedCompactor = compactor;
+    compactor = nullptr;
+    finishedCompactor->wait();
+    bool success = finishedCompactor->success();
+    delete finishedCompactor;
+
+    // Everything written after the snapshot was taken is in the backlog. Write out what's still
+    // pending to the old log first so it doesn't end up in the new log twice.
+    writePending();
+
+    QString compactFileName = fileName + QStringLiteral(".compact");
+    if (success) {
+        QFile compactFile(compactFileName);
+        success = compactFile.open(QIODevice::WriteOnly | QIODevice::Append)
+                && compactFile.write(compactionBacklog) == compactionBacklog.size()
+                && syncFile(&compactFile);
+    }
+    compactionBacklog.clear();
+
+    if (success) {
+        file.close();
+        success = std::rename(QFile::encodeName(compactFileName).constData(), QFile::encodeName(fileName).constData()) == 0;
+        openLog();
+    }
+    if (success && !syncDirectory(fileName)) {
+        // The old log may come back after a crash, records appended to the new one from now on would be
+        // lost with it. Retried on the next sync(), which doesn't report success before it worked.
+        qCWarning(dbgSessionStore) << "Syncing the directory of" << fileName << "failed.";
+        directorySyncPending = true;
+    }
+    if (success) {
+        qCDebug(dbgSessionStore) << "Compacted session log" << fileName << "to" << logSize << "bytes";
+        compactedSize = logSize;
+    } else {
+        qCWarning(dbgSessionStore) << "Compacting session log" << fileName << "failed. Continuing with the old log.";
+        QFile::remove(compactFileName);
+        // Don't retry right away
+        compactedSize = logSize;
+    }
+    emit q_ptr->compactionFinished(success);
+}
+
+MqttSessionCompactor::MqttSessionCompactor(const StoredSessions &sessions, const QString &fileName, QObject *parent):
+    QThread(parent),
+    m_sessions(sessions),
+    m_fileName(fileName)
+{
+
+}
+
+bool MqttSessionCompactor::success() const
+{
+    return m_success;
+}
+
+void MqttSessionCompactor::run()
+{
+    QFile file(m_fileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qCWarning(dbgSessionStore) << "Cannot open" << m_fileName << file.errorString();
+        return;
+    }
+    QByteArray buffer;
+    bool ok = true;
+    foreach (const QString &clientId, m_sessions.keys()) {
+        MqttFileSessionStorePrivate::appendSessionFrames(&buffer, clientId, m_sessions.value(clientId));
+        if (buffer.size() > 64 * 1024) {
+            ok = ok && file.write(buffer) == buffer.size();
+            buffer.clear();
+        }
+    }
+    ok = ok && file.write(buffer) == buffer.size();
+    // Syncing the bulk of the data here keeps it off the server thread
+    m_success = ok && MqttFileSessionStorePrivate::syncFile(&file);
+}
@@ -0,0 +1,110 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+*
+* Copyright 2013 - 2020, nymea GmbH
+* Contact: contact@nymea.io
+*
+* This file is part of nymea.
+* This project including source code and documentation is protected by copyright law, and
+* remains the property of nymea GmbH. All rights, including reproduction, publication,
+* editing and translation, are reserved. The use of this project is subject to the terms of a
+* license agreement to be concluded with nymea GmbH in accordance with the terms
+* of use of nymea GmbH, available under https://nymea.io/license
+*
+* GNU Lesser General Public License Usage
+* Alternatively, this project may be redistributed and/or modified under the terms of the GNU
+* Lesser General Public License as published by the Free Software Foundation; version 3.
+* this project is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+* without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License along with this project.
+* If not, see <https://www.gnu.org/licenses/>.
+*
+* For any further details and any questions please contact us under contact@nymea.io
+* or see our FAQ/Licensing Information on https://nymea.io/license/faq
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef MQTTSESSIONSTORE_H
+#define MQTTSESSIONSTORE_H
+
+#include <QObject>
+#include <QList>
+
+#include "mqttpacket.h"
+#include "mqttsubscription.h"
+
+class MqttFileSessionStorePrivate;
+
+// Receives all changes to persistent sessions (clients connected without the clean session flag) from
+// MqttServer, see MqttServer::setSessionStore().
+class MqttSessionStore
+{
+public:
+    struct Session {
+        QString clientId;
+        QString username;
+        MqttSubscriptions subscriptions;
+        // Unacknowledged PUBLISH, PUBREC and PUBREL packets in the order they were sent
+        QList<MqttPacket> inflightPackets;
+        // Messages queued while the session was offline
+        QList<MqttPacket> queuedMessages;
+    };
+
+    virtual ~MqttSessionStore() = default;
+
+    virtual QList<Session> restoreSessions() = 0;
+
+    // Adding a session replaces any stored session with the same client ID
+    virtual void addSession(const QString &clientId, const QString &username) = 0;
+    virtual void removeSession(const QString &clientId) = 0;
+    virtual void addSubscription(const QString &clientId, const MqttSubscription &subscription) = 0;
+    virtual void removeSubscription(const QString &clientId, const QByteArray &topicFilter) = 0;
+    // Stores or replaces the inflight packet with the packet ID of the given packet
+    virtual void storePacket(const QString &clientId, const MqttPacket &packet) = 0;
+    virtual void removePacket(const QString &clientId, quint16 packetId) = 0;
+    virtual void queueMessage(const QString &clientId, const MqttPacket &packet) = 0;
+    virtual void dequeueMessages(const QString &clientId, int count) = 0;
+
+    // Makes all changes so far durable. Called by the server before acknowledging QoS 1 and 2
+    // messages when durable acknowledgements are enabled, see MqttServer::setDurableAcknowledgements().
+    virtual bool sync() { return true; }
+};
+
+class MqttFileSessionStore: public QObject, public MqttSessionStore
+{
+    Q_OBJECT
+public:
+    explicit MqttFileSessionStore(const QString &fileName, QObject *parent = nullptr);
+    ~MqttFileSessionStore() override;
+
+    QString fileName() const;
+
+    // The log is compacted in a background thread once it exceeds this size and has
+    // doubled since the last compaction. 0 disables automatic compaction.
+    qint64 compactionThreshold() const;
+    void setCompactionThreshold(qint64 compactionThreshold);
+    bool isCompacting() const;
+    void compact();
+
+    void flush();
+
+    QList<Session> restoreSessions() override;
+    void addSession(const QString &clientId, const QString &username) override;
+    void removeSession(const QString &clientId) override;
+    void addSubscription(const QString &clientId, const MqttSubscription &subscription) override;
+    void removeSubscription(const QString &clientId, const QByteArray &topicFilter) override;
+    void storePacket(const QString &clientId, const MqttPacket &packet) override;
+    void removePacket(const QString &clientId, quint16 packetId) override;
+    void queueMessage(const QString &clientId, const MqttPacket &packet) override;
+    void dequeueMessages(const QString &clientId, int count) override;
+    bool sync() override;
+
+signals:
+    void compactionFinished(bool success);
+
+private:
+    MqttFileSessionStorePrivate *d_ptr;
+};
+
+#endif // MQTTSESSIONSTORE_H
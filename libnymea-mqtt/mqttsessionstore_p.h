@@ -0,0 +1,136 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+*
+* Copyright 2013 - 2020, nymea GmbH
+* Contact: contact@nymea.io
+*
+* This file is part of nymea.
+* This project including source code and documentation is protected by copyright law, and
+* remains the property of nymea GmbH. All rights, including reproduction, publication,
+* editing and translation, are reserved. The use of this project is subject to the terms of a
+* license agreement to be concluded with nymea GmbH in accordance with the terms
+* of use of nymea GmbH, available under https://nymea.io/license
+*
+* GNU Lesser General Public License Usage
+* Alternatively, this project may be redistributed and/or modified under the terms of the GNU
+* Lesser General Public License as published by the Free Software Foundation; version 3.
+* this project is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+* without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License along with this project.
+* If not, see <https://www.gnu.org/licenses/>.
+*
+* For any further details and any questions please contact us under contact@nymea.io
+* or see our FAQ/Licensing Information on https://nymea.io/license/faq
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef MQTTSESSIONSTORE_P_H
+#define MQTTSESSIONSTORE_P_H
+
+#include <QObject>
+#include <QThread>
+#include <QFile>
+#include <QHash>
+#include <QVector>
+#include <QLoggingCategory>
+
+#include "mqttsessionstore.h"
+
+Q_DECLARE_LOGGING_CATEGORY(dbgSessionStore)
+
+class MqttSessionCompactor;
+
+class StoredSession
+{
+public:
+    QString username;
+    MqttSubscriptions subscriptions;
+    QVector<quint16> inflightPacketList;
+    QHash<quint16, MqttPacket> inflightPackets;
+    QList<MqttPacket> queuedMessages;
+};
+typedef QHash<QString, StoredSession> StoredSessions;
+
+// The log is a sequence of frames: record length (quint32, big endian), CRC-16 of the record (quint16,
+// big endian) and the record. A record is a QDataStream with the record type, the client ID and the
+// arguments of the change. Replaying stops at the first incomplete or corrupt frame, which is where
+// writing stopped when the process died.
+class MqttFileSessionStorePrivate: public QObject
+{
+    Q_OBJECT
+public:
+    enum RecordType {
+        RecordAddSession = 1,
+        RecordRemoveSession,
+        RecordAddSubscription,
+        RecordRemoveSubscription,
+        RecordStorePacket,
+        RecordRemovePacket,
+        RecordQueueMessage,
+        RecordDequeueMessages
+    };
+
+    explicit MqttFileSessionStorePrivate(MqttFileSessionStore *q);
+
+    static QByteArray sessionRecord(RecordType type, const QString &clientId);
+    static QByteArray addSessionRecord(const QString &clientId, const QString &username);
+    static QByteArray subscriptionRecord(const QString &clientId, const MqttSubscription &subscription);
+    static QByteArray packetRecord(RecordType type, const QString &clientId, const MqttPacket &packet);
+    static bool syncFile(QFile *file);
+    // Makes renaming a file within its directory durable
+    static bool syncDirectory(const QString &fileName);
+    static void appendFrame(QByteArray *buffer, const QByteArray &record);
+    static void appendSessionFrames(QByteArray *buffer, const QString &clientId, const StoredSession &session);
+    static bool replayRecord(const QByteArray &record, StoredSessions *sessions);
+
+    static void addSubscription(StoredSession *session, const MqttSubscription &subscription);
+    static void removeSubscription(StoredSession *session, const QByteArray &topicFilter);
+    static void storePacket(StoredSession *session, const MqttPacket &packet);
+    static void removePacket(StoredSession *session, quint16 packetId);
+    static void dequeueMessages(StoredSession *session, int count);
+
+    bool openLog(qint64 validSize = -1);
+    void append(const QByteArray &record);
+    void writePending();
+    void startCompaction();
+    void onCompactionFinished();
+
+    MqttFileSessionStore *q_ptr;
+
+    QString fileName;
+    QFile file;
+    StoredSessions sessions;
+
+    QByteArray pendingWrites;
+    bool writeScheduled = false;
+    qint64 logSize = 0;
+
+    qint64 compactionThreshold = 16 * 1024 * 1024;
+    qint64 compactedSize = 0;
+    MqttSessionCompactor *compactor = nullptr;
+    // Frames written while the compactor runs, they are appended to the compacted log
+    QByteArray compactionBacklog;
+    // The rename of the compacted log is not durable yet
+    bool directorySyncPending = false;
+};
+
+// Writes a snapshot of all sessions to a new log file in a background thread
+class MqttSessionCompactor: public QThread
+{
+    Q_OBJECT
+public:
+    MqttSessionCompactor(const StoredSessions &sessions, const QString &fileName, QObject *parent = nullptr);
+
+    bool success() const;
+
+protected:
+    void run() override;
+
+private:
+    StoredSessions m_sessions;
+    QString m_fileName;
+    bool m_success = false;
+};
+
+#endif // MQTTSESSIONSTORE_P_H
@@ -0,0 +1,160 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+*
+* Copyright 2013 - 2020, nymea GmbH
+* Contact: contact@nymea.io
+*
+* This file is part of nymea.
+* This project including source code and documentation is protected by copyright law, and
+* remains the property of nymea GmbH. All rights, including reproduction, publication,
+* editing and translation, are reserved. The use of this project is subject to the terms of a
+* license agreement to be concluded with nymea GmbH in accordance with the terms
+* of use of nymea GmbH, available under https://nymea.io/license
+*
+* GNU Lesser General Public License Usage
+* Alternatively, this project may be redistributed and/or modified under the terms of the GNU
+* Lesser General Public License as published by the Free Software Foundation; version 3.
+* this project is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+* without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License along with this project.
+* If not, see <https://www.gnu.org/licenses/>.
+*
+* For any further details and any questions please contact us under contact@nymea.io
+* or see our FAQ/Licensing Information on https://nymea.io/license/faq
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef MQTTTIMERWHEEL_P_H
+#define MQTTTIMERWHEEL_P_H
+
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QSet>
+#include <QList>
+#include <QVector>
+
+#include <functional>
+
+// A coarse grained timer wheel tracking a large number of timeouts with a single QTimer.
+// Touching an entry only updates its last seen timestamp. Whenever the wheel reaches the slot
+// an entry sits in, the entry is either expired or moved ahead to the slot matching its remaining
+// time. Timeouts longer than the span of the wheel cascade through it the same way.
+template <typename Key>
+class MqttTimerWheel
+{
+public:
+    typedef std::function<void(const QList<Key> &keys)> ExpiryHandler;
+
+    explicit MqttTimerWheel(int tickInterval = 250, int slotCount = 256):
+        m_tickInterval(tickInterval),
+        m_slots(slotCount)
+    {
+        m_clock.start();
+        m_timer.setInterval(tickInterval);
+        QObject::connect(&m_timer, &QTimer::timeout, &m_timer, [this]() { tick(); });
+    }
+
+    void setExpiryHandler(const ExpiryHandler &handler)
+    {
+        m_handler = handler;
+    }
+
+    // Starts tracking the given key. It expires if not touched for timeout milliseconds.
+    void add(const Key &key, qint64 timeout)
+    {
+        remove(key);
+        Entry entry;
+        entry.lastSeen = m_clock.elapsed();
+        entry.timeout = timeout;
+        schedule(key, entry);
+        m_entries.insert(key, entry);
+        if (!m_timer.isActive()) {
+            m_timer.start();
+        }
+    }
+
+    void touch(const Key &key)
+    {
+        typename QHash<Key, Entry>::iterator it = m_entries.find(key);
+        if (it != m_entries.end()) {
+            it->lastSeen = m_clock.elapsed();
+        }
+    }
+
+    void remove(const Key &key)
+    {
+        typename QHash<Key, Entry>::iterator it = m_entries.find(key);
+        if (it == m_entries.end()) {
+            return;
+        }
+        m_slots[it->slot].remove(key);
+        m_entries.erase(it);
+        if (m_entries.isEmpty()) {
+            m_timer.stop();
+        }
+    }
+
+    bool contains(const Key &key) const
+    {
+        return m_entries.contains(key);
+    }
+
+    int count() const
+    {
+        return m_entries.count();
+    }
+
+private:
+    struct Entry {
+        qint64 lastSeen = 0;
+        qint64 timeout = 0;
+        int slot = 0;
+    };
+
+    void schedule(const Key &key, Entry &entry)
+    {
+        qint64 remaining = entry.lastSeen + entry.timeout - m_clock.elapsed();
+        qint64 ticks = qBound<qint64>(1, (remaining + m_tickInterval - 1) / m_tickInterval, m_slots.count() - 1);
+        entry.slot = static_cast<int>((m_currentSlot + ticks) % m_slots.count());
+        m_slots[entry.slot].insert(key);
+    }
+
+    void tick()
+    {
+        m_currentSlot = (m_currentSlot + 1) % m_slots.count();
+        QSet<Key> due;
+        due.swap(m_slots[m_currentSlot]);
+
+        qint64 now = m_clock.elapsed();
+        QList<Key> expired;
+        foreach (const Key &key, due) {
+            Entry &entry = m_entries[key];
+            if (now - entry.lastSeen >= entry.timeout) {
+                m_entries.remove(key);
+                expired.append(key);
+            } else {
+                schedule(key, entry);
+            }
+        }
+        if (m_entries.isEmpty()) {
+            m_timer.stop();
+        }
+
+        // Handle all entries expired in this tick at once
+        if (!expired.isEmpty() && m_handler) {
+            m_handler(expired);
+        }
+    }
+
+    int m_tickInterval;
+    QVector<QSet<Key> > m_slots;
+    int m_currentSlot = 0;
+    QElapsedTimer m_clock;
+    QTimer m_timer;
+    QHash<Key, Entry> m_entries;
+    ExpiryHandler m_handler;
+};
+
+#endif // MQTTTIMERWHEEL_P_H
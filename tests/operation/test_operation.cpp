@@ -28,10 +28,87 @@
 #include "mqttserver.h"
 #include "mqttclient.h"
 #include "mqttclient_p.h"
+#include "mqttsessionstore.h"
+#include "mqttbridge.h"
+#include "mqttbroker.h"
+#include "mqttaccesscontrol.h"
 
 #include <QTest>
 #include <QSignalSpy>
+#include <QElapsedTimer>
+#include <QThread>
+#include <QFile>
+#include <QTemporaryDir>
 
+#ifdef Q_OS_LINUX
+#include <unistd.h>
+#endif
+
+class CountingAuthorizer: public MqttAuthorizer
+{
+public:
+    Mqtt::ConnectReturnCode authorizeConnect(int, const QString &, const QString &, const QString &, const QHostAddress &) override {
+        return Mqtt::ConnectReturnCodeAccepted;
+    }
+    bool authorizeSubscribe(int, const QString &, const QString &topicFilter) override {
+        subscribeChecks++;
+        return !topicFilter.startsWith(denied);
+    }
+    bool authorizePublish(int, const QString &, const QString &topic) override {
+        publishChecks++;
+        return !topic.startsWith(denied);
+    }
+
+    QString denied = "denied/";
+    int subscribeChecks = 0;
+    int publishChecks = 0;
+};
+
+class AsyncAuthorizer: public MqttAuthorizer
+{
+public:
+    Mqtt::ConnectReturnCode authorizeConnect(int, const QString &, const QString &, const QString &, const QHostAddress &) override {
+        return Mqtt::ConnectReturnCodeNotAuthorized;
+    }
+    MqttConnectAuthorization *authorizeConnectAsync(int, const QString &clientId, const QString &, const QString &, const QHostAddress &) override {
+        MqttConnectAuthorization *authorization = new MqttConnectAuthorization();
+        pending.insert(clientId, authorization);
+        return authorization;
+    }
+    bool authorizeSubscribe(int, const QString &, const QString &) override {
+        return true;
+    }
+    bool authorizePublish(int, const QString &, const QString &) override {
+        return true;
+    }
+
+    QHash<QString, MqttConnectAuthorization*> pending;
+};
+
+class CompleteAuthorizationThread: public QThread
+{
+public:
+    CompleteAuthorizationThread(MqttConnectAuthorization *authorization, Mqtt::ConnectReturnCode returnCode):
+        m_authorization(authorization), m_returnCode(returnCode) {}
+protected:
+    void run() override {
+        m_authorization->complete(m_returnCode);
+    }
+private:
+    MqttConnectAuthorization *m_authorization;
+    Mqtt::ConnectReturnCode m_returnCode;
+};
+
+class FailingSessionStore: public MqttFileSessionStore
+{
+public:
+    using MqttFileSessionStore::MqttFileSessionStore;
+    bool sync() override {
+        return !failSync && MqttFileSessionStore::sync();
+    }
+
+    bool failSync = false;
+};
 
 class OperationTests: public QObject
 {
@@ -68,6 +145,18 @@ private slots:
     void testSessionManagementDropOldSession();
     void testSessionManagementResumeOldSession();
     void testSessionManagementFailResumeOldSession();
+    void testOfflineSession();
+    void testInflightWindow();
+    void testRetransmission();
+    void testPacketIds();
+    void testSessionStore();
+    void testGroupCommit_data();
+    void testGroupCommit();
+    void testGroupCommitBenchmark_data();
+    void testGroupCommitBenchmark();
+    void testHeldAcknowledgementsOnDrop_data();
+    void testHeldAcknowledgementsOnDrop();
+    void testFailedGroupCommit();
 
     void testQoS1PublishToServerIsAckedOnSessionResume();
     void testQoS1PublishToClientIsDeliveredOnSessionResume();
@@ -77,6 +166,18 @@ private slots:
     void testQoS2PublishToClientIsCompletedOnSessionResume();
 
     void testRetain();
+    void testRetainedDelivery();
+    void testRetainedMessagesFile();
+    void testMessageExpiry();
+    void testRetainedBudget();
+    void testPayloadCompression();
+    void testBridge();
+    void testCluster();
+    void testBroker();
+    void testAuthorizationCache();
+    void testAsyncConnectAuthorization();
+    void testAccessControl();
+    void testStatistics();
 
     void testUnsubscribe();
 
@@ -84,15 +185,40 @@ private slots:
 
     void testBinaryPaylaod();
 
+    void testLargePayload_data();
+    void testLargePayload();
+
+    void testConnectRateLimit();
+
+    void testLocalSocket();
+
+    void testIoUringTransport();
+
+    void testInProcessConnection();
+
+    void testHandover();
+
+    void testMemoryPerConnection();
+
 private:
     // Connects and waits for the MQTT CONNECT to be finished
     MqttClient *connectAndWait(const QString &clientId, bool cleanSession = true, quint16 keepAlive = 300, const QString &willTopic = QString(), const QString &willMessage = QString(), Mqtt::QoS willQoS = Mqtt::QoS0, bool willRetain = false);
 
+    // Connects to a server within the process and waits for the MQTT CONNECT to be finished. The client is deleted
+    // by the test, it is not cleaned up with the ones connected to m_server.
+    MqttClient *connectAndWait(MqttServer *server, const QString &clientId, bool cleanSession = true, const QString &username = QString());
+
     // Just connects, returns the client and signalspy which has been created before calling connect. You must delete the spy yourself!
     QPair<MqttClient*, QSignalSpy*> connectToServer(const QString &clientId, bool cleanSession = true, quint16 keepAlive = 300, const QString &willTopic = QString(), const QString &willMessage = QString(), Mqtt::QoS willQoS = Mqtt::QoS0, bool willRetain = false);
 
     void disconnectAndWait(MqttClient* client);
 
+    // Connects a raw socket, so a test can send acknowledgements by hand, and subscribes it to the given topic filter.
+    // Returns once the CONNACK and SUBACK arrived.
+    bool connectRawAndWait(QTcpSocket *socket, const QString &clientId, const QString &topicFilter, Mqtt::QoS qos = Mqtt::QoS1);
+    // Appends the packets received on a raw socket, returns the number of packets received so far
+    int readPackets(QTcpSocket *socket, MqttPackets *received);
+
     bool subscribeAndWait(MqttClient* client, const QString &topic, Mqtt::QoS qos = Mqtt::QoS1);
 
 private:
@@ -120,6 +246,24 @@ MqttClient *OperationTests::connectAndWait(const QString &clientId, bool cleanSe
     return result.first;
 }
 
+MqttClient *OperationTests::connectAndWait(MqttServer *server, const QString &clientId, bool cleanSession, const QString &username)
+{
+    MqttClient *client = new MqttClient(clientId, this);
+    client->setAutoReconnect(false);
+    client->setUsername(username);
+
+    QSignalSpy connectedSpy(client, &MqttClient::connected);
+    client->connectToServer(server, cleanSession);
+    if (connectedSpy.count() == 0) {
+        connectedSpy.wait();
+    }
+
+    if (connectedSpy.count() == 0) {
+        qWarning() << "WARNING: Client didn't emit connected";
+    }
+    return client;
+}
+
 QPair<MqttClient*, QSignalSpy*> OperationTests::connectToServer(const QString &clientId, bool cleanSession, quint16 keepAlive, const QString &willTopic, const QString &willMessage, Mqtt::QoS willQoS, bool willRetain)
 {
     MqttClient* client = new MqttClient(clientId, keepAlive, willTopic, willMessage.toUtf8(), willQoS, willRetain, this);
@@ -141,6 +285,47 @@ void OperationTests::disconnectAndWait(MqttClient* client)
     }
 }
 
+bool OperationTests::connectRawAndWait(QTcpSocket *socket, const QString &clientId, const QString &topicFilter, Mqtt::QoS qos)
+{
+    socket->connectToHost(m_serverHost, m_serverPort);
+    if (!socket->waitForConnected()) {
+        return false;
+    }
+    MqttPacket connectPacket(MqttPacket::TypeConnect);
+    connectPacket.setProtocolLevel(Mqtt::Protocol311);
+    connectPacket.setClientId(clientId.toUtf8());
+    connectPacket.setKeepAlive(300);
+    MqttPacket subscribePacket(MqttPacket::TypeSubscribe, 1);
+    subscribePacket.addSubscription(MqttSubscription(topicFilter.toUtf8(), qos));
+    socket->write(connectPacket.serialize() + subscribePacket.serialize());
+
+    QSignalSpy readyReadSpy(socket, &QTcpSocket::readyRead);
+    MqttPackets received;
+    while (readPackets(socket, &received) < 2 && readyReadSpy.wait()) {
+    }
+    return received.count() == 2
+            && received.at(0).type() == MqttPacket::TypeConnack && received.at(0).connectReturnCode() == Mqtt::ConnectReturnCodeAccepted
+            && received.at(1).type() == MqttPacket::TypeSuback;
+}
+
+int OperationTests::readPackets(QTcpSocket *socket, MqttPackets *received)
+{
+    // Incomplete packets stay in the socket until the rest arrived
+    QByteArray data = socket->peek(socket->bytesAvailable());
+    int offset = 0;
+    forever {
+        MqttPacket packet;
+        int length = packet.parse(data.mid(offset));
+        if (length <= 0) {
+            break;
+        }
+        offset += length;
+        received->append(packet);
+    }
+    socket->read(offset);
+    return received->count();
+}
+
 bool OperationTests::subscribeAndWait(MqttClient* client, const QString &topic, Mqtt::QoS qos)
 {
     QSignalSpy subscribedSpy(client, &MqttClient::subscribeResult);
@@ -177,6 +362,15 @@ void OperationTests::cleanup()
         client->deleteLater();
     }
     QTRY_COMPARE(m_server->clients().count(), 0);
+
+    m_server->setConnectRateLimit(0);
+    m_server->setMaximumQueuedConnects(1000);
+    m_server->setSessionExpiryInterval(0);
+    m_server->setMaximumOfflineQueueCount(1000);
+    m_server->setMaximumInflightMessages(0);
+    m_server->setMaximumRetransmissions(5);
+    m_server->setDurableAcknowledgements(false);
+    m_server->setGroupCommit(5, 64);
 }
 
 void OperationTests::connectAndDisconnect()
@@ -619,6 +813,447 @@ void OperationTests::testSessionManagementFailResumeOldSession()
     QVERIFY2(!client.second->first().at(0).value<Mqtt::ConnackFlags>().testFlag(Mqtt::ConnackFlagSessionPresent), "Session present flag is set while it should not be.");
 }
 
+void OperationTests::testOfflineSession()
+{
+    m_server->setSessionExpiryInterval(60);
+    m_server->setMaximumOfflineQueueCount(2);
+
+    MqttClient *client = connectAndWait("offlineClient", false);
+    QVERIFY(subscribeAndWait(client, "offline/#", Mqtt::QoS1));
+    disconnectAndWait(client);
+    QTRY_COMPARE(m_server->offlineSessions(), QStringList() << "offlineClient");
+
+    // QoS 0 messages are not queued, of the others only the newest two fit into the queue
+    MqttClient *publisher = connectAndWait("offlinePublisher");
+    QSignalSpy publishedSpy(publisher, &MqttClient::published);
+    publisher->publish("offline/topic", "0", Mqtt::QoS0);
+    publisher->publish("offline/topic", "1", Mqtt::QoS1);
+    publisher->publish("offline/topic", "2", Mqtt::QoS1);
+    publisher->publish("offline/topic", "3", Mqtt::QoS1);
+    QTRY_COMPARE(publishedSpy.count(), 4);
+
+    QSignalSpy connectedSpy(client, &MqttClient::connected);
+    QSignalSpy receivedSpy(client, &MqttClient::publishReceived);
+    client->connectToHost(m_serverHost, m_serverPort, false);
+    QTRY_COMPARE(connectedSpy.count(), 1);
+    QVERIFY2(connectedSpy.first().at(1).value<Mqtt::ConnackFlags>().testFlag(Mqtt::ConnackFlagSessionPresent), "Session present flag is not set while it should be.");
+    QVERIFY(m_server->offlineSessions().isEmpty());
+
+    QTRY_COMPARE(receivedSpy.count(), 2);
+    QCOMPARE(receivedSpy.at(0).at(1).toByteArray(), QByteArray("2"));
+    QCOMPARE(receivedSpy.at(1).at(1).toByteArray(), QByteArray("3"));
+
+    // Offline sessions expire
+    m_server->setSessionExpiryInterval(1);
+    QSignalSpy unsubscribedSpy(m_server, &MqttServer::clientUnsubscribed);
+    disconnectAndWait(client);
+    QTRY_COMPARE(m_server->offlineSessions().count(), 1);
+    QTRY_VERIFY_WITH_TIMEOUT(m_server->offlineSessions().isEmpty(), 5000);
+    QCOMPARE(unsubscribedSpy.count(), 1);
+}
+
+void OperationTests::testInflightWindow()
+{
+    m_server->setMaximumInflightMessages(2);
+
+    QTcpSocket socket;
+    QVERIFY(connectRawAndWait(&socket, "inflightClient", "inflight/#"));
+    MqttPackets received;
+
+    for (int i = 0; i < 5; i++) {
+        m_server->publish("inflight/topic", QByteArray::number(i));
+    }
+    QTRY_COMPARE(readPackets(&socket, &received), 2);
+    QTest::qWait(100);
+    QCOMPARE(readPackets(&socket, &received), 2);
+    QCOMPARE(received.at(0).payload(), QByteArray("0"));
+    QCOMPARE(received.at(1).payload(), QByteArray("1"));
+
+    // Each PUBACK releases the next message, in order
+    for (int i = 0; i < 5; i++) {
+        socket.write(MqttPacket(MqttPacket::TypePuback, received.at(i).packetId()).serialize());
+        int expected = qMin(5, i + 3);
+        QTRY_COMPARE(readPackets(&socket, &received), expected);
+        QCOMPARE(received.at(expected - 1).payload(), QByteArray::number(expected - 1));
+    }
+
+    // A duplicate PUBREC gets the PUBREL again, the message is not published twice and the window stays closed
+    QTcpSocket qos2Socket;
+    QVERIFY(connectRawAndWait(&qos2Socket, "inflightQoS2Client", "inflightqos2/#", Mqtt::QoS2));
+    MqttPackets qos2Received;
+    QSignalSpy publishedSpy(m_server, &MqttServer::published);
+    for (int i = 0; i < 3; i++) {
+        m_server->publish("inflightqos2/topic", QByteArray::number(i));
+    }
+    QTRY_COMPARE(readPackets(&qos2Socket, &qos2Received), 2);
+    quint16 packetId = qos2Received.at(0).packetId();
+    for (int i = 0; i < 2; i++) {
+        qos2Socket.write(MqttPacket(MqttPacket::TypePubrec, packetId).serialize());
+        QTRY_COMPARE(readPackets(&qos2Socket, &qos2Received), 3 + i);
+        QCOMPARE(qos2Received.at(2 + i).type(), MqttPacket::TypePubrel);
+        QCOMPARE(qos2Received.at(2 + i).packetId(), packetId);
+    }
+    QTest::qWait(100);
+    QCOMPARE(readPackets(&qos2Socket, &qos2Received), 4);
+    QCOMPARE(publishedSpy.count(), 1);
+
+    // Only the PUBCOMP releases the next message, a duplicate one nothing more
+    for (int i = 0; i < 2; i++) {
+        qos2Socket.write(MqttPacket(MqttPacket::TypePubcomp, packetId).serialize());
+    }
+    QTRY_COMPARE(readPackets(&qos2Socket, &qos2Received), 5);
+    QCOMPARE(qos2Received.at(4).payload(), QByteArray("2"));
+    QTest::qWait(100);
+    QCOMPARE(readPackets(&qos2Socket, &qos2Received), 5);
+
+    // Retained messages sent on subscribing are within the window too, and retransmitted like any other
+    MqttClient *publisher = connectAndWait("inflightRetainedPublisher");
+    QSignalSpy retainedPublishedSpy(publisher, &MqttClient::published);
+    for (int i = 0; i < 3; i++) {
+        publisher->publish(QString("inflightretained/%1").arg(i), QByteArray::number(i), Mqtt::QoS1, true);
+    }
+    QTRY_COMPARE(retainedPublishedSpy.count(), 3);
+    QTcpSocket retainedSocket;
+    QVERIFY(connectRawAndWait(&retainedSocket, "inflightRetainedClient", "inflightretained/none"));
+    MqttPackets retainedReceived;
+    auto retainedTopics = [&]() {
+        readPackets(&retainedSocket, &retainedReceived);
+        QSet<QByteArray> topics;
+        for (int i = 1; i < retainedReceived.count(); i++) {
+            topics.insert(retainedReceived.at(i).topic());
+        }
+        return topics.count();
+    };
+    MqttPacket subscribePacket(MqttPacket::TypeSubscribe, 2);
+    subscribePacket.addSubscription(MqttSubscription("inflightretained/#", Mqtt::QoS1));
+    retainedSocket.write(subscribePacket.serialize());
+    QTRY_COMPARE(readPackets(&retainedSocket, &retainedReceived), 3);
+    QCOMPARE(retainedReceived.at(0).type(), MqttPacket::TypeSuback);
+    QTRY_VERIFY_WITH_TIMEOUT(readPackets(&retainedSocket, &retainedReceived) > 3, 5000);
+    QVERIFY(retainedReceived.at(3).dup());
+    QCOMPARE(retainedTopics(), 2);
+    retainedSocket.write(MqttPacket(MqttPacket::TypePuback, retainedReceived.at(1).packetId()).serialize());
+    QTRY_COMPARE(retainedTopics(), 3);
+
+    for (int i = 0; i < 3; i++) {
+        publisher->publish(QString("inflightretained/%1").arg(i), QByteArray(), Mqtt::QoS1, true);
+    }
+    QTRY_COMPARE(retainedPublishedSpy.count(), 6);
+    retainedSocket.disconnectFromHost();
+    qos2Socket.disconnectFromHost();
+    socket.disconnectFromHost();
+    QTRY_VERIFY(!m_server->clients().contains("inflightClient"));
+    QTRY_VERIFY(!m_server->clients().contains("inflightQoS2Client"));
+    QTRY_VERIFY(!m_server->clients().contains("inflightRetainedClient"));
+}
+
+void OperationTests::testRetransmission()
+{
+    m_server->setMaximumRetransmissions(1);
+
+    QTcpSocket socket;
+    QVERIFY(connectRawAndWait(&socket, "retransmissionClient", "retransmission/#"));
+    MqttPackets received;
+
+    // Acknowledged right away, nothing is resent
+    m_server->publish("retransmission/topic", "acked");
+    QTRY_COMPARE(readPackets(&socket, &received), 1);
+    socket.write(MqttPacket(MqttPacket::TypePuback, received.at(0).packetId()).serialize());
+    received.clear();
+
+    // Not acknowledged, resent with the DUP flag once the timeout passes
+    m_server->publish("retransmission/topic", "unacked");
+    QTRY_COMPARE(readPackets(&socket, &received), 1);
+    QVERIFY(!received.at(0).dup());
+    QTRY_COMPARE_WITH_TIMEOUT(readPackets(&socket, &received), 2, 5000);
+    QVERIFY(received.at(1).dup());
+    QCOMPARE(received.at(1).packetId(), received.at(0).packetId());
+    QCOMPARE(received.at(1).payload(), QByteArray("unacked"));
+
+    // Still no acknowledgement after the last retransmission, the client is dropped
+    QTRY_COMPARE_WITH_TIMEOUT(socket.state(), QAbstractSocket::UnconnectedState, 10000);
+    QVERIFY(!m_server->clients().contains("retransmissionClient"));
+}
+
+void OperationTests::testPacketIds()
+{
+    QTcpSocket socket;
+    QVERIFY(connectRawAndWait(&socket, "packetIdClient", "packetids/#"));
+    MqttPackets received;
+
+    for (int i = 0; i < 200; i++) {
+        m_server->publish("packetids/topic", QByteArray::number(i));
+    }
+    QTRY_COMPARE(readPackets(&socket, &received), 200);
+
+    // Every other message is acknowledged, new ones never reuse an ID still in flight
+    QSet<quint16> inflight;
+    for (int i = 0; i < 200; i++) {
+        QVERIFY(received.at(i).packetId() != 0);
+        QVERIFY(!inflight.contains(received.at(i).packetId()));
+        inflight.insert(received.at(i).packetId());
+        if (i % 2 == 0) {
+            socket.write(MqttPacket(MqttPacket::TypePuback, received.at(i).packetId()).serialize());
+            inflight.remove(received.at(i).packetId());
+        }
+    }
+    QTest::qWait(100);
+    for (int i = 0; i < 200; i++) {
+        m_server->publish("packetids/topic", QByteArray::number(i));
+    }
+    QTRY_COMPARE(readPackets(&socket, &received), 400);
+    for (int i = 200; i < 400; i++) {
+        QVERIFY(received.at(i).packetId() != 0);
+        QVERIFY2(!inflight.contains(received.at(i).packetId()), "Packet ID reused while in flight");
+        inflight.insert(received.at(i).packetId());
+    }
+
+    socket.disconnectFromHost();
+    QTRY_VERIFY(!m_server->clients().contains("packetIdClient"));
+}
+
+void OperationTests::testSessionStore()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    QString fileName = dir.path() + "/sessions.log";
+
+    // A persistent client subscribes and goes offline, a message is queued for it
+    MqttFileSessionStore *store = new MqttFileSessionStore(fileName);
+    MqttServer *server = new MqttServer();
+    server->setSessionExpiryInterval(60);
+    server->setSessionStore(store);
+    server->listenInProcess();
+
+    MqttClient *client = connectAndWait(server, "storedClient", false);
+    QVERIFY(subscribeAndWait(client, "stored/#", Mqtt::QoS1));
+    disconnectAndWait(client);
+    QTRY_COMPARE(server->offlineSessions(), QStringList() << "storedClient");
+    server->publish("stored/topic", "queued");
+    delete server;
+    delete store;
+
+    // After the restart the session is restored from the log, including the queued message
+    store = new MqttFileSessionStore(fileName);
+    server = new MqttServer();
+    server->setSessionExpiryInterval(60);
+    QSignalSpy subscribedSpy(server, &MqttServer::clientSubscribed);
+    server->setSessionStore(store);
+    QCOMPARE(server->offlineSessions(), QStringList() << "storedClient");
+    QCOMPARE(subscribedSpy.count(), 1);
+    server->listenInProcess();
+
+    QSignalSpy receivedSpy(client, &MqttClient::publishReceived);
+    QSignalSpy publishedSpy(server, &MqttServer::published);
+    QSignalSpy connectedSpy(client, &MqttClient::connected);
+    client->connectToServer(server, false);
+    QTRY_COMPARE(connectedSpy.count(), 1);
+    QVERIFY2(connectedSpy.first().at(1).value<Mqtt::ConnackFlags>().testFlag(Mqtt::ConnackFlagSessionPresent), "Session present flag is not set while it should be.");
+    QTRY_COMPARE(receivedSpy.count(), 1);
+    QCOMPARE(receivedSpy.first().at(1).toByteArray(), QByteArray("queued"));
+    QTRY_COMPARE(publishedSpy.count(), 1);
+
+    // Compacting keeps the current state, the acknowledged message is gone
+    QSignalSpy compactedSpy(store, &MqttFileSessionStore::compactionFinished);
+    store->compact();
+    QTRY_COMPARE(compactedSpy.count(), 1);
+    QCOMPARE(compactedSpy.first().at(0).toBool(), true);
+    store->flush();
+
+    MqttFileSessionStore compacted(fileName);
+    QList<MqttSessionStore::Session> sessions = compacted.restoreSessions();
+    QCOMPARE(sessions.count(), 1);
+    QCOMPARE(sessions.first().clientId, QString("storedClient"));
+    QCOMPARE(sessions.first().subscriptions.count(), 1);
+    QCOMPARE(sessions.first().subscriptions.first().topicFilter(), QByteArray("stored/#"));
+    QVERIFY(sessions.first().inflightPackets.isEmpty());
+    QVERIFY(sessions.first().queuedMessages.isEmpty());
+
+    disconnectAndWait(client);
+    delete client;
+    delete server;
+    delete store;
+}
+
+void OperationTests::testGroupCommit_data()
+{
+    QTest::addColumn<bool>("durable");
+
+    QTest::newRow("not durable") << false;
+    QTest::newRow("durable") << true;
+}
+
+void OperationTests::testGroupCommit()
+{
+    QFETCH(bool, durable);
+
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    QString fileName = dir.path() + "/sessions.log";
+    MqttFileSessionStore store(fileName);
+    MqttServer server;
+    server.setSessionExpiryInterval(60);
+    server.setSessionStore(&store);
+    server.setDurableAcknowledgements(durable);
+    // Long enough to only commit on full batches within the test
+    const int batchSize = 4;
+    server.setGroupCommit(60000, batchSize);
+    server.listenInProcess();
+
+    // Messages for an offline session end up in the session store
+    MqttClient *subscriber = connectAndWait(&server, "groupCommitSubscriber", false);
+    QVERIFY(subscribeAndWait(subscriber, "groupcommit/#", Mqtt::QoS1));
+    disconnectAndWait(subscriber);
+    QTRY_COMPARE(server.offlineSessions(), QStringList() << "groupCommitSubscriber");
+
+    MqttClient *publisher = connectAndWait(&server, "groupCommitPublisher");
+    QSignalSpy publishedSpy(publisher, &MqttClient::published);
+    for (int i = 0; i < batchSize - 1; i++) {
+        publisher->publish("groupcommit/topic", QByteArray::number(i), Mqtt::QoS1);
+    }
+    if (durable) {
+        // Held until the batch is full
+        QTest::qWait(100);
+        QCOMPARE(publishedSpy.count(), 0);
+    } else {
+        QTRY_COMPARE(publishedSpy.count(), batchSize - 1);
+    }
+    publisher->publish("groupcommit/topic", QByteArray::number(batchSize - 1), Mqtt::QoS1);
+    QTRY_COMPARE(publishedSpy.count(), batchSize);
+
+    if (durable) {
+        // The store was synced before the acknowledgements were released
+        MqttFileSessionStore synced(fileName);
+        QList<MqttSessionStore::Session> sessions = synced.restoreSessions();
+        QCOMPARE(sessions.count(), 1);
+        QCOMPARE(sessions.first().queuedMessages.count(), batchSize);
+    }
+
+    disconnectAndWait(publisher);
+    QTRY_VERIFY(server.clients().isEmpty());
+    delete publisher;
+    delete subscriber;
+}
+
+void OperationTests::testGroupCommitBenchmark_data()
+{
+    QTest::addColumn<bool>("durable");
+    QTest::addColumn<int>("interval");
+    QTest::addColumn<int>("batchSize");
+
+    QTest::newRow("not durable") << false << 0 << 0;
+    QTest::newRow("sync per message") << true << 0 << 1;
+    QTest::newRow("5 ms, batches of 64") << true << 5 << 64;
+    QTest::newRow("20 ms, batches of 256") << true << 20 << 256;
+}
+
+void OperationTests::testGroupCommitBenchmark()
+{
+    // Reports the time until a burst of QoS 1 messages is acknowledged as benchmark result. Every message is
+    // queued for an offline session, so each of them changes the session store.
+    QFETCH(bool, durable);
+    QFETCH(int, interval);
+    QFETCH(int, batchSize);
+    const int messageCount = 500;
+
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    MqttFileSessionStore store(dir.path() + "/sessions.log");
+    MqttServer server;
+    server.setSessionExpiryInterval(60);
+    server.setMaximumOfflineQueueCount(messageCount);
+    server.setSessionStore(&store);
+    server.setDurableAcknowledgements(durable);
+    server.setGroupCommit(interval, batchSize);
+    server.listenInProcess();
+
+    MqttClient *subscriber = connectAndWait(&server, "groupCommitBenchmarkSubscriber", false);
+    QVERIFY(subscribeAndWait(subscriber, "groupcommit/#", Mqtt::QoS1));
+    disconnectAndWait(subscriber);
+    QTRY_COMPARE(server.offlineSessions(), QStringList() << "groupCommitBenchmarkSubscriber");
+
+    MqttClient *publisher = connectAndWait(&server, "groupCommitBenchmarkPublisher");
+    QSignalSpy publishedSpy(publisher, &MqttClient::published);
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < messageCount; i++) {
+        publisher->publish("groupcommit/topic", QByteArray::number(i), Mqtt::QoS1);
+    }
+    QTRY_COMPARE_WITH_TIMEOUT(publishedSpy.count(), messageCount, 60000);
+    QTest::setBenchmarkResult(timer.elapsed(), QTest::WalltimeMilliseconds);
+
+    disconnectAndWait(publisher);
+    QTRY_VERIFY(server.clients().isEmpty());
+    delete publisher;
+    delete subscriber;
+}
+
+void OperationTests::testHeldAcknowledgementsOnDrop_data()
+{
+    QTest::addColumn<Mqtt::QoS>("willQoS");
+
+    QTest::newRow("QoS 1 will") << Mqtt::QoS1;
+    QTest::newRow("QoS 2 will") << Mqtt::QoS2;
+}
+
+void OperationTests::testHeldAcknowledgementsOnDrop()
+{
+    QFETCH(Mqtt::QoS, willQoS);
+
+    m_server->setDurableAcknowledgements(true);
+    m_server->setGroupCommit(200, 0);
+
+    MqttClient *subscriber = connectAndWait("heldAcks-subscriber");
+    QVERIFY(subscribeAndWait(subscriber, "heldacks/#", Mqtt::QoS1));
+    QSignalSpy receivedSpy(subscriber, &MqttClient::publishReceived);
+    MqttClient *client = connectAndWait("heldAcks-client", true, 300, "heldacks/will", "gone", willQoS);
+    client->publish("heldacks/topic", "held", Mqtt::QoS1);
+    QTRY_COMPARE(receivedSpy.count(), 1);
+
+    // Dropped while its acknowledgement is held, the will goes out right away
+    client->d_ptr->socket->abort();
+    QTRY_COMPARE(receivedSpy.count(), 2);
+    QCOMPARE(receivedSpy.at(1).at(0).toString(), QString("heldacks/will"));
+
+    // The next group commit only serves the clients still connected
+    QSignalSpy publishedSpy(subscriber, &MqttClient::published);
+    subscriber->publish("heldacks/topic", "after", Mqtt::QoS1);
+    QTRY_COMPARE(publishedSpy.count(), 1);
+    QCOMPARE(m_server->clients(), QStringList() << "heldAcks-subscriber");
+}
+
+void OperationTests::testFailedGroupCommit()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    FailingSessionStore store(dir.path() + "/sessions.log");
+    MqttServer server;
+    server.setSessionExpiryInterval(60);
+    server.setSessionStore(&store);
+    server.setDurableAcknowledgements(true);
+    server.setGroupCommit(10, 0);
+    server.listenInProcess();
+
+    MqttClient *publisher = connectAndWait(&server, "failedCommitPublisher", false);
+    QSignalSpy publishedSpy(publisher, &MqttClient::published);
+    QSignalSpy disconnectedSpy(publisher, &MqttClient::disconnected);
+
+    // Not acknowledged if the store can't be synced, the client is dropped instead
+    store.failSync = true;
+    publisher->publish("failedcommit/topic", "unsynced", Mqtt::QoS1);
+    QTRY_COMPARE(disconnectedSpy.count(), 1);
+    QCOMPARE(publishedSpy.count(), 0);
+
+    // And retransmits after reconnecting
+    store.failSync = false;
+    publisher->connectToServer(&server, false);
+    QTRY_COMPARE(publishedSpy.count(), 1);
+
+    disconnectAndWait(publisher);
+    QTRY_VERIFY(server.clients().isEmpty());
+    delete publisher;
+}
+
 void OperationTests::testQoS1PublishToServerIsAckedOnSessionResume()
 {
     MqttClient *client = connectAndWait("client1", true);
@@ -710,6 +1345,49 @@ void OperationTests::testQoS2PublishToClientIsCompletedOnSessionResume()
     QTRY_VERIFY2(publishReceivedSpy.count() == 1, "Client did not receive publish packet upon session resume");
 }
 
+void OperationTests::testMessageExpiry()
+{
+    m_server->setSessionExpiryInterval(60);
+    m_server->setMessageExpiryInterval("expiry/short/", 1);
+    QCOMPARE(m_server->messageExpiryInterval("expiry/short/topic"), 1);
+    QCOMPARE(m_server->messageExpiryInterval("expiry/long/topic"), 0);
+
+    MqttClient *offlineClient = connectAndWait("expiryOfflineClient", false);
+    QVERIFY(subscribeAndWait(offlineClient, "expiry/#", Mqtt::QoS1));
+    disconnectAndWait(offlineClient);
+    QTRY_COMPARE(m_server->offlineSessions(), QStringList() << "expiryOfflineClient");
+
+    MqttClient *publisher = connectAndWait("expiryPublisher");
+    QSignalSpy publishedSpy(publisher, &MqttClient::published);
+    publisher->publish("expiry/short/topic", "stale", Mqtt::QoS1, true);
+    publisher->publish("expiry/long/topic", "fresh", Mqtt::QoS1, true);
+    QTRY_COMPARE(publishedSpy.count(), 2);
+    m_server->publish("expiry/long/server", "stale", 1);
+
+    QTest::qWait(1500);
+
+    // Neither the queued nor the retained copies of expired messages are delivered
+    QSignalSpy connectedSpy(offlineClient, &MqttClient::connected);
+    QSignalSpy receivedSpy(offlineClient, &MqttClient::publishReceived);
+    offlineClient->connectToHost(m_serverHost, m_serverPort, false);
+    QTRY_COMPARE(connectedSpy.count(), 1);
+    QTRY_COMPARE(receivedSpy.count(), 1);
+    QCOMPARE(receivedSpy.at(0).at(0).toString(), QString("expiry/long/topic"));
+
+    MqttClient *subscriber = connectAndWait("expirySubscriber");
+    QSignalSpy retainedSpy(subscriber, &MqttClient::publishReceived);
+    subscriber->subscribe("expiry/#", Mqtt::QoS1);
+    QTRY_COMPARE(retainedSpy.count(), 1);
+    QTest::qWait(100);
+    QCOMPARE(retainedSpy.count(), 1);
+    QCOMPARE(retainedSpy.at(0).at(1).toByteArray(), QByteArray("fresh"));
+
+    publisher->publish("expiry/long/topic", QByteArray(), Mqtt::QoS1, true);
+    QTRY_COMPARE(publishedSpy.count(), 3);
+    m_server->setMessageExpiryInterval("expiry/short/", 0);
+    QCOMPARE(m_server->messageExpiryInterval("expiry/short/topic"), 0);
+}
+
 void OperationTests::testRetain()
 {
     MqttClient *client1 = connectAndWait("client1", true);
@@ -735,14 +1413,16 @@ void OperationTests::testRetain()
     QTRY_VERIFY2(publishReceivedSpy.count() == 1, "Did not receive published meessage.");
     QVERIFY2(publishReceivedSpy.first().at(2).toBool() == false, "Retain flag is set");
 
-    // Disconnect client, and connect again, verify we get 2 retained messages now
+    // Disconnect client, and connect again, verify the second retained message replaced the first one
     disconnectAndWait(client2);
     client2 = connectAndWait("client2");
     QSignalSpy publishReceivedSpy2(client2, &MqttClient::publishReceived);
     client2->subscribe("/retaintopic", Mqtt::QoS1);
-    QTRY_VERIFY2(publishReceivedSpy2.count() == 2, "Did not receive retained topic on subscribe.");
+    QTRY_VERIFY2(publishReceivedSpy2.count() == 1, "Did not receive retained topic on subscribe.");
+    QTest::qWait(100);
+    QVERIFY2(publishReceivedSpy2.count() == 1, "Received more than the latest retained message.");
     QVERIFY2(publishReceivedSpy2.at(0).at(2).toBool() == true, "Retain flag not set");
-    QVERIFY2(publishReceivedSpy2.at(1).at(2).toBool() == true, "Retain flag not set");
+    QCOMPARE(publishReceivedSpy2.at(0).at(1).toByteArray(), QByteArray("Message 2"));
 
     publishReceivedSpy2.clear();
 
@@ -758,7 +1438,7 @@ void OperationTests::testRetain()
     QTest::qWait(500);
     QVERIFY2(publishReceivedSpy3.count() == 0, "Did receive retained messages on subscribe but should not have.");
 
-    // post another 2 retained messages (and some others), reconnect and verify they're there again
+    // post another 2 retained messages (and some others), reconnect and verify the latest one is there
     client1->publish("/retaintopic", "Message 3", Mqtt::QoS1, true);
     client1->publish("/retaintopic", "Message 4", Mqtt::QoS1, false);
     client1->publish("/retaintopic", "Message 5", Mqtt::QoS1, false);
@@ -770,11 +1450,12 @@ void OperationTests::testRetain()
     client2 = connectAndWait("client2");
     QSignalSpy publishReceivedSpy4(client2, &MqttClient::publishReceived);
     client2->subscribe("/retaintopic", Mqtt::QoS1);
-    QTRY_VERIFY2(publishReceivedSpy4.count() == 2, "Did not receive retained messages.");
+    QTRY_VERIFY2(publishReceivedSpy4.count() == 1, "Did not receive retained messages.");
+    QCOMPARE(publishReceivedSpy4.at(0).at(1).toByteArray(), QByteArray("Message 6"));
 
     publishReceivedSpy4.clear();
 
-    // post a QoS0 message to this topic. it should discard previously retained messages but stay retained
+    // post a QoS0 message to this topic. it should replace the previously retained message
     client1->publish("/retaintopic", "Message 8", Mqtt::QoS0, true);
     QTRY_VERIFY2(publishReceivedSpy4.count() == 1, "Did not receive retained messages.");
 
@@ -785,6 +1466,685 @@ void OperationTests::testRetain()
     QTRY_VERIFY2(publishReceivedSpy5.count() == 1, "Did not receive exactly 1 retained message.");
 }
 
+void OperationTests::testRetainedDelivery()
+{
+    MqttClient *publisher = connectAndWait("retainedDelivery-publisher");
+    QSignalSpy publishedSpy(publisher, &MqttClient::published);
+    publisher->publish("retaineddelivery/retained", "retained", Mqtt::QoS2, true);
+    QTRY_COMPARE(publishedSpy.count(), 1);
+
+    QTcpSocket socket;
+    QVERIFY(connectRawAndWait(&socket, "retainedDelivery-subscriber", "retaineddelivery/live"));
+    MqttPackets received;
+    m_server->publish("retaineddelivery/live", "live");
+    QTRY_COMPARE(readPackets(&socket, &received), 1);
+    quint16 inflightId = received.at(0).packetId();
+
+    // Sent with a packet ID of the subscriber, not the one of the publisher, and at most with the granted QoS
+    MqttPacket subscribePacket(MqttPacket::TypeSubscribe, 2);
+    subscribePacket.addSubscription(MqttSubscription("retaineddelivery/retained", Mqtt::QoS1));
+    socket.write(subscribePacket.serialize());
+    QTRY_COMPARE(readPackets(&socket, &received), 3);
+    QCOMPARE(received.at(1).type(), MqttPacket::TypeSuback);
+    QCOMPARE(received.at(2).type(), MqttPacket::TypePublish);
+    QVERIFY(received.at(2).retain());
+    QCOMPARE(received.at(2).qos(), Mqtt::QoS1);
+    QVERIFY(received.at(2).packetId() != 0);
+    QVERIFY(received.at(2).packetId() != inflightId);
+
+    // Each acknowledgement completes its own message
+    QSignalSpy serverPublishedSpy(m_server, &MqttServer::published);
+    socket.write(MqttPacket(MqttPacket::TypePuback, received.at(2).packetId()).serialize());
+    QTRY_COMPARE(serverPublishedSpy.count(), 1);
+    QCOMPARE(serverPublishedSpy.at(0).at(2).toString(), QString("retaineddelivery/retained"));
+    socket.write(MqttPacket(MqttPacket::TypePuback, inflightId).serialize());
+    QTRY_COMPARE(serverPublishedSpy.count(), 2);
+    QCOMPARE(serverPublishedSpy.at(1).at(2).toString(), QString("retaineddelivery/live"));
+
+    publisher->publish("retaineddelivery/retained", QByteArray(), Mqtt::QoS1, true);
+    QTRY_COMPARE(publishedSpy.count(), 2);
+    socket.disconnectFromHost();
+    QTRY_VERIFY(!m_server->clients().contains("retainedDelivery-subscriber"));
+}
+
+void OperationTests::testRetainedBudget()
+{
+    MqttServer server;
+    server.listenInProcess();
+    server.setMaximumRetainedBytes(1000);
+    server.setRetainedQuota("budget/device/", 300);
+
+    MqttClient *client = connectAndWait(&server, "budgetClient");
+    QSignalSpy publishedSpy(client, &MqttClient::published);
+
+    // Updates of a topic replace each other instead of piling up
+    for (int i = 0; i < 10; i++) {
+        client->publish("budget/state", QByteArray(100, 'x'), Mqtt::QoS1, true);
+    }
+    QTRY_COMPARE(publishedSpy.count(), 10);
+    QCOMPARE(server.retainedMessageCount(), 1);
+    QCOMPARE(server.retainedBytes(), qint64(112));
+
+    // A device flooding its prefix only evicts its own topics
+    for (int i = 0; i < 10; i++) {
+        client->publish(QString("budget/device/%1").arg(i), QByteArray(86, 'x'), Mqtt::QoS1, true);
+    }
+    QTRY_COMPARE(publishedSpy.count(), 20);
+    QCOMPARE(server.retainedMessageCount(), 3);
+    QCOMPARE(server.retainedEvictions(), quint64(8));
+
+    // Beyond the global budget the least recently used topics go first
+    QSignalSpy receivedSpy(client, &MqttClient::publishReceived);
+    QVERIFY(subscribeAndWait(client, "budget/state", Mqtt::QoS0));
+    QTRY_COMPARE(receivedSpy.count(), 1);
+    for (int i = 0; i < 6; i++) {
+        client->publish(QString("budget/other/%1").arg(i), QByteArray(130, 'x'), Mqtt::QoS1, true);
+    }
+    QTRY_COMPARE(publishedSpy.count(), 26);
+    QVERIFY(server.retainedBytes() <= 1000);
+    QCOMPARE(server.retainedEvictions(), quint64(10));
+    receivedSpy.clear();
+    QVERIFY(subscribeAndWait(client, "budget/#", Mqtt::QoS0));
+    QTRY_COMPARE(receivedSpy.count(), server.retainedMessageCount());
+    QStringList topics;
+    for (int i = 0; i < receivedSpy.count(); i++) {
+        topics << receivedSpy.at(i).at(0).toString();
+    }
+    QVERIFY(topics.contains("budget/state"));
+    QCOMPARE(topics.count(), 7);
+    QVERIFY(!topics.contains("budget/device/8"));
+
+    // Too large to fit at all
+    client->publish("budget/huge", QByteArray(2000, 'x'), Mqtt::QoS1, true);
+    QTRY_COMPARE(publishedSpy.count(), 27);
+    QVERIFY(server.retainedBytes() <= 1000);
+
+    disconnectAndWait(client);
+    delete client;
+}
+
+void OperationTests::testPayloadCompression()
+{
+    MqttServer server;
+    server.listenInProcess();
+    server.setSessionExpiryInterval(60);
+    server.setPayloadCompressionThreshold(1024);
+
+    QByteArray large;
+    for (int i = 0; i < 500; i++) {
+        large.append(QString("{\"sensor\":%1,\"value\":42}").arg(i % 10).toUtf8());
+    }
+    QByteArray small(100, 'x');
+
+    MqttClient *publisher = connectAndWait(&server, "compressionPublisher");
+    QSignalSpy publishedSpy(publisher, &MqttClient::published);
+
+    // Large retained payloads are held compressed, small ones as they are
+    publisher->publish("compression/large", large, Mqtt::QoS1, true);
+    publisher->publish("compression/small", small, Mqtt::QoS1, true);
+    QTRY_COMPARE(publishedSpy.count(), 2);
+    QVERIFY(server.retainedBytes() < large.size() / 4);
+
+    // Subscribers get the original payload
+    MqttClient *subscriber = connectAndWait(&server, "compressionSubscriber", false);
+    QSignalSpy receivedSpy(subscriber, &MqttClient::publishReceived);
+    QVERIFY(subscribeAndWait(subscriber, "compression/#", Mqtt::QoS1));
+    QTRY_COMPARE(receivedSpy.count(), 2);
+    QMap<QString, QByteArray> received;
+    received.insert(receivedSpy.at(0).at(0).toString(), receivedSpy.at(0).at(1).toByteArray());
+    received.insert(receivedSpy.at(1).at(0).toString(), receivedSpy.at(1).at(1).toByteArray());
+    QCOMPARE(received.value("compression/large"), large);
+    QCOMPARE(received.value("compression/small"), small);
+
+    // Messages queued for an offline session as well
+    disconnectAndWait(subscriber);
+    QTRY_COMPARE(server.offlineSessions(), QStringList() << "compressionSubscriber");
+    publisher->publish("compression/queued", large, Mqtt::QoS1);
+    QTRY_COMPARE(publishedSpy.count(), 3);
+    QSignalSpy connectedSpy(subscriber, &MqttClient::connected);
+    receivedSpy.clear();
+    subscriber->connectToServer(&server, false);
+    QTRY_COMPARE(connectedSpy.count(), 1);
+    QTRY_COMPARE(receivedSpy.count(), 1);
+    QCOMPARE(receivedSpy.first().at(0).toString(), QString("compression/queued"));
+    QCOMPARE(receivedSpy.first().at(1).toByteArray(), large);
+
+    disconnectAndWait(subscriber);
+    disconnectAndWait(publisher);
+    delete subscriber;
+    delete publisher;
+}
+
+void OperationTests::testBridge()
+{
+    MqttServer local;
+    MqttServer remote;
+    remote.listenInProcess();
+    remote.setSessionExpiryInterval(60);
+
+    QSignalSpy localSubscribedSpy(&local, &MqttServer::clientSubscribed);
+    MqttBridge bridge(&local, "bridge");
+    bridge.addTopic("sensors/#", MqttBridge::DirectionOut, Mqtt::QoS1, QString(), "gateway/");
+    bridge.addTopic("commands/#", MqttBridge::DirectionIn, Mqtt::QoS1, QString(), "gateway/");
+    bridge.addTopic("shared/#", MqttBridge::DirectionBoth);
+    QTRY_COMPARE(localSubscribedSpy.count(), 2);
+
+    MqttClient *localClient = connectAndWait(&local, "bridgeLocalClient");
+    QSignalSpy localReceivedSpy(localClient, &MqttClient::publishReceived);
+    QVERIFY(subscribeAndWait(localClient, "#", Mqtt::QoS1));
+    QSignalSpy localPublishedSpy(localClient, &MqttClient::published);
+
+    // Queued while the uplink is down
+    localClient->publish("sensors/temperature", "21", Mqtt::QoS1);
+    localClient->publish("other/topic", "not forwarded", Mqtt::QoS1);
+    QTRY_COMPARE(localPublishedSpy.count(), 2);
+    QTRY_COMPARE(bridge.queuedMessages(), 1);
+
+    MqttClient *remoteClient = connectAndWait(&remote, "bridgeRemoteClient");
+    QSignalSpy remoteReceivedSpy(remoteClient, &MqttClient::publishReceived);
+    QSignalSpy remoteSubscribedSpy(&remote, &MqttServer::clientSubscribed);
+    QVERIFY(subscribeAndWait(remoteClient, "#", Mqtt::QoS1));
+
+    QSignalSpy bridgeConnectedSpy(&bridge, &MqttBridge::connected);
+    bridge.connectToServer(&remote);
+    QTRY_COMPARE(bridgeConnectedSpy.count(), 1);
+    QTRY_COMPARE(remoteReceivedSpy.count(), 1);
+    QCOMPARE(remoteReceivedSpy.first().at(0).toString(), QString("gateway/sensors/temperature"));
+    QCOMPARE(remoteReceivedSpy.first().at(1).toByteArray(), QByteArray("21"));
+    QCOMPARE(bridge.queuedMessages(), 0);
+
+    // Incoming
+    QTRY_COMPARE(remoteSubscribedSpy.count(), 3);
+    localReceivedSpy.clear();
+    remoteClient->publish("gateway/commands/light", "on", Mqtt::QoS1);
+    QTRY_COMPARE(localReceivedSpy.count(), 1);
+    QCOMPARE(localReceivedSpy.first().at(0).toString(), QString("commands/light"));
+    QCOMPARE(localReceivedSpy.first().at(1).toByteArray(), QByteArray("on"));
+
+    // Both directions, without messages coming back
+    localReceivedSpy.clear();
+    remoteReceivedSpy.clear();
+    localClient->publish("shared/state", "from local", Mqtt::QoS1);
+    remoteClient->publish("shared/state", "from remote", Mqtt::QoS1);
+    QTRY_COMPARE(remoteReceivedSpy.count(), 2);
+    QTRY_COMPARE(localReceivedSpy.count(), 2);
+    QTest::qWait(200);
+    QCOMPARE(remoteReceivedSpy.count(), 2);
+    QCOMPARE(localReceivedSpy.count(), 2);
+
+    // Batches
+    bridge.setBatchSize(10);
+    bridge.setBatchInterval(1000);
+    remoteReceivedSpy.clear();
+    for (int i = 0; i < 25; i++) {
+        localClient->publish(QString("sensors/%1").arg(i), QByteArray::number(i), Mqtt::QoS1);
+    }
+    QTRY_COMPARE(remoteReceivedSpy.count(), 25);
+    for (int i = 0; i < 25; i++) {
+        QCOMPARE(remoteReceivedSpy.at(i).at(0).toString(), QString("gateway/sensors/%1").arg(i));
+    }
+
+    disconnectAndWait(remoteClient);
+    disconnectAndWait(localClient);
+    delete remoteClient;
+    delete localClient;
+}
+
+void OperationTests::testCluster()
+{
+    QStringList nodes = QStringList() << "nymea-mqtt-test-node-a" << "nymea-mqtt-test-node-b";
+    MqttServer nodeA;
+    MqttServer nodeB;
+    nodeA.listenInProcess();
+    nodeB.listenInProcess();
+
+    // A retained message from before joining is replicated when the nodes connect
+    MqttClient *publisher = connectAndWait(&nodeB, "clusterPublisher");
+    QSignalSpy publishedSpy(publisher, &MqttClient::published);
+    publisher->publish("cluster/early", "early", Mqtt::QoS1, true);
+    QTRY_COMPARE(publishedSpy.count(), 1);
+
+    QVERIFY(nodeA.joinCluster(nodes.at(0), nodes));
+    QVERIFY(nodeB.joinCluster(nodes.at(1), nodes));
+    QTRY_COMPARE(nodeA.clusterPeers(), QStringList() << nodes.at(1));
+    QTRY_COMPARE(nodeB.clusterPeers(), QStringList() << nodes.at(0));
+    QTRY_COMPARE(nodeA.retainedMessageCount(), 1);
+
+    // Publishes reach subscribers on other nodes
+    MqttClient *subscriber = connectAndWait(&nodeA, "clusterSubscriber");
+    QSignalSpy receivedSpy(subscriber, &MqttClient::publishReceived);
+    QVERIFY(subscribeAndWait(subscriber, "cluster/#", Mqtt::QoS1));
+    QTRY_COMPARE(receivedSpy.count(), 1);
+    QCOMPARE(receivedSpy.first().at(1).toByteArray(), QByteArray("early"));
+
+    // Wait for the filter to reach the other node, then publish on it
+    receivedSpy.clear();
+    QTest::qWait(100);
+    publisher->publish("cluster/topic", "hello", Mqtt::QoS1);
+    QTRY_COMPARE(receivedSpy.count(), 1);
+    QCOMPARE(receivedSpy.first().at(0).toString(), QString("cluster/topic"));
+    QCOMPARE(receivedSpy.first().at(1).toByteArray(), QByteArray("hello"));
+
+    // Messages published by the server itself as well
+    nodeB.publish("cluster/server", "from node b");
+    QTRY_COMPARE(receivedSpy.count(), 2);
+
+    // Retained messages are replicated, clearing them too
+    publisher->publish("cluster/retained", "state", Mqtt::QoS1, true);
+    QTRY_COMPARE(nodeA.retainedMessageCount(), 2);
+    publisher->publish("cluster/retained", QByteArray(), Mqtt::QoS1, true);
+    QTRY_COMPARE(nodeA.retainedMessageCount(), 1);
+
+    nodeB.leaveCluster();
+    QTRY_VERIFY(nodeA.clusterPeers().isEmpty());
+
+    disconnectAndWait(subscriber);
+    disconnectAndWait(publisher);
+    delete subscriber;
+    delete publisher;
+}
+
+void OperationTests::testBroker()
+{
+    MqttServer serverA;
+    MqttServer serverB;
+    serverA.listenInProcess();
+    serverB.listenInProcess();
+    serverA.setSessionExpiryInterval(60);
+    serverB.setSessionExpiryInterval(60);
+
+    // Retained messages from before attaching are shared
+    MqttClient *publisher = connectAndWait(&serverB, "brokerPublisher");
+    QSignalSpy publishedSpy(publisher, &MqttClient::published);
+    publisher->publish("broker/early", "early", Mqtt::QoS1, true);
+    QTRY_COMPARE(publishedSpy.count(), 1);
+
+    MqttBroker broker;
+    broker.addServer(&serverA);
+    broker.addServer(&serverB);
+    QCOMPARE(broker.servers().count(), 2);
+    QCOMPARE(serverA.retainedMessageCount(), 1);
+
+    MqttClient *subscriber = connectAndWait(&serverA, "brokerSubscriber", false);
+    QSignalSpy receivedSpy(subscriber, &MqttClient::publishReceived);
+    QVERIFY(subscribeAndWait(subscriber, "broker/#", Mqtt::QoS1));
+    QTRY_COMPARE(receivedSpy.count(), 1);
+    QCOMPARE(receivedSpy.first().at(1).toByteArray(), QByteArray("early"));
+
+    // Publishes on one server reach the subscribers on the other one
+    QCOMPARE(broker.clients().count(), 2);
+    receivedSpy.clear();
+    publisher->publish("broker/topic", "hello", Mqtt::QoS1, true);
+    QTRY_COMPARE(receivedSpy.count(), 1);
+    QCOMPARE(receivedSpy.first().at(0).toString(), QString("broker/topic"));
+    QCOMPARE(serverA.retainedMessageCount(), 2);
+
+    // The same client ID on the other server takes over the connection and the session
+    QSignalSpy subscriberDisconnectedSpy(subscriber, &MqttClient::disconnected);
+    MqttClient *takeover = new MqttClient("brokerSubscriber", this);
+    takeover->setAutoReconnect(false);
+    QSignalSpy takeoverConnectedSpy(takeover, &MqttClient::connected);
+    takeover->connectToServer(&serverB, false);
+    QTRY_COMPARE(takeoverConnectedSpy.count(), 1);
+    QTRY_COMPARE(subscriberDisconnectedSpy.count(), 1);
+    QVERIFY(takeoverConnectedSpy.first().at(1).value<Mqtt::ConnackFlags>().testFlag(Mqtt::ConnackFlagSessionPresent));
+    QCOMPARE(serverA.clients(), QStringList());
+    QSignalSpy takeoverReceivedSpy(takeover, &MqttClient::publishReceived);
+    serverA.publish("broker/server", "from server a");
+    QTRY_COMPARE(takeoverReceivedSpy.count(), 1);
+
+    // Detached servers keep the retained messages but route on their own again
+    broker.removeServer(&serverA);
+    QCOMPARE(serverA.retainedMessageCount(), 2);
+    serverA.publish("broker/server", "not routed");
+    QTest::qWait(100);
+    QCOMPARE(takeoverReceivedSpy.count(), 1);
+
+    disconnectAndWait(takeover);
+    disconnectAndWait(publisher);
+    delete takeover;
+    delete publisher;
+    delete subscriber;
+}
+
+void OperationTests::testAuthorizationCache()
+{
+    MqttServer server;
+    server.listenInProcess();
+    CountingAuthorizer authorizer;
+    server.setAuthorizer(&authorizer);
+    server.setAuthorizationCacheSize(2);
+
+    MqttClient *client = connectAndWait(&server, "authorizationCacheClient");
+    QSignalSpy receivedSpy(client, &MqttClient::publishReceived);
+    QVERIFY(subscribeAndWait(client, "#", Mqtt::QoS1));
+    QCOMPARE(authorizer.subscribeChecks, 1);
+
+    QSignalSpy publishedSpy(client, &MqttClient::published);
+    for (int i = 0; i < 3; i++) {
+        client->publish("allowed/topic", "allowed", Mqtt::QoS1);
+        client->publish("denied/topic", "denied", Mqtt::QoS1);
+    }
+    QTRY_COMPARE(publishedSpy.count(), 6);
+    QTRY_COMPARE(receivedSpy.count(), 3);
+    QCOMPARE(authorizer.publishChecks, 2);
+
+    // Policy changes take effect once invalidated
+    authorizer.denied = "allowed/";
+    client->publish("allowed/topic", "still cached", Mqtt::QoS1);
+    QTRY_COMPARE(receivedSpy.count(), 4);
+    server.invalidateAuthorizationCache("authorizationCacheClient");
+    client->publish("allowed/topic", "denied now", Mqtt::QoS1);
+    QTRY_COMPARE(publishedSpy.count(), 8);
+    QTest::qWait(100);
+    QCOMPARE(receivedSpy.count(), 4);
+    QCOMPARE(authorizer.publishChecks, 3);
+
+    // A full cache starts over
+    client->publish("other/1", "1", Mqtt::QoS1);
+    client->publish("other/2", "2", Mqtt::QoS1);
+    client->publish("allowed/topic", "3", Mqtt::QoS1);
+    QTRY_COMPARE(publishedSpy.count(), 11);
+    QCOMPARE(authorizer.publishChecks, 6);
+
+    // Subscriptions as well
+    authorizer.denied = "denied/";
+    server.invalidateAuthorizationCache();
+    QSignalSpy subscribeResultSpy(client, &MqttClient::subscribeResult);
+    client->subscribe("denied/#", Mqtt::QoS1);
+    QTRY_COMPARE(subscribeResultSpy.count(), 1);
+    QCOMPARE(subscribeResultSpy.first().at(1).value<Mqtt::SubscribeReturnCodes>().first(), Mqtt::SubscribeReturnCodeFailure);
+    client->subscribe("denied/#", Mqtt::QoS1);
+    QTRY_COMPARE(subscribeResultSpy.count(), 2);
+    QCOMPARE(authorizer.subscribeChecks, 2);
+
+    disconnectAndWait(client);
+    delete client;
+}
+
+void OperationTests::testAsyncConnectAuthorization()
+{
+    MqttServer server;
+    server.listenInProcess();
+    AsyncAuthorizer authorizer;
+    server.setAuthorizer(&authorizer);
+    server.setAuthorizationTimeout(500);
+
+    // The first client waits for its authorization, also with a subscription sent right after the CONNECT
+    MqttClient *slowClient = new MqttClient("slowClient", this);
+    slowClient->setAutoReconnect(false);
+    QSignalSpy slowConnectedSpy(slowClient, &MqttClient::connected);
+    slowClient->connectToServer(&server);
+    QTRY_VERIFY(authorizer.pending.contains("slowClient"));
+    QSignalSpy slowSubscribedSpy(slowClient, &MqttClient::subscribeResult);
+    slowClient->subscribe("async/#", Mqtt::QoS1);
+
+    // Others are served meanwhile
+    MqttClient *fastClient = new MqttClient("fastClient", this);
+    fastClient->setAutoReconnect(false);
+    QSignalSpy fastConnectedSpy(fastClient, &MqttClient::connected);
+    fastClient->connectToServer(&server);
+    QTRY_VERIFY(authorizer.pending.contains("fastClient"));
+    authorizer.pending.value("fastClient")->complete(Mqtt::ConnectReturnCodeAccepted);
+    QTRY_COMPARE(fastConnectedSpy.count(), 1);
+    QCOMPARE(fastConnectedSpy.first().at(0).value<Mqtt::ConnectReturnCode>(), Mqtt::ConnectReturnCodeAccepted);
+    QCOMPARE(server.clients(), QStringList() << "fastClient");
+    QCOMPARE(slowConnectedSpy.count(), 0);
+
+    // Completed from another thread, it finishes in the server's thread
+    QThread *finishedThread = nullptr;
+    connect(authorizer.pending.value("slowClient"), &MqttConnectAuthorization::finished, this, [&finishedThread]() {
+        finishedThread = QThread::currentThread();
+    }, Qt::DirectConnection);
+    CompleteAuthorizationThread thread(authorizer.pending.value("slowClient"), Mqtt::ConnectReturnCodeAccepted);
+    thread.start();
+    QVERIFY(thread.wait());
+    QTRY_COMPARE(slowConnectedSpy.count(), 1);
+    QCOMPARE(finishedThread, QThread::currentThread());
+    QCOMPARE(slowConnectedSpy.first().at(0).value<Mqtt::ConnectReturnCode>(), Mqtt::ConnectReturnCodeAccepted);
+    QTRY_VERIFY(slowSubscribedSpy.count() > 0);
+
+    // Rejected ones
+    MqttClient *rejectedClient = new MqttClient("rejectedClient", this);
+    rejectedClient->setAutoReconnect(false);
+    QSignalSpy rejectedConnectedSpy(rejectedClient, &MqttClient::connected);
+    rejectedClient->connectToServer(&server);
+    QTRY_VERIFY(authorizer.pending.contains("rejectedClient"));
+    authorizer.pending.value("rejectedClient")->complete(Mqtt::ConnectReturnCodeBadUsernameOrPassword);
+    QTRY_COMPARE(rejectedConnectedSpy.count(), 1);
+    QCOMPARE(rejectedConnectedSpy.first().at(0).value<Mqtt::ConnectReturnCode>(), Mqtt::ConnectReturnCodeBadUsernameOrPassword);
+
+    // Timeouts and the limit of pending authorizations
+    server.setMaximumPendingAuthorizations(1);
+    MqttClient *timeoutClient = new MqttClient("timeoutClient", this);
+    timeoutClient->setAutoReconnect(false);
+    QSignalSpy timeoutConnectedSpy(timeoutClient, &MqttClient::connected);
+    timeoutClient->connectToServer(&server);
+    QTRY_VERIFY(authorizer.pending.contains("timeoutClient"));
+    MqttClient *limitClient = new MqttClient("limitClient", this);
+    limitClient->setAutoReconnect(false);
+    QSignalSpy limitConnectedSpy(limitClient, &MqttClient::connected);
+    limitClient->connectToServer(&server);
+    QTRY_COMPARE(limitConnectedSpy.count(), 1);
+    QCOMPARE(limitConnectedSpy.first().at(0).value<Mqtt::ConnectReturnCode>(), Mqtt::ConnectReturnCodeServerUnavailable);
+    QVERIFY(!authorizer.pending.contains("limitClient"));
+    QTRY_COMPARE(timeoutConnectedSpy.count(), 1);
+    QCOMPARE(timeoutConnectedSpy.first().at(0).value<Mqtt::ConnectReturnCode>(), Mqtt::ConnectReturnCodeServerUnavailable);
+    // Completing it late has no effect on the server
+    authorizer.pending.value("timeoutClient")->complete(Mqtt::ConnectReturnCodeAccepted);
+    QTest::qWait(100);
+    QCOMPARE(server.clients().count(), 2);
+
+    disconnectAndWait(slowClient);
+    disconnectAndWait(fastClient);
+    delete limitClient;
+    delete timeoutClient;
+    delete rejectedClient;
+    delete fastClient;
+    delete slowClient;
+}
+
+void OperationTests::testAccessControl()
+{
+    MqttAccessControl accessControl;
+    QVERIFY(!accessControl.loadRules("topic\n"));
+    QVERIFY(!accessControl.loadRules("permit all\n"));
+    QVERIFY(accessControl.isEmpty());
+    QVERIFY(accessControl.loadRules("# Everybody may read public topics\n"
+                                    "topic read public/#\n"
+                                    "pattern write devices/%c/#\n"
+                                    "pattern read commands/%u/+\n"
+                                    "\n"
+                                    "user admin\n"
+                                    "topic #\n"));
+
+    MqttServer server;
+    server.listenInProcess();
+    server.setAccessControl(accessControl);
+
+    MqttClient *device = connectAndWait(&server, "device1", true, "alice");
+
+    MqttClient *admin = connectAndWait(&server, "admin", true, "admin");
+    QSignalSpy adminReceivedSpy(admin, &MqttClient::publishReceived);
+    QVERIFY(subscribeAndWait(admin, "#", Mqtt::QoS1));
+
+    // Subscriptions need read access to every matching topic
+    QSignalSpy subscribeResultSpy(device, &MqttClient::subscribeResult);
+    QStringList topicFilters = QStringList() << "public/news" << "public/#" << "commands/alice/+" << "commands/alice/light"
+                                             << "commands/alice/#" << "commands/+/light" << "devices/device1/state" << "#";
+    QList<bool> allowed = QList<bool>() << true << true << true << true << false << false << false << false;
+    foreach (const QString &topicFilter, topicFilters) {
+        device->subscribe(topicFilter, Mqtt::QoS1);
+    }
+    QTRY_COMPARE(subscribeResultSpy.count(), topicFilters.count());
+    for (int i = 0; i < topicFilters.count(); i++) {
+        bool success = subscribeResultSpy.at(i).at(1).value<Mqtt::SubscribeReturnCodes>().first() != Mqtt::SubscribeReturnCodeFailure;
+        QVERIFY2(success == allowed.at(i), topicFilters.at(i).toUtf8());
+    }
+
+    // Publishing only below the own client ID
+    QSignalSpy publishedSpy(device, &MqttClient::published);
+    device->publish("devices/device1/state", "on", Mqtt::QoS1);
+    device->publish("devices/device2/state", "on", Mqtt::QoS1);
+    device->publish("public/news", "fake", Mqtt::QoS1);
+    device->publish("devices/device1", "on", Mqtt::QoS1);
+    QTRY_COMPARE(publishedSpy.count(), 4);
+    QTRY_COMPARE(adminReceivedSpy.count(), 2);
+    QCOMPARE(adminReceivedSpy.at(0).at(0).toString(), QString("devices/device1/state"));
+    QCOMPARE(adminReceivedSpy.at(1).at(0).toString(), QString("devices/device1"));
+
+    // Denied publishes neither set nor clear retained messages
+    QSignalSpy adminPublishedSpy(admin, &MqttClient::published);
+    admin->publish("devices/device2/state", "on", Mqtt::QoS1, true);
+    QTRY_COMPARE(adminPublishedSpy.count(), 1);
+    QCOMPARE(server.retainedMessageCount(), 1);
+    device->publish("public/news", "fake", Mqtt::QoS1, true);
+    QTRY_COMPARE(publishedSpy.count(), 5);
+    QCOMPARE(server.retainedMessageCount(), 1);
+    device->publish("devices/device2/state", QByteArray(), Mqtt::QoS1, true);
+    QTRY_COMPARE(publishedSpy.count(), 6);
+    QCOMPARE(server.retainedMessageCount(), 1);
+
+    // Placeholders within client IDs or usernames are not expanded
+    MqttClient *impostor = connectAndWait(&server, "%u", true, "bob");
+    QSignalSpy impostorPublishedSpy(impostor, &MqttClient::published);
+    adminReceivedSpy.clear();
+    impostor->publish("devices/bob/state", "on", Mqtt::QoS1);
+    impostor->publish("devices/%u/state", "on", Mqtt::QoS1);
+    QTRY_COMPARE(impostorPublishedSpy.count(), 2);
+    QTRY_COMPARE(adminReceivedSpy.count(), 1);
+    QCOMPARE(adminReceivedSpy.first().at(0).toString(), QString("devices/%u/state"));
+    disconnectAndWait(impostor);
+    delete impostor;
+
+    // New rules apply to connected clients right away
+    MqttAccessControl readOnly;
+    readOnly.addRule("#", MqttAccessControl::AccessRead);
+    server.setAccessControl(readOnly);
+    adminReceivedSpy.clear();
+    device->publish("devices/device1/state", "off", Mqtt::QoS1);
+    QTRY_COMPARE(publishedSpy.count(), 7);
+    QTest::qWait(100);
+    QCOMPARE(adminReceivedSpy.count(), 0);
+
+    disconnectAndWait(device);
+    disconnectAndWait(admin);
+    delete device;
+    delete admin;
+}
+
+void OperationTests::testStatistics()
+{
+    MqttServer server;
+    server.listenInProcess();
+
+    MqttClient *monitor = connectAndWait(&server, "statisticsMonitor");
+    QSignalSpy monitorReceivedSpy(monitor, &MqttClient::publishReceived);
+    QVERIFY(subscribeAndWait(monitor, "$SYS/broker/#", Mqtt::QoS0));
+
+    MqttClient *client = connectAndWait(&server, "statisticsClient");
+    QSignalSpy clientReceivedSpy(client, &MqttClient::publishReceived);
+    QVERIFY(subscribeAndWait(client, "#", Mqtt::QoS1));
+
+    // Clients can't publish to $ topics
+    QSignalSpy publishedSpy(client, &MqttClient::published);
+    client->publish("$SYS/broker/uptime", "0", Mqtt::QoS1);
+    for (int i = 0; i < 3; i++) {
+        client->publish("statistics/test", QByteArray::number(i), Mqtt::QoS1);
+    }
+    QTRY_COMPARE(publishedSpy.count(), 4);
+    QTRY_COMPARE(clientReceivedSpy.count(), 3);
+    QCOMPARE(monitorReceivedSpy.count(), 0);
+
+    server.setStatisticsInterval(1);
+    QCOMPARE(server.statisticsInterval(), 1);
+    QTRY_VERIFY_WITH_TIMEOUT(monitorReceivedSpy.count() >= 17, 3000);
+    QHash<QString, QByteArray> values;
+    for (int i = 0; i < 17; i++) {
+        values.insert(monitorReceivedSpy.at(i).at(0).toString(), monitorReceivedSpy.at(i).at(1).toByteArray());
+    }
+    QCOMPARE(values.value("$SYS/broker/clients/connected"), QByteArray("2"));
+    QCOMPARE(values.value("$SYS/broker/subscriptions/count"), QByteArray("2"));
+    QCOMPARE(values.value("$SYS/broker/messages/received"), QByteArray("4"));
+    QCOMPARE(values.value("$SYS/broker/messages/sent"), QByteArray("3"));
+    QCOMPARE(values.value("$SYS/broker/messages/dropped"), QByteArray("0"));
+    QCOMPARE(values.value("$SYS/broker/retained messages/count"), QByteArray("0"));
+    QVERIFY(values.contains("$SYS/broker/load/messages/received"));
+
+    // Wildcards don't match them
+    QCOMPARE(clientReceivedSpy.count(), 3);
+
+    server.setStatisticsInterval(0);
+    QCOMPARE(server.statisticsInterval(), 0);
+
+    disconnectAndWait(client);
+    disconnectAndWait(monitor);
+    delete client;
+    delete monitor;
+}
+
+void OperationTests::testRetainedMessagesFile()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    QString fileName = dir.path() + "/retained";
+
+    MqttServer *server = new MqttServer();
+    QVERIFY(server->setRetainedMessagesFile(fileName));
+    server->listenInProcess();
+    MqttClient *client = connectAndWait(server, "retainingClient");
+    QSignalSpy publishedSpy(client, &MqttClient::published);
+    client->publish("retained/a", "A", Mqtt::QoS1, true);
+    client->publish("retained/b", "B", Mqtt::QoS1, true);
+    QTRY_COMPARE(publishedSpy.count(), 2);
+    disconnectAndWait(client);
+
+    // Destroying the server writes the snapshot
+    delete server;
+    QVERIFY(QFile::exists(fileName));
+    QCOMPARE(QFile(fileName + ".log").size(), 0);
+
+    // Restart from the snapshot, retained messages are served from it
+    server = new MqttServer();
+    QVERIFY(server->setRetainedMessagesFile(fileName));
+    server->listenInProcess();
+    QSignalSpy connectedSpy(client, &MqttClient::connected);
+    client->connectToServer(server);
+    QTRY_COMPARE(connectedSpy.count(), 1);
+    QSignalSpy receivedSpy(client, &MqttClient::publishReceived);
+    QVERIFY(subscribeAndWait(client, "retained/#", Mqtt::QoS1));
+    QTRY_COMPARE(receivedSpy.count(), 2);
+    QVERIFY(receivedSpy.at(0).at(2).toBool());
+    QVERIFY(receivedSpy.at(1).at(2).toBool());
+
+    // Changes go to the log
+    publishedSpy.clear();
+    client->publish("retained/a", QByteArray(), Mqtt::QoS1, true);
+    client->publish("retained/c", "C", Mqtt::QoS1, true);
+    QTRY_COMPARE(publishedSpy.count(), 2);
+    QVERIFY(QFile(fileName + ".log").size() > 0);
+
+    // Starting on the snapshot and the log, as after a crash, gives the current state
+    MqttServer *restartedServer = new MqttServer();
+    QVERIFY(restartedServer->setRetainedMessagesFile(fileName));
+    restartedServer->listenInProcess();
+    MqttClient *restartedClient = connectAndWait(restartedServer, "restartedClient");
+    QSignalSpy restartedReceivedSpy(restartedClient, &MqttClient::publishReceived);
+    QVERIFY(subscribeAndWait(restartedClient, "retained/#", Mqtt::QoS1));
+    QTRY_COMPARE(restartedReceivedSpy.count(), 2);
+    QStringList topics;
+    topics << restartedReceivedSpy.at(0).at(0).toString() << restartedReceivedSpy.at(1).at(0).toString();
+    topics.sort();
+    QCOMPARE(topics, QStringList() << "retained/b" << "retained/c");
+
+    disconnectAndWait(restartedClient);
+    disconnectAndWait(client);
+    delete restartedClient;
+    delete client;
+    delete restartedServer;
+    delete server;
+}
+
 void OperationTests::testUnsubscribe()
 {
     MqttClient *client1 = connectAndWait("client1");
@@ -844,6 +2204,312 @@ void OperationTests::testBinaryPaylaod()
     QCOMPARE(publishReceivedSpy.first().at(1).toByteArray(), payload);
 }
 
+void OperationTests::testLargePayload_data()
+{
+    QTest::addColumn<Mqtt::QoS>("qos");
+
+    QTest::newRow("QoS0") << Mqtt::QoS0;
+    QTest::newRow("QoS1") << Mqtt::QoS1;
+    QTest::newRow("QoS2") << Mqtt::QoS2;
+}
+
+void OperationTests::testLargePayload()
+{
+    QFETCH(Mqtt::QoS, qos);
+
+    // Large payloads are relayed to subscribers without copying them into the frame, verify they arrive intact
+    QByteArray payload;
+    for (int i = 0; i < 40000; i++) {
+        payload.append(static_cast<char>(i % 251));
+    }
+
+    MqttClient *subscriber1 = connectAndWait("subscriber1");
+    MqttClient *subscriber2 = connectAndWait("subscriber2");
+    QVERIFY(subscribeAndWait(subscriber1, "large/#", qos));
+    QVERIFY(subscribeAndWait(subscriber2, "large/#", qos));
+    QSignalSpy receivedSpy1(subscriber1, &MqttClient::publishReceived);
+    QSignalSpy receivedSpy2(subscriber2, &MqttClient::publishReceived);
+
+    MqttClient *publisher = connectAndWait("publisher");
+    publisher->publish("large/topic", payload, qos);
+    publisher->publish("large/topic", "small", qos);
+
+    QTRY_COMPARE(receivedSpy1.count(), 2);
+    QTRY_COMPARE(receivedSpy2.count(), 2);
+    QCOMPARE(receivedSpy1.at(0).at(1).toByteArray(), payload);
+    QCOMPARE(receivedSpy1.at(1).at(1).toByteArray(), QByteArray("small"));
+    QCOMPARE(receivedSpy2.at(0).at(1).toByteArray(), payload);
+    QCOMPARE(receivedSpy2.at(1).at(1).toByteArray(), QByteArray("small"));
+}
+
+void OperationTests::testConnectRateLimit()
+{
+    // Allow one connect per second, one more may wait in the queue, the third one is rejected
+    m_server->setConnectRateLimit(1);
+    m_server->setMaximumQueuedConnects(1);
+
+    QList<QPair<MqttClient*, QSignalSpy*> > connections;
+    for (int i = 0; i < 3; i++) {
+        connections.append(connectToServer(QString("rateLimit-client%1").arg(i)));
+    }
+
+    int accepted = 0;
+    int rejected = 0;
+    for (int i = 0; i < connections.count(); i++) {
+        QSignalSpy *spy = connections.at(i).second;
+        if (spy->count() == 0) {
+            spy->wait();
+        }
+        if (spy->count() == 1) {
+            Mqtt::ConnectReturnCode returnCode = spy->first().at(0).value<Mqtt::ConnectReturnCode>();
+            accepted += returnCode == Mqtt::ConnectReturnCodeAccepted ? 1 : 0;
+            rejected += returnCode == Mqtt::ConnectReturnCodeServerUnavailable ? 1 : 0;
+        }
+        delete spy;
+    }
+    QCOMPARE(accepted, 2);
+    QCOMPARE(rejected, 1);
+}
+
+void OperationTests::testLocalSocket()
+{
+    int addressId = m_server->listenLocal("nymea-mqtt-test");
+    QVERIFY2(addressId >= 0, "Failed to listen on local socket");
+
+    MqttClient *localClient = new MqttClient("local-client", this);
+    localClient->setAutoReconnect(false);
+    m_clients.append(localClient);
+    QSignalSpy connectedSpy(localClient, &MqttClient::connected);
+    localClient->connectToLocalServer("nymea-mqtt-test");
+    QTRY_COMPARE(connectedSpy.count(), 1);
+    QCOMPARE(connectedSpy.first().at(0).value<Mqtt::ConnectReturnCode>(), Mqtt::ConnectReturnCodeAccepted);
+    QVERIFY(localClient->isConnected());
+
+    QSignalSpy subscribedSpy(localClient, &MqttClient::subscribed);
+    localClient->subscribe("local/#");
+    QTRY_COMPARE(subscribedSpy.count(), 1);
+
+    // Messages are routed between local socket and TCP clients
+    MqttClient *tcpClient = connectAndWait("tcp-client");
+    QSignalSpy publishReceivedSpy(localClient, &MqttClient::publishReceived);
+    tcpClient->publish("local/topic", "hello", Mqtt::QoS1);
+    QTRY_COMPARE(publishReceivedSpy.count(), 1);
+    QCOMPARE(publishReceivedSpy.first().at(1).toByteArray(), QByteArray("hello"));
+
+    disconnectAndWait(localClient);
+    m_server->close(addressId);
+}
+
+void OperationTests::testIoUringTransport()
+{
+    if (!MqttServer::isTransportAvailable(MqttServer::TransportIoUring)) {
+        QSKIP("io_uring is not available on this system");
+    }
+    quint16 port = m_serverPort + 200;
+    m_server->setTransport(MqttServer::TransportIoUring);
+    int addressId = m_server->listen(QHostAddress(m_serverHost), port);
+    m_server->setTransport(MqttServer::TransportQt);
+    QVERIFY(addressId >= 0);
+    QVERIFY(m_server->isListening(QHostAddress(m_serverHost), port));
+
+    MqttClient *ioUringClient = new MqttClient("io-uring-client", 300, "io-uring/will", "gone", Mqtt::QoS1, false, this);
+    ioUringClient->setAutoReconnect(false);
+    m_clients.append(ioUringClient);
+    QSignalSpy connectedSpy(ioUringClient, &MqttClient::connected);
+    ioUringClient->connectToHost(m_serverHost, port);
+    QTRY_COMPARE(connectedSpy.count(), 1);
+    QCOMPARE(connectedSpy.first().at(0).value<Mqtt::ConnectReturnCode>(), Mqtt::ConnectReturnCodeAccepted);
+    QVERIFY(subscribeAndWait(ioUringClient, "io-uring/#", Mqtt::QoS1));
+
+    // Messages are routed between both transports. The large payload takes several receive buffers and sends.
+    MqttClient *tcpClient = connectAndWait("tcp-client");
+    QVERIFY(subscribeAndWait(tcpClient, "qt/#", Mqtt::QoS1));
+    QByteArray largePayload(256 * 1024, 'x');
+    QSignalSpy ioUringReceivedSpy(ioUringClient, &MqttClient::publishReceived);
+    tcpClient->publish("io-uring/small", "to io_uring", Mqtt::QoS1);
+    tcpClient->publish("io-uring/large", largePayload, Mqtt::QoS1);
+    QTRY_COMPARE(ioUringReceivedSpy.count(), 2);
+    QCOMPARE(ioUringReceivedSpy.at(0).at(1).toByteArray(), QByteArray("to io_uring"));
+    QCOMPARE(ioUringReceivedSpy.at(1).at(1).toByteArray(), largePayload);
+
+    QSignalSpy tcpReceivedSpy(tcpClient, &MqttClient::publishReceived);
+    QSignalSpy publishedSpy(ioUringClient, &MqttClient::published);
+    ioUringClient->publish("qt/large", largePayload, Mqtt::QoS2);
+    QTRY_COMPARE(tcpReceivedSpy.count(), 1);
+    QCOMPARE(tcpReceivedSpy.first().at(1).toByteArray(), largePayload);
+    QTRY_COMPARE(publishedSpy.count(), 1);
+
+    // A connection dropped by the peer is noticed and the will published
+    QVERIFY(subscribeAndWait(tcpClient, "io-uring/will", Mqtt::QoS1));
+    tcpReceivedSpy.clear();
+    QSignalSpy clientDisconnectedSpy(m_server, &MqttServer::clientDisconnected);
+    ioUringClient->d_ptr->socket->abort();
+    QTRY_COMPARE(clientDisconnectedSpy.count(), 1);
+    QTRY_COMPARE(tcpReceivedSpy.count(), 1);
+    QCOMPARE(tcpReceivedSpy.first().at(0).toString(), QString("io-uring/will"));
+
+    // Closing the listener drops its clients
+    MqttClient *otherClient = new MqttClient("io-uring-client2", this);
+    otherClient->setAutoReconnect(false);
+    m_clients.append(otherClient);
+    QSignalSpy otherConnectedSpy(otherClient, &MqttClient::connected);
+    otherClient->connectToHost(m_serverHost, port);
+    QTRY_COMPARE(otherConnectedSpy.count(), 1);
+    QSignalSpy disconnectedSpy(otherClient, &MqttClient::disconnected);
+    m_server->close(addressId);
+    QTRY_COMPARE(disconnectedSpy.count(), 1);
+    QVERIFY(!m_server->isListening(QHostAddress(m_serverHost), port));
+}
+
+void OperationTests::testInProcessConnection()
+{
+    int addressId = m_server->listenInProcess();
+    QVERIFY(m_server->listeningAddressIds().contains(addressId));
+
+    MqttClient *inProcessClient = new MqttClient("in-process-client", this);
+    inProcessClient->setAutoReconnect(false);
+    m_clients.append(inProcessClient);
+    QSignalSpy connectedSpy(inProcessClient, &MqttClient::connected);
+    inProcessClient->connectToServer(m_server);
+    QTRY_COMPARE(connectedSpy.count(), 1);
+    QCOMPARE(connectedSpy.first().at(0).value<Mqtt::ConnectReturnCode>(), Mqtt::ConnectReturnCodeAccepted);
+    QVERIFY(inProcessClient->isConnected());
+    QVERIFY(subscribeAndWait(inProcessClient, "inprocess/#", Mqtt::QoS2));
+
+    // Network client to in-process client
+    MqttClient *tcpClient = connectAndWait("tcp-client");
+    QVERIFY(subscribeAndWait(tcpClient, "network/#", Mqtt::QoS2));
+    QSignalSpy inProcessReceivedSpy(inProcessClient, &MqttClient::publishReceived);
+    tcpClient->publish("inprocess/topic", "to in-process", Mqtt::QoS2);
+    QTRY_COMPARE(inProcessReceivedSpy.count(), 1);
+    QCOMPARE(inProcessReceivedSpy.first().at(1).toByteArray(), QByteArray("to in-process"));
+
+    // In-process client to network client, including the QoS 2 handshake
+    QSignalSpy publishedSpy(inProcessClient, &MqttClient::published);
+    QSignalSpy tcpReceivedSpy(tcpClient, &MqttClient::publishReceived);
+    quint16 packetId = inProcessClient->publish("network/topic", "to network", Mqtt::QoS2);
+    QTRY_COMPARE(tcpReceivedSpy.count(), 1);
+    QCOMPARE(tcpReceivedSpy.first().at(1).toByteArray(), QByteArray("to network"));
+    QTRY_COMPARE(publishedSpy.count(), 1);
+    QCOMPARE(publishedSpy.first().at(0).value<quint16>(), packetId);
+
+    // Closing the in-process address drops the client
+    QSignalSpy disconnectedSpy(inProcessClient, &MqttClient::disconnected);
+    m_server->close(addressId);
+    QTRY_COMPARE(disconnectedSpy.count(), 1);
+    QVERIFY(!inProcessClient->isConnected());
+}
+
+void OperationTests::testHandover()
+{
+#if (QT_VERSION < QT_VERSION_CHECK(5, 10, 0))
+    QSKIP("Needs QMetaObject::invokeMethod() with functors");
+#else
+    // The old server needs to keep running in its own thread while the new one blocks in receiveHandover()
+    QThread oldServerThread;
+    oldServerThread.start();
+    QObject oldServerContext;
+    oldServerContext.moveToThread(&oldServerThread);
+
+    MqttServer *oldServer = nullptr;
+    int addressId = -1;
+    quint16 port = m_serverPort + 100;
+    QMetaObject::invokeMethod(&oldServerContext, [&]() {
+        oldServer = new MqttServer();
+        addressId = oldServer->listen(QHostAddress(m_serverHost), port);
+    }, Qt::BlockingQueuedConnection);
+    QVERIFY(addressId >= 0);
+
+    MqttClient *client = new MqttClient("handover-client", this);
+    client->setAutoReconnect(false);
+    m_clients.append(client);
+    QSignalSpy connectedSpy(client, &MqttClient::connected);
+    client->connectToHost(m_serverHost, port);
+    QTRY_COMPARE(connectedSpy.count(), 1);
+    QVERIFY(subscribeAndWait(client, "handover/#", Mqtt::QoS1));
+
+    QSignalSpy disconnectedSpy(client, &MqttClient::disconnected);
+    MqttServer newServer;
+    QSignalSpy clientConnectedSpy(&newServer, &MqttServer::clientConnected);
+    QAtomicInt handedOver(0);
+    QMetaObject::invokeMethod(&oldServerContext, [&]() {
+        handedOver = oldServer->handOver("nymea-mqtt-handover-test") ? 1 : 0;
+    }, Qt::QueuedConnection);
+    QVERIFY(newServer.receiveHandover("nymea-mqtt-handover-test"));
+    QTRY_COMPARE(handedOver.load(), 1);
+
+    // The session continues on the new server without the client reconnecting
+    QCOMPARE(newServer.listeningAddressIds(), QList<int>() << addressId);
+    QCOMPARE(newServer.clients(), QStringList() << "handover-client");
+    QCOMPARE(clientConnectedSpy.count(), 1);
+    QSignalSpy publishReceivedSpy(client, &MqttClient::publishReceived);
+    client->publish("handover/topic", "after handover", Mqtt::QoS1);
+    QTRY_COMPARE(publishReceivedSpy.count(), 1);
+    QCOMPARE(publishReceivedSpy.first().at(1).toByteArray(), QByteArray("after handover"));
+    QCOMPARE(disconnectedSpy.count(), 0);
+
+    disconnectAndWait(client);
+    QTRY_COMPARE(newServer.clients().count(), 0);
+
+    QMetaObject::invokeMethod(&oldServerContext, [&]() {
+        delete oldServer;
+    }, Qt::BlockingQueuedConnection);
+    oldServerThread.quit();
+    oldServerThread.wait();
+#endif
+}
+
+static qint64 residentMemory()
+{
+#ifdef Q_OS_LINUX
+    QFile statm("/proc/self/statm");
+    if (!statm.open(QFile::ReadOnly)) {
+        return -1;
+    }
+    QList<QByteArray> fields = statm.readAll().split(' ');
+    return fields.value(1).toLongLong() * sysconf(_SC_PAGESIZE);
+#else
+    return -1;
+#endif
+}
+
+void OperationTests::testMemoryPerConnection()
+{
+    // Reports the resident memory used per idle connection as benchmark result. Raw sockets are used on the client
+    // side to keep the overhead of the test itself low, the figure still includes their share though.
+    const int connectionCount = 200;
+    if (residentMemory() < 0) {
+        QSKIP("Resident memory can't be determined on this platform");
+    }
+
+    QList<QTcpSocket*> sockets;
+    qint64 before = residentMemory();
+    for (int i = 0; i < connectionCount; i++) {
+        QTcpSocket *socket = new QTcpSocket(this);
+        socket->connectToHost(m_serverHost, m_serverPort);
+        sockets.append(socket);
+    }
+    for (int i = 0; i < connectionCount; i++) {
+        QTcpSocket *socket = sockets.at(i);
+        QVERIFY(socket->state() == QAbstractSocket::ConnectedState || socket->waitForConnected());
+        MqttPacket connectPacket(MqttPacket::TypeConnect);
+        connectPacket.setProtocolLevel(Mqtt::Protocol311);
+        connectPacket.setClientId(QString("memory-client%1").arg(i).toUtf8());
+        connectPacket.setKeepAlive(300);
+        socket->write(connectPacket.serialize());
+    }
+    QTRY_COMPARE_WITH_TIMEOUT(m_server->clients().count(), connectionCount, 20000);
+    qint64 after = residentMemory();
+
+    qint64 perConnection = (after - before) / connectionCount;
+    QTest::setBenchmarkResult(perConnection, QTest::BytesAllocated);
+    // Only catches gross regressions, the resident memory grows in pages and depends on the allocator
+    QVERIFY2(perConnection < 64 * 1024, qPrintable(QString("%1 bytes per connection").arg(perConnection)));
+
+    qDeleteAll(sockets);
+    QTRY_COMPARE(m_server->clients().count(), 0);
+}
+
 #endif
 
 QTEST_MAIN(OperationTests)